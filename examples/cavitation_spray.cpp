@@ -42,6 +42,7 @@ int main(int argc, char* argv[]) {
       particles.updateTemporaryPosition(timer);
       particles.updateVelocityAndPosition();
       particles.removeOutsideParticles(minpos, maxpos);
+      if (particles.needsCompaction()) particles.compactStorage();
 
       // particles.moveInflowParticles(timer);
       // // particles.shiftParticles(2.1, 0.03);
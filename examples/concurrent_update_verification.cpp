@@ -0,0 +1,70 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <iostream>
+#include <boost/format.hpp>
+#include <Eigen/Core>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "condition.h"
+#include "logger.h"
+#include "particles.h"
+
+namespace {
+
+// Refines the whole fluid, so that every normal particle is split between beginConcurrentUpdate()
+// and endConcurrentUpdate(), and then adds one more particle from the slots left.
+int splitAll(tiny_mps::Particles& particles, int threads) {
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#endif
+  particles.addResolutionZone(Eigen::Vector3d::Constant(-1.0e10), Eigen::Vector3d::Constant(1.0e10), 0.5);
+  const int changed = particles.adaptResolution();
+  const int next_index = particles.addParticle();
+  tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Threads: %d, split particles: %d, size: %d, next slot: %d")
+      % threads % changed % particles.getSize() % next_index;
+  return next_index;
+}
+
+bool check(const std::string& name, bool passed) {
+  tiny_mps::Log(passed ? tiny_mps::LOG_INFO : tiny_mps::LOG_ERROR) << (passed ? "Passed: " : "Failed: ") << name;
+  return passed;
+}
+
+} // namespace
+
+// Verifies that with deterministic_slots, particles split on several threads take
+// the same slots and end in the same state as on a single thread.
+int main(int argc, char* argv[]) {
+  try {
+    std::string input_data = "./input/input.data";
+    std::string input_grid = "./input/dam.grid";
+    int threads = 4;
+    if (argc >= 2) input_data = argv[1];
+    if (argc >= 3) input_grid = argv[2];
+    if (argc >= 4) threads = std::stoi(argv[3]);
+    tiny_mps::Condition condition(input_data);
+    condition.deterministic_slots = true;
+    tiny_mps::Particles serial(input_grid, condition);
+    tiny_mps::Particles parallel(serial);
+    const int serial_index = splitAll(serial, 1);
+    const int parallel_index = splitAll(parallel, threads);
+
+    bool passed = true;
+    passed &= check("particles are split", serial.getSize() > 0 && serial.getMinSpacing() < condition.average_distance);
+    passed &= check("storage sizes are the same", serial.getSize() == parallel.getSize());
+    if (!passed) return EXIT_FAILURE;
+    passed &= check("types are the same", serial.particle_types == parallel.particle_types);
+    passed &= check("boundary types are the same", serial.boundary_types == parallel.boundary_types);
+    passed &= check("positions are the same", serial.position == parallel.position);
+    passed &= check("velocities are the same", serial.velocity == parallel.velocity);
+    passed &= check("spacings are the same", serial.particle_spacing == parallel.particle_spacing);
+    passed &= check("free slots are in the same order", serial_index == parallel_index);
+    if (!passed) return EXIT_FAILURE;
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
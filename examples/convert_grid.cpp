@@ -0,0 +1,39 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <iostream>
+#include <string>
+#include <Eigen/Core>
+#include "grid_file.h"
+
+// Converts a grid file between the text (.grid) and binary (.gridb) formats.
+// The output is binary if its name ends with ".gridb", and text otherwise.
+// Usage: convert_grid input/nozzle3.grid input/nozzle3.gridb
+int main(int argc, char* argv[]) {
+  try {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " <input grid> <output grid>" << std::endl;
+      return 1;
+    }
+    const std::string input_grid = argv[1];
+    const std::string output_grid = argv[2];
+    tiny_mps::GridFile grid(input_grid);
+    const int size = grid.getSize();
+    Eigen::VectorXi particle_types = Eigen::VectorXi::Zero(size);
+    Eigen::Matrix3Xd position = Eigen::Matrix3Xd::Zero(3, size);
+    Eigen::Matrix3Xd velocity = Eigen::Matrix3Xd::Zero(3, size);
+    Eigen::VectorXd pressure = Eigen::VectorXd::Zero(size);
+    grid.read(3, particle_types, position, velocity, pressure);
+    const std::string extension = ".gridb";
+    if (output_grid.size() >= extension.size() &&
+        output_grid.compare(output_grid.size() - extension.size(), extension.size(), extension) == 0) {
+      tiny_mps::GridFile::writeBinary(output_grid, grid.getStartTime(), size, particle_types, position, velocity, pressure);
+    } else {
+      tiny_mps::GridFile::writeText(output_grid, grid.getStartTime(), size, particle_types, position, velocity, pressure);
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
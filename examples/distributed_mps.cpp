@@ -0,0 +1,54 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <iostream>
+#include <boost/format.hpp>
+#include <Eigen/Core>
+#include "condition.h"
+#include "domain_decomposition.h"
+#include "grid.h"
+#include "particles.h"
+
+// Sample code running standard_mps over MPI ranks.
+// Build with "make mpi=yes" and run, e.g. "mpirun -np 4 ./bin/distributed_mps".
+// Each rank writes its own particles to output_r<rank>_<index>.vtk.
+int main(int argc, char* argv[]) {
+  try {
+    std::string output_path = "./output/";
+    std::string input_data = "./input/input.data";
+    std::string input_grid = "./input/dam.grid";
+    if (argc >= 2) output_path = argv[1];
+    if (argc >= 3) input_data = argv[2];
+    if (argc >= 4) input_grid = argv[3];
+    tiny_mps::Condition condition(input_data);
+    tiny_mps::DomainDecomposition domain(condition);
+    output_path += (boost::format("output_r%1%_") % domain.getRank()).str() + "%1%.vtk";
+    domain.decompose(input_grid);
+    tiny_mps::Particles particles(input_grid, condition, domain);
+    domain.decompose(particles);
+    tiny_mps::Timer timer(condition);
+    Eigen::Vector3d minpos(-0.1, -0.1, 0);
+    Eigen::Vector3d maxpos(1.1, 2.1, 0);
+    while(particles.nextLoop(output_path, timer)) {
+      domain.exchangeHalo(particles);
+      particles.calculateTemporaryVelocity(condition.gravity, timer);
+      particles.updateTemporaryPosition(timer);
+      domain.updateHalo(particles);
+      particles.giveCollisionRepulsionForce();
+      particles.updateTemporaryPosition(timer);
+      domain.updateHalo(particles);
+      particles.solvePressurePoissonFused(timer);
+      particles.setZeroOnNegativePressure();
+      particles.correctVelocity(timer);
+      particles.updateTemporaryPosition(timer);
+      particles.updateVelocityAndPosition();
+      particles.removeOutsideParticles(minpos, maxpos);
+      domain.migrate(particles);
+      domain.balanceLoad(particles, timer);
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/format.hpp>
+#include <Eigen/Core>
+#include "condition.h"
+#include "ensemble.h"
+#include "particles.h"
+#include "bubble_particles.h"
+
+// Sample code using TinyMPS library.
+// Runs cavitation_analysis for every inflow velocity in a case file in one process,
+// as start.sh does with one process per case.
+// Usage: ensemble_analysis [output root] [case file] [threads] [OpenMP threads per case]
+// Each line of the case file is "name velocity", where velocity is the downward inflow speed.
+int main(int argc, char* argv[]) {
+  try {
+    std::string output_root = "./output/";
+    std::string input_data = "./input/nozzle.data";
+    std::string input_grid = "./input/nozzle3.grid";
+    std::string input_cases = "./input/inflow";
+    int threads = 0;
+    int threads_per_case = 1;
+    if (argc >= 2) output_root = argv[1];
+    if (argc >= 3) input_cases = argv[2];
+    if (argc >= 4) threads = std::stoi(argv[3]);
+    if (argc >= 5) threads_per_case = std::stoi(argv[4]);
+    tiny_mps::Condition condition(input_data);
+    const my_mps::BubbleParticles initial_particles(input_grid, condition);
+
+    tiny_mps::Ensemble ensemble(condition, output_root);
+    std::ifstream ifs(input_cases);
+    if (ifs.fail()) throw std::ios_base::failure("Failed to read files: " + input_cases);
+    std::string line;
+    while (getline(ifs, line)) {
+      std::stringstream ss(line);
+      std::string name, velocity;
+      if (!(ss >> name >> velocity)) continue;
+      ensemble.addCase("nozzle_" + name, {{"inflow_y", "-" + velocity}});
+    }
+
+    ensemble.run([&](const tiny_mps::Condition& condition, const std::string& output_path, tiny_mps::EnsembleResult& result) {
+      my_mps::BubbleParticles particles(initial_particles, condition);
+      tiny_mps::Timer timer(condition);
+      Eigen::Vector3d minpos(-0.1, -2.1 * condition.average_distance, 0);
+      Eigen::Vector3d maxpos(1.1, 2.1, 0);
+      Eigen::Vector3d gridminpos(-0.016, -condition.average_distance, 0);
+      Eigen::Vector3d gridmaxpos(0.016, 0.020, 0);
+
+      particles.initAverageGrid(gridminpos, gridmaxpos);
+      while(particles.nextLoop(output_path, timer)) {
+        particles.moveInflowParticles(timer);
+        particles.calculateTemporaryVelocity(condition.gravity, timer);
+        particles.updateTemporaryPosition(timer);
+        particles.giveCollisionRepulsionForce();
+        particles.updateTemporaryPosition(timer);
+        particles.calculateTemporaryParticleNumberDensity();
+        particles.checkSurface2();
+        particles.calculateModifiedParticleNumberDensity();
+        particles.solvePressurePoissonDuan(timer);
+        particles.correctVelocityDuan(timer);
+        particles.updateTemporaryPosition(timer);
+        particles.calculateAveragePressure();
+        particles.updateAverageGrid(5.0e-3, timer);
+        particles.calculateBubblesFromAveragePressure();
+        particles.updateVelocityAndPosition();
+        particles.removeOutsideParticles(minpos, maxpos);
+      }
+      const tiny_mps::StepStats stats = particles.calculateStepStats();
+      result.steps = timer.getLoopCount();
+      result.simulated_time = timer.getCurrentTime();
+      result.max_speed = stats.max_speed;
+      result.particles = stats.normal;
+    }, threads, threads_per_case);
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <iostream>
+#include <string>
+#include <Eigen/Core>
+#include "grid_file.h"
+#include "logger.h"
+
+namespace {
+
+struct GridData {
+  double start_time;
+  Eigen::VectorXi particle_types;
+  Eigen::Matrix3Xd position;
+  Eigen::Matrix3Xd velocity;
+  Eigen::VectorXd pressure;
+};
+
+GridData readGrid(const std::string& path) {
+  tiny_mps::GridFile grid(path);
+  const int size = grid.getSize();
+  GridData data = {grid.getStartTime(), Eigen::VectorXi::Zero(size), Eigen::Matrix3Xd::Zero(3, size),
+                   Eigen::Matrix3Xd::Zero(3, size), Eigen::VectorXd::Zero(size)};
+  grid.read(3, data.particle_types, data.position, data.velocity, data.pressure);
+  return data;
+}
+
+// Every value must be the same bit for bit, as both formats keep full precision.
+bool check(const std::string& name, const GridData& expected, const GridData& actual) {
+  const bool passed = expected.start_time == actual.start_time &&
+                      expected.particle_types.size() == actual.particle_types.size() &&
+                      expected.particle_types == actual.particle_types && expected.position == actual.position &&
+                      expected.velocity == actual.velocity && expected.pressure == actual.pressure;
+  tiny_mps::Log(passed ? tiny_mps::LOG_INFO : tiny_mps::LOG_ERROR) << (passed ? "Passed: " : "Failed: ") << name;
+  return passed;
+}
+
+} // namespace
+
+// Verifies that converting a grid file into the binary format and back keeps every value.
+// Usage: grid_file_verification output/ input/dam.grid
+int main(int argc, char* argv[]) {
+  try {
+    std::string output_path = "./output/";
+    std::string input_grid = "./input/dam.grid";
+    if (argc >= 2) output_path = argv[1];
+    if (argc >= 3) input_grid = argv[2];
+    const std::string binary_grid = output_path + "verification.gridb";
+    const std::string text_grid = output_path + "verification.grid";
+    const GridData text = readGrid(input_grid);
+    tiny_mps::GridFile::writeBinary(binary_grid, text.start_time, text.particle_types.size(), text.particle_types,
+                                    text.position, text.velocity, text.pressure);
+    const GridData binary = readGrid(binary_grid);
+    tiny_mps::GridFile::writeText(text_grid, binary.start_time, binary.particle_types.size(), binary.particle_types,
+                                  binary.position, binary.velocity, binary.pressure);
+    const GridData round_trip = readGrid(text_grid);
+    bool passed = true;
+    passed &= check(".grid -> .gridb", text, binary);
+    passed &= check(".grid -> .gridb -> .grid", text, round_trip);
+    if (!passed) return EXIT_FAILURE;
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
@@ -0,0 +1,190 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <boost/format.hpp>
+#include <Eigen/Core>
+#include "condition.h"
+#include "logger.h"
+#include "particles.h"
+
+namespace {
+
+struct Totals {
+  int count;
+  // Particles finer and coarser than average_distance.
+  int fine;
+  int coarse;
+  double volume;
+  Eigen::Vector3d momentum;
+};
+
+// Sums the volume and the momentum per density of normal particles.
+Totals sumNormalParticles(const tiny_mps::Particles& particles, double spacing) {
+  Totals totals = {0, 0, 0, 0.0, Eigen::Vector3d::Zero()};
+  for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+    if (particles.particle_types(i_particle) != tiny_mps::ParticleType::NORMAL) continue;
+    double volume = std::pow(particles.particle_spacing(i_particle), particles.getDimension());
+    ++totals.count;
+    if (particles.particle_spacing(i_particle) < spacing * (1.0 - 1.0e-9)) ++totals.fine;
+    if (particles.particle_spacing(i_particle) > spacing * (1.0 + 1.0e-9)) ++totals.coarse;
+    totals.volume += volume;
+    totals.momentum += particles.velocity.col(i_particle) * volume;
+  }
+  return totals;
+}
+
+// Counts normal particles within the box.
+int countNormalParticles(const tiny_mps::Particles& particles, const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos) {
+  int count = 0;
+  for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+    if (particles.particle_types(i_particle) != tiny_mps::ParticleType::NORMAL) continue;
+    const Eigen::Vector3d point = particles.position.col(i_particle);
+    if ((point.array() >= minpos.array()).all() && (point.array() <= maxpos.array()).all()) ++count;
+  }
+  return count;
+}
+
+struct Interface {
+  int count;
+  int surface;
+  double min_ratio;
+  double max_ratio;
+  double mean_ratio;
+};
+
+// Gathers PND relative to the initial one of normal particles within the box which have
+// a particle of another spacing within the PND radius of the coarsest one.
+Interface sumInterface(const tiny_mps::Particles& particles, const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos, double radius) {
+  Interface interface = {0, 0, 1.0e10, 0.0, 0.0};
+  for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+    if (particles.particle_types(i_particle) != tiny_mps::ParticleType::NORMAL) continue;
+    const Eigen::Vector3d point = particles.position.col(i_particle);
+    if ((point.array() < minpos.array()).any() || (point.array() > maxpos.array()).any()) continue;
+    bool found = false;
+    for (int j_particle = 0; j_particle < particles.getSize() && !found; ++j_particle) {
+      if (particles.particle_types(j_particle) == tiny_mps::ParticleType::GHOST) continue;
+      found = (particles.position.col(j_particle) - point).norm() < radius
+          && std::abs(particles.particle_spacing(j_particle) - particles.particle_spacing(i_particle)) > 1.0e-9 * radius;
+    }
+    if (!found) continue;
+    const double ratio = particles.particle_number_density(i_particle) / particles.getInitialParticleNumberDensity();
+    ++interface.count;
+    if (particles.boundary_types(i_particle) == tiny_mps::BoundaryType::SURFACE) ++interface.surface;
+    interface.min_ratio = std::min(interface.min_ratio, ratio);
+    interface.max_ratio = std::max(interface.max_ratio, ratio);
+    interface.mean_ratio += ratio;
+  }
+  if (interface.count > 0) interface.mean_ratio /= interface.count;
+  return interface;
+}
+
+bool check(const std::string& name, bool passed) {
+  tiny_mps::Log(passed ? tiny_mps::LOG_INFO : tiny_mps::LOG_ERROR) << (passed ? "Passed: " : "Failed: ") << name;
+  return passed;
+}
+
+} // namespace
+
+// Verifies that splitting and merging particles conserve volume and momentum,
+// and that the delta time follows the finest spacing.
+int main(int argc, char* argv[]) {
+  try {
+    std::string input_data = "./input/input.data";
+    std::string input_grid = "./input/dam.grid";
+    if (argc >= 2) input_data = argv[1];
+    if (argc >= 3) input_grid = argv[2];
+    tiny_mps::Condition condition(input_data);
+    tiny_mps::Particles particles(input_grid, condition);
+    tiny_mps::Timer timer(condition);
+    Eigen::Vector3d minpos = Eigen::Vector3d::Constant(1.0e10);
+    Eigen::Vector3d maxpos = Eigen::Vector3d::Constant(-1.0e10);
+    for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+      if (particles.particle_types(i_particle) != tiny_mps::ParticleType::NORMAL) continue;
+      minpos = minpos.cwiseMin(particles.position.col(i_particle));
+      maxpos = maxpos.cwiseMax(particles.position.col(i_particle));
+      Eigen::Vector3d rnd = Eigen::Vector3d::Random();
+      if (condition.dimension == 2) rnd(2) = 0;
+      particles.velocity.col(i_particle) = rnd;
+      particles.temporary_velocity.col(i_particle) = rnd;
+    }
+    // The lower left quarter of the fluid is refined and the upper right one coarsened.
+    const Eigen::Vector3d center = (minpos + maxpos) * 0.5;
+    const double margin = condition.average_distance;
+    particles.addResolutionZone(minpos - Eigen::Vector3d::Constant(margin), center, 0.5);
+    particles.addResolutionZone(center, maxpos + Eigen::Vector3d::Constant(margin), 2.0);
+
+    const tiny_mps::ResolutionZone fine_zone = particles.getResolutionZones()[0];
+    const tiny_mps::ResolutionZone coarse_zone = particles.getResolutionZones()[1];
+    const int fine_before = countNormalParticles(particles, fine_zone.minpos, fine_zone.maxpos);
+    const int coarse_before = countNormalParticles(particles, coarse_zone.minpos, coarse_zone.maxpos);
+    const Totals before = sumNormalParticles(particles, condition.average_distance);
+    const int changed = particles.adaptResolution();
+    const Totals after = sumNormalParticles(particles, condition.average_distance);
+    const int fine_after = countNormalParticles(particles, fine_zone.minpos, fine_zone.maxpos);
+    const int coarse_after = countNormalParticles(particles, coarse_zone.minpos, coarse_zone.maxpos);
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Particles: %d -> %d (fine: %d, coarse: %d)") % before.count % after.count % after.fine % after.coarse;
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Particles in the fine zone: %d -> %d, in the coarse zone: %d -> %d")
+        % fine_before % fine_after % coarse_before % coarse_after;
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Volume: %.15e -> %.15e") % before.volume % after.volume;
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Momentum: %.15e -> %.15e") % before.momentum.norm() % after.momentum.norm();
+    const double tolerance = 1.0e-12;
+    bool passed = true;
+    passed &= check("particles are split and merged", changed > 0 && after.fine > 0 && after.coarse > 0);
+    passed &= check("volume is conserved", std::abs(after.volume - before.volume) <= tolerance * before.volume);
+    passed &= check("momentum is conserved", (after.momentum - before.momentum).norm() <= tolerance * before.momentum.norm());
+    // Zones of ratios 0.5 and 2 hold 2^dimension times and about 1/2^dimension times the particles.
+    const int children = (condition.dimension == 2) ? 4 : 8;
+    passed &= check("the fine zone reaches its particle count", fine_after == fine_before * children);
+    passed &= check("the coarse zone reaches its particle count", coarse_after <= 1.1 * coarse_before / children);
+    passed &= check("spacings are stable", particles.adaptResolution() == 0);
+
+    // The fluid is at rest, so PND stays close to the initial one across the boundaries between spacings.
+    // Particles next to walls, which keep average_distance, and near the free surface are left out.
+    particles.updateParticleNumberDensity();
+    particles.checkSurfaceParticles();
+    const double radius = condition.pnd_weight_radius * particles.getMaxSpacingScale();
+    Eigen::Vector3d axes = Eigen::Vector3d::Ones();
+    if (condition.dimension == 2) axes(2) = 0.0;
+    const Interface interface = sumInterface(particles, minpos + axes * condition.pnd_weight_radius,
+                                             maxpos - axes * 2.0 * radius, radius);
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("PND at boundaries between spacings: %d particles, %f - %f (mean: %f) times the initial one")
+        % interface.count % interface.min_ratio % interface.max_ratio % interface.mean_ratio;
+    passed &= check("PND stays close to the initial one across spacings",
+                    interface.count > 0 && std::abs(interface.mean_ratio - 1.0) < 0.05
+                    && interface.min_ratio > 0.8 && interface.max_ratio < 1.2);
+    passed &= check("no particle is on the surface across spacings", interface.count > 0 && interface.surface == 0);
+
+    // The corrected gradient of a hydrostatic pressure is exact whatever the spacings of the neighbors.
+    const Eigen::Vector3d gravity = condition.gravity;
+    for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+      particles.pressure(i_particle) = condition.mass_density * gravity.dot(particles.position.col(i_particle));
+    }
+    particles.temporary_position = particles.position;
+    particles.temporary_velocity.setZero();
+    particles.correctVelocityWithTensor(timer);
+    double gradient_error = 0.0;
+    const Eigen::Vector3d expected = -gravity * timer.getCurrentDeltaTime();
+    for (int i_particle = 0; i_particle < particles.getSize(); ++i_particle) {
+      if (particles.particle_types(i_particle) != tiny_mps::ParticleType::NORMAL) continue;
+      const Eigen::Vector3d point = particles.position.col(i_particle);
+      if ((point.array() < (minpos + axes * radius).array()).any() || (point.array() > (maxpos - axes * 2.0 * radius).array()).any()) continue;
+      gradient_error = std::max(gradient_error, (particles.correction_velocity.col(i_particle) - expected).norm());
+    }
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Error of the corrected hydrostatic gradient: %e") % gradient_error;
+    passed &= check("the corrected gradient is exact across spacings", gradient_error <= 1.0e-9 * expected.norm());
+
+    const double max_speed = particles.getMaxSpeed();
+    timer.limitCurrentDeltaTime(max_speed, condition, particles.getMinSpacing());
+    tiny_mps::Log(tiny_mps::LOG_INFO) << boost::format("Minimum spacing: %e, delta time: %e") % particles.getMinSpacing() % timer.getCurrentDeltaTime();
+    passed &= check("delta time follows the minimum spacing",
+                    timer.getCurrentDeltaTime() <= condition.courant_number * 0.5 * condition.average_distance / max_speed * (1.0 + tolerance));
+    if (!passed) return EXIT_FAILURE;
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
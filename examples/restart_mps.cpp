@@ -0,0 +1,46 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include <iostream>
+#include <boost/format.hpp>
+#include <Eigen/Core>
+#include "checkpoint.h"
+#include "condition.h"
+#include "grid.h"
+#include "particles.h"
+
+// Sample code using TinyMPS library.
+// Resumes standard_mps from a checkpoint written with checkpoint_interval in the data file.
+int main(int argc, char* argv[]) {
+  try {
+    std::string output_path = "./output/";
+    std::string input_data = "./input/input.data";
+    std::string input_checkpoint = "./output/checkpoint.bin";
+    if (argc >= 2) output_path = argv[1];
+    if (argc >= 3) input_data = argv[2];
+    if (argc >= 4) input_checkpoint = argv[3];
+    output_path += "output_%1%.vtk";
+    tiny_mps::Condition condition(input_data);
+    tiny_mps::CheckpointReader checkpoint(input_checkpoint);
+    tiny_mps::Particles particles(checkpoint, condition);
+    tiny_mps::Timer timer(condition, checkpoint);
+    Eigen::Vector3d minpos(-0.1, -0.1, 0);
+    Eigen::Vector3d maxpos(1.1, 2.1, 0);
+    while(particles.nextLoop(output_path, timer)) {
+      particles.calculateTemporaryVelocity(condition.gravity, timer);
+      particles.updateTemporaryPosition(timer);
+      particles.giveCollisionRepulsionForce();
+      particles.updateTemporaryPosition(timer);
+      particles.solvePressurePoissonFused(timer);
+      particles.setZeroOnNegativePressure();
+      particles.correctVelocity(timer);
+      particles.updateTemporaryPosition(timer);
+      particles.updateVelocityAndPosition();
+      particles.removeOutsideParticles(minpos, maxpos);
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 1;
+}
@@ -27,9 +27,7 @@ int main(int argc, char* argv[]) {
       particles.updateTemporaryPosition(timer);
       particles.giveCollisionRepulsionForce();
       particles.updateTemporaryPosition(timer);
-      particles.calculateTemporaryParticleNumberDensity();
-      particles.checkSurfaceParticles();
-      particles.solvePressurePoisson(timer);
+      particles.solvePressurePoissonFused(timer);
       particles.setZeroOnNegativePressure();
       particles.correctVelocity(timer);
       particles.updateTemporaryPosition(timer);
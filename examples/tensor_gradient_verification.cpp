@@ -4,6 +4,7 @@
 #include <boost/format.hpp>
 #include <Eigen/Core>
 #include "condition.h"
+#include "gradient_correction.h"
 #include "grid.h"
 #include "particles.h"
 
@@ -22,6 +23,10 @@ int main(int argc, char* argv[]) {
         regular.pressure(100 * y + x) = condition.mass_density * condition.gravity.norm() * regular.position(1, 100 * y + x);
       }
     }
+    tiny_mps::Grid regular_grid(condition.gradient_radius, regular.temporary_position,
+                                regular.boundary_types.array() != tiny_mps::BoundaryType::OTHERS, condition.dimension);
+    tiny_mps::GradientCorrection regular_correction(regular.getSize(), condition.dimension);
+    regular.calculateGradientCorrection(regular.temporary_position, regular_grid, regular_correction);
     regular.correctVelocity(timer);
     regular.writeVtkFile("./output/regular_standard.vtk", "regular_standard");
     {
@@ -31,7 +36,7 @@ int main(int argc, char* argv[]) {
         ofs << regular.position(0, i) << ", " << regular.position(1, i) << ", " << err << std::endl;
       }
     }
-    regular.correctVelocityWithTensor(timer);
+    regular.correctVelocityWithTensor(timer, regular_grid, regular_correction);
     regular.writeVtkFile("./output/regular_tensor.vtk", "regular_tensor");
     {
       std::ofstream ofs("./output/regular_tensor_err.csv");
@@ -51,6 +56,10 @@ int main(int argc, char* argv[]) {
         irregular.pressure(100 * y + x) = condition.mass_density * condition.gravity.norm() * irregular.position(1, 100 * y + x);
       }
     }
+    tiny_mps::Grid irregular_grid(condition.gradient_radius, irregular.temporary_position,
+                                  irregular.boundary_types.array() != tiny_mps::BoundaryType::OTHERS, condition.dimension);
+    tiny_mps::GradientCorrection irregular_correction(irregular.getSize(), condition.dimension);
+    irregular.calculateGradientCorrection(irregular.temporary_position, irregular_grid, irregular_correction);
     irregular.correctVelocity(timer);
     irregular.writeVtkFile("./output/irregular_standard.vtk", "irregular_standard");
     {
@@ -60,7 +69,7 @@ int main(int argc, char* argv[]) {
         ofs << irregular.position(0, i) << ", " << irregular.position(1, i) << ", " << err << std::endl;
       }
     }
-    irregular.correctVelocityWithTensor(timer);
+    irregular.correctVelocityWithTensor(timer, irregular_grid, irregular_correction);
     irregular.writeVtkFile("./output/irregular_tensor.vtk", "irregular_tensor");
     {
       std::ofstream ofs("./output/irregular_tensor_err.csv");
@@ -89,7 +98,7 @@ int main(int argc, char* argv[]) {
         ofs << regular.position(0, i) << ", " << regular.position(1, i) << ", " << err << std::endl;
       }
     }
-    regular.correctVelocityWithTensor(timer);
+    regular.correctVelocityWithTensor(timer, regular_grid, regular_correction);
     regular.writeVtkFile("./output/regular_tensor2.vtk", "regular_tensor2");
     {
       std::ofstream ofs("./output/regular_tensor_err2.csv");
@@ -116,7 +125,7 @@ int main(int argc, char* argv[]) {
         ofs << irregular.position(0, i) << ", " << irregular.position(1, i) << ", " << err << std::endl;
       }
     }
-    irregular.correctVelocityWithTensor(timer);
+    irregular.correctVelocityWithTensor(timer, irregular_grid, irregular_correction);
     irregular.writeVtkFile("./output/irregular_tensor2.vtk", "irregular_tensor2");
     {
       std::ofstream ofs("./output/irregular_tensor_err2.csv");
@@ -18,15 +18,22 @@ enum SurfaceLayer {
 class BubbleParticles : public tiny_mps::Particles {
  public:
   BubbleParticles(const std::string& path, const tiny_mps::Condition& condition);
+  // Copies other to run it under another condition. The bubble radius and void fraction of
+  // each particle are copied as they are; only the initial bubble radius follows the condition.
+  BubbleParticles(const BubbleParticles& other, const tiny_mps::Condition& condition);
+  // Restarts from the particles written by writeCheckpoint().
+  BubbleParticles(tiny_mps::CheckpointReader& reader, const tiny_mps::Condition& condition);
   BubbleParticles(const tiny_mps::Particles& other) = delete;
   BubbleParticles& operator=(const tiny_mps::Particles& other) = delete;
   virtual ~BubbleParticles() {};
   bool nextLoop(const std::string& path, tiny_mps::Timer& timer);
   bool saveInterval(const std::string& path, const tiny_mps::Timer& timer) const;
-  void writeVtkFile(const std::string& path, const std::string& title) const;
+  void writeCheckpoint(tiny_mps::CheckpointWriter& writer) const;
   void writeGridVtkFile(const std::string& path, const std::string& title) const;
   void extendStorage(int extra_size);
+  std::vector<int> compactStorage();
   void setGhostParticle(int index);
+  void setGhostParticles(const std::vector<int>& indices);
   void calculateBubbles();
   void calculateBubblesFromAveragePressure();
   void calculateAveragePressure();
@@ -40,7 +47,28 @@ class BubbleParticles : public tiny_mps::Particles {
   void initAverageGrid(const Eigen::Vector3d& min_pos, const Eigen::Vector3d& max_pos);
   void updateAverageGrid(double start_time, const tiny_mps::Timer& timer);
 
+ protected:
+  void saveStepState();
+  void restoreStepState();
+  void addOutputFields(tiny_mps::ParticleSnapshot& snapshot) const;
+  void copyParticleFields(int source, int destination);
+
  private:
+  static void writeGridVtkFile(const std::string& path, const std::string& title, const std::vector<double>& average_grid,
+                               int grid_w, int grid_h, const Eigen::Vector3d& grid_min_pos, double spacing);
+
+  // Bubble data at the beginning of a step, restored on step rejection.
+  struct StepState {
+    Eigen::VectorXd average_pressure;
+    Eigen::Matrix3Xd normal_vector;
+    Eigen::VectorXd modified_pnd;
+    Eigen::VectorXd bubble_radius;
+    Eigen::VectorXd void_fraction;
+    Eigen::VectorXi free_surface_type;
+    std::vector<double> average_grid;
+    int average_count;
+  };
+
   Eigen::VectorXd average_pressure;
   Eigen::Matrix3Xd normal_vector;
   Eigen::VectorXd modified_pnd;
@@ -52,6 +80,7 @@ class BubbleParticles : public tiny_mps::Particles {
   Eigen::Vector3d grid_min_pos, grid_max_pos;
   int grid_w, grid_h;
   int average_count;
+  StepState step_state;
 };
 
 }
@@ -0,0 +1,118 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_CHECKPOINT_H_INCLUDED
+#define MPS_CHECKPOINT_H_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Binary checkpoint files hold the full state of a run in native byte order and full precision:
+//   Header : "TINYMPS\0", uint32 version, uint32 0x01020304 (byte order), uint32 sizeof(int)
+//   Body   : sections, each of which begins with its name (uint64 length and characters)
+// Arrays are stored as their size followed by their data in one block.
+// Objects write and read their own sections, e.g. Particles::writeCheckpoint() and
+// Timer(condition, reader), so they must be read back in the order they were written.
+// Example:
+//   CheckpointWriter writer("output/checkpoint.bin");
+//   particles.writeCheckpoint(writer);
+//   timer.writeCheckpoint(writer);
+//   writer.close();
+//   ...
+//   CheckpointReader reader("output/checkpoint.bin");
+//   Particles particles(reader, condition);
+//   Timer timer(condition, reader);
+class CheckpointWriter {
+ public:
+  // Writes to path + ".tmp", which close() renames to path, so that an interrupted
+  // write leaves the previous checkpoint intact.
+  explicit CheckpointWriter(const std::string& path);
+  // CheckpointWriter is neither copyable nor movable.
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+  // Removes the temporary file unless close() has been called.
+  virtual ~CheckpointWriter();
+
+  void beginSection(const std::string& name);
+  template <typename T>
+  void write(const T& value) {
+    static_assert(std::is_arithmetic<T>::value, "Only arithmetic values can be written directly.");
+    writeBytes(&value, sizeof(T));
+  }
+  template <typename T>
+  void write(const std::vector<T>& values) {
+    static_assert(std::is_arithmetic<T>::value, "Only arrays of arithmetic values can be written.");
+    write<std::uint64_t>(values.size());
+    writeBytes(values.data(), sizeof(T) * values.size());
+  }
+  template <typename Scalar, int Rows, int Cols, int Options, int MaxRows, int MaxCols>
+  void write(const Eigen::Matrix<Scalar, Rows, Cols, Options, MaxRows, MaxCols>& matrix) {
+    write<std::int64_t>(matrix.rows());
+    write<std::int64_t>(matrix.cols());
+    writeBytes(matrix.data(), sizeof(Scalar) * matrix.size());
+  }
+  void write(const std::string& value);
+  // Flushes the file and replaces the checkpoint at path with it.
+  void close();
+
+ private:
+  void writeBytes(const void* data, std::size_t bytes);
+
+  std::string path;
+  std::string temporary_path;
+  std::ofstream ofs;
+  bool closed;
+};
+
+class CheckpointReader {
+ public:
+  // Opens path and checks its header.
+  explicit CheckpointReader(const std::string& path);
+  // CheckpointReader is neither copyable nor movable.
+  CheckpointReader(const CheckpointReader&) = delete;
+  CheckpointReader& operator=(const CheckpointReader&) = delete;
+  virtual ~CheckpointReader(){}
+
+  // Throws unless the next section is name.
+  void beginSection(const std::string& name);
+  template <typename T>
+  void read(T& value) {
+    static_assert(std::is_arithmetic<T>::value, "Only arithmetic values can be read directly.");
+    readBytes(&value, sizeof(T));
+  }
+  template <typename T>
+  void read(std::vector<T>& values) {
+    static_assert(std::is_arithmetic<T>::value, "Only arrays of arithmetic values can be read.");
+    std::uint64_t size;
+    read(size);
+    values.resize(size);
+    readBytes(values.data(), sizeof(T) * size);
+  }
+  template <typename Scalar, int Rows, int Cols, int Options, int MaxRows, int MaxCols>
+  void read(Eigen::Matrix<Scalar, Rows, Cols, Options, MaxRows, MaxCols>& matrix) {
+    std::int64_t rows, cols;
+    read(rows);
+    read(cols);
+    if ((Rows != Eigen::Dynamic && rows != Rows) || (Cols != Eigen::Dynamic && cols != Cols)) fail("Array size mismatch");
+    matrix.resize(rows, cols);
+    readBytes(matrix.data(), sizeof(Scalar) * matrix.size());
+  }
+  void read(std::string& value);
+
+  inline const std::string& getPath() const { return path; }
+
+ private:
+  void readBytes(void* data, std::size_t bytes);
+  void fail(const std::string& message) const;
+
+  std::string path;
+  std::ifstream ifs;
+};
+
+} // namespace tiny_mps
+#endif // MPS_CHECKPOINT_H_INCLUDED
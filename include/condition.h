@@ -9,15 +9,25 @@
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <regex>
 #include <Eigen/Core>
+#include "logger.h"
+#include "output_filter.h"
+#include "resolution_zone.h"
 
 namespace tiny_mps {
 
 // Holds analysis conditions.
 class Condition {
  public:
+  // Overrides of items of the data file, e.g. {{"inflow_y", "-2.0"}}.
+  using Overrides = std::vector<std::pair<std::string, std::string> >;
+
   explicit Condition(std::string path);
+  // Reads the items of base with overrides applied. Does not reconfigure Logger.
+  Condition(const Condition& base, const Overrides& overrides);
   // Condition is neither copyable nor movable.
   Condition(const Condition&) = delete;
   Condition& operator=(const Condition&) = delete;
@@ -31,6 +41,7 @@ class Condition {
   double head_pressure;
   bool viscosity_calculation;
   double kinematic_viscosity;
+  bool implicit_viscosity;
 
   double courant_number;
   double diffusion_number;
@@ -40,6 +51,12 @@ class Condition {
   double delta_time;
   double min_delta_time;
   double output_interval;
+  bool adaptive_delta_time;
+  double max_delta_time;
+  double delta_time_growth_factor;
+  double delta_time_shrink_factor;
+  bool step_rejection;
+  double rejection_courant_number;
 
   double surface_threshold_pnd;
   double surface_threshold_number;
@@ -51,6 +68,9 @@ class Condition {
 
   int extra_ghost_particles;
   int additional_ghost_particles;
+  // The storage of the whole run, shared among MPI ranks.
+  int reserve_particles;
+  double storage_growth_factor;
   Eigen::Vector3d inflow_velocity;
 
   double collision_influence;
@@ -72,8 +92,42 @@ class Condition {
   double vapor_pressure;
   double secondary_surface_eta;
 
+  bool simd_kernels;
+  int thread_chunks;
+  double compaction_ghost_ratio;
+  bool deterministic_slots;
+  bool static_walls;
+  std::string polygon_wall_file;
+  // Boxes read from resolution1_box and resolution1_spacing_ratio, ... for resolution_zones,
+  // which Particles adds with addResolutionZone() on construction.
+  std::vector<ResolutionZone> resolution_zones;
+  std::string domain_decomposition;
+  std::string output_format;
+  int hdf5_compression;
+  // Bits of the double fields of vtu files (32 or 64), and the zlib level of their arrays (0: raw).
+  int vtu_precision;
+  int vtu_compression;
+  // Applies to the main output.
+  OutputFilter output_filter;
+  // Outputs besides the main one, read from output1_name, output1_interval, ... for output_streams.
+  std::vector<OutputStream> output_streams;
+  bool async_output;
+  int checkpoint_interval;
+  std::string checkpoint_file;
+  int load_balance_interval;
+  double load_imbalance_tolerance;
+  std::string log_level;
+  int log_step_interval;
+  bool log_async;
+
  private:
   void readDataFile(std::string path);
+  // Sets the members from data.
+  void setValues();
+  // Reads prefix + "fields", "types", "box" and "stride", which default to everything.
+  OutputFilter getOutputFilter(const std::string& prefix) const;
+  // Reads prefix + "box" as "min_x,min_y,min_z,max_x,max_y,max_z" and prefix + "spacing_ratio".
+  ResolutionZone getResolutionZone(const std::string& prefix) const;
 
   int getValue(const std::string& item, int& value) const;
   int getValue(const std::string& item, double& value) const;
@@ -81,6 +135,8 @@ class Condition {
   int getValue(const std::string& item, std::string& value) const;
 
   std::unordered_map<std::string, std::string> data;
+  // Items in the order they appear in the file.
+  std::vector<std::string> items;
 };
 
 }
@@ -0,0 +1,186 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_DOMAIN_DECOMPOSITION_H_INCLUDED
+#define MPS_DOMAIN_DECOMPOSITION_H_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include "condition.h"
+
+namespace tiny_mps {
+
+class CheckpointReader;
+class CheckpointWriter;
+class Particles;
+struct StepStats;
+class Timer;
+
+// A box of space owned by one rank. Bounds may be infinite; the lower bound is inclusive
+// and the upper bound exclusive, so that boxes of all ranks tile the whole space.
+struct Subdomain {
+  inline bool contains(const Eigen::Vector3d& point, int dimension) const {
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      if (point(i_dim) < minpos(i_dim) || point(i_dim) >= maxpos(i_dim)) return false;
+    }
+    return true;
+  }
+  inline double getDistance(const Eigen::Vector3d& point, int dimension) const {
+    double distance2 = 0.0;
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      double d = std::max(std::max(minpos(i_dim) - point(i_dim), point(i_dim) - maxpos(i_dim)), 0.0);
+      distance2 += d * d;
+    }
+    return std::sqrt(distance2);
+  }
+
+  Eigen::Vector3d minpos;
+  Eigen::Vector3d maxpos;
+};
+
+// Splits particles among MPI ranks by slabs or recursive coordinate bisection, so that
+// each rank gets about the same cost, the sum of the number of neighbors plus one of its particles.
+// Each rank keeps the particles in its subdomain and copies of the others' particles
+// within the halo width (halo particles), which are refreshed before every neighbor stage.
+// The subdomains are first cut from the positions in the grid file, which only rank 0 reads,
+// and each rank reads only its own particles and those around them.
+// Built without MPI (make mpi=yes), there is a single rank and every call does nothing.
+// NORMAL particles migrate to the rank of their subdomain; the other types stay with
+// the rank they were given first. Particles must not be compacted while halos exist.
+// Example:
+//   DomainDecomposition domain(condition);
+//   domain.decompose("input/dam.grid");
+//   Particles particles("input/dam.grid", condition, domain);
+//   domain.decompose(particles);
+//   while(particles.nextLoop(path, timer)) {
+//     domain.exchangeHalo(particles);
+//     particles.calculateTemporaryVelocity(condition.gravity, timer);
+//     particles.updateTemporaryPosition(timer);
+//     domain.updateHalo(particles);
+//     particles.solvePressurePoissonFused(timer);
+//     ...
+//     particles.updateVelocityAndPosition();
+//     domain.migrate(particles);
+//     domain.balanceLoad(particles, timer);
+//   }
+class DomainDecomposition {
+ public:
+  // Initializes MPI unless it has been initialized.
+  explicit DomainDecomposition(const Condition& condition);
+  // DomainDecomposition is neither copyable nor movable.
+  DomainDecomposition(const DomainDecomposition&) = delete;
+  DomainDecomposition& operator=(const DomainDecomposition&) = delete;
+  // Finalizes MPI if the constructor initialized it.
+  virtual ~DomainDecomposition();
+
+  // Divides the space by the positions of the particles in the grid file at path, each weighted
+  // by one. Rank 0 reads them and sends the subdomains to the others.
+  void decompose(const std::string& path);
+  // Drops the particles of the other ranks, which the constructor of Particles from a grid file and
+  // this DomainDecomposition read for the neighbors of this rank's particles, and compacts the storage.
+  // Their neighbor counts, computed with those particles, are the costs for the first balanceLoad().
+  // Unless decompose(path) has been called, the space is first divided by the costs of particles,
+  // which every rank must then hold in the same order (e.g. read from the same grid file).
+  // Registers itself to particles, so that their statistics and pressure solver become global.
+  void decompose(Particles& particles);
+  // Takes over particles restored from the checkpoint of this rank, which resume()
+  // reads after Particles and Timer, and registers itself to them.
+  // The number of ranks must be the same as when the checkpoint was written.
+  void resume(Particles& particles, CheckpointReader& reader);
+  // Writes the subdomains. Particles::saveCheckpoint() calls it after Particles and Timer.
+  void writeCheckpoint(CheckpointWriter& writer) const;
+  // Returns path with "_r<rank>" inserted before its extension if distributed,
+  // so that every rank writes its own checkpoint.
+  std::string getRankPath(const std::string& path) const;
+  // Drops old halo particles and receives new ones within the halo width of the subdomain.
+  void exchangeHalo(Particles& particles);
+  // Overwrites the fields of halo particles with those of their owners.
+  void updateHalo(Particles& particles) const;
+  void updateHalo(Eigen::VectorXd& values) const;
+  // Drops halo particles and sends NORMAL particles which left the subdomain to their new ranks.
+  // Returns the number of particles sent.
+  int migrate(Particles& particles);
+  // Cuts the subdomains again by the current cost of all particles and moves every particle except
+  // INFLOW and DUMMY_INFLOW to its new rank. Returns the number of particles sent.
+  int rebalance(Particles& particles);
+  // Calls rebalance() every load_balance_interval steps in Condition if the load imbalance
+  // exceeds load_imbalance_tolerance. Returns true if it did.
+  bool balanceLoad(Particles& particles, const Timer& timer);
+  // Returns the maximum cost of a rank divided by the mean.
+  double getLoadImbalance(const Particles& particles) const;
+
+  // Sums or takes the maximum of the statistics over all ranks.
+  void reduce(StepStats& stats) const;
+  double sum(double value) const;
+  int sum(int value) const;
+  double max(double value) const;
+  // Solves matrix * x = rhs, whose rows of halo particles are ignored and whose columns
+  // of halo particles are coupled with their owners, by the conjugate gradient method with
+  // a diagonal preconditioner. Stops as Eigen::ConjugateGradient does with default settings.
+  bool solveConjugateGradient(const Eigen::SparseMatrix<double>& matrix, const Eigen::VectorXd& rhs,
+                              Eigen::VectorXd& x, int& iterations, double& error) const;
+
+  // Returns the rank whose subdomain contains the point.
+  int findRank(const Eigen::Vector3d& point) const;
+  // Returns true if the point is in the subdomain of this rank or within the halo width around it,
+  // where particles are at average_distance.
+  inline bool isWithinHalo(const Eigen::Vector3d& point) const {
+    return subdomains[rank].getDistance(point, dimension) < calculateHaloWidth(1.0);
+  }
+  inline bool isHalo(int index) const {
+    return index < static_cast<int>(halo_flags.size()) && halo_flags[index];
+  }
+  inline int getRank() const { return rank; }
+  inline int getSize() const { return size; }
+  inline bool isDistributed() const { return size > 1; }
+  inline int getHaloCount() const { return halo_indices.size(); }
+  inline double getHaloWidth() const { return halo_width; }
+  inline const std::vector<Subdomain>& getSubdomains() const { return subdomains; }
+
+ private:
+  struct WeightedPoint {
+    Eigen::Vector3d point;
+    double weight;
+  };
+  // Assigns the boxes of ranks [rank_begin, rank_end) by splitting box at weighted quantiles of points.
+  void bisect(std::vector<WeightedPoint>& points, int rank_begin, int rank_end, const Subdomain& box, int slab_axis);
+  // Cuts the subdomains by points, which every rank must give in the same order.
+  void cut(std::vector<WeightedPoint>& points);
+  std::vector<WeightedPoint> gatherWeightedPoints(const Particles& particles) const;
+  static int getLongestAxis(const std::vector<WeightedPoint>& points, int dimension);
+  static double getCost(const Particles& particles, int index);
+  void dropHalo(Particles& particles);
+  // Sends NORMAL particles, or all but INFLOW and DUMMY_INFLOW if all_types is true,
+  // which are outside the subdomain to the ranks of their subdomains.
+  int sendOutside(Particles& particles, bool all_types);
+  // max_spacing_scale is the largest particle spacing relative to average_distance.
+  double calculateHaloWidth(double max_spacing_scale) const;
+  // Sends the subdomains of rank 0 to the others.
+  void broadcastSubdomains();
+  // Sends buffers[r] to rank r and returns what was received, ordered by the source rank.
+  std::vector<double> exchangeBuffers(const std::vector<std::vector<double> >& buffers) const;
+  // Returns the values of all ranks concatenated in the order of ranks.
+  std::vector<double> gatherAll(const std::vector<double>& values) const;
+  static void packParticle(const Particles& particles, int index, std::vector<double>& buffer);
+  static void unpackParticle(Particles& particles, int index, const double* record, bool with_type);
+
+  const Condition& condition_;
+  const int dimension;
+  int rank;
+  int size;
+  bool initialized_mpi;
+  // True once decompose(path) has cut the subdomains.
+  bool decomposed;
+  double halo_width;
+  std::vector<Subdomain> subdomains;
+  // Indices of own particles sent to each rank as halos, and of halo particles received, ordered by the source rank.
+  std::vector<std::vector<int> > halo_send_lists;
+  std::vector<int> halo_indices;
+  std::vector<char> halo_flags;
+};
+
+} // namespace tiny_mps
+#endif // MPS_DOMAIN_DECOMPOSITION_H_INCLUDED
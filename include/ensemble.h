@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_ENSEMBLE_H_INCLUDED
+#define MPS_ENSEMBLE_H_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "condition.h"
+
+namespace tiny_mps {
+
+// Result of a case of Ensemble. name, output_directory, succeeded, message and wall_time are
+// filled by Ensemble; the others are left to the case function.
+struct EnsembleResult {
+  EnsembleResult()
+      : succeeded(false), wall_time(0.0), steps(0), simulated_time(0.0), max_speed(0.0), particles(0) {}
+
+  std::string name;
+  std::string output_directory;
+  bool succeeded;
+  // what() of the exception which stopped the case.
+  std::string message;
+  // Seconds.
+  double wall_time;
+  int steps;
+  double simulated_time;
+  double max_speed;
+  int particles;
+};
+
+// Runs the cases of a parameter sweep in one process instead of one process per case.
+// The data file is read once and each case gets a Condition of it with its overrides;
+// the case function typically copies particles read once with Particles(other, condition).
+// Cases run concurrently on a pool of threads, each of which runs threads_per_case OpenMP threads,
+// and write into output_root/<name>/. A case which throws does not stop the others.
+// Example:
+//   Condition base("./input/nozzle.data");
+//   my_mps::BubbleParticles initial("./input/nozzle3.grid", base);
+//   Ensemble ensemble(base, "./output/");
+//   ensemble.addCase("1", {{"inflow_y", "-1.40625"}});
+//   ensemble.addCase("2", {{"inflow_y", "-1.4375"}});
+//   ensemble.run([&](const Condition& condition, const std::string& output_directory, EnsembleResult& result) {
+//     my_mps::BubbleParticles particles(initial, condition);
+//     Timer timer(condition);
+//     while(particles.nextLoop(output_directory, timer)) { ... }
+//     result.steps = timer.getLoopCount();
+//   }, 4, 1);
+class Ensemble {
+ public:
+  using CaseFunction = std::function<void(const Condition& condition, const std::string& output_directory, EnsembleResult& result)>;
+
+  // output_root must end with a path separator, as output paths of Particles do.
+  Ensemble(const Condition& base, const std::string& output_root);
+  // Ensemble is neither copyable nor movable.
+  Ensemble(const Ensemble&) = delete;
+  Ensemble& operator=(const Ensemble&) = delete;
+  virtual ~Ensemble(){}
+
+  void addCase(const std::string& name, const Condition::Overrides& overrides);
+  // Runs all cases on threads workers, or as many as the hardware threads allow if it is not positive.
+  // Per-step logs of concurrent cases would interleave, so Logger keeps only warnings and errors
+  // while cases run. Writes output_root/summary.txt and returns the results in the order of cases.
+  std::vector<EnsembleResult> run(const CaseFunction& function, int threads = 0, int threads_per_case = 1);
+  // Writes a table of results, one line per case.
+  static void writeSummary(const std::string& path, const std::vector<EnsembleResult>& results);
+
+  inline int getSize() const { return names.size(); }
+
+ private:
+  void runCase(const CaseFunction& function, int index, EnsembleResult& result) const;
+  static void makeDirectory(const std::string& path);
+
+  const Condition& base_;
+  std::string output_root;
+  std::vector<std::string> names;
+  std::vector<Condition::Overrides> overrides;
+};
+
+} // namespace tiny_mps
+#endif // MPS_ENSEMBLE_H_INCLUDED
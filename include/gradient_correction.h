@@ -0,0 +1,52 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_GRADIENT_CORRECTION_H_INCLUDED
+#define MPS_GRADIENT_CORRECTION_H_INCLUDED
+
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Holds the inverses of the symmetric tensors sum(w_ij * n_ij * n_ij^T) / n0,
+// which correct the gradient operator for irregular particle distributions.
+// Matrices depend only on positions, so one instance can be reused by every
+// gradient evaluated on the same position state.
+// Example:
+//   GradientCorrection correction(size, dimension);
+//   particles.calculateGradientCorrection(particles.temporary_position, grid, correction);
+//   if (correction.isCorrected(i_particle)) grad = correction.apply(i_particle, grad);
+class GradientCorrection {
+ public:
+  GradientCorrection(int size, int dimension);
+  virtual ~GradientCorrection(){}
+
+  // Marks every matrix as uncorrected and fits the storage to size.
+  void reset(int size);
+
+  // Stores the inverse of the symmetric tensor using a closed form.
+  // Returns false and leaves the index uncorrected if the tensor is nearly singular.
+  bool setTensor(int index, const Eigen::Matrix3d& tensor);
+
+  // Returns correction_matrix * vec.
+  inline Eigen::Vector3d apply(int index, const Eigen::Vector3d& vec) const {
+    const double* c = inverse.col(index).data();
+    return Eigen::Vector3d(c[0] * vec(0) + c[1] * vec(1) + c[2] * vec(2),
+                           c[1] * vec(0) + c[3] * vec(1) + c[4] * vec(2),
+                           c[2] * vec(0) + c[4] * vec(1) + c[5] * vec(2));
+  }
+  Eigen::Matrix3d getMatrix(int index) const;
+
+  inline bool isCorrected(int index) const { return corrected(index) != 0; }
+  inline int getSize() const { return inverse.cols(); }
+  inline int getDimension() const { return dimension; }
+  inline int getCorrectedCount() const { return corrected.sum(); }
+
+ private:
+  const int dimension;
+  // Upper triangles of the inverses: xx, xy, xz, yy, yz, zz.
+  Eigen::Matrix<double, 6, Eigen::Dynamic> inverse;
+  Eigen::VectorXi corrected;
+};
+
+} // namespace tiny_mps
+#endif // MPS_GRADIENT_CORRECTION_H_INCLUDED
@@ -39,6 +39,10 @@ class Grid {
 
   void getNeighborsInBox(int index, Neighbors& neighbors) const;
 
+  // Returns valid coordinates within grid_width from an arbitrary point,
+  // which does not have to be one of the coordinates.
+  void getNeighborsAround(const Eigen::Vector3d& point, Neighbors& neighbors) const;
+
   inline int getSize() const { return size; }
   inline int getDimension() const { return dimension; }
   inline double getGridWidth() const { return grid_width; }
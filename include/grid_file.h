@@ -0,0 +1,83 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_GRID_FILE_H_INCLUDED
+#define MPS_GRID_FILE_H_INCLUDED
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Reads the initial particles of a grid file, either of the two formats:
+//   Text (.grid)    : start time, the number of particles, and a line per particle of
+//                     "type x y z u v w pressure"
+//   Binary (.gridb) : "TMPSGRID", uint32 version, uint32 0x01020304 (byte order), uint64 the number of particles,
+//                     float64 start time, int32 types[n], float64 positions[n][3], velocities[n][3], pressures[n]
+// The format is told by the first bytes, not by the extension. The file is memory-mapped
+// and text lines are parsed in parallel, so that large inputs load in a fraction of a second.
+// Example:
+//   GridFile grid("input/dam.grid");
+//   grid.read(dimension, particle_types, position, velocity, pressure);
+//   GridFile::writeBinary("input/dam.gridb", grid.getStartTime(), particle_types, position, velocity, pressure);
+class GridFile {
+ public:
+  // Maps path and reads its header.
+  explicit GridFile(const std::string& path);
+  // GridFile is neither copyable nor movable.
+  GridFile(const GridFile&) = delete;
+  GridFile& operator=(const GridFile&) = delete;
+  virtual ~GridFile();
+
+  // Reads the particles into the first getSize() entries, which must exist.
+  // Only the first dimension components of positions and velocities are set.
+  void read(int dimension, Eigen::VectorXi& particle_types, Eigen::Matrix3Xd& position,
+            Eigen::Matrix3Xd& velocity, Eigen::VectorXd& pressure) const;
+  // Reads particle indices[k] into entry k, so that only a part of a large file is held.
+  void read(int dimension, const std::vector<int>& indices, Eigen::VectorXi& particle_types,
+            Eigen::Matrix3Xd& position, Eigen::Matrix3Xd& velocity, Eigen::VectorXd& pressure) const;
+  // Returns the positions of all particles only.
+  Eigen::Matrix3Xd readPositions(int dimension) const;
+  // Returns the indices of the particles whose positions satisfy predicate, without storing the positions.
+  // predicate is called in parallel, so it must be thread-safe.
+  std::vector<int> selectParticles(int dimension, const std::function<bool(const Eigen::Vector3d&)>& predicate) const;
+
+  inline int getSize() const { return particles_number; }
+  inline double getStartTime() const { return start_time; }
+  inline bool isBinary() const { return binary; }
+
+  // Writes the first size particles in either format.
+  static void writeBinary(const std::string& path, double start_time, int size, const Eigen::VectorXi& particle_types,
+                          const Eigen::Matrix3Xd& position, const Eigen::Matrix3Xd& velocity,
+                          const Eigen::VectorXd& pressure);
+  static void writeText(const std::string& path, double start_time, int size, const Eigen::VectorXi& particle_types,
+                        const Eigen::Matrix3Xd& position, const Eigen::Matrix3Xd& velocity,
+                        const Eigen::VectorXd& pressure);
+
+ private:
+  void readHeader();
+  // Unmaps or frees the file.
+  void release();
+  // Calls function(k, type, values) in parallel for particle indices[k], where values are
+  // "x y z u v w pressure". Fails at the first invalid particle.
+  template <typename Function>
+  void parseParticles(const std::vector<int>& indices, const Function& function) const;
+  // Logs and throws an error about the file.
+  void fail(const std::string& message) const;
+
+  std::string path;
+  // The mapped file, or a copy of it where mapping is unavailable.
+  const char* data;
+  std::size_t length;
+  bool mapped;
+  bool binary;
+  int particles_number;
+  double start_time;
+  // Where particles begin.
+  std::size_t body;
+};
+
+} // namespace tiny_mps
+#endif // MPS_GRID_FILE_H_INCLUDED
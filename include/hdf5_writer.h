@@ -0,0 +1,65 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_HDF5_WRITER_H_INCLUDED
+#define MPS_HDF5_WRITER_H_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "particle_snapshot.h"
+
+namespace tiny_mps {
+
+// Writes a time series into a single HDF5 file (series_path + ".h5") and XDMF files next to it,
+// which ParaView opens as time series: series_path + ".xmf" for particles and series_path + "_grid.xmf" for grids.
+//   /Step_0000 : Points (N x 3) and a dataset per field of a ParticleSnapshot, with Time as attribute
+//   /Grid_0000 : Pressure (height x width) of a structured grid, e.g. that of BubbleParticles
+// Datasets are chunked, and deflated if compression (1-9) is positive.
+// The file stays open between outputs and is flushed after each of them, and each output appends its
+// entry to the XDMF file. The first output of each kind removes those of the same kind whose index is
+// not below its own, so that a restarted run replaces those left behind; the file keeps track of the
+// space they took and reuses it. Build with "make hdf5=yes"; otherwise every write throws.
+// Example:
+//   Hdf5Writer writer("output/output", 0);
+//   writer.writeParticles(timer.getOutputCount(), timer.getCurrentTime(), particles.makeSnapshot());
+class Hdf5Writer {
+ public:
+  Hdf5Writer(const std::string& series_path, int compression);
+  Hdf5Writer(const Hdf5Writer&) = delete;
+  Hdf5Writer& operator=(const Hdf5Writer&) = delete;
+  virtual ~Hdf5Writer();
+
+  void writeParticles(int index, double time, const ParticleSnapshot& snapshot);
+  void writeGrid(int index, double time, const std::vector<double>& values, int width, int height,
+                 const Eigen::Vector3d& origin, double spacing);
+  // Returns true if built with HDF5.
+  static bool isAvailable();
+
+ private:
+  // Outputs of one kind, i.e. groups named prefix + index, and their XDMF file.
+  struct Series {
+    std::string prefix;
+    std::string name;
+    std::string xmf_path;
+    std::fstream xmf;
+  };
+
+  // Opens the file on the first output, creating it anew if truncate is true.
+  void openFile(bool truncate);
+  // Removes the outputs of series from index on and writes its XDMF file from the others.
+  void beginSeries(Series& series, int index);
+  // Writes entry, the XDMF of the output just written, and flushes both files.
+  void endOutput(Series& series, const std::string& entry);
+
+  std::string series_path;
+  int compression;
+  // The identifier (hid_t) of the HDF5 file, or -1 until the first output.
+  std::int64_t file;
+  Series particles;
+  Series grid;
+};
+
+} // namespace tiny_mps
+#endif // MPS_HDF5_WRITER_H_INCLUDED
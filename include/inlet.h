@@ -0,0 +1,25 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_INLET_H_INCLUDED
+#define MPS_INLET_H_INCLUDED
+
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// A group of INFLOW and DUMMY_INFLOW particles moving with one velocity.
+// Each time they travel average_distance, the INFLOW particles leave a copy
+// of themselves as normal particles and the whole group steps back one layer.
+struct Inlet {
+  explicit Inlet(const Eigen::Vector3d& velocity) : velocity(velocity), stride(0.0) {}
+
+  Eigen::Vector3d velocity;
+  // Distance traveled since the last layer was emitted.
+  double stride;
+  std::vector<int> inflow_particles;
+  std::vector<int> dummy_particles;
+};
+
+} // namespace tiny_mps
+#endif // MPS_INLET_H_INCLUDED
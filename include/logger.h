@@ -0,0 +1,103 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_LOGGER_H_INCLUDED
+#define MPS_LOGGER_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace tiny_mps {
+
+// Log levels in increasing verbosity. "quiet" in a data file is the same as LOG_ERROR.
+enum LogLevel {
+  LOG_ERROR = 0,
+  LOG_WARNING = 1,
+  LOG_INFO = 2,
+  LOG_DEBUG = 3
+};
+
+// Collects log lines into a buffer and writes it to std::cout in blocks instead of
+// flushing every line. Errors go to std::cerr at once, after the pending lines.
+// With the asynchronous sink, blocks are written by a background thread.
+// Messages tagged as per-step are kept only every step_interval steps.
+class Logger {
+ public:
+  static Logger& getInstance();
+  // Logger is neither copyable nor movable.
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+  virtual ~Logger();
+
+  void configure(LogLevel level, int step_interval, bool async);
+  // Parses "quiet", "error", "warning", "info" or "debug".
+  static LogLevel parseLevel(const std::string& name);
+  inline void setStep(int step) { this->step = step; }
+  inline bool isEnabled(LogLevel level) const { return level <= this->level; }
+  inline bool isStepEnabled(LogLevel level) const {
+    return isEnabled(level) && (step_interval <= 1 || step % step_interval == 0);
+  }
+  void write(LogLevel level, const std::string& line);
+  // Writes all pending lines and waits for the sink.
+  void flush();
+
+ private:
+  Logger();
+  void sendBuffer();
+  void runSink();
+
+  LogLevel level;
+  int step_interval;
+  // Set by every Timer, which may run on several threads (e.g. Ensemble).
+  std::atomic<int> step;
+  bool async;
+  std::string buffer;
+  std::mutex buffer_mutex;
+  // Blocks waiting for the background sink.
+  std::deque<std::string> blocks;
+  std::mutex sink_mutex;
+  std::condition_variable sink_condition;
+  std::condition_variable drained_condition;
+  bool writing;
+  bool stopping;
+  std::thread sink_thread;
+};
+
+// Builds one line and passes it to the logger at the end of the statement.
+// Example:
+//   Log(LOG_INFO) << "Succeed in reading grid file: " << path;
+class Log {
+ public:
+  explicit Log(LogLevel level) : level(level), enabled(Logger::getInstance().isEnabled(level)) {}
+  Log(const Log&) = delete;
+  Log& operator=(const Log&) = delete;
+  virtual ~Log() {
+    if (enabled) Logger::getInstance().write(level, stream.str());
+  }
+  template <typename T>
+  inline Log& operator<<(const T& value) {
+    if (enabled) stream << value;
+    return *this;
+  }
+
+ protected:
+  Log(LogLevel level, bool enabled) : level(level), enabled(enabled) {}
+
+ private:
+  const LogLevel level;
+  const bool enabled;
+  std::ostringstream stream;
+};
+
+// Same as Log, but kept only on steps that match log_step_interval.
+class StepLog : public Log {
+ public:
+  explicit StepLog(LogLevel level) : Log(level, Logger::getInstance().isStepEnabled(level)) {}
+};
+
+} // namespace tiny_mps
+#endif // MPS_LOGGER_H_INCLUDED
@@ -0,0 +1,53 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_OUTPUT_FILTER_H_INCLUDED
+#define MPS_OUTPUT_FILTER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Selects the fields and particles an output writes. The default selects everything.
+// Particles are selected by type and box, and then every stride-th of them is taken.
+class OutputFilter {
+ public:
+  OutputFilter() : has_box(false), box_min(Eigen::Vector3d::Zero()), box_max(Eigen::Vector3d::Zero()), stride(1) {}
+  virtual ~OutputFilter(){}
+
+  // Sets the filter from items of the data file. Each is "all" (or "off" for box) to select everything.
+  //   fields : names of fields, e.g. "Pressure,Velocity", which must be written by Particles or its subclasses
+  //   types  : particle types among normal, wall, dummy_wall, inflow, dummy_inflow and ghost, e.g. "normal,wall"
+  //   box    : "min_x,min_y,min_z,max_x,max_y,max_z"
+  void parse(const std::string& fields, const std::string& types, const std::string& box, int stride);
+
+  bool selectsAllParticles() const;
+  // Throws std::logic_error for a name which is not a field, since parse() checks fields against them.
+  bool selectsField(const std::string& name) const;
+  // Returns the indices of the selected particles in ascending order.
+  std::vector<int> selectParticles(const Eigen::Matrix3Xd& position, const Eigen::VectorXi& particle_types) const;
+  // Returns true if name is a field which Particles or its subclasses write.
+  static bool isFieldName(const std::string& name);
+
+ private:
+  // Empty selects all.
+  std::vector<std::string> fields;
+  // Empty selects all.
+  std::vector<int> particle_types;
+  bool has_box;
+  Eigen::Vector3d box_min;
+  Eigen::Vector3d box_max;
+  int stride;
+};
+
+// An output written every interval (sec) besides the main one, e.g. the fluid alone at a shorter interval.
+// Its files are named by name in the directory of the main output, e.g. "output/fluid_0001.vtk".
+struct OutputStream {
+  std::string name;
+  double interval;
+  OutputFilter filter;
+};
+
+} // namespace tiny_mps
+#endif // MPS_OUTPUT_FILTER_H_INCLUDED
@@ -0,0 +1,61 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_PAIR_KERNELS_H_INCLUDED
+#define MPS_PAIR_KERNELS_H_INCLUDED
+
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Holds coordinates as separate x, y and z arrays (structure of arrays).
+// Each array is padded to a multiple of eight doubles so that every array
+// starts on the alignment Eigen uses for the widest enabled vector unit.
+class AlignedCoordinates {
+ public:
+  AlignedCoordinates() : size(0), padded_size(0) {}
+  virtual ~AlignedCoordinates(){}
+
+  // Copies a 3xN column-major matrix into the x, y and z arrays.
+  void assign(const Eigen::Matrix3Xd& coordinates);
+
+  inline const double* x() const { return data.data(); }
+  inline const double* y() const { return data.data() + padded_size; }
+  inline const double* z() const { return data.data() + 2 * padded_size; }
+  inline int getSize() const { return size; }
+  inline int getPaddedSize() const { return padded_size; }
+
+ private:
+  int size;
+  int padded_size;
+  Eigen::VectorXd data;
+};
+
+// Pair kernels over a block of neighbor candidates.
+// They are compiled for AVX-512 or AVX2 when the compiler targets them
+// (e.g. make simd=native) and fall back to scalar code otherwise.
+// All of them use the standard weight, w(r) = r_e / r - 1, and expect
+// candidates not to contain the "index" particle itself, as returned by
+// Grid::getNeighborsInBox().
+namespace pair_kernels {
+
+// Returns the instruction set the kernels were compiled for.
+const char* getInstructionSet();
+
+// Stores the candidates within the radius from the "index" particle into neighbors
+// and returns their number. neighbors may be the same array as candidates.
+int filterNeighbors(const AlignedCoordinates& coordinates, int index,
+                    const int* candidates, int candidate_size, double radius, int* neighbors);
+
+// Returns the sum of weights over candidates within the radius.
+// The number of those candidates is assigned to count.
+double sumParticleNumberDensity(const AlignedCoordinates& coordinates, int index,
+                                const int* candidates, int candidate_size, double radius, int& count);
+
+// Returns sum((values_j - reference) * r_ij * w(|r_ij|) / |r_ij|^2) over neighbors.
+Eigen::Vector3d sumGradient(const AlignedCoordinates& coordinates, int index,
+                            const int* neighbors, int neighbor_size,
+                            const double* values, double reference, double radius);
+
+} // namespace pair_kernels
+} // namespace tiny_mps
+#endif // MPS_PAIR_KERNELS_H_INCLUDED
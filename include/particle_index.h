@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_PARTICLE_INDEX_H_INCLUDED
+#define MPS_PARTICLE_INDEX_H_INCLUDED
+
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include "checkpoint.h"
+
+namespace tiny_mps {
+
+// Keeps the indices of particles grouped by ParticleType in a single array,
+// so that loops can visit only the particles of the types they need
+// instead of scanning the whole storage including ghost slots.
+// Groups are stored in the order WALL, NORMAL, INFLOW, DUMMY_INFLOW, DUMMY_WALL, GHOST,
+// so that the following sets are contiguous:
+//   getRange(NORMAL)               : fluid particles
+//   getRange(WALL, INFLOW)         : particles whose pressure is solved
+//   getRange(INFLOW, DUMMY_INFLOW) : inflow particles
+//   getLiveRange()                 : every particle except ghosts
+// Indices within a group are not sorted.
+class ParticleIndex {
+ public:
+  class Range {
+   public:
+    Range(const int* first, const int* last) : first(first), last(last) {}
+    inline const int* begin() const { return first; }
+    inline const int* end() const { return last; }
+    inline int size() const { return last - first; }
+   private:
+    const int* first;
+    const int* last;
+  };
+
+  ParticleIndex() : begins() {}
+  virtual ~ParticleIndex(){}
+
+  // Rebuilds every group from particle_types.
+  void build(const Eigen::VectorXi& particle_types);
+  // Appends the indices from the current size to new_size as ghosts.
+  void extend(int new_size);
+  // Moves index from the group of old_type to that of new_type.
+  void change(int index, int old_type, int new_type);
+  // Writes and reads the groups as they are, keeping the order of indices within them.
+  void writeCheckpoint(CheckpointWriter& writer) const;
+  void readCheckpoint(CheckpointReader& reader);
+
+  inline Range getRange(int type) const { return getRange(type, type); }
+  // Returns the groups from first to last in the storage order described above.
+  inline Range getRange(int first, int last) const {
+    return Range(indices.data() + begins[getOrder(first)], indices.data() + begins[getOrder(last) + 1]);
+  }
+  inline Range getLiveRange() const { return Range(indices.data(), indices.data() + begins[kGhostOrder]); }
+  inline int getCount(int type) const { return getRange(type).size(); }
+  inline int getSize() const { return indices.size(); }
+
+ private:
+  static const int kGroups = 6;
+  static const int kGhostOrder = kGroups - 1;
+  static int getOrder(int type);
+  inline void swap(int location_a, int location_b) {
+    std::swap(indices[location_a], indices[location_b]);
+    locations[indices[location_a]] = location_a;
+    locations[indices[location_b]] = location_b;
+  }
+
+  std::vector<int> indices;
+  std::vector<int> locations;
+  // The group of order k occupies indices[begins[k]] to indices[begins[k + 1] - 1].
+  int begins[kGroups + 1];
+};
+
+} // namespace tiny_mps
+#endif // MPS_PARTICLE_INDEX_H_INCLUDED
@@ -0,0 +1,60 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_PARTICLE_SNAPSHOT_H_INCLUDED
+#define MPS_PARTICLE_SNAPSHOT_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "output_filter.h"
+
+namespace tiny_mps {
+
+// Copies of the positions and fields of particles to be written to a file,
+// so that they can be written while the particles move on (see SnapshotWriter).
+// Fields are written in the order they were added.
+// Example:
+//   ParticleSnapshot snapshot(position);
+//   snapshot.addField("Pressure", pressure);
+//   snapshot.addField("Velocity", velocity);
+//   snapshot.writeVtkFile("output/output_0001.vtk", "Time: 0.01");
+// With an OutputFilter, only the selected particles and fields are copied.
+class ParticleSnapshot {
+ public:
+  enum FieldKind { DOUBLE_SCALAR, INT_SCALAR, DOUBLE_VECTOR };
+  // Only the array of kind is filled.
+  struct Field {
+    std::string name;
+    FieldKind kind;
+    Eigen::VectorXd doubles;
+    Eigen::VectorXi ints;
+    Eigen::Matrix3Xd vectors;
+  };
+
+  explicit ParticleSnapshot(const Eigen::Matrix3Xd& position) : position(position), all_particles(true) {}
+  ParticleSnapshot(const Eigen::Matrix3Xd& position, const Eigen::VectorXi& particle_types, const OutputFilter& filter);
+  virtual ~ParticleSnapshot(){}
+
+  void addField(const std::string& name, const Eigen::VectorXd& values);
+  void addField(const std::string& name, const Eigen::VectorXi& values);
+  void addField(const std::string& name, const Eigen::Matrix3Xd& values);
+  // Writes legacy ASCII VTK.
+  void writeVtkFile(const std::string& path, const std::string& title) const;
+  // Writes binary VTK XML, with double fields as Float32 if float32 and arrays deflated at compression (1-9). See VtuWriter.
+  void writeVtuFile(const std::string& path, double time, bool float32 = false, int compression = 0) const;
+
+  inline int getSize() const { return position.cols(); }
+  inline const Eigen::Matrix3Xd& getPosition() const { return position; }
+  inline const std::vector<Field>& getFields() const { return fields; }
+
+ private:
+  Eigen::Matrix3Xd position;
+  std::vector<Field> fields;
+  OutputFilter filter;
+  // The indices of the selected particles, unless all_particles.
+  std::vector<int> indices;
+  bool all_particles;
+};
+
+} // namespace tiny_mps
+#endif // MPS_PARTICLE_SNAPSHOT_H_INCLUDED
@@ -3,14 +3,34 @@
 #ifndef MPS_PARTICLES_H_INCLUDED
 #define MPS_PARTICLES_H_INCLUDED
 
-#include <stack>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
 #include <Eigen/IterativeLinearSolvers>
+#include "checkpoint.h"
 #include "condition.h"
+#include "domain_decomposition.h"
+#include "gradient_correction.h"
 #include "grid.h"
+#include "hdf5_writer.h"
+#include "inlet.h"
+#include "logger.h"
+#include "pair_kernels.h"
+#include "slot_allocator.h"
+#include "particle_index.h"
+#include "particle_snapshot.h"
+#include "polygon_wall.h"
+#include "resolution_zone.h"
+#include "snapshot_writer.h"
+#include "static_boundary.h"
 #include "timer.h"
+#include "vtu_writer.h"
+#include "work_chunks.h"
 
 namespace tiny_mps {
 
@@ -31,32 +51,144 @@ enum BoundaryType {
   OTHERS = -1
 };
 
+// Summary of particles gathered in one pass at the beginning of each step.
+struct StepStats {
+  StepStats()
+      : max_speed(0.0), kinetic_energy(0.0), has_nan(false),
+        normal(0), wall(0), dummy_wall(0), inflow(0), dummy_inflow(0), ghost(0),
+        inner(0), surface(0), others(0) {}
+  // Accumulates statistics of another range of particles.
+  inline void merge(const StepStats& other) {
+    max_speed = std::max(max_speed, other.max_speed);
+    kinetic_energy += other.kinetic_energy;
+    has_nan = has_nan || other.has_nan;
+    normal += other.normal;
+    wall += other.wall;
+    dummy_wall += other.dummy_wall;
+    inflow += other.inflow;
+    dummy_inflow += other.dummy_inflow;
+    ghost += other.ghost;
+    inner += other.inner;
+    surface += other.surface;
+    others += other.others;
+  }
+
+  // The maximum speed of non-ghost particles.
+  double max_speed;
+  // The total kinetic energy of normal particles.
+  double kinetic_energy;
+  bool has_nan;
+  // The number of particles for each ParticleType.
+  int normal, wall, dummy_wall, inflow, dummy_inflow, ghost;
+  // The number of particles for each BoundaryType.
+  int inner, surface, others;
+};
+
 // Holds data on particles and manipulates them.
 class Particles {
  public:
   Particles(int size, const Condition& condition);
   Particles(const std::string& path, const Condition& condition);
+  // Reads only the particles within the halo width of the subdomain of this rank, which
+  // DomainDecomposition::decompose(path) has cut. Pass them to domain.decompose() next.
+  Particles(const std::string& path, const Condition& condition, const DomainDecomposition& domain);
   Particles(const Particles& other);
+  // Copies the particles of other to run them under another condition, e.g. a case of Ensemble.
+  // Values derived from the condition (initial PND, lambda, inflow velocity, wall weights) are recomputed.
+  // The copy is not registered to the DomainDecomposition of other.
+  Particles(const Particles& other, const Condition& condition);
+  // Restarts from the particles written by writeCheckpoint(). The polygon wall is read again from Condition.
+  Particles(CheckpointReader& reader, const Condition& condition);
   Particles& operator=(const Particles& other);
   virtual ~Particles();
   virtual void writeVtkFile(const std::string& path, const std::string& title) const;
+  // Writes the same fields as writeVtkFile() to a binary VTK XML file (.vtu).
+  void writeVtuFile(const std::string& path, double time) const;
+  // Copies the positions and the output fields.
+  ParticleSnapshot makeSnapshot() const;
+  // Copies the particles and output fields selected by filter.
+  ParticleSnapshot makeSnapshot(const OutputFilter& filter) const;
+  // Writes a file named by path formatted with the output index, in output_format of Condition.
+  // vtu files are also listed in a ParaView collection (.pvd) named by path without the index.
+  // With async_output in Condition, the file is written on a background thread from a snapshot.
+  // output_streams in Condition are written at their own intervals next to it.
+  // Returns true if the main output was written.
   bool saveInterval(const std::string& path, const Timer& timer) const;
+  // Waits until every file of saveInterval() has been written. nextLoop() calls it at the end and on errors.
+  void flushOutput() const;
+  // Writes every value needed to continue the run, in full precision.
+  virtual void writeCheckpoint(CheckpointWriter& writer) const;
+  // Writes the particles and timer to path, replacing the previous checkpoint,
+  // followed by the subdomains if a DomainDecomposition is set.
+  void saveCheckpoint(const std::string& path, const Timer& timer) const;
+  // Calls saveCheckpoint() every checkpoint_interval steps in Condition, writing checkpoint_file
+  // into the directory of path, with the rank in its name when distributed.
+  // nextLoop() calls it after step rejection.
+  bool saveCheckpointInterval(const std::string& path, const Timer& timer) const;
   bool nextLoop(const std::string& path, Timer& timer);
+  StepStats calculateStepStats() const;
   bool checkNeedlessCalculation() const;
+  bool checkNeedlessCalculation(const StepStats& stats) const;
+  // Returns true if the step just taken has to be taken again with a smaller delta time,
+  // because the solver failed, values became NaN, or the maximum speed exceeded rejection_courant_number.
+  bool checkStepRejection(const StepStats& stats, const Timer& timer) const;
   virtual void extendStorage(int extra_size);
+  // Packs non-ghost particles to the front keeping their order and fits the storage
+  // to them plus extra_ghost_particles. Returns the new index of each old index (-1 for ghosts).
+  virtual std::vector<int> compactStorage();
+  // Returns true if the ghosts beyond those the last compaction (or reading the particles) left
+  // exceed compaction_ghost_ratio of the storage, so that a compaction always frees that much.
+  bool needsCompaction() const;
   int addParticle();
+  // Same as addParticle() called count times, but extends the storage at most once.
+  std::vector<int> addParticles(int count);
   virtual void setGhostParticle(int index);
-  void removeOutsideParticles(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos);
-  void removeFastParticles(double max_speed);
+  // Same as setGhostParticle() for each index, without printing every particle.
+  virtual void setGhostParticles(const std::vector<int>& indices);
+  // Turns every non-ghost particle for which predicate returns true into a ghost
+  // and returns their number. predicate is evaluated in parallel, so it must be thread-safe.
+  int removeParticles(const std::function<bool(int)>& predicate);
+  // Allows addParticle() and setGhostParticle() to be called from parallel loops until
+  // endConcurrentUpdate(). Each thread can add up to slots_per_thread particles, and all of them
+  // up to max_slots (slots_per_thread times the threads if negative), which are reserved beforehand.
+  // The particle index and inlets are brought up to date at the end.
+  void beginConcurrentUpdate(int slots_per_thread, int max_slots = -1);
+  void endConcurrentUpdate();
+  int removeOutsideParticles(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos);
+  int removeFastParticles(double max_speed);
   void calculateTemporaryParticleNumberDensity();
   void updateParticleNumberDensity();
   void updateParticleNumberDensity(const Grid& grid);
   void updateVoxelRatio(int width, const Grid& grid);
+  // Moves INFLOW and DUMMY_INFLOW particles in the box from their inlets to a new one
+  // with its own velocity, and returns its number. Inlet 0 is made of all inflow
+  // particles moving with inflow_velocity in Condition.
+  int addInlet(const Eigen::Vector3d& velocity, const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos);
   void moveInflowParticles(const Timer& timer);
+  // Adds a box whose normal particles adaptResolution() keeps at spacing_ratio times average_distance,
+  // and returns its index. Where boxes overlap, the finest one applies.
+  // Operators weight each neighbor with the kernel of the particle they are computed for, scaled by its spacing,
+  // times the volume ratio of the neighbor. Polygon walls are tabulated at average_distance, so they throw
+  // std::logic_error with zones. resolution_zones in Condition are added on construction,
+  // and nextLoop() adapts particles to the zones every step.
+  int addResolutionZone(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos, double spacing_ratio);
+  // Splits each normal particle coarser than its zone into 2^dimension particles of half the spacing,
+  // and merges up to 2^dimension neighboring particles finer than their zone into one within its spacing,
+  // conserving volume and momentum. Both are repeated until spacings settle at the zone targets.
+  // Returns the number of particles split or merged.
+  int adaptResolution();
   void calculateTemporaryVelocity(const Eigen::Vector3d& force, const Timer& timer);
   void calculateTemporaryVelocity(const Eigen::Vector3d& force, const Timer& timer, Grid& grid);
+  // Solves (I - dt * nu * Laplacian) u = temporary_velocity for normal particles, each component
+  // sharing one matrix. Velocities of inflow particles and polygon walls are given.
+  // calculateTemporaryVelocity() calls it if implicit_viscosity is on in Condition.
+  // Across MPI ranks, the system is solved by DomainDecomposition::solveConjugateGradient().
+  void solveViscosityImplicitly(const Timer& timer, const Grid& grid);
   void updateTemporaryPosition(const Timer& timer);
   void solvePressurePoisson(const Timer& timer);
+  // Same as calculateTemporaryParticleNumberDensity(), checkSurfaceParticles() and solvePressurePoisson()
+  // called in a row, but shares a single neighbor search among them.
+  void solvePressurePoissonFused(const Timer& timer);
   void solvePressurePoissonTanakaMasunaga(const Timer& timer);
   void solvePressurePoissonTamai(const Timer& timer);
   void setZeroOnNegativePressure();
@@ -65,7 +197,9 @@ class Particles {
   void correctVelocityExplicitly(const Timer& timer);
   void correctTanakaMasunagaVelocity(const Timer& timer);
   void correctVelocityWithTensor(const Timer& timer);
+  void correctVelocityWithTensor(const Timer& timer, const Grid& grid, const GradientCorrection& correction);
   void correctVelocityTanakaMasunagaWithTensor(const Timer& timer);
+  void calculateGradientCorrection(const Eigen::Matrix3Xd& coordinates, const Grid& grid, GradientCorrection& correction) const;
   void updateVelocityAndPosition();
   void checkSurfaceParticles();
   void checkSurfaceParticlesRemovingIsolated();
@@ -73,9 +207,33 @@ class Particles {
   void giveCollisionRepulsionForce(double influence_ratio, double restitution_coefficient);
   void shiftParticles(double influence_ratio, double alpha);
   void showParticlesInfo();
+  void showParticlesInfo(const StepStats& stats) const;
+  // Rebuilds the index of particle types. Call it after writing particle_types directly.
+  void updateParticleIndex();
+  // Reads line segments (2D) or triangles (3D) which act as walls in addition to WALL particles,
+  // and tabulates their wall weight functions. polygon_wall_file in Condition is read on construction.
+  void loadPolygonWall(const std::string& path);
+  // Rebinds WALL and DUMMY_WALL particles used by static_walls in Condition.
+  // Call it after moving them directly; changes of their types are tracked automatically.
+  void updateStaticBoundary();
+  // Makes statistics and the pressure solver global over the ranks of domain, and treats its
+  // halo particles as neighbors only. DomainDecomposition::decompose() calls it.
+  inline void setDomainDecomposition(const DomainDecomposition* domain) { domain_decomposition = domain; }
 
   inline int getSize() const { return size; }
   inline int getDimension() const { return dimension; }
+  inline const ParticleIndex& getParticleIndex() const { return particle_index; }
+  inline const std::vector<Inlet>& getInlets() const { return inlets; }
+  inline const StaticBoundary& getStaticBoundary() const { return static_boundary; }
+  inline const std::vector<ResolutionZone>& getResolutionZones() const { return resolution_zones; }
+  // True while every particle has the spacing average_distance.
+  inline bool isUniformResolution() const { return min_spacing_scale == 1.0 && max_spacing_scale == 1.0; }
+  inline double getMaxSpacingScale() const { return max_spacing_scale; }
+  inline double getInitialParticleNumberDensity() const { return initial_particle_number_density; }
+  // The smallest particle spacing, which limits the delta time.
+  inline double getMinSpacing() const { return min_spacing_scale * condition_.average_distance; }
+  inline const PolygonWall& getPolygonWall() const { return polygon_wall; }
+  inline const DomainDecomposition* getDomainDecomposition() const { return domain_decomposition; }
   inline double getMaxSpeed() const {
     Eigen::VectorXd moving = (particle_types.array() != ParticleType::GHOST).cast<double>().transpose();
     Eigen::VectorXd norms = velocity.colwise().norm();
@@ -91,33 +249,186 @@ class Particles {
   Eigen::Matrix3Xd correction_velocity;
   Eigen::VectorXi particle_types;
   Eigen::VectorXi boundary_types;
+  // Neighbors within the PND radius, counted in units of the volume of each particle.
   Eigen::VectorXi neighbor_particles;
   Eigen::VectorXd source_term;
   Eigen::VectorXd voxel_ratio;
+  // The distance between particles each particle stands for. Its volume is particle_spacing^dimension.
+  Eigen::VectorXd particle_spacing;
 
  protected:
+  // Adds the fields of writeVtkFile() and writeVtuFile().
+  virtual void addOutputFields(ParticleSnapshot& snapshot) const;
+  // Copies the fields a subclass adds from source to destination, for the children of a split particle.
+  // It is called from parallel loops, so it must write only to destination.
+  virtual void copyParticleFields(int /*source*/, int /*destination*/) {}
+  // Runs job on the snapshot writer thread if async_output in Condition is on, or at once otherwise.
+  void submitOutput(const SnapshotWriter::Job& job) const;
+  // Returns the writer of output_format hdf5 for series_path, e.g. "out/output", made by the first call.
+  std::shared_ptr<Hdf5Writer> getHdf5Writer(const std::string& series_path) const;
+  // Returns the collection of output_format vtu for pvd_path, e.g. "out/output.pvd", made by the first call.
+  std::shared_ptr<VtuCollection> getVtuCollection(const std::string& pvd_path) const;
+  // Writes the particles selected by filter as an output of saveInterval().
+  void writeOutput(const std::string& path, int index, double time, const OutputFilter& filter) const;
+  // Returns the path of the series of path of saveInterval() without extension, e.g. "out/output" for "out/output_%1%.vtk".
+  static std::string getSeriesPath(const std::string& path);
   virtual double weightForParticleNumberDensity(const Eigen::Vector3d& vec) const;
   virtual double weightForGradientPressure(const Eigen::Vector3d& vec) const;
   virtual double weightForLaplacianPressure(const Eigen::Vector3d& vec) const;
   virtual double weightForLaplacianViscosity(const Eigen::Vector3d& vec) const;
   void solveConjugateGradient(Eigen::SparseMatrix<double> p_mat);
+  // Keeps and brings back the state at the beginning of a step for step_rejection in Condition.
+  virtual void saveStepState();
+  virtual void restoreStepState();
+  void correctVelocityWithTensor(const Timer& timer, const Eigen::Matrix3Xd& coordinates, const Grid& grid, const GradientCorrection& correction);
+  // Calls function for each particle in range, on threads balanced by neighbor counts if thread_chunks
+  // in Condition is positive. function must write only to the particle it is given.
+  template <typename Function>
+  void forEachParticle(const ParticleIndex::Range& range, const Function& function) const {
+    if (condition_.thread_chunks <= 0) {
+      for (int i_particle : range) function(i_particle);
+      return;
+    }
+    WorkChunks(range, neighbor_particles, condition_.thread_chunks).forEach(function);
+  }
+  // Moves each entry to new_indices (entries with -1 are dropped) and fits the array to new_size.
+  // Entries behind the moved ones are set to zero or fill.
+  static void compactArray(Eigen::Matrix3Xd& array, const std::vector<int>& new_indices, int new_size);
+  static void compactArray(Eigen::VectorXd& array, const std::vector<int>& new_indices, int new_size, double fill = 0.0);
+  static void compactArray(Eigen::VectorXi& array, const std::vector<int>& new_indices, int new_size, int fill = 0);
 
   const Condition& condition_;
   int size;
   const int dimension;
-  std::stack<int> ghost_stack;
+  SlotAllocator ghost_slots;
+  // Indices of particles grouped by type, kept in sync with particle_types.
+  ParticleIndex particle_index;
   double initial_particle_number_density;
   double laplacian_lambda_pressure;
   double laplacian_lambda_viscosity;
   double initial_neighbor_particles;
-  double inflow_stride;
+  std::vector<Inlet> inlets;
+  // Returns the mean spacing of two particles relative to average_distance, which scales the collision
+  // distance between them; it is exactly one at uniform resolution.
+  inline double getPairScale(int i_particle, int j_particle) const {
+    return (particle_spacing(i_particle) + particle_spacing(j_particle)) * 0.5 / condition_.average_distance;
+  }
+  // The spacing and the volume of a particle relative to those of average_distance.
+  inline double getSpacingScale(int i_particle) const { return particle_spacing(i_particle) / condition_.average_distance; }
+  inline double getVolumeScale(int i_particle) const { return std::pow(getSpacingScale(i_particle), dimension); }
+  // Returns the volume of j_particle relative to that of i_particle. Weights of neighbors seen from
+  // i_particle are those of its own kernel, e.g. weightForParticleNumberDensity(r_ij / getSpacingScale(i_particle)),
+  // times this ratio, so PND stays at initial_particle_number_density across spacings.
+  inline double getVolumeRatio(int i_particle, int j_particle) const {
+    if (isUniformResolution()) return 1.0;
+    return std::pow(particle_spacing(j_particle) / particle_spacing(i_particle), dimension);
+  }
+  // Returns the Laplacian weight of a pair in the row of i_particle multiplied by its volume scale: the mean
+  // of the weights seen from both particles, each over its squared spacing scale and times the volume scale
+  // of the other. It is symmetric, so the matrices stay so for the conjugate gradient, and is weight(r_ij)
+  // at uniform resolution.
+  template <typename Weight>
+  double getLaplacianPairWeight(const Weight& weight, int i_particle, int j_particle, const Eigen::Vector3d& r_ij) const {
+    if (isUniformResolution()) return weight(r_ij);
+    const double scale_i = getSpacingScale(i_particle);
+    const double scale_j = getSpacingScale(j_particle);
+    return 0.5 * (std::pow(scale_j, dimension) * weight(r_ij / scale_i) / (scale_i * scale_i)
+                + std::pow(scale_i, dimension) * weight(r_ij / scale_j) / (scale_j * scale_j));
+  }
+  // Removes the neighbors at radius or farther from i_particle. Grids are built with the radius times
+  // max_spacing_scale, so operators that count neighbors narrow them to the radius of i_particle here.
+  void eraseNeighborsBeyond(const Eigen::Matrix3Xd& coordinates, int i_particle, double radius, Grid::Neighbors& neighbors) const {
+    if (isUniformResolution()) return;
+    neighbors.erase(std::remove_if(neighbors.begin(), neighbors.end(), [&](int j_particle) {
+      return (coordinates.col(j_particle) - coordinates.col(i_particle)).norm() >= radius;
+    }), neighbors.end());
+  }
+
+  std::vector<ResolutionZone> resolution_zones;
+  // The range of particle_spacing relative to average_distance. The maximum widens neighbor searches.
+  double min_spacing_scale;
+  double max_spacing_scale;
+  // Structure-of-arrays copy of the coordinates used by pair kernels.
+  AlignedCoordinates aligned_coordinates;
+  // WALL and DUMMY_WALL particles binned once, built on demand when static_walls is on.
+  // Only PND and solvePressurePoissonFused() use it; the other operators bin the walls with the rest.
+  StaticBoundary static_boundary;
+  // Polygon walls and their wall weight functions for PND, the pressure gradient and viscosity.
+  // The pressure on the walls is that of each particle (Neumann condition), so they add nothing
+  // to the pressure Laplacian, and their velocity is zero (no-slip condition).
+  PolygonWall polygon_wall;
+  WallWeightTable wall_pnd_weight;
+  WallWeightTable wall_gradient_weight;
+  WallWeightTable wall_viscosity_weight;
+  // Returns the gradient term of polygon walls, whose pressure term (e.g. p_wall - p_min) is pressure_difference.
+  inline Eigen::Vector3d getPolygonWallGradient(const Eigen::Vector3d& point, double pressure_difference) const {
+    Eigen::Vector3d direction;
+    double distance = polygon_wall.getDistance(point, direction);
+    return direction * (pressure_difference * wall_gradient_weight.getGradient(distance));
+  }
+  // Returns the contribution of polygon walls to the tensor of calculateGradientCorrection().
+  inline Eigen::Matrix3d getPolygonWallGradientTensor(const Eigen::Vector3d& point) const {
+    Eigen::Vector3d direction;
+    double distance = polygon_wall.getDistance(point, direction);
+    return wall_gradient_weight.getTensor(distance, direction) / initial_particle_number_density;
+  }
+  // Set by setDomainDecomposition(), or nullptr for a single process.
+  const DomainDecomposition* domain_decomposition;
+  inline bool isHaloParticle(int index) const {
+    return domain_decomposition != nullptr && domain_decomposition->isHalo(index);
+  }
+  // Set when the pressure solver fails within the current step.
+  bool solver_failed;
+  // Ghosts left by the last compaction, or by reading the particles. See needsCompaction().
+  int compacted_ghosts;
+  std::unique_ptr<Particles> step_snapshot;
+  // Made by the first submitOutput() with async_output. Copies of particles make their own.
+  mutable std::unique_ptr<SnapshotWriter> snapshot_writer;
+  // Writers of output_format hdf5 by series path, which keep their files open. Copies of particles make their own.
+  mutable std::map<std::string, std::shared_ptr<Hdf5Writer> > hdf5_writers;
+  // Collections of output_format vtu by path, which keep their files open. Copies of particles make their own.
+  mutable std::map<std::string, std::shared_ptr<VtuCollection> > vtu_collections;
 
  private:
   using VectorXb = Eigen::Matrix<bool, Eigen::Dynamic, 1>;
   void initialize(int particles_number);
-  void readGridFile(const std::string& path, const Condition& condition);
+  // Reads the particles within the halo width of the subdomain of domain if it is not null.
+  void readGridFile(const std::string& path, const Condition& condition, const DomainDecomposition* domain = nullptr);
+  // reserve_particles in Condition shared among the ranks.
+  int getReserveParticles(int ranks) const;
+  void readCheckpoint(CheckpointReader& reader);
   void setInitialParticleNumberDensity();
   void setLaplacianLambda();
+  void resetInlets();
+  void emitInflowLayer(Inlet& inlet);
+  double getTargetSpacing(const Eigen::Vector3d& point) const;
+  int splitParticles();
+  int mergeParticles();
+  // Replaces the zones with resolution_zones in Condition, if any. nextLoop() adapts the particles to them,
+  // so subclasses have their fields when particles are split.
+  void readResolutionZones();
+  // Drops entries of inlets which are no longer INFLOW or DUMMY_INFLOW particles.
+  void removeStaleInletParticles();
+  // Makes sure the ghost stack holds at least count slots.
+  void reserveGhostParticles(int count);
+  void calculateParticleNumberDensity(const Eigen::Matrix3Xd& coordinates, const Grid& grid);
+  void calculateParticleNumberDensityWithKernels(const Eigen::Matrix3Xd& coordinates, const Grid& grid);
+  // Adds the contributions of polygon walls to particle_number_density and neighbor_particles.
+  void addPolygonWallParticleNumberDensity(const Eigen::Matrix3Xd& coordinates);
+  inline void addPolygonWallParticleNumberDensity(const Eigen::Vector3d& point, double& pnd, int& count) const {
+    Eigen::Vector3d direction;
+    double distance = polygon_wall.getDistance(point, direction);
+    pnd += wall_pnd_weight.getWeight(distance);
+    count += wall_pnd_weight.getCount(distance);
+  }
+  void calculateParticleNumberDensityWithStaticBoundary(const Eigen::Matrix3Xd& coordinates);
+  // Builds static_boundary unless it is up to date.
+  void prepareStaticBoundary();
+  // Returns the neighbors of the "index" particle, searching moving_grid, which bins the
+  // particles in moving in that order, and static_boundary.
+  void getNeighborsWithStaticBoundary(int index, const Eigen::Matrix3Xd& coordinates, const Grid& moving_grid,
+                                      const ParticleIndex::Range& moving, Grid::Neighbors& neighbors, Grid::Neighbors& buffer) const;
+  static Eigen::Matrix3Xd gatherColumns(const Eigen::Matrix3Xd& array, const ParticleIndex::Range& range);
 
   static inline double weightStandard(const double distance, const double influence_radius) {
     if (distance < influence_radius) return (influence_radius / distance - 1.0);
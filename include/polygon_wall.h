@@ -0,0 +1,115 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_POLYGON_WALL_H_INCLUDED
+#define MPS_POLYGON_WALL_H_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Wall weight function: sums over virtual wall particles which fill the half space
+// behind a flat wall on a square lattice of the particle spacing, tabulated by the
+// distance from a particle to the wall. The first layer of the lattice lies on the wall,
+// as WALL particles do in grid files.
+class WallWeightTable {
+ public:
+  using Weight = std::function<double(const Eigen::Vector3d&)>;
+
+  WallWeightTable() : dimension(2), radius(0.0), min_distance(0.0), step(0.0) {}
+  virtual ~WallWeightTable(){}
+
+  // Tabulates sums of weight within radius.
+  void build(const Weight& weight, double radius, double spacing, int dimension);
+
+  // Returns sum(w_ij).
+  inline double getWeight(double distance) const { return interpolate(weights, distance); }
+  // Returns the number of virtual particles within radius.
+  inline int getCount(double distance) const { return (int)std::lround(interpolate(counts, distance)); }
+  // Returns sum(w_ij * (r_ij . n) / |r_ij|^2), where n is the unit vector from the particle toward the wall.
+  inline double getGradient(double distance) const { return interpolate(gradients, distance); }
+  // Returns sum(w_ij * r_ij * r_ij^T / |r_ij|^2) for the wall toward direction.
+  inline Eigen::Matrix3d getTensor(double distance, const Eigen::Vector3d& direction) const {
+    Eigen::Matrix3d normal = direction * direction.transpose();
+    Eigen::Matrix3d tangent = Eigen::Matrix3d::Identity() - normal;
+    // Virtual particles lie in the plane in 2D.
+    if (dimension == 2) tangent(2, 2) = 0.0;
+    return interpolate(normal_moments, distance) * normal + interpolate(tangent_moments, distance) * tangent;
+  }
+  inline double getRadius() const { return radius; }
+
+ private:
+  static const int kSamples = 256;
+  inline double interpolate(const std::vector<double>& table, double distance) const {
+    if (table.empty() || distance >= radius) return 0.0;
+    double x = (std::max(distance, min_distance) - min_distance) / step;
+    int i = std::min((int)x, kSamples - 1);
+    return table[i] + (table[i + 1] - table[i]) * (x - i);
+  }
+
+  int dimension;
+  double radius;
+  // Distances below this are treated as this, as a particle on the wall would overlap a virtual particle.
+  double min_distance;
+  double step;
+  std::vector<double> weights;
+  std::vector<double> counts;
+  std::vector<double> gradients;
+  // sum(w_ij * (r_ij . n)^2 / |r_ij|^2) and the same along one tangent of the wall.
+  std::vector<double> normal_moments;
+  std::vector<double> tangent_moments;
+};
+
+// Represents solid boundaries with line segments (2D) or triangles (3D)
+// instead of WALL and DUMMY_WALL particles.
+// Elements are searched linearly, which suits geometries of up to a few hundred elements.
+// Fluid lies on the left of a segment from vertex 1 to 2, and on the side
+// from which the vertices of a triangle are seen counterclockwise.
+// File format:
+//   Line 0: the number of elements
+//   Line 1-: x1 y1 z1 x2 y2 z2 (segments) or x1 y1 z1 x2 y2 z2 x3 y3 z3 (triangles)
+// Example:
+//   PolygonWall wall;
+//   wall.readFile("input/dam.wall", 2);
+//   Eigen::Vector3d direction;
+//   double distance = wall.getDistance(position.col(i_particle), direction);
+//   pnd += table.getWeight(distance);
+class PolygonWall {
+ public:
+  PolygonWall() : dimension(2) {}
+  virtual ~PolygonWall(){}
+
+  void readFile(const std::string& path, int dimension);
+  void addSegment(const Eigen::Vector3d& a, const Eigen::Vector3d& b);
+  void addTriangle(const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Vector3d& c);
+  void clear();
+
+  // Returns the signed distance from point to the nearest element, which is negative behind it,
+  // and assigns the unit vector from point toward the solid side to direction.
+  // Returns infinity if there are no elements.
+  double getDistance(const Eigen::Vector3d& point, Eigen::Vector3d& direction) const;
+
+  inline bool isEmpty() const { return vertices.empty(); }
+  // The number of line segments or triangles.
+  inline int getSize() const { return vertices.size() / getVerticesPerElement(); }
+  inline int getDimension() const { return dimension; }
+
+ private:
+  inline int getVerticesPerElement() const { return (dimension == 2) ? 2 : 3; }
+  // Returns the unit normal toward the fluid of the element beginning at vertices[index].
+  Eigen::Vector3d getNormal(std::size_t index) const;
+  static Eigen::Vector3d closestPointOnSegment(const Eigen::Vector3d& p, const Eigen::Vector3d& a, const Eigen::Vector3d& b);
+  static Eigen::Vector3d closestPointOnTriangle(const Eigen::Vector3d& p, const Eigen::Vector3d& a,
+                                                const Eigen::Vector3d& b, const Eigen::Vector3d& c);
+
+  int dimension;
+  // Vertices of every element in order, 2 per segment or 3 per triangle.
+  std::vector<Eigen::Vector3d> vertices;
+};
+
+} // namespace tiny_mps
+#endif // MPS_POLYGON_WALL_H_INCLUDED
@@ -0,0 +1,26 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_RESOLUTION_ZONE_H_INCLUDED
+#define MPS_RESOLUTION_ZONE_H_INCLUDED
+
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// A box in which normal particles are kept at spacing_ratio times average_distance.
+// Ratios below one refine the box and ratios above one coarsen it.
+struct ResolutionZone {
+  ResolutionZone(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos, double spacing_ratio)
+      : minpos(minpos), maxpos(maxpos), spacing_ratio(spacing_ratio) {}
+
+  inline bool contains(const Eigen::Vector3d& point) const {
+    return (point.array() >= minpos.array()).all() && (point.array() <= maxpos.array()).all();
+  }
+
+  Eigen::Vector3d minpos;
+  Eigen::Vector3d maxpos;
+  double spacing_ratio;
+};
+
+} // namespace tiny_mps
+#endif // MPS_RESOLUTION_ZONE_H_INCLUDED
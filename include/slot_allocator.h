@@ -0,0 +1,56 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_SLOT_ALLOCATOR_H_INCLUDED
+#define MPS_SLOT_ALLOCATOR_H_INCLUDED
+
+#include <mutex>
+#include <vector>
+#include "checkpoint.h"
+
+namespace tiny_mps {
+
+// Free list of storage slots that can be shared by threads.
+// acquire() and release() lock a mutex unless per-thread caches are filled.
+// Between fillCaches() and drainCaches(), each thread takes slots from its own cache
+// and keeps released slots in it without locking.
+// In deterministic mode, a thread never falls back to the shared list while caching,
+// so the slots a thread receives depend only on its number and the order of its calls
+// (e.g. a "#pragma omp for schedule(static)" loop with a fixed number of threads).
+class SlotAllocator {
+ public:
+  SlotAllocator() : deterministic(false) {}
+  SlotAllocator(const SlotAllocator& other);
+  SlotAllocator& operator=(const SlotAllocator& other);
+  virtual ~SlotAllocator(){}
+
+  // Returns a free slot, or -1 if none is left.
+  int acquire();
+  void release(int index);
+  // Moves up to per_thread slots from the shared list to the cache of each thread.
+  void fillCaches(int per_thread);
+  // Returns the slots left in the caches to the shared list, in the order of threads.
+  void drainCaches();
+  void clear();
+  // Writes and reads the shared list. Caches must be drained.
+  void writeCheckpoint(CheckpointWriter& writer) const;
+  void readCheckpoint(CheckpointReader& reader);
+
+  // The number of slots in the shared list.
+  inline int size() const { return free_slots.size(); }
+  inline bool isCaching() const { return !caches.empty(); }
+  inline bool isDeterministic() const { return deterministic; }
+  inline void setDeterministic(bool deterministic) { this->deterministic = deterministic; }
+  static int getThreadCount();
+
+ private:
+  static int getThreadNumber();
+
+  // Slots are taken from the back.
+  std::vector<int> free_slots;
+  std::vector<std::vector<int>> caches;
+  bool deterministic;
+  std::mutex mutex;
+};
+
+} // namespace tiny_mps
+#endif // MPS_SLOT_ALLOCATOR_H_INCLUDED
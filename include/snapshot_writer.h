@@ -0,0 +1,52 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_SNAPSHOT_WRITER_H_INCLUDED
+#define MPS_SNAPSHOT_WRITER_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace tiny_mps {
+
+// Runs output jobs in the order submitted on a background thread, so that the simulation
+// goes on while files are written. Jobs must own copies of what they write (e.g. ParticleSnapshot).
+// While max_pending jobs are waiting, submit() blocks until the thread takes one, which
+// bounds the memory of snapshots when writing falls behind.
+// An exception thrown by a job is rethrown by the next submit() or flush().
+class SnapshotWriter {
+ public:
+  using Job = std::function<void()>;
+
+  explicit SnapshotWriter(int max_pending = 2);
+  // SnapshotWriter is neither copyable nor movable.
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+  // Writes all pending jobs. Errors are logged instead of thrown.
+  virtual ~SnapshotWriter();
+
+  void submit(const Job& job);
+  // Waits until every submitted job has finished.
+  void flush();
+
+ private:
+  void run();
+  // Rethrows the error of a job, if any. Requires the lock.
+  void rethrowError();
+
+  const std::size_t max_pending;
+  std::deque<Job> jobs;
+  bool running;
+  bool stopping;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable job_condition;
+  std::condition_variable done_condition;
+  std::thread thread;
+};
+
+} // namespace tiny_mps
+#endif // MPS_SNAPSHOT_WRITER_H_INCLUDED
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_STATIC_BOUNDARY_H_INCLUDED
+#define MPS_STATIC_BOUNDARY_H_INCLUDED
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <Eigen/Core>
+#include "grid.h"
+#include "particle_index.h"
+
+namespace tiny_mps {
+
+// Holds particles which never move, such as WALL and DUMMY_WALL, as a layer binned once.
+// Their neighbors among themselves and the particle number density they give each other
+// are cached, so that only the other particles have to be binned every step.
+// Example:
+//   boundary.build(position, wall_indices, radius, dimension);
+//   boundary.cacheParticleNumberDensity(position, pnd_radius, weight);
+//   if (boundary.contains(i_particle)) {
+//     for (int j_particle : boundary.getNeighbors(i_particle)) interaction(i_particle, j_particle);
+//   } else {
+//     boundary.getNeighborsAround(position.col(i_particle), neighbors);
+//   }
+class StaticBoundary {
+ public:
+  StaticBoundary() : radius(0.0), built(false) {}
+  // StaticBoundary is neither copyable nor movable.
+  StaticBoundary(const StaticBoundary&) = delete;
+  StaticBoundary& operator=(const StaticBoundary&) = delete;
+  virtual ~StaticBoundary(){}
+
+  // Bins the particles in indices and caches their neighbors among themselves within radius.
+  void build(const Eigen::Matrix3Xd& coordinates, const std::vector<int>& indices, double radius, int dimension);
+  // Caches the sum of weights and the number of neighbors within pnd_radius (<= radius) among the particles.
+  void cacheParticleNumberDensity(const Eigen::Matrix3Xd& coordinates, double pnd_radius,
+                                  const std::function<double(const Eigen::Vector3d&)>& weight);
+  // Drops everything, so that build() has to be called again.
+  void clear();
+
+  // Returns the indices of the particles within radius from the point.
+  void getNeighborsAround(const Eigen::Vector3d& point, Grid::Neighbors& neighbors) const;
+  // Returns the cached neighbors of a particle in the layer.
+  inline ParticleIndex::Range getNeighbors(int index) const {
+    const int local = locals[index];
+    return ParticleIndex::Range(neighbor_indices.data() + neighbor_begins[local],
+                                neighbor_indices.data() + neighbor_begins[local + 1]);
+  }
+
+  inline bool isBuilt() const { return built; }
+  inline bool contains(int index) const { return index < static_cast<int>(locals.size()) && locals[index] >= 0; }
+  inline int getSize() const { return indices.size(); }
+  inline double getRadius() const { return radius; }
+  inline double getParticleNumberDensity(int index) const { return particle_number_density(locals[index]); }
+  inline int getNeighborCount(int index) const { return neighbor_count(locals[index]); }
+
+ private:
+  double radius;
+  bool built;
+  // Index of each particle in the layer, and the inverse map (-1 for the others).
+  std::vector<int> indices;
+  std::vector<int> locals;
+  std::unique_ptr<Grid> grid;
+  // Neighbors of the k-th particle are neighbor_indices[neighbor_begins[k]] to neighbor_indices[neighbor_begins[k + 1] - 1].
+  std::vector<int> neighbor_begins;
+  std::vector<int> neighbor_indices;
+  Eigen::VectorXd particle_number_density;
+  Eigen::VectorXi neighbor_count;
+};
+
+} // namespace tiny_mps
+#endif // MPS_STATIC_BOUNDARY_H_INCLUDED
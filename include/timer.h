@@ -3,19 +3,72 @@
 #ifndef MPS_TIMER_H_INCLUDED
 #define MPS_TIMER_H_INCLUDED
 
+#include <algorithm>
 #include <chrono>
 #include <ctime>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <boost/format.hpp>
+#include "checkpoint.h"
+#include "logger.h"
 
 namespace tiny_mps {
 
+// One step taken by Timer.
+struct DeltaTimeRecord {
+  int step;
+  // The time at the beginning of the step.
+  double time;
+  double delta_time;
+  // False if the step was rolled back by rejectStep().
+  bool accepted;
+};
+
+// Aggregates of the steps taken by Timer.
+struct DeltaTimeSummary {
+  DeltaTimeSummary() : accepted_steps(0), rejected_steps(0), min_delta_time(0.0), max_delta_time(0.0), sum_delta_time(0.0) {}
+
+  inline void add(const DeltaTimeRecord& record) {
+    if (!record.accepted) {
+      ++rejected_steps;
+      return;
+    }
+    min_delta_time = (accepted_steps == 0) ? record.delta_time : std::min(min_delta_time, record.delta_time);
+    max_delta_time = std::max(max_delta_time, record.delta_time);
+    sum_delta_time += record.delta_time;
+    ++accepted_steps;
+  }
+
+  int accepted_steps;
+  int rejected_steps;
+  // Over the accepted steps.
+  double min_delta_time;
+  double max_delta_time;
+  double sum_delta_time;
+};
+
+// When an output stream writes next (see OutputStream).
+struct OutputSchedule {
+  double interval;
+  double next_output_time;
+  int output_count;
+};
+
 // Holds data on time
 class Timer {
  public:
   explicit Timer(const Condition & condition) {
     initialize(condition);
   }
+  // Resumes the time written by writeCheckpoint(). finish_time and the settings of
+  // the delta time are taken from condition, so that a run can be extended.
+  Timer(const Condition& condition, CheckpointReader& reader) {
+    initialize(condition);
+    readCheckpoint(reader);
+  }
   // Timer is neither copyable nor movable.
   Timer(const Timer&) = delete;
   Timer& operator=(const Timer&) = delete;
@@ -34,9 +87,27 @@ class Timer {
     this->next_output_time = condition.initial_time;
     this->loop_count = 0;
     this->output_count = 0;
+    this->adaptive = condition.adaptive_delta_time;
+    this->max_delta_time = condition.max_delta_time * condition.delta_time;
+    this->growth_factor = condition.delta_time_growth_factor;
+    this->shrink_factor = condition.delta_time_shrink_factor;
+    this->retrying = false;
+    this->step_start_time = condition.initial_time;
+    this->step_start_next_output_time = condition.initial_time;
+    this->step_start_output_count = 0;
+    this->schedules.clear();
+    for (const OutputStream& stream : condition.output_streams) {
+      schedules.push_back(OutputSchedule{stream.interval, condition.initial_time, 0});
+    }
+    this->step_start_schedules = schedules;
+    this->summary = DeltaTimeSummary();
+    this->has_last_step = false;
+    this->last_step = DeltaTimeRecord{0, condition.initial_time, condition.delta_time, true};
+    this->trace.clear();
+    Logger::getInstance().setStep(0);
     start_chrono = std::chrono::system_clock::now();
     std::time_t start = std::chrono::system_clock::to_time_t(start_chrono);
-    std::cout << "Started timer at " << std::ctime(&start) << std::endl;
+    Log(LOG_INFO) << "Started timer at " << std::ctime(&start);
   }
 
   inline bool hasNextLoop() const {
@@ -45,15 +116,30 @@ class Timer {
   }
 
   inline void update() {
+    step_start_time = current_time;
+    step_start_next_output_time = next_output_time;
+    step_start_output_count = output_count;
+    step_start_schedules = schedules;
+    recordStep(DeltaTimeRecord{loop_count, current_time, current_delta_time, true});
     if (isOutputTime()) {
         next_output_time += output_interval;
         ++output_count;
     }
+    for (OutputSchedule& schedule : schedules) {
+      if (current_time < schedule.next_output_time) continue;
+      schedule.next_output_time += schedule.interval;
+      ++schedule.output_count;
+    }
     current_time += current_delta_time;
     ++loop_count;
+    Logger::getInstance().setStep(loop_count);
   }
 
   inline void printCompuationTime() {
+    StepLog(LOG_INFO) << getComputationTime();
+  }
+
+  inline std::string getComputationTime() const {
     using std::chrono::duration_cast;
     using std::chrono::system_clock;
     using std::chrono::hours;
@@ -62,37 +148,192 @@ class Timer {
     using std::chrono::milliseconds;
     auto end = system_clock::now();
     auto dur = end - start_chrono;
-    std::cout << boost::format("Computation Time: %02dh %02dmin %02d.%03ds.")
+    return (boost::format("Computation Time: %02dh %02dmin %02d.%03ds.")
         % duration_cast<hours>(dur).count()
         % (duration_cast<minutes>(dur).count() % 60)
         % (duration_cast<seconds>(dur).count() % 60)
-        % (duration_cast<milliseconds>(dur).count() % 1000) << std::endl;
+        % (duration_cast<milliseconds>(dur).count() % 1000)).str();
   }
 
   inline void printTimeInfo() {
-    std::cout << boost::format("Time step: %06d, Current time: %e, Delta time: %e")
+    StepLog(LOG_INFO) << boost::format("Time step: %06d, Current time: %e, Delta time: %e")
         % getLoopCount()
         % getCurrentTime()
-        % getCurrentDeltaTime() << std::endl;
+        % getCurrentDeltaTime();
+  }
+
+  // Rolls back the last update() and shrinks the delta time by delta_time_shrink_factor,
+  // so that the step can be taken again from the state before it.
+  inline void rejectStep() {
+    if (!has_last_step || !last_step.accepted) return;
+    last_step.accepted = false;
+    if (!trace.empty()) trace.back().accepted = false;
+    current_time = step_start_time;
+    next_output_time = step_start_next_output_time;
+    output_count = step_start_output_count;
+    schedules = step_start_schedules;
+    --loop_count;
+    Logger::getInstance().setStep(loop_count);
+    Log(LOG_WARNING) << boost::format("Rejected step: %06d, Delta time: %e -> %e")
+        % loop_count % current_delta_time % (current_delta_time * shrink_factor);
+    current_delta_time *= shrink_factor;
+    retrying = true;
   }
 
   inline void limitCurrentDeltaTime(double max_speed, const Condition& condition) {
+    limitCurrentDeltaTime(max_speed, condition, condition.average_distance);
+  }
+
+  // min_spacing is the smallest particle spacing, which is below average_distance where particles are split.
+  inline void limitCurrentDeltaTime(double max_speed, const Condition& condition, double min_spacing) {
+    if (adaptive) {
+      adaptCurrentDeltaTime(max_speed, condition, min_spacing);
+      return;
+    }
+    if (retrying) {
+      // Keeps the delta time shrunk by rejectStep() for the retry.
+      const double shrunk_delta_time = current_delta_time;
+      retrying = false;
+      limitCurrentDeltaTime(max_speed, condition, min_spacing);
+      current_delta_time = std::min(current_delta_time, shrunk_delta_time);
+      return;
+    }
     if (max_speed <= 0) return;
     current_delta_time = initial_delta_time;
-    double dt = condition.average_distance * condition.courant_number / max_speed;
+    double dt = min_spacing * condition.courant_number / max_speed;
     current_delta_time = std::min(dt, current_delta_time);
     if (condition.viscosity_calculation == false) return;
-    dt = condition.diffusion_number * condition.average_distance * condition.average_distance
-        / condition.kinematic_viscosity;
+    // Implicit viscosity is unconditionally stable.
+    if (condition.implicit_viscosity) return;
+    dt = condition.diffusion_number * min_spacing * min_spacing / condition.kinematic_viscosity;
     current_delta_time = std::min(dt, current_delta_time);
   }
 
+  // Chooses the largest delta time satisfying the CFL and diffusion conditions up to max_delta_time.
+  // It grows by delta_time_growth_factor per step at most, and not at all while retrying a rejected step.
+  // Reductions required by the conditions are applied at once.
+  inline void adaptCurrentDeltaTime(double max_speed, const Condition& condition, double min_spacing) {
+    double target = max_delta_time;
+    if (max_speed > 0) target = std::min(target, min_spacing * condition.courant_number / max_speed);
+    if (condition.viscosity_calculation && !condition.implicit_viscosity) {
+      target = std::min(target, condition.diffusion_number * min_spacing * min_spacing / condition.kinematic_viscosity);
+    }
+    double limit = retrying ? current_delta_time : current_delta_time * growth_factor;
+    current_delta_time = std::min(target, limit);
+    retrying = false;
+  }
+
+  // Prints the number of accepted and rejected steps and the range of accepted delta times.
+  inline void printDeltaTimeSummary() const {
+    const DeltaTimeSummary total = getDeltaTimeSummary();
+    const int accepted = total.accepted_steps;
+    Log(LOG_INFO) << boost::format("Delta time - accepted steps: %d, rejected steps: %d, min: %e, max: %e, average: %e")
+        % accepted % total.rejected_steps % total.min_delta_time % total.max_delta_time
+        % (accepted > 0 ? total.sum_delta_time / accepted : 0.0);
+  }
+
+  // Writes the last kDeltaTimeTraceSize steps taken in this process as "step time delta_time accepted" lines.
+  inline void writeDeltaTimeHistory(const std::string& path) const {
+    std::ofstream ofs(path);
+    if (ofs.fail()) {
+      Log(LOG_ERROR) << "Error: in writeDeltaTimeHistory() in timer.h";
+      throw std::ios_base::failure("Error: in writeDeltaTimeHistory() in timer.h");
+    }
+    ofs << "# step time delta_time accepted" << std::endl;
+    for (const DeltaTimeRecord& record : trace) {
+      ofs << record.step << " " << record.time << " " << record.delta_time << " " << record.accepted << std::endl;
+    }
+  }
+
+  inline void writeCheckpoint(CheckpointWriter& writer) const {
+    writer.beginSection("Timer");
+    writer.write(current_time);
+    writer.write(initial_time);
+    writer.write(current_delta_time);
+    writer.write(initial_delta_time);
+    writer.write(next_output_time);
+    writer.write(loop_count);
+    writer.write(output_count);
+    writer.write(retrying);
+    writer.write(step_start_time);
+    writer.write(step_start_next_output_time);
+    writer.write(step_start_output_count);
+    writer.write<std::uint64_t>(schedules.size());
+    for (std::size_t i = 0; i < schedules.size(); ++i) {
+      writer.write(schedules[i].next_output_time);
+      writer.write(schedules[i].output_count);
+      writer.write(step_start_schedules[i].next_output_time);
+      writer.write(step_start_schedules[i].output_count);
+    }
+    // The trace is not written, so that the size of checkpoints does not grow with the steps.
+    writer.write(summary.accepted_steps);
+    writer.write(summary.rejected_steps);
+    writer.write(summary.min_delta_time);
+    writer.write(summary.max_delta_time);
+    writer.write(summary.sum_delta_time);
+    writer.write(has_last_step);
+    writer.write(last_step.step);
+    writer.write(last_step.time);
+    writer.write(last_step.delta_time);
+    writer.write(last_step.accepted);
+  }
+
+  inline void readCheckpoint(CheckpointReader& reader) {
+    reader.beginSection("Timer");
+    reader.read(current_time);
+    reader.read(initial_time);
+    reader.read(current_delta_time);
+    reader.read(initial_delta_time);
+    reader.read(next_output_time);
+    reader.read(loop_count);
+    reader.read(output_count);
+    reader.read(retrying);
+    reader.read(step_start_time);
+    reader.read(step_start_next_output_time);
+    reader.read(step_start_output_count);
+    // Intervals are taken from condition. Streams added since the checkpoint start now.
+    std::uint64_t schedule_count;
+    reader.read(schedule_count);
+    for (std::uint64_t i = 0; i < schedule_count; ++i) {
+      OutputSchedule schedule, step_start_schedule;
+      reader.read(schedule.next_output_time);
+      reader.read(schedule.output_count);
+      reader.read(step_start_schedule.next_output_time);
+      reader.read(step_start_schedule.output_count);
+      if (i >= schedules.size()) continue;
+      schedules[i].next_output_time = schedule.next_output_time;
+      schedules[i].output_count = schedule.output_count;
+      step_start_schedules[i].next_output_time = step_start_schedule.next_output_time;
+      step_start_schedules[i].output_count = step_start_schedule.output_count;
+    }
+    for (std::size_t i = schedule_count; i < schedules.size(); ++i) {
+      schedules[i].next_output_time = current_time;
+      step_start_schedules[i].next_output_time = current_time;
+    }
+    reader.read(summary.accepted_steps);
+    reader.read(summary.rejected_steps);
+    reader.read(summary.min_delta_time);
+    reader.read(summary.max_delta_time);
+    reader.read(summary.sum_delta_time);
+    reader.read(has_last_step);
+    reader.read(last_step.step);
+    reader.read(last_step.time);
+    reader.read(last_step.delta_time);
+    reader.read(last_step.accepted);
+    Logger::getInstance().setStep(loop_count);
+    Log(LOG_INFO) << boost::format("Resumed timer at step: %06d, Current time: %e") % loop_count % current_time;
+  }
+
   inline bool isUnderMinDeltaTime() {
     return getCurrentDeltaTime() < min_delta_time;
   }
   inline bool isOutputTime() const {
     return current_time >= next_output_time;
   }
+  // For output_streams[stream] in Condition.
+  inline bool isOutputTime(int stream) const {
+    return current_time >= schedules[stream].next_output_time;
+  }
 
   inline double getCurrentTime() const { return current_time; }
   inline double getInitialTime() const { return initial_time; }
@@ -102,8 +343,28 @@ class Timer {
   inline void setInitialDeltaTime(double delta_time) { initial_delta_time = delta_time; }
   inline int getLoopCount() const { return loop_count; }
   inline int getOutputCount() const { return output_count; }
+  inline int getOutputCount(int stream) const { return schedules[stream].output_count; }
+  // Includes the last step, which rejectStep() can still roll back.
+  inline DeltaTimeSummary getDeltaTimeSummary() const {
+    DeltaTimeSummary total = summary;
+    if (has_last_step) total.add(last_step);
+    return total;
+  }
+  inline const std::deque<DeltaTimeRecord>& getDeltaTimeTrace() const { return trace; }
+
+  // The number of the last steps kept for writeDeltaTimeHistory().
+  static const std::size_t kDeltaTimeTraceSize = 1000;
 
  private:
+  // Adds the previous step to summary, as it can no longer be rejected, and keeps record as the last step.
+  inline void recordStep(const DeltaTimeRecord& record) {
+    if (has_last_step) summary.add(last_step);
+    last_step = record;
+    has_last_step = true;
+    trace.push_back(record);
+    if (trace.size() > kDeltaTimeTraceSize) trace.pop_front();
+  }
+
   // Stores the time point when called initialize.
   std::chrono::system_clock::time_point start_chrono;
 
@@ -118,6 +379,24 @@ class Timer {
   double next_output_time;
   int loop_count;
   int output_count;
+  bool adaptive;
+  double max_delta_time;
+  double growth_factor;
+  double shrink_factor;
+  // True between rejectStep() and the next adaptCurrentDeltaTime().
+  bool retrying;
+  // Values before the last update(), restored by rejectStep().
+  double step_start_time;
+  double step_start_next_output_time;
+  int step_start_output_count;
+  std::vector<OutputSchedule> schedules;
+  std::vector<OutputSchedule> step_start_schedules;
+  // The steps before the last one.
+  DeltaTimeSummary summary;
+  bool has_last_step;
+  DeltaTimeRecord last_step;
+  // The last steps, bounded by kDeltaTimeTraceSize.
+  std::deque<DeltaTimeRecord> trace;
 };
 
 } // namespace tiny_mps
@@ -0,0 +1,83 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_VTU_WRITER_H_INCLUDED
+#define MPS_VTU_WRITER_H_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+namespace tiny_mps {
+
+// Writes points as a VTK XML unstructured grid (.vtu) of vertex cells, whose arrays are
+// appended as binary in native byte order. Arrays are referenced, not copied,
+// so they must outlive write(). Cells are indexed by Int32 up to 2^31 points.
+// Double fields can be written as Float32, and arrays deflated by zlib (build with "make zlib=yes").
+// Example:
+//   VtuWriter writer(position);
+//   writer.addPointData("Pressure", pressure);
+//   writer.addPointData("Velocity", velocity);
+//   writer.setTime(timer.getCurrentTime());
+//   writer.write("output/output_0001.vtu");
+//   VtuCollection collection("output/output.pvd");
+//   collection.add(timer.getCurrentTime(), "output_0001.vtu");
+class VtuWriter {
+ public:
+  explicit VtuWriter(const Eigen::Matrix3Xd& points);
+  virtual ~VtuWriter(){}
+
+  void addPointData(const std::string& name, const Eigen::VectorXd& values);
+  void addPointData(const std::string& name, const Eigen::VectorXi& values);
+  void addPointData(const std::string& name, const Eigen::Matrix3Xd& values);
+  // Stores time as the TimeValue field, which ParaView shows for single files.
+  inline void setTime(double time) { this->time = time; has_time = true; }
+  // Writes double fields as Float32. Points stay Float64.
+  inline void setFloat32(bool float32) { this->float32 = float32; }
+  // Deflates arrays at level (1-9), or writes them raw if it is 0.
+  void setCompression(int level);
+  void write(const std::string& path) const;
+  // Returns true if built with zlib.
+  static bool isCompressionAvailable();
+
+ private:
+  struct Array {
+    std::string name;
+    std::string type;
+    int components;
+    const void* data;
+    std::uint64_t bytes;
+  };
+  static void writeArrayHeader(std::ostream& os, const Array& array, std::uint64_t offset);
+  // Returns the appended block of array: its size and data, or zlib blocks with their header if compressed.
+  std::string encode(const Array& array) const;
+
+  const Eigen::Matrix3Xd& points;
+  std::vector<Array> point_data;
+  double time;
+  bool has_time;
+  bool float32;
+  int compression;
+};
+
+// A ParaView collection (.pvd) which lists outputs with their times. The header and the footer are
+// written once, and each output writes its entry over the footer followed by the footer again.
+// The first add() removes entries at its time or later, which a restarted run leaves behind.
+// file is written as given, so it should be relative to the directory of the collection.
+class VtuCollection {
+ public:
+  explicit VtuCollection(const std::string& path);
+  VtuCollection(const VtuCollection&) = delete;
+  VtuCollection& operator=(const VtuCollection&) = delete;
+  virtual ~VtuCollection(){}
+
+  void add(double time, const std::string& file);
+
+ private:
+  std::string path;
+  std::fstream pvd;
+};
+
+} // namespace tiny_mps
+#endif // MPS_VTU_WRITER_H_INCLUDED
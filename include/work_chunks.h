@@ -0,0 +1,46 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#ifndef MPS_WORK_CHUNKS_H_INCLUDED
+#define MPS_WORK_CHUNKS_H_INCLUDED
+
+#include <vector>
+#include <Eigen/Core>
+#include "particle_index.h"
+
+namespace tiny_mps {
+
+// Splits a range of particles into contiguous chunks of about equal cost and runs a function
+// on every particle in parallel. The cost of a particle is its number of neighbors plus one.
+// Threads take chunks one at a time, so that those which finish early take over the rest
+// instead of waiting for threads with dense regions such as jets.
+// function is called once for each particle and must not write to the other particles.
+// Example:
+//   WorkChunks chunks(particle_index.getRange(ParticleType::NORMAL), neighbor_particles, 8);
+//   chunks.forEach([&](int i_particle) { interaction(i_particle); });
+class WorkChunks {
+ public:
+  // Makes about chunks_per_thread chunks for each thread, or a single chunk if it is not positive.
+  WorkChunks(const ParticleIndex::Range& range, const Eigen::VectorXi& neighbor_counts, int chunks_per_thread);
+  virtual ~WorkChunks(){}
+
+  template <typename Function>
+  void forEach(const Function& function) const {
+    const int chunk_number = getSize();
+#pragma omp parallel for schedule(dynamic, 1) if (chunk_number > 1)
+    for (int i_chunk = 0; i_chunk < chunk_number; ++i_chunk) {
+      for (const int* index = range.begin() + begins[i_chunk]; index != range.begin() + begins[i_chunk + 1]; ++index) {
+        function(*index);
+      }
+    }
+  }
+
+  inline int getSize() const { return begins.size() - 1; }
+
+ private:
+  ParticleIndex::Range range;
+  // The k-th chunk is range.begin()[begins[k]] to range.begin()[begins[k + 1] - 1].
+  std::vector<int> begins;
+};
+
+} // namespace tiny_mps
+#endif // MPS_WORK_CHUNKS_H_INCLUDED
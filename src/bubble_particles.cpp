@@ -1,9 +1,9 @@
 // Copyright (c) 2017 Shota SUGIHARA
 // Distributed under the MIT License.
 #include "bubble_particles.h"
+#include "hdf5_writer.h"
 #define _USE_MATH_DEFINES
 #include <cmath>
-#include <Eigen/LU>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -20,172 +20,171 @@ BubbleParticles::BubbleParticles(const std::string& path, const tiny_mps::Condit
   bubble_radius = Eigen::VectorXd::Constant(getSize(), init_bubble_radius);
   void_fraction = Eigen::VectorXd::Constant(getSize(), condition.initial_void_fraction);
   free_surface_type = Eigen::VectorXi::Zero(getSize());
+  // Empty until initAverageGrid().
+  grid_min_pos = Eigen::Vector3d::Zero();
+  grid_max_pos = Eigen::Vector3d::Zero();
+  grid_w = 0;
+  grid_h = 0;
   average_count = 0;
+}
+
+BubbleParticles::BubbleParticles(const BubbleParticles& other, const tiny_mps::Condition& condition)
+    : Particles(other, condition),
+      average_pressure(other.average_pressure),
+      normal_vector(other.normal_vector),
+      modified_pnd(other.modified_pnd),
+      bubble_radius(other.bubble_radius),
+      void_fraction(other.void_fraction),
+      free_surface_type(other.free_surface_type),
+      average_grid(other.average_grid),
+      grid_min_pos(other.grid_min_pos),
+      grid_max_pos(other.grid_max_pos),
+      grid_w(other.grid_w),
+      grid_h(other.grid_h),
+      average_count(other.average_count) {
+  init_bubble_radius = cbrt((3 * condition.initial_void_fraction) / (4 * M_PI * condition.bubble_density * (1 - condition.initial_void_fraction)));
+}
+
+BubbleParticles::BubbleParticles(tiny_mps::CheckpointReader& reader, const tiny_mps::Condition& condition)
+    : Particles(reader, condition) {
+  init_bubble_radius = cbrt((3 * condition.initial_void_fraction) / (4 * M_PI * condition.bubble_density * (1 - condition.initial_void_fraction)));
+  reader.beginSection("BubbleParticles");
+  reader.read(average_pressure);
+  reader.read(normal_vector);
+  reader.read(modified_pnd);
+  reader.read(bubble_radius);
+  reader.read(void_fraction);
+  reader.read(free_surface_type);
+  reader.read(average_grid);
+  reader.read(grid_min_pos);
+  reader.read(grid_max_pos);
+  reader.read(grid_w);
+  reader.read(grid_h);
+  reader.read(average_count);
+  if (average_grid.size() != static_cast<std::size_t>(grid_w * grid_h)) {
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "Error: in BubbleParticles() in bubble_particles.cpp";
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "The grid has " << average_grid.size() << " values for " << grid_w << " x " << grid_h
+                                       << " in checkpoint: " << reader.getPath();
+    throw std::runtime_error("Error: in BubbleParticles() in bubble_particles.cpp.");
+  }
+}
 
+void BubbleParticles::writeCheckpoint(tiny_mps::CheckpointWriter& writer) const {
+  Particles::writeCheckpoint(writer);
+  writer.beginSection("BubbleParticles");
+  writer.write(average_pressure);
+  writer.write(normal_vector);
+  writer.write(modified_pnd);
+  writer.write(bubble_radius);
+  writer.write(void_fraction);
+  writer.write(free_surface_type);
+  writer.write(average_grid);
+  writer.write(grid_min_pos);
+  writer.write(grid_max_pos);
+  writer.write(grid_w);
+  writer.write(grid_h);
+  writer.write(average_count);
 }
 
 bool BubbleParticles::nextLoop(const std::string& path, tiny_mps::Timer& timer) {
-  std::cout << std::endl;
-  timer.limitCurrentDeltaTime(getMaxSpeed(), condition_);
+  tiny_mps::StepLog(tiny_mps::LOG_INFO) << "";
+  tiny_mps::StepStats stats = calculateStepStats();
+  if (condition_.step_rejection && checkStepRejection(stats, timer)) {
+    restoreStepState();
+    timer.rejectStep();
+    stats = calculateStepStats();
+  }
+  if (!resolution_zones.empty()) adaptResolution();
+  saveCheckpointInterval(path, timer);
+  timer.limitCurrentDeltaTime(stats.max_speed, condition_, getMinSpacing());
   timer.printCompuationTime();
   timer.printTimeInfo();
-  showParticlesInfo();
-  std::cout << boost::format("Max velocity: %f") % getMaxSpeed() << std::endl;
+  showParticlesInfo(stats);
+  tiny_mps::StepLog(tiny_mps::LOG_INFO) << boost::format("Max velocity: %f, Kinetic energy: %e") % stats.max_speed % stats.kinetic_energy;
   saveInterval(path, timer);
-  if (checkNeedlessCalculation()) {
-    std::cerr << "Error: All particles have become ghost." << std::endl;
+  if (checkNeedlessCalculation(stats)) {
+    flushOutput();
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "Error: All particles have become ghost.";
     writeVtkFile(path + "err.vtk", (boost::format("Time: %s") % timer.getCurrentTime()).str());
     throw std::range_error("Error: All particles have become ghost.");
   }
   if (timer.isUnderMinDeltaTime()) {
-    std::cerr << "Error: Delta time has become so small." << std::endl;
+    flushOutput();
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "Error: Delta time has become so small.";
     writeVtkFile(path + "err.vtk", (boost::format("Time: %s") % timer.getCurrentTime()).str());
     throw std::range_error("Error: Delta time has become so small.");
   }
   if (!timer.hasNextLoop()) {
-    std::cout << std::endl << "Total ";
-    timer.printCompuationTime();
-    std::cout << "Succeed in simulation." << std::endl;
+    tiny_mps::Log(tiny_mps::LOG_INFO) << "";
+    tiny_mps::Log(tiny_mps::LOG_INFO) << "Total " << timer.getComputationTime();
+    timer.printDeltaTimeSummary();
+    flushOutput();
+    tiny_mps::Log(tiny_mps::LOG_INFO) << "Succeed in simulation.";
+    tiny_mps::Logger::getInstance().flush();
     return false;
   }
   timer.update();
+  if (condition_.step_rejection) saveStepState();
+  solver_failed = false;
   temporary_velocity = velocity;
   temporary_position = position;
   return true;
 }
 
 bool BubbleParticles::saveInterval(const std::string& path, const tiny_mps::Timer& timer) const {
-  if (!timer.isOutputTime()) return false;
+  if (!Particles::saveInterval(path + "output_%1%.vtk", timer)) return false;
+  if (condition_.output_format == "hdf5") {
+    // The grid goes into the same file as the particles.
+    std::shared_ptr<tiny_mps::Hdf5Writer> writer = getHdf5Writer(getSeriesPath(path + "output_%1%.vtk"));
+    const int index = timer.getOutputCount();
+    const double time = timer.getCurrentTime();
+    const std::vector<double> grid = average_grid;
+    const int w = grid_w, h = grid_h;
+    const Eigen::Vector3d min_pos = grid_min_pos;
+    const double spacing = condition_.average_distance;
+    submitOutput([writer, index, time, grid, w, h, min_pos, spacing]() {
+      writer->writeGrid(index, time, grid, w, h, min_pos, spacing);
+    });
+    return true;
+  }
   std::string output_index = (boost::format("%04d") % timer.getOutputCount()).str();
-  writeVtkFile((boost::format(path + "output_%1%.vtk") % output_index).str(), (boost::format("Time: %s") % timer.getCurrentTime()).str());
-  writeGridVtkFile((boost::format(path + "grid_%1%.vtk") % output_index).str(), (boost::format("Time: %s") % timer.getCurrentTime()).str());
+  const std::string grid_path = (boost::format(path + "grid_%1%.vtk") % output_index).str();
+  const std::string title = (boost::format("Time: %s") % timer.getCurrentTime()).str();
+  // Copies for the snapshot writer thread.
+  const std::vector<double> grid = average_grid;
+  const int w = grid_w, h = grid_h;
+  const Eigen::Vector3d min_pos = grid_min_pos;
+  const double spacing = condition_.average_distance;
+  submitOutput([grid_path, title, grid, w, h, min_pos, spacing]() {
+    writeGridVtkFile(grid_path, title, grid, w, h, min_pos, spacing);
+  });
   return true;
 }
 
-void BubbleParticles::writeVtkFile(const std::string& path, const std::string& title) const {
-  int size = getSize();
-  std::ofstream ofs(path);
-  if(ofs.fail()) {
-    std::cerr << "Error: in writeVtkFile() in particles.cpp." << std::endl;
-    throw std::ios_base::failure("Error: in writeVtkFile() in particles.cpp.");
-  }
-  ofs << "# vtk DataFile Version 2.0" << std::endl;
-  ofs << title << std::endl;
-  ofs << "ASCII" << std::endl;
-  ofs << "DATASET UNSTRUCTURED_GRID" << std::endl;
-  ofs << std::endl;
-  ofs << "POINTS " << size << " double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << position(0, i) << " " << position(1, i) << " " << position(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "CELLS " << size << " " << size * 2 << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << 1 << " " << i << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "CELL_TYPES " << size << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << 1 << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "POINT_DATA " << size << std::endl;
-  ofs << "SCALARS Pressure double" << std::endl;
-  ofs << "LOOKUP_TABLE Pressure" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << pressure(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "VECTORS Velocity double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << velocity(0, i) << " " << velocity(1, i) << " " << velocity(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS Type int" << std::endl;
-  ofs << "LOOKUP_TABLE Type" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << particle_types(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS ParticleNumberDensity double" << std::endl;
-  ofs << "LOOKUP_TABLE ParticleNumberDensity" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << particle_number_density(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS NeighborParticles int" << std::endl;
-  ofs << "LOOKUP_TABLE NeighborParticles" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << neighbor_particles(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS BoundaryCondition int" << std::endl;
-  ofs << "LOOKUP_TABLE BoundaryCondition" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << boundary_types(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "VECTORS CorrectionVelocity double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << correction_velocity(0, i) << " " << correction_velocity(1, i) << " " << correction_velocity(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS SourceTerm double" << std::endl;
-  ofs << "LOOKUP_TABLE SourceTerm" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << source_term(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS VoxelsRatio double" << std::endl;
-  ofs << "LOOKUP_TABLE VoxelsRatio" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << voxel_ratio(i) << std::endl;
-  }
-
-  // extended
-  ofs << std::endl;
-  ofs << "SCALARS AveragePressure double" << std::endl;
-  ofs << "LOOKUP_TABLE AveragePressure" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << average_pressure(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "VECTORS NormalVector double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << normal_vector(0, i) << " " << normal_vector(1, i) << " " << normal_vector(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS BubbleRadius double" << std::endl;
-  ofs << "LOOKUP_TABLE BubbleRadius" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << bubble_radius(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS VoidFraction double" << std::endl;
-  ofs << "LOOKUP_TABLE VoidFraction" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << void_fraction(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS FreeSurfaceType int" << std::endl;
-  ofs << "LOOKUP_TABLE FreeSurfaceType" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << free_surface_type(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS ModifiedParticleNumberDensity double" << std::endl;
-  ofs << "LOOKUP_TABLE ModifiedParticleNumberDensity" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << modified_pnd(i) << std::endl;
-  }
-
-  std::cout << "Succeed in writing vtk file: " << path << std::endl;
+void BubbleParticles::addOutputFields(tiny_mps::ParticleSnapshot& snapshot) const {
+  Particles::addOutputFields(snapshot);
+  snapshot.addField("AveragePressure", average_pressure);
+  snapshot.addField("NormalVector", normal_vector);
+  snapshot.addField("BubbleRadius", bubble_radius);
+  snapshot.addField("VoidFraction", void_fraction);
+  snapshot.addField("FreeSurfaceType", free_surface_type);
+  snapshot.addField("ModifiedParticleNumberDensity", modified_pnd);
 }
 
 void BubbleParticles::writeGridVtkFile(const std::string& path, const std::string& title) const {
+  writeGridVtkFile(path, title, average_grid, grid_w, grid_h, grid_min_pos, condition_.average_distance);
+}
+
+void BubbleParticles::writeGridVtkFile(const std::string& path, const std::string& title, const std::vector<double>& average_grid,
+                                       int grid_w, int grid_h, const Eigen::Vector3d& grid_min_pos, double spacing) {
+  if (average_grid.size() != static_cast<std::size_t>(grid_w * grid_h)) {
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "Error: in writeGridVtkFile() in bubble_particles.cpp.";
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "The grid has " << average_grid.size() << " values for " << grid_w << " x " << grid_h;
+    throw std::invalid_argument("Error: in writeGridVtkFile() in bubble_particles.cpp.");
+  }
   std::ofstream ofs(path);
   if(ofs.fail()) {
-    std::cerr << "Error: in writeGridVtkFile() in particles.cpp." << std::endl;
+    tiny_mps::Log(tiny_mps::LOG_ERROR) << "Error: in writeGridVtkFile() in particles.cpp.";
     throw std::ios_base::failure("Error: in writeGridVtkFile() in particles.cpp.");
   }
   ofs << "# vtk DataFile Version 2.0" << std::endl;
@@ -194,7 +193,7 @@ void BubbleParticles::writeGridVtkFile(const std::string& path, const std::strin
   ofs << "DATASET STRUCTURED_POINTS" << std::endl;
   ofs << "DIMENSIONS " << grid_w << " " << grid_h << " 1" << std::endl;
   ofs << "ORIGIN " << grid_min_pos(0) << " " << grid_min_pos(1) <<  " 0.0" << std::endl;
-  ofs << "SPACING " << condition_.average_distance << " " << condition_.average_distance << " " << condition_.average_distance << std::endl;
+  ofs << "SPACING " << spacing << " " << spacing << " " << spacing << std::endl;
   ofs << "POINT_DATA " << grid_w * grid_h << std::endl;
   ofs << "SCALARS Pressure double" << std::endl;
   ofs << "LOOKUP_TABLE Pressure" << std::endl;
@@ -203,7 +202,7 @@ void BubbleParticles::writeGridVtkFile(const std::string& path, const std::strin
   }
   ofs << std::endl;
 
-  std::cout << "Succeed in writing grid vtk file: " << path << std::endl;
+  tiny_mps::Log(tiny_mps::LOG_INFO) << "Succeed in writing grid vtk file: " << path;
 }
 
 void BubbleParticles::extendStorage(int extra_size) {
@@ -223,6 +222,17 @@ void BubbleParticles::extendStorage(int extra_size) {
   free_surface_type.segment(size, extra_size).setZero();
 }
 
+std::vector<int> BubbleParticles::compactStorage() {
+  std::vector<int> new_indices = Particles::compactStorage();
+  compactArray(average_pressure, new_indices, size);
+  compactArray(normal_vector, new_indices, size);
+  compactArray(modified_pnd, new_indices, size);
+  compactArray(bubble_radius, new_indices, size);
+  compactArray(void_fraction, new_indices, size);
+  compactArray(free_surface_type, new_indices, size);
+  return new_indices;
+}
+
 void BubbleParticles::setGhostParticle(int index) {
   Particles::setGhostParticle(index);
   average_pressure(index) = 0.0;
@@ -233,6 +243,49 @@ void BubbleParticles::setGhostParticle(int index) {
   free_surface_type(index) = SurfaceLayer::OTHERS;
 }
 
+void BubbleParticles::setGhostParticles(const std::vector<int>& indices) {
+  Particles::setGhostParticles(indices);
+  for (int index : indices) average_pressure(index) = 0.0;
+  for (int index : indices) normal_vector.col(index).setZero();
+  for (int index : indices) modified_pnd(index) = 0.0;
+  for (int index : indices) bubble_radius(index) = 0.0;
+  for (int index : indices) void_fraction(index) = condition_.initial_void_fraction;
+  for (int index : indices) free_surface_type(index) = SurfaceLayer::OTHERS;
+}
+
+void BubbleParticles::copyParticleFields(int source, int destination) {
+  average_pressure(destination) = average_pressure(source);
+  normal_vector.col(destination) = normal_vector.col(source);
+  modified_pnd(destination) = modified_pnd(source);
+  bubble_radius(destination) = bubble_radius(source);
+  void_fraction(destination) = void_fraction(source);
+  free_surface_type(destination) = free_surface_type(source);
+}
+
+void BubbleParticles::saveStepState() {
+  Particles::saveStepState();
+  step_state.average_pressure = average_pressure;
+  step_state.normal_vector = normal_vector;
+  step_state.modified_pnd = modified_pnd;
+  step_state.bubble_radius = bubble_radius;
+  step_state.void_fraction = void_fraction;
+  step_state.free_surface_type = free_surface_type;
+  step_state.average_grid = average_grid;
+  step_state.average_count = average_count;
+}
+
+void BubbleParticles::restoreStepState() {
+  Particles::restoreStepState();
+  average_pressure = step_state.average_pressure;
+  normal_vector = step_state.normal_vector;
+  modified_pnd = step_state.modified_pnd;
+  bubble_radius = step_state.bubble_radius;
+  void_fraction = step_state.void_fraction;
+  free_surface_type = step_state.free_surface_type;
+  average_grid = step_state.average_grid;
+  average_count = step_state.average_count;
+}
+
 void BubbleParticles::checkSurface(){
   // First step.
   using namespace tiny_mps;
@@ -254,28 +307,31 @@ void BubbleParticles::checkSurface(){
     }
   }
   // Second step.
-  Grid grid(condition_.pnd_weight_radius, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
+  Grid grid(condition_.pnd_weight_radius * max_spacing_scale, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
   const double root2 = std::sqrt(2);
   normal_vector.setZero();
   for(int i_particle = 0; i_particle < getSize(); ++i_particle) {
     if(boundary_types(i_particle) == BoundaryType::SURFACE) {
       Grid::Neighbors neighbors;
       grid.getNeighbors(i_particle, neighbors);
+      const double scale = getSpacingScale(i_particle);
+      eraseNeighborsBeyond(temporary_position, i_particle, condition_.pnd_weight_radius * scale, neighbors);
       if (neighbors.empty()) continue;
       for (int j_particle : neighbors) {
         Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-        normal_vector.col(i_particle) += r_ij.normalized() * weightForParticleNumberDensity(r_ij);
+        normal_vector.col(i_particle) += r_ij.normalized() * weightForParticleNumberDensity(r_ij / scale) * getVolumeRatio(i_particle, j_particle);
       }
       normal_vector.col(i_particle) /= particle_number_density(i_particle);
+      const double spacing = particle_spacing(i_particle);
       for (int j_particle : neighbors) {
         Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-        if (r_ij.norm() >= root2 * condition_.average_distance
-            && (temporary_position.col(i_particle) + condition_.average_distance * normal_vector.col(i_particle).normalized() - temporary_position.col(j_particle)).norm() < condition_.average_distance) {
+        if (r_ij.norm() >= root2 * spacing
+            && (temporary_position.col(i_particle) + spacing * normal_vector.col(i_particle).normalized() - temporary_position.col(j_particle)).norm() < spacing) {
           boundary_types(i_particle) = BoundaryType::INNER;
           free_surface_type(i_particle) = SurfaceLayer::INNER;
           break;
         }
-        if (r_ij.norm() < root2 * condition_.average_distance
+        if (r_ij.norm() < root2 * spacing
             && r_ij.normalized().dot(normal_vector.col(i_particle).normalized()) > 1.0 / root2) {
           boundary_types(i_particle) = BoundaryType::INNER;
           free_surface_type(i_particle) = SurfaceLayer::INNER;
@@ -285,11 +341,13 @@ void BubbleParticles::checkSurface(){
     }
   }
   // Third step.
-  Grid judge_inner_surface(condition_.average_distance * condition_.secondary_surface_eta, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
+  Grid judge_inner_surface(condition_.average_distance * condition_.secondary_surface_eta * max_spacing_scale, temporary_position,
+                           particle_types.array() != ParticleType::GHOST, dimension);
   for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::SURFACE) {
       Grid::Neighbors neighbors;
       judge_inner_surface.getNeighbors(i_particle, neighbors);
+      eraseNeighborsBeyond(temporary_position, i_particle, particle_spacing(i_particle) * condition_.secondary_surface_eta, neighbors);
       if (neighbors.empty()) continue;
       for (int j_particle : neighbors) {
         if (boundary_types(j_particle) == BoundaryType::INNER && free_surface_type(j_particle) == SurfaceLayer::INNER)
@@ -320,26 +378,30 @@ void BubbleParticles::checkSurface2(){
     }
   }
   // Second step.
-  Grid grid(condition_.pnd_weight_radius, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
+  Grid grid(condition_.pnd_weight_radius * max_spacing_scale, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
   normal_vector.setZero();
   for(int i_particle = 0; i_particle < getSize(); ++i_particle) {
     if(boundary_types(i_particle) == BoundaryType::SURFACE) {
       Grid::Neighbors neighbors;
       grid.getNeighbors(i_particle, neighbors);
+      const double scale = getSpacingScale(i_particle);
+      eraseNeighborsBeyond(temporary_position, i_particle, condition_.pnd_weight_radius * scale, neighbors);
       if (neighbors.empty()) continue;
       for (int j_particle : neighbors) {
         Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-        normal_vector.col(i_particle) += r_ij.normalized() * weightForParticleNumberDensity(r_ij);
+        normal_vector.col(i_particle) += r_ij.normalized() * weightForParticleNumberDensity(r_ij / scale) * getVolumeRatio(i_particle, j_particle);
       }
       normal_vector.col(i_particle) /= particle_number_density(i_particle);
     }
   }
   // Third step.
-  Grid judge_inner_surface(condition_.average_distance * condition_.secondary_surface_eta, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
+  Grid judge_inner_surface(condition_.average_distance * condition_.secondary_surface_eta * max_spacing_scale, temporary_position,
+                           particle_types.array() != ParticleType::GHOST, dimension);
   for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::SURFACE) {
       Grid::Neighbors neighbors;
       judge_inner_surface.getNeighbors(i_particle, neighbors);
+      eraseNeighborsBeyond(temporary_position, i_particle, particle_spacing(i_particle) * condition_.secondary_surface_eta, neighbors);
       if (neighbors.empty()) continue;
       for (int j_particle : neighbors) {
         if (boundary_types(j_particle) == BoundaryType::INNER && free_surface_type(j_particle) == SurfaceLayer::INNER)
@@ -350,48 +412,44 @@ void BubbleParticles::checkSurface2(){
 }
 
 void BubbleParticles::calculateBubbles() {
-  for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
-    if (particle_types(i_particle) == tiny_mps::ParticleType::NORMAL) {
-      double del_p = (condition_.vapor_pressure - condition_.head_pressure) - pressure(i_particle);
-      // double del_p = (condition_.vapor_pressure - condition_.head_pressure) - average_pressure(i_particle);
-      if (del_p > 0) bubble_radius(i_particle) += sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
-      else bubble_radius(i_particle) -= sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
-      if (bubble_radius(i_particle) > condition_.average_distance) bubble_radius(i_particle) = condition_.average_distance;
-      if (bubble_radius(i_particle) < 0) bubble_radius(i_particle) = 0;
-
-      double bubble_vol = 4 * M_PI * condition_.bubble_density * bubble_radius(i_particle) * bubble_radius(i_particle) * bubble_radius(i_particle) / 3;
-      void_fraction(i_particle) = bubble_vol / (1 + bubble_vol);
-      if (void_fraction(i_particle) < condition_.min_void_fraction) void_fraction(i_particle) = condition_.min_void_fraction;
-      if (void_fraction(i_particle) > 0.5) void_fraction(i_particle) = 0.5;
-    }
+  for (int i_particle : particle_index.getRange(tiny_mps::ParticleType::NORMAL)) {
+    double del_p = (condition_.vapor_pressure - condition_.head_pressure) - pressure(i_particle);
+    // double del_p = (condition_.vapor_pressure - condition_.head_pressure) - average_pressure(i_particle);
+    if (del_p > 0) bubble_radius(i_particle) += sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
+    else bubble_radius(i_particle) -= sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
+    if (bubble_radius(i_particle) > condition_.average_distance) bubble_radius(i_particle) = condition_.average_distance;
+    if (bubble_radius(i_particle) < 0) bubble_radius(i_particle) = 0;
+
+    double bubble_vol = 4 * M_PI * condition_.bubble_density * bubble_radius(i_particle) * bubble_radius(i_particle) * bubble_radius(i_particle) / 3;
+    void_fraction(i_particle) = bubble_vol / (1 + bubble_vol);
+    if (void_fraction(i_particle) < condition_.min_void_fraction) void_fraction(i_particle) = condition_.min_void_fraction;
+    if (void_fraction(i_particle) > 0.5) void_fraction(i_particle) = 0.5;
   }
 }
 
 void BubbleParticles::calculateBubblesFromAveragePressure() {
-  for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
-    if (particle_types(i_particle) == tiny_mps::ParticleType::NORMAL) {
-      int ix = std::floor((temporary_position(0, i_particle) - grid_min_pos(0) + condition_.average_distance / 2.0) / condition_.average_distance);
-      int iy = std::floor((temporary_position(1, i_particle) - grid_min_pos(1) + condition_.average_distance / 2.0) / condition_.average_distance);
-      if (ix < 0 || ix >= grid_w) continue;
-      if (iy < 0 || iy >= grid_h) continue;
-      // double del_p = (condition_.vapor_pressure - condition_.head_pressure) - pressure(i_particle);
-      double del_p = (condition_.vapor_pressure - condition_.head_pressure) - average_grid[ix + iy * grid_w];
-      if (del_p > 0) bubble_radius(i_particle) += sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
-      else bubble_radius(i_particle) -= sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
-      if (bubble_radius(i_particle) > condition_.average_distance) bubble_radius(i_particle) = condition_.average_distance;
-      if (bubble_radius(i_particle) < 0) bubble_radius(i_particle) = 0;
-
-      double bubble_vol = 4 * M_PI * condition_.bubble_density * bubble_radius(i_particle) * bubble_radius(i_particle) * bubble_radius(i_particle) / 3;
-      void_fraction(i_particle) = bubble_vol / (1 + bubble_vol);
-      if (void_fraction(i_particle) < condition_.min_void_fraction) void_fraction(i_particle) = condition_.min_void_fraction;
-      if (void_fraction(i_particle) > 0.5) void_fraction(i_particle) = 0.5;
-    }
+  for (int i_particle : particle_index.getRange(tiny_mps::ParticleType::NORMAL)) {
+    int ix = std::floor((temporary_position(0, i_particle) - grid_min_pos(0) + condition_.average_distance / 2.0) / condition_.average_distance);
+    int iy = std::floor((temporary_position(1, i_particle) - grid_min_pos(1) + condition_.average_distance / 2.0) / condition_.average_distance);
+    if (ix < 0 || ix >= grid_w) continue;
+    if (iy < 0 || iy >= grid_h) continue;
+    // double del_p = (condition_.vapor_pressure - condition_.head_pressure) - pressure(i_particle);
+    double del_p = (condition_.vapor_pressure - condition_.head_pressure) - average_grid[ix + iy * grid_w];
+    if (del_p > 0) bubble_radius(i_particle) += sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
+    else bubble_radius(i_particle) -= sqrt(2 * abs(del_p) / (3 * condition_.mass_density));
+    if (bubble_radius(i_particle) > condition_.average_distance) bubble_radius(i_particle) = condition_.average_distance;
+    if (bubble_radius(i_particle) < 0) bubble_radius(i_particle) = 0;
+
+    double bubble_vol = 4 * M_PI * condition_.bubble_density * bubble_radius(i_particle) * bubble_radius(i_particle) * bubble_radius(i_particle) / 3;
+    void_fraction(i_particle) = bubble_vol / (1 + bubble_vol);
+    if (void_fraction(i_particle) < condition_.min_void_fraction) void_fraction(i_particle) = condition_.min_void_fraction;
+    if (void_fraction(i_particle) > 0.5) void_fraction(i_particle) = 0.5;
   }
 }
 
 void BubbleParticles::calculateAveragePressure() {
   using namespace tiny_mps;
-  Grid grid(condition_.pnd_weight_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.pnd_weight_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       average_pressure(i_particle) = 0.0;
@@ -403,12 +461,14 @@ void BubbleParticles::calculateAveragePressure() {
       average_pressure(i_particle) = pressure(i_particle);
       continue;
     }
-    double numerator = pressure(i_particle) * weightPoly6Kernel(0, condition_.pnd_weight_radius);
-    double denominator = weightPoly6Kernel(0, condition_.pnd_weight_radius);
+    const double radius = condition_.pnd_weight_radius * getSpacingScale(i_particle);
+    double numerator = pressure(i_particle) * weightPoly6Kernel(0, radius);
+    double denominator = weightPoly6Kernel(0, radius);
     for (int j_particle : neighbors) {
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      numerator += pressure(j_particle) * weightPoly6Kernel(r_ij.norm(), condition_.pnd_weight_radius);
-      denominator += weightPoly6Kernel(r_ij.norm(), condition_.pnd_weight_radius);
+      double w_ij = weightPoly6Kernel(r_ij.norm(), radius) * getVolumeRatio(i_particle, j_particle);
+      numerator += pressure(j_particle) * w_ij;
+      denominator += w_ij;
     }
     average_pressure(i_particle) = numerator / denominator;
   }
@@ -425,28 +485,27 @@ inline double BubbleParticles::weightPoly6Kernel(double r, double h) {
 
 void BubbleParticles::calculateModifiedParticleNumberDensity() {
   using namespace tiny_mps;
-  Grid grid(condition_.average_distance * 1.05, temporary_position, particle_types.array() != ParticleType::GHOST, condition_.dimension);
+  Grid grid(condition_.average_distance * 1.05 * max_spacing_scale, temporary_position, particle_types.array() != ParticleType::GHOST, condition_.dimension);
   Eigen::Vector3d l0_vec(condition_.average_distance, 0.0, 0.0);
-  for (int i_particle = 0; i_particle < getSize(); ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::GHOST) {
-      modified_pnd(i_particle) = 0.0;
-      continue;
-    }
+  // Ghosts keep zero, which setGhostParticle() assigns.
+  forEachParticle(particle_index.getLiveRange(), [&](int i_particle) {
     double n_hat = initial_particle_number_density;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
-    if (neighbors.empty()) continue;
+    eraseNeighborsBeyond(temporary_position, i_particle, particle_spacing(i_particle) * 1.05, neighbors);
+    if (neighbors.empty()) return;
+    const double scale = getSpacingScale(i_particle);
     for (int j_particle : neighbors) {
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      n_hat += weightForParticleNumberDensity(r_ij) - weightForParticleNumberDensity(l0_vec);
+      n_hat += (weightForParticleNumberDensity(r_ij / scale) - weightForParticleNumberDensity(l0_vec)) * getVolumeRatio(i_particle, j_particle);
     }
     modified_pnd(i_particle) = std::max(particle_number_density(i_particle), n_hat);
-  }
+  });
 }
 
 void BubbleParticles::solvePressurePoisson(const tiny_mps::Timer& timer) {
   using namespace tiny_mps;
-  Grid grid(condition_.laplacian_pressure_weight_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.laplacian_pressure_weight_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   using T = Eigen::Triplet<double>;
   double lap_r = grid.getGridWidth();
   int n_size = (int)(std::pow(lap_r * 2, dimension));
@@ -455,6 +514,7 @@ void BubbleParticles::solvePressurePoisson(const tiny_mps::Timer& timer) {
   source_term.setZero();
   std::vector<T> coeffs(size * n_size);
   std::vector<int> neighbors(n_size * 2);
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
   for (int i_particle = 0; i_particle < size; ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       coeffs.push_back(T(i_particle, i_particle, 1.0));
@@ -464,26 +524,30 @@ void BubbleParticles::solvePressurePoisson(const tiny_mps::Timer& timer) {
       continue;
     }
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     double sum = 0.0;
     double div_vel = 0.0;
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      double mat_ij = weightForLaplacianPressure(r_ij) * 2 * dimension
+      double mat_ij = getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij) * 2 * dimension
               / (laplacian_lambda_pressure * initial_particle_number_density);
       sum -= mat_ij;
       div_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) * condition_.dimension
+              / (r_ij.squaredNorm() * initial_particle_number_density);
       if (boundary_types(j_particle) == BoundaryType::INNER) {
         coeffs.push_back(T(i_particle, j_particle, mat_ij));
       }
     }
-    sum -= condition_.weak_compressibility * condition_.mass_density / (delta_time * delta_time);
+    // The row is multiplied by the volume scale, as getLaplacianPairWeight() is.
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
     coeffs.push_back(T(i_particle, i_particle, sum));
     double initial_pnd_i = initial_particle_number_density * (1 - void_fraction(i_particle));
-    source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+    source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
                 - (particle_number_density(i_particle) - initial_pnd_i)
-                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
   }
   p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
   solveConjugateGradient(p_mat);
@@ -491,7 +555,7 @@ void BubbleParticles::solvePressurePoisson(const tiny_mps::Timer& timer) {
 
 void BubbleParticles::solvePressurePoissonDuan(const tiny_mps::Timer& timer) {
   using namespace tiny_mps;
-  Grid grid(condition_.laplacian_pressure_weight_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.laplacian_pressure_weight_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   using T = Eigen::Triplet<double>;
   double lap_r = grid.getGridWidth();
   int n_size = (int)(std::pow(lap_r * 2, dimension));
@@ -500,6 +564,7 @@ void BubbleParticles::solvePressurePoissonDuan(const tiny_mps::Timer& timer) {
   source_term.setZero();
   std::vector<T> coeffs(size * n_size);
   std::vector<int> neighbors(n_size * 2);
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
   for (int i_particle = 0; i_particle < size; ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       coeffs.push_back(T(i_particle, i_particle, 1.0));
@@ -509,37 +574,41 @@ void BubbleParticles::solvePressurePoissonDuan(const tiny_mps::Timer& timer) {
       continue;
     }
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     double sum = 0.0;
     double div_vel = 0.0;
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      double mat_ij = weightForLaplacianPressure(r_ij) * 2 * dimension
+      double mat_ij = getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij) * 2 * dimension
               / (laplacian_lambda_pressure * initial_particle_number_density);
       sum -= mat_ij;
       div_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) * condition_.dimension
+              / (r_ij.squaredNorm() * initial_particle_number_density);
       if (boundary_types(j_particle) == BoundaryType::INNER) {
         coeffs.push_back(T(i_particle, j_particle, mat_ij));
       }
     }
-    sum -= condition_.weak_compressibility * condition_.mass_density / (delta_time * delta_time);
+    // The row is multiplied by the volume scale, as getLaplacianPairWeight() is.
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
     if (free_surface_type(i_particle) == SurfaceLayer::INNER_SURFACE) {
-      sum -= (modified_pnd(i_particle) - particle_number_density(i_particle)) * 2 * dimension / (laplacian_lambda_pressure * initial_particle_number_density);
+      sum -= volume * (modified_pnd(i_particle) - particle_number_density(i_particle)) * 2 * dimension / (laplacian_lambda_pressure * initial_particle_number_density);
       coeffs.push_back(T(i_particle, i_particle, sum));
       double initial_pnd_i = initial_particle_number_density * (1 - void_fraction(i_particle));
-      source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+      source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
                 - (modified_pnd(i_particle) - initial_pnd_i)
-                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
       // source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
       //           - (modified_pnd(i_particle) - initial_particle_number_density)
       //           * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
     } else {
       coeffs.push_back(T(i_particle, i_particle, sum));
       // double initial_pnd_i = initial_particle_number_density * (1 - void_fraction(i_particle));
-      source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+      source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
                 - (particle_number_density(i_particle) - initial_particle_number_density)
-                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
     }
   }
   p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
@@ -548,23 +617,27 @@ void BubbleParticles::solvePressurePoissonDuan(const tiny_mps::Timer& timer) {
 
 void BubbleParticles::correctVelocityDuan(const tiny_mps::Timer& timer) {
   using namespace tiny_mps;
-  Grid grid(condition_.gradient_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.gradient_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  GradientCorrection correction(size, dimension);
+  calculateGradientCorrection(temporary_position, grid, correction);
   correction_velocity.setZero();
   int tensor_count = 0;
   int not_tensor_count = 0;
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
-    if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
+  forEachParticle(particle_index.getRange(ParticleType::NORMAL), [&](int i_particle) {
+    if (boundary_types(i_particle) == BoundaryType::OTHERS) return;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
-    Eigen::Matrix3d tensor = Eigen::Matrix3d::Zero();
+    const double scale = getSpacingScale(i_particle);
+    eraseNeighborsBeyond(temporary_position, i_particle, condition_.gradient_radius * scale, neighbors);
     Eigen::Vector3d tmp_vel(0.0, 0.0, 0.0);
     if (free_surface_type(i_particle) == SurfaceLayer::INNER_SURFACE) {
       for (int j_particle : neighbors) {
         if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
         Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-        tmp_vel += r_ij * (pressure(j_particle) + pressure(i_particle)) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
+        tmp_vel += r_ij * (pressure(j_particle) + pressure(i_particle)) * weightForGradientPressure(r_ij / scale)
+                 * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
       }
+      if (!polygon_wall.isEmpty()) tmp_vel += getPolygonWallGradient(temporary_position.col(i_particle), 2 * pressure(i_particle));
       if (dimension == 2) tmp_vel(2) = 0;
       correction_velocity.col(i_particle) -= tmp_vel * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
     } else {
@@ -578,29 +651,25 @@ void BubbleParticles::correctVelocityDuan(const tiny_mps::Timer& timer) {
       for (int j_particle : neighbors) {
         if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
         Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-        Eigen::Vector3d n_ij = r_ij.normalized();
-        Eigen::Matrix3d tmp_tensor = Eigen::Matrix3d::Zero();
-        tmp_tensor << n_ij(0) * n_ij(0), n_ij(0) * n_ij(1), n_ij(0) * n_ij(2),
-                      n_ij(1) * n_ij(0), n_ij(1) * n_ij(1), n_ij(1) * n_ij(2),
-                      n_ij(2) * n_ij(0), n_ij(2) * n_ij(1), n_ij(2) * n_ij(2);
-        tensor += tmp_tensor * weightForGradientPressure(r_ij) / initial_particle_number_density;
         double xi = 0.2 + 2 * normal_vector.col(j_particle).norm();
-        tmp_vel += r_ij * (pressure(j_particle) - pressure(i_particle) + xi * (p_max - p_min)) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
-      }
-      if (dimension == 2) {
-        tmp_vel(2) = 0;
-        tensor(2, 2) = 1.0;
+        tmp_vel += r_ij * (pressure(j_particle) - pressure(i_particle) + xi * (p_max - p_min)) * weightForGradientPressure(r_ij / scale)
+                 * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
       }
-      if (tensor.determinant() > 1.0e-10) {
-        correction_velocity.col(i_particle) -= tensor.inverse() * tmp_vel * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
+      // Polygon walls take the pressure of the particle and have no normal vector.
+      if (!polygon_wall.isEmpty()) tmp_vel += getPolygonWallGradient(temporary_position.col(i_particle), 0.2 * (p_max - p_min));
+      if (dimension == 2) tmp_vel(2) = 0;
+      if (correction.isCorrected(i_particle)) {
+        correction_velocity.col(i_particle) -= correction.apply(i_particle, tmp_vel) * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
+#pragma omp atomic
         ++tensor_count;
       } else {
         correction_velocity.col(i_particle) -= tmp_vel * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
+#pragma omp atomic
         ++not_tensor_count;
       }
     }
-  }
-  std::cout << "Tensor: " << tensor_count << ", Not Tensor: " << not_tensor_count << std::endl;
+  });
+  tiny_mps::StepLog(tiny_mps::LOG_INFO) << "Tensor: " << tensor_count << ", Not Tensor: " << not_tensor_count;
   temporary_velocity += correction_velocity;
 }
 
@@ -610,15 +679,12 @@ void BubbleParticles::initAverageGrid(const Eigen::Vector3d& min_pos, const Eige
   grid_max_pos = max_pos;
   grid_w = r_ij(0) / condition_.average_distance + 1;
   grid_h = r_ij(1) / condition_.average_distance + 1;
-  average_grid.reserve(grid_w * grid_h);
-  for (int i = 0; i < grid_w * grid_h; i++) {
-    average_grid[i] = 0;
-  }
+  average_grid.assign(grid_w * grid_h, 0.0);
 }
 
 void BubbleParticles::updateAverageGrid(double start_time, const tiny_mps::Timer& timer) {
   using namespace tiny_mps;
-  std::cout << "average: " << average_count  << ", " << timer.getLoopCount() << std::endl;
+  tiny_mps::StepLog(tiny_mps::LOG_INFO) << "average: " << average_count  << ", " << timer.getLoopCount();
   if (start_time > timer.getCurrentTime()) {
     average_count = timer.getLoopCount();
     return;
@@ -0,0 +1,110 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "checkpoint.h"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "logger.h"
+
+namespace tiny_mps {
+
+namespace {
+const char kMagic[8] = {'T', 'I', 'N', 'Y', 'M', 'P', 'S', '\0'};
+// Increase it whenever the contents of any section change.
+const std::uint32_t kVersion = 3;
+const std::uint32_t kByteOrder = 0x01020304;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string& path)
+    : path(path), temporary_path(path + ".tmp"), closed(false) {
+  ofs.open(temporary_path, std::ios::binary | std::ios::trunc);
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in CheckpointWriter() in checkpoint.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << temporary_path;
+    throw std::ios_base::failure("Error: in CheckpointWriter() in checkpoint.cpp.");
+  }
+  writeBytes(kMagic, sizeof(kMagic));
+  write(kVersion);
+  write(kByteOrder);
+  write<std::uint32_t>(sizeof(int));
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  if (closed) return;
+  ofs.close();
+  std::remove(temporary_path.c_str());
+}
+
+void CheckpointWriter::beginSection(const std::string& name) {
+  write(name);
+}
+
+void CheckpointWriter::write(const std::string& value) {
+  write<std::uint64_t>(value.size());
+  writeBytes(value.data(), value.size());
+}
+
+void CheckpointWriter::close() {
+  ofs.close();
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in close() in checkpoint.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << temporary_path;
+    throw std::ios_base::failure("Error: in close() in checkpoint.cpp.");
+  }
+  // rename() does not replace an existing file on Windows.
+  std::remove(path.c_str());
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    Log(LOG_ERROR) << "Error: in close() in checkpoint.cpp";
+    Log(LOG_ERROR) << "Failed to rename " << temporary_path << " to " << path;
+    throw std::ios_base::failure("Error: in close() in checkpoint.cpp.");
+  }
+  closed = true;
+}
+
+void CheckpointWriter::writeBytes(const void* data, std::size_t bytes) {
+  ofs.write(static_cast<const char*>(data), bytes);
+}
+
+CheckpointReader::CheckpointReader(const std::string& path) : path(path) {
+  ifs.open(path, std::ios::binary);
+  if (ifs.fail()) {
+    Log(LOG_ERROR) << "Error: in CheckpointReader() in checkpoint.cpp";
+    Log(LOG_ERROR) << "Failed to read files: " << path;
+    throw std::ios_base::failure("Error: in CheckpointReader() in checkpoint.cpp.");
+  }
+  char magic[sizeof(kMagic)];
+  readBytes(magic, sizeof(magic));
+  if (std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) fail("Not a checkpoint file");
+  std::uint32_t version, byte_order, int_size;
+  read(version);
+  read(byte_order);
+  read(int_size);
+  if (version != kVersion) fail("Unsupported version " + std::to_string(version));
+  if (byte_order != kByteOrder || int_size != sizeof(int)) fail("Written on an incompatible platform");
+}
+
+void CheckpointReader::beginSection(const std::string& name) {
+  std::string section;
+  read(section);
+  if (section != name) fail("Expected section " + name + ", but found " + section);
+}
+
+void CheckpointReader::read(std::string& value) {
+  std::uint64_t size;
+  read(size);
+  value.resize(size);
+  if (size > 0) readBytes(&value[0], size);
+}
+
+void CheckpointReader::readBytes(void* data, std::size_t bytes) {
+  ifs.read(static_cast<char*>(data), bytes);
+  if (ifs.fail()) fail("Unexpected end of file");
+}
+
+void CheckpointReader::fail(const std::string& message) const {
+  Log(LOG_ERROR) << "Error: in CheckpointReader in checkpoint.cpp";
+  Log(LOG_ERROR) << message << ": " << path;
+  throw std::ios_base::failure("Error: in CheckpointReader in checkpoint.cpp.");
+}
+
+} // namespace tiny_mps
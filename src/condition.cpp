@@ -1,15 +1,45 @@
 // Copyright (c) 2017 Shota SUGIHARA
 // Distributed under the MIT License.
 #include "condition.h"
+#include "hdf5_writer.h"
+#include "vtu_writer.h"
 
 namespace tiny_mps{
 
 Condition::Condition(std::string path) {
   readDataFile(path);
+  log_level = "info";
+  getValue("log_level", log_level);
+  log_step_interval = 1;
+  getValue("log_step_interval", log_step_interval);
+  log_async = false;
+  getValue("log_async", log_async);
+  Logger::getInstance().configure(Logger::parseLevel(log_level), log_step_interval, log_async);
+  Log(LOG_INFO) << "Succeed in reading data file: " << path;
+  for (const std::string& item : items) Log(LOG_DEBUG) << "    " << item << ": " << data.at(item);
+  Log(LOG_DEBUG) << "";
+  setValues();
+}
+
+Condition::Condition(const Condition& base, const Overrides& overrides)
+    : log_level(base.log_level), log_step_interval(base.log_step_interval), log_async(base.log_async),
+      data(base.data), items(base.items) {
+  for (const auto& item : overrides) {
+    if (data.find(item.first) == data.end()) {
+      Log(LOG_WARNING) << "Warning: " << item.first << " is not in the base data file.";
+      items.push_back(item.first);
+    }
+    data[item.first] = item.second;
+    Log(LOG_DEBUG) << "    " << item.first << ": " << item.second;
+  }
+  setValues();
+}
+
+void Condition::setValues() {
   getValue("average_distance",  average_distance);
   getValue("dimension", dimension);
   if(dimension != 2 && dimension != 3) {
-    std::cerr << "Error: " << dimension << "-dimension is not supported." << std::endl;
+    Log(LOG_ERROR) << "Error: " << dimension << "-dimension is not supported.";
     throw std::out_of_range("Error: dimension is out of range.");
   }
   double gx, gy, gz;
@@ -32,6 +62,8 @@ Condition::Condition(std::string path) {
   getValue("mass_density", mass_density);
   getValue("viscosity_calculation", viscosity_calculation);
   getValue("kinematic_viscosity", kinematic_viscosity);
+  implicit_viscosity = false;
+  getValue("implicit_viscosity", implicit_viscosity);
 
   getValue("courant_number", courant_number);
   getValue("diffusion_number", diffusion_number);
@@ -42,6 +74,10 @@ Condition::Condition(std::string path) {
   getValue("laplacian_viscosity_influence", laplacian_viscosity_influence);
   getValue("additional_ghost_particles", additional_ghost_particles);
   getValue("extra_ghost_particles", extra_ghost_particles);
+  reserve_particles = 0;
+  getValue("reserve_particles", reserve_particles);
+  storage_growth_factor = 1.5;
+  getValue("storage_growth_factor", storage_growth_factor);
   getValue("collision_influence", collision_influence);
   getValue("restitution_coefficent", restitution_coefficent);
 
@@ -50,6 +86,18 @@ Condition::Condition(std::string path) {
   getValue("finish_time", finish_time);
   getValue("min_delta_time", min_delta_time);
   getValue("output_interval", output_interval);
+  adaptive_delta_time = false;
+  getValue("adaptive_delta_time", adaptive_delta_time);
+  max_delta_time = 10.0;
+  getValue("max_delta_time", max_delta_time);
+  delta_time_growth_factor = 1.2;
+  getValue("delta_time_growth_factor", delta_time_growth_factor);
+  delta_time_shrink_factor = 0.5;
+  getValue("delta_time_shrink_factor", delta_time_shrink_factor);
+  step_rejection = false;
+  getValue("step_rejection", step_rejection);
+  rejection_courant_number = 2.0 * courant_number;
+  getValue("rejection_courant_number", rejection_courant_number);
   getValue("relaxation_coefficient_pnd", relaxation_coefficient_pnd);
   getValue("relaxation_coefficient_vel_div", relaxation_coefficient_vel_div);
   getValue("weak_compressibility", weak_compressibility);
@@ -62,6 +110,82 @@ Condition::Condition(std::string path) {
   getValue("vapor_pressure", vapor_pressure);
   getValue("secondary_surface_eta", secondary_surface_eta);
 
+  simd_kernels = false;
+  getValue("simd_kernels", simd_kernels);
+  thread_chunks = 0;
+  getValue("thread_chunks", thread_chunks);
+  compaction_ghost_ratio = 0.0;
+  getValue("compaction_ghost_ratio", compaction_ghost_ratio);
+  deterministic_slots = false;
+  getValue("deterministic_slots", deterministic_slots);
+  static_walls = false;
+  getValue("static_walls", static_walls);
+  polygon_wall_file = "";
+  getValue("polygon_wall_file", polygon_wall_file);
+  int zone_count = 0;
+  getValue("resolution_zones", zone_count);
+  resolution_zones.clear();
+  for (int i_zone = 1; i_zone <= zone_count; ++i_zone) {
+    resolution_zones.push_back(getResolutionZone("resolution" + std::to_string(i_zone) + "_"));
+  }
+  domain_decomposition = "bisection";
+  getValue("domain_decomposition", domain_decomposition);
+  output_format = "vtk";
+  getValue("output_format", output_format);
+  if (output_format != "vtk" && output_format != "vtu" && output_format != "hdf5") {
+    Log(LOG_ERROR) << "Error: Unknown output format: " << output_format;
+    throw std::invalid_argument("Error: output_format must be vtk, vtu or hdf5.");
+  }
+  if (output_format == "hdf5" && !Hdf5Writer::isAvailable()) {
+    Log(LOG_ERROR) << "Error: output_format hdf5 requires TinyMPS built with \"make hdf5=yes\".";
+    throw std::invalid_argument("Error: TinyMPS was built without HDF5.");
+  }
+  hdf5_compression = 0;
+  getValue("hdf5_compression", hdf5_compression);
+  vtu_precision = 64;
+  getValue("vtu_precision", vtu_precision);
+  if (vtu_precision != 32 && vtu_precision != 64) {
+    Log(LOG_ERROR) << "Error: Unknown vtu precision: " << vtu_precision;
+    throw std::invalid_argument("Error: vtu_precision must be 32 or 64.");
+  }
+  vtu_compression = 0;
+  getValue("vtu_compression", vtu_compression);
+  if (vtu_compression > 0 && !VtuWriter::isCompressionAvailable()) {
+    Log(LOG_ERROR) << "Error: vtu_compression requires TinyMPS built with \"make zlib=yes\".";
+    throw std::invalid_argument("Error: TinyMPS was built without zlib.");
+  }
+  output_filter = getOutputFilter("output_");
+  int stream_count = 0;
+  getValue("output_streams", stream_count);
+  output_streams.clear();
+  for (int i_stream = 1; i_stream <= stream_count; ++i_stream) {
+    const std::string prefix = "output" + std::to_string(i_stream) + "_";
+    OutputStream stream;
+    stream.name = "stream" + std::to_string(i_stream);
+    getValue(prefix + "name", stream.name);
+    // Streams write <name>_<index> files next to the main output_<index> ones.
+    bool duplicate = (stream.name == "output");
+    for (const OutputStream& other : output_streams) duplicate |= (stream.name == other.name);
+    if (duplicate) {
+      Log(LOG_ERROR) << "Error: " << prefix << "name " << stream.name << " is used by another output.";
+      throw std::invalid_argument("Error: output stream names must differ from output and from each other.");
+    }
+    stream.interval = output_interval;
+    getValue(prefix + "interval", stream.interval);
+    stream.filter = getOutputFilter(prefix);
+    output_streams.push_back(stream);
+  }
+  async_output = false;
+  getValue("async_output", async_output);
+  checkpoint_interval = 0;
+  getValue("checkpoint_interval", checkpoint_interval);
+  checkpoint_file = "checkpoint.bin";
+  getValue("checkpoint_file", checkpoint_file);
+  load_balance_interval = 0;
+  getValue("load_balance_interval", load_balance_interval);
+  load_imbalance_tolerance = 1.1;
+  getValue("load_imbalance_tolerance", load_imbalance_tolerance);
+
   pnd_weight_radius = pnd_influence * average_distance;
   gradient_radius = gradient_influence * average_distance;
   laplacian_pressure_weight_radius = laplacian_pressure_influence * average_distance;
@@ -71,11 +195,10 @@ Condition::Condition(std::string path) {
 void Condition::readDataFile(std::string path) {
   std::ifstream ifs(path);
   if(ifs.fail()) {
-    std::cerr << "Error: in readDataFile() in condition.h" << std::endl;
-    std::cerr << "Failed to read files: " << path << std::endl;
+    Log(LOG_ERROR) << "Error: in readDataFile() in condition.h";
+    Log(LOG_ERROR) << "Failed to read files: " << path;
     throw std::ios_base::failure("Error: in readDataFile() in condition.h");
   }
-  std::cout << "Succeed in reading data file: " << path << std::endl;
   std::string tmp_str;
   std::regex re("\\(.*\\)");          // For removing (**)
   std::regex re2("-+\\w+-+");         // For removing like --**--
@@ -92,10 +215,41 @@ void Condition::readDataFile(std::string path) {
     item = std::regex_replace(item, re, "");
     item = std::regex_replace(item, re2, "");
     ss >> value;
+    if (data.find(item) == data.end()) items.push_back(item);
     data[item] = value;
-    std::cout << "    " << item << ": " << value << std::endl;
   }
-  std::cout << std::endl;
+}
+
+OutputFilter Condition::getOutputFilter(const std::string& prefix) const {
+  std::string fields = "all", types = "all", box = "off";
+  int stride = 1;
+  getValue(prefix + "fields", fields);
+  getValue(prefix + "types", types);
+  getValue(prefix + "box", box);
+  getValue(prefix + "stride", stride);
+  OutputFilter filter;
+  filter.parse(fields, types, box, stride);
+  return filter;
+}
+
+ResolutionZone Condition::getResolutionZone(const std::string& prefix) const {
+  std::string box = "";
+  double spacing_ratio = 1.0;
+  getValue(prefix + "box", box);
+  getValue(prefix + "spacing_ratio", spacing_ratio);
+  std::vector<double> bounds;
+  std::stringstream ss(box);
+  std::string bound;
+  while (std::getline(ss, bound, ',')) {
+    if (!bound.empty()) bounds.push_back(std::stod(bound));
+  }
+  if (bounds.size() != 6 || spacing_ratio <= 0.0) {
+    Log(LOG_ERROR) << "Error: " << prefix << "box needs 6 values: min_x,min_y,min_z,max_x,max_y,max_z, and "
+                   << prefix << "spacing_ratio must be positive.";
+    throw std::invalid_argument("Error: A resolution zone needs a box and a positive spacing ratio.");
+  }
+  return ResolutionZone(Eigen::Vector3d(bounds[0], bounds[1], bounds[2]), Eigen::Vector3d(bounds[3], bounds[4], bounds[5]),
+                        spacing_ratio);
 }
 
 int Condition::getValue(const std::string& item, int& value) const {
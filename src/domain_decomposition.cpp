@@ -0,0 +1,520 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "domain_decomposition.h"
+#include <limits>
+#include <stdexcept>
+#ifdef MPS_USE_MPI
+#include <mpi.h>
+#endif
+#include "checkpoint.h"
+#include "grid_file.h"
+#include "logger.h"
+#include "particles.h"
+
+namespace tiny_mps {
+
+namespace {
+// Doubles per particle in exchanged buffers: types, 4 vectors and 6 scalars.
+const int kRecordSize = 20;
+// Each rank gives at most this number of weighted points to rebalance().
+const int kMaxBalancePoints = 65536;
+
+Subdomain getWholeSpace() {
+  Subdomain whole;
+  whole.minpos.setConstant(-std::numeric_limits<double>::infinity());
+  whole.maxpos.setConstant(std::numeric_limits<double>::infinity());
+  return whole;
+}
+}
+
+DomainDecomposition::DomainDecomposition(const Condition& condition)
+    : condition_(condition), dimension(condition.dimension), rank(0), size(1), initialized_mpi(false), decomposed(false), halo_width(0.0) {
+#ifdef MPS_USE_MPI
+  int initialized = 0;
+  MPI_Initialized(&initialized);
+  if (!initialized) {
+    MPI_Init(nullptr, nullptr);
+    initialized_mpi = true;
+  }
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+  if (condition.domain_decomposition != "bisection" && condition.domain_decomposition != "slab") {
+    Log(LOG_ERROR) << "Error: Unknown domain decomposition: " << condition.domain_decomposition;
+    throw std::invalid_argument("Error: Unknown domain decomposition.");
+  }
+  // Only rank 0 reports progress.
+  if (rank != 0) {
+    Logger::getInstance().configure(std::min(Logger::parseLevel(condition.log_level), LOG_WARNING),
+                                    condition.log_step_interval, condition.log_async);
+  }
+  subdomains.assign(size, getWholeSpace());
+  halo_send_lists.resize(size);
+  Log(LOG_INFO) << "Domain decomposition: " << condition.domain_decomposition << " (ranks: " << size << ")";
+}
+
+DomainDecomposition::~DomainDecomposition() {
+#ifdef MPS_USE_MPI
+  if (initialized_mpi) MPI_Finalize();
+#endif
+}
+
+void DomainDecomposition::decompose(const std::string& path) {
+  if (rank == 0) {
+    const Eigen::Matrix3Xd position = GridFile(path).readPositions(dimension);
+    std::vector<WeightedPoint> points;
+    points.reserve(position.cols());
+    for (int i_particle = 0; i_particle < position.cols(); ++i_particle) {
+      points.push_back(WeightedPoint{position.col(i_particle), 1.0});
+    }
+    cut(points);
+  }
+  broadcastSubdomains();
+  decomposed = true;
+}
+
+void DomainDecomposition::decompose(Particles& particles) {
+  particles.setDomainDecomposition(this);
+  if (!decomposed) {
+    std::vector<WeightedPoint> points;
+    for (int i_particle : particles.getParticleIndex().getLiveRange()) {
+      points.push_back(WeightedPoint{particles.position.col(i_particle), getCost(particles, i_particle)});
+    }
+    cut(points);
+    decomposed = true;
+  }
+  if (!isDistributed()) return;
+  particles.removeParticles([&](int index) { return findRank(particles.position.col(index)) != rank; });
+  particles.compactStorage();
+  Log(LOG_INFO) << "Particles of rank " << rank << ": " << particles.getParticleIndex().getLiveRange().size()
+                << " (total: " << sum(static_cast<int>(particles.getParticleIndex().getLiveRange().size())) << ")";
+}
+
+void DomainDecomposition::resume(Particles& particles, CheckpointReader& reader) {
+  reader.beginSection("DomainDecomposition");
+  int checkpoint_rank, checkpoint_size;
+  reader.read(checkpoint_rank);
+  reader.read(checkpoint_size);
+  if (checkpoint_rank != rank || checkpoint_size != size) {
+    Log(LOG_ERROR) << "Error: The checkpoint was written by rank " << checkpoint_rank << " of " << checkpoint_size
+                   << ", but this is rank " << rank << " of " << size << ": " << reader.getPath();
+    throw std::invalid_argument("Error: in resume() in domain_decomposition.cpp.");
+  }
+  for (Subdomain& subdomain : subdomains) {
+    reader.read(subdomain.minpos);
+    reader.read(subdomain.maxpos);
+  }
+  particles.setDomainDecomposition(this);
+  Log(LOG_INFO) << "Particles of rank " << rank << ": " << particles.getParticleIndex().getLiveRange().size()
+                << " (total: " << sum(static_cast<int>(particles.getParticleIndex().getLiveRange().size())) << ")";
+}
+
+void DomainDecomposition::writeCheckpoint(CheckpointWriter& writer) const {
+  // Halo particles would be restored as particles of their own.
+  if (!halo_indices.empty()) {
+    Log(LOG_ERROR) << "Error: in writeCheckpoint() in domain_decomposition.cpp";
+    Log(LOG_ERROR) << "Checkpoints must be written without halo particles, e.g. before exchangeHalo().";
+    throw std::logic_error("Error: in writeCheckpoint() in domain_decomposition.cpp.");
+  }
+  writer.beginSection("DomainDecomposition");
+  writer.write(rank);
+  writer.write(size);
+  for (const Subdomain& subdomain : subdomains) {
+    writer.write(subdomain.minpos);
+    writer.write(subdomain.maxpos);
+  }
+}
+
+std::string DomainDecomposition::getRankPath(const std::string& path) const {
+  if (!isDistributed()) return path;
+  const std::string suffix = "_r" + std::to_string(rank);
+  const std::size_t name_begin = path.find_last_of("/\\") + 1;
+  const std::size_t dot = path.find_last_of('.');
+  if (dot == std::string::npos || dot < name_begin) return path + suffix;
+  return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+void DomainDecomposition::cut(std::vector<WeightedPoint>& points) {
+  const int slab_axis = (condition_.domain_decomposition == "slab") ? getLongestAxis(points, dimension) : -1;
+  bisect(points, 0, size, getWholeSpace(), slab_axis);
+}
+
+void DomainDecomposition::bisect(std::vector<WeightedPoint>& points, int rank_begin, int rank_end,
+                                 const Subdomain& box, int slab_axis) {
+  const int rank_number = rank_end - rank_begin;
+  if (rank_number == 1) {
+    subdomains[rank_begin] = box;
+    return;
+  }
+  // Slabs are cut off one at a time along a single axis.
+  const int axis = (slab_axis >= 0) ? slab_axis : getLongestAxis(points, dimension);
+  const int lower_ranks = (slab_axis >= 0) ? 1 : rank_number / 2;
+  std::sort(points.begin(), points.end(), [axis](const WeightedPoint& a, const WeightedPoint& b) {
+    return a.point(axis) < b.point(axis);
+  });
+  double total_weight = 0.0;
+  for (const WeightedPoint& point : points) total_weight += point.weight;
+  const double lower_weight = total_weight * lower_ranks / rank_number;
+  // The lower part takes the points whose centers of weight are below lower_weight.
+  int k = 0;
+  double weight = 0.0;
+  while (k < static_cast<int>(points.size()) && weight + 0.5 * points[k].weight < lower_weight) weight += points[k++].weight;
+  double cut = 0.0;
+  if (points.empty()) {
+    if (std::isfinite(box.minpos(axis)) && std::isfinite(box.maxpos(axis))) cut = 0.5 * (box.minpos(axis) + box.maxpos(axis));
+  } else if (k == 0) {
+    cut = points.front().point(axis);
+  } else if (k == static_cast<int>(points.size())) {
+    cut = std::nextafter(points.back().point(axis), std::numeric_limits<double>::infinity());
+  } else {
+    cut = 0.5 * (points[k - 1].point(axis) + points[k].point(axis));
+  }
+  auto middle = std::lower_bound(points.begin(), points.end(), cut, [axis](const WeightedPoint& a, double value) {
+    return a.point(axis) < value;
+  });
+  std::vector<WeightedPoint> upper_points(middle, points.end());
+  points.erase(middle, points.end());
+  Subdomain lower_box = box, upper_box = box;
+  lower_box.maxpos(axis) = cut;
+  upper_box.minpos(axis) = cut;
+  bisect(points, rank_begin, rank_begin + lower_ranks, lower_box, slab_axis);
+  bisect(upper_points, rank_begin + lower_ranks, rank_end, upper_box, slab_axis);
+}
+
+int DomainDecomposition::getLongestAxis(const std::vector<WeightedPoint>& points, int dimension) {
+  if (points.empty()) return 0;
+  Eigen::Vector3d minpos = points.front().point, maxpos = points.front().point;
+  for (const WeightedPoint& point : points) {
+    minpos = minpos.cwiseMin(point.point);
+    maxpos = maxpos.cwiseMax(point.point);
+  }
+  Eigen::Vector3d extent = maxpos - minpos;
+  if (dimension == 2) extent(2) = 0.0;
+  int axis;
+  extent.maxCoeff(&axis);
+  return axis;
+}
+
+double DomainDecomposition::getCost(const Particles& particles, int index) {
+  return particles.neighbor_particles(index) + 1.0;
+}
+
+int DomainDecomposition::findRank(const Eigen::Vector3d& point) const {
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    if (subdomains[i_rank].contains(point, dimension)) return i_rank;
+  }
+  return rank;
+}
+
+double DomainDecomposition::calculateHaloWidth(double max_spacing_scale) const {
+  double radius = std::max({condition_.pnd_weight_radius, condition_.gradient_radius,
+                            condition_.laplacian_pressure_weight_radius, condition_.laplacian_viscosity_weight_radius,
+                            condition_.collision_influence * condition_.average_distance});
+  // Halos are fixed within a step, in which particles move less than average_distance.
+  return radius * max_spacing_scale + condition_.average_distance;
+}
+
+void DomainDecomposition::broadcastSubdomains() {
+#ifdef MPS_USE_MPI
+  std::vector<double> values;
+  for (const Subdomain& subdomain : subdomains) {
+    for (int i_dim = 0; i_dim < 3; ++i_dim) values.push_back(subdomain.minpos(i_dim));
+    for (int i_dim = 0; i_dim < 3; ++i_dim) values.push_back(subdomain.maxpos(i_dim));
+  }
+  MPI_Bcast(values.data(), values.size(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    for (int i_dim = 0; i_dim < 3; ++i_dim) subdomains[i_rank].minpos(i_dim) = values[6 * i_rank + i_dim];
+    for (int i_dim = 0; i_dim < 3; ++i_dim) subdomains[i_rank].maxpos(i_dim) = values[6 * i_rank + 3 + i_dim];
+  }
+#endif
+}
+
+void DomainDecomposition::exchangeHalo(Particles& particles) {
+  dropHalo(particles);
+  if (!isDistributed()) return;
+  halo_width = calculateHaloWidth(particles.getMaxSpacingScale());
+  std::vector<std::vector<double> > buffers(size);
+  for (std::vector<int>& list : halo_send_lists) list.clear();
+  for (int i_particle : particles.getParticleIndex().getLiveRange()) {
+    for (int i_rank = 0; i_rank < size; ++i_rank) {
+      if (i_rank == rank || subdomains[i_rank].getDistance(particles.position.col(i_particle), dimension) >= halo_width) continue;
+      halo_send_lists[i_rank].push_back(i_particle);
+      packParticle(particles, i_particle, buffers[i_rank]);
+    }
+  }
+  std::vector<double> received = exchangeBuffers(buffers);
+  halo_indices = particles.addParticles(received.size() / kRecordSize);
+  for (int k = 0; k < static_cast<int>(halo_indices.size()); ++k) {
+    unpackParticle(particles, halo_indices[k], received.data() + k * kRecordSize, true);
+  }
+  particles.updateParticleIndex();
+  halo_flags.assign(particles.getSize(), 0);
+  for (int index : halo_indices) halo_flags[index] = 1;
+  StepLog(LOG_DEBUG) << "Halo particles: " << halo_indices.size();
+}
+
+void DomainDecomposition::updateHalo(Particles& particles) const {
+  if (!isDistributed()) return;
+  std::vector<std::vector<double> > buffers(size);
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    for (int index : halo_send_lists[i_rank]) packParticle(particles, index, buffers[i_rank]);
+  }
+  std::vector<double> received = exchangeBuffers(buffers);
+  for (int k = 0; k < static_cast<int>(halo_indices.size()); ++k) {
+    unpackParticle(particles, halo_indices[k], received.data() + k * kRecordSize, false);
+  }
+}
+
+void DomainDecomposition::updateHalo(Eigen::VectorXd& values) const {
+  if (!isDistributed()) return;
+  std::vector<std::vector<double> > buffers(size);
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    for (int index : halo_send_lists[i_rank]) buffers[i_rank].push_back(values(index));
+  }
+  std::vector<double> received = exchangeBuffers(buffers);
+  for (int k = 0; k < static_cast<int>(halo_indices.size()); ++k) values(halo_indices[k]) = received[k];
+}
+
+void DomainDecomposition::dropHalo(Particles& particles) {
+  std::vector<int> live_halo;
+  for (int index : halo_indices) {
+    if (particles.particle_types(index) != ParticleType::GHOST) live_halo.push_back(index);
+  }
+  std::sort(live_halo.begin(), live_halo.end());
+  if (!live_halo.empty()) particles.setGhostParticles(live_halo);
+  halo_indices.clear();
+  halo_flags.clear();
+  for (std::vector<int>& list : halo_send_lists) list.clear();
+}
+
+int DomainDecomposition::migrate(Particles& particles) {
+  dropHalo(particles);
+  if (!isDistributed()) return 0;
+  return sendOutside(particles, false);
+}
+
+int DomainDecomposition::rebalance(Particles& particles) {
+  dropHalo(particles);
+  if (!isDistributed()) return 0;
+  std::vector<WeightedPoint> points = gatherWeightedPoints(particles);
+  cut(points);
+  return sendOutside(particles, true);
+}
+
+bool DomainDecomposition::balanceLoad(Particles& particles, const Timer& timer) {
+  if (!isDistributed() || condition_.load_balance_interval <= 0) return false;
+  if (timer.getLoopCount() % condition_.load_balance_interval != 0) return false;
+  const double imbalance = getLoadImbalance(particles);
+  if (imbalance <= condition_.load_imbalance_tolerance) return false;
+  const int sent = sum(rebalance(particles));
+  Log(LOG_INFO) << "Rebalanced subdomains - load imbalance: " << imbalance << " -> " << getLoadImbalance(particles)
+                << ", particles moved: " << sent;
+  return true;
+}
+
+double DomainDecomposition::getLoadImbalance(const Particles& particles) const {
+  double cost = 0.0;
+  for (int i_particle : particles.getParticleIndex().getLiveRange()) {
+    if (!isHalo(i_particle)) cost += getCost(particles, i_particle);
+  }
+  const double mean_cost = sum(cost) / size;
+  return (mean_cost > 0.0) ? max(cost) / mean_cost : 1.0;
+}
+
+std::vector<DomainDecomposition::WeightedPoint> DomainDecomposition::gatherWeightedPoints(const Particles& particles) const {
+  std::vector<int> movable;
+  for (int i_particle : particles.getParticleIndex().getLiveRange()) {
+    const int type = particles.particle_types(i_particle);
+    if (type != ParticleType::INFLOW && type != ParticleType::DUMMY_INFLOW) movable.push_back(i_particle);
+  }
+  // Large ranks give every stride-th particle carrying the cost of the stride.
+  const int stride = std::max(1, static_cast<int>((movable.size() + kMaxBalancePoints - 1) / kMaxBalancePoints));
+  std::vector<double> values;
+  for (std::size_t k = 0; k < movable.size(); k += stride) {
+    double weight = 0.0;
+    for (std::size_t l = k; l < std::min(k + stride, movable.size()); ++l) weight += getCost(particles, movable[l]);
+    for (int i_dim = 0; i_dim < 3; ++i_dim) values.push_back(particles.position(i_dim, movable[k]));
+    values.push_back(weight);
+  }
+  std::vector<double> gathered = gatherAll(values);
+  std::vector<WeightedPoint> points(gathered.size() / 4);
+  for (std::size_t k = 0; k < points.size(); ++k) {
+    points[k].point = Eigen::Vector3d(gathered[4 * k], gathered[4 * k + 1], gathered[4 * k + 2]);
+    points[k].weight = gathered[4 * k + 3];
+  }
+  return points;
+}
+
+int DomainDecomposition::sendOutside(Particles& particles, bool all_types) {
+  std::vector<std::vector<double> > buffers(size);
+  std::vector<int> leaving;
+  for (int i_particle : particles.getParticleIndex().getLiveRange()) {
+    const int type = particles.particle_types(i_particle);
+    if (all_types ? (type == ParticleType::INFLOW || type == ParticleType::DUMMY_INFLOW) : type != ParticleType::NORMAL) continue;
+    int destination = findRank(particles.position.col(i_particle));
+    if (destination == rank) continue;
+    packParticle(particles, i_particle, buffers[destination]);
+    leaving.push_back(i_particle);
+  }
+  std::sort(leaving.begin(), leaving.end());
+  if (!leaving.empty()) particles.setGhostParticles(leaving);
+  std::vector<double> received = exchangeBuffers(buffers);
+  std::vector<int> arrivals = particles.addParticles(received.size() / kRecordSize);
+  for (int k = 0; k < static_cast<int>(arrivals.size()); ++k) {
+    unpackParticle(particles, arrivals[k], received.data() + k * kRecordSize, all_types);
+  }
+  if (all_types) particles.updateParticleIndex();
+  StepLog(LOG_DEBUG) << "Migrated particles - sent: " << leaving.size() << ", received: " << arrivals.size();
+  return leaving.size();
+}
+
+void DomainDecomposition::reduce(StepStats& stats) const {
+  if (!isDistributed()) return;
+  stats.max_speed = max(stats.max_speed);
+  stats.kinetic_energy = sum(stats.kinetic_energy);
+  stats.has_nan = sum(static_cast<int>(stats.has_nan)) > 0;
+  stats.normal = sum(stats.normal);
+  stats.wall = sum(stats.wall);
+  stats.dummy_wall = sum(stats.dummy_wall);
+  stats.inflow = sum(stats.inflow);
+  stats.dummy_inflow = sum(stats.dummy_inflow);
+  stats.ghost = sum(stats.ghost);
+  stats.inner = sum(stats.inner);
+  stats.surface = sum(stats.surface);
+  stats.others = sum(stats.others);
+}
+
+double DomainDecomposition::sum(double value) const {
+#ifdef MPS_USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  return value;
+}
+
+int DomainDecomposition::sum(int value) const {
+#ifdef MPS_USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  return value;
+}
+
+double DomainDecomposition::max(double value) const {
+#ifdef MPS_USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &value, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+  return value;
+}
+
+bool DomainDecomposition::solveConjugateGradient(const Eigen::SparseMatrix<double>& matrix, const Eigen::VectorXd& rhs,
+                                                 Eigen::VectorXd& x, int& iterations, double& error) const {
+  const int n = matrix.cols();
+  // Rows of halo particles are masked out of every product and sum.
+  Eigen::VectorXd owned(n);
+  for (int i = 0; i < n; ++i) owned(i) = isHalo(i) ? 0.0 : 1.0;
+  Eigen::VectorXd inverse_diagonal = matrix.diagonal();
+  for (int i = 0; i < n; ++i) inverse_diagonal(i) = (inverse_diagonal(i) != 0.0) ? 1.0 / inverse_diagonal(i) : 1.0;
+  const int max_iterations = 2 * sum(static_cast<int>(owned.sum()));
+  const double tolerance = Eigen::NumTraits<double>::epsilon();
+  x.setZero(n);
+  iterations = 0;
+  error = 0.0;
+  Eigen::VectorXd residual = rhs.cwiseProduct(owned);
+  const double rhs_norm2 = sum(residual.squaredNorm());
+  if (rhs_norm2 == 0.0) return true;
+  const double threshold = std::max(tolerance * tolerance * rhs_norm2, std::numeric_limits<double>::min());
+  double residual_norm2 = rhs_norm2;
+  Eigen::VectorXd p = inverse_diagonal.cwiseProduct(residual);
+  Eigen::VectorXd z(n), tmp(n);
+  double abs_new = sum(residual.dot(p));
+  while (iterations < max_iterations) {
+    updateHalo(p);
+    tmp = (matrix * p).cwiseProduct(owned);
+    double alpha = abs_new / sum(p.dot(tmp));
+    x += alpha * p;
+    residual -= alpha * tmp;
+    residual_norm2 = sum(residual.squaredNorm());
+    if (residual_norm2 < threshold) break;
+    z = inverse_diagonal.cwiseProduct(residual);
+    double abs_old = abs_new;
+    abs_new = sum(residual.dot(z));
+    p = z + (abs_new / abs_old) * p;
+    ++iterations;
+  }
+  updateHalo(x);
+  error = std::sqrt(residual_norm2 / rhs_norm2);
+  return error <= tolerance;
+}
+
+std::vector<double> DomainDecomposition::gatherAll(const std::vector<double>& values) const {
+#ifdef MPS_USE_MPI
+  std::vector<int> counts(size), displacements(size);
+  int count = values.size();
+  MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+  int total = 0;
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    displacements[i_rank] = total;
+    total += counts[i_rank];
+  }
+  std::vector<double> gathered(total);
+  MPI_Allgatherv(values.data(), count, MPI_DOUBLE, gathered.data(), counts.data(), displacements.data(), MPI_DOUBLE, MPI_COMM_WORLD);
+  return gathered;
+#else
+  return values;
+#endif
+}
+
+std::vector<double> DomainDecomposition::exchangeBuffers(const std::vector<std::vector<double> >& buffers) const {
+#ifdef MPS_USE_MPI
+  std::vector<int> send_counts(size), send_displacements(size), receive_counts(size), receive_displacements(size);
+  std::vector<double> sent;
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    send_displacements[i_rank] = sent.size();
+    send_counts[i_rank] = buffers[i_rank].size();
+    sent.insert(sent.end(), buffers[i_rank].begin(), buffers[i_rank].end());
+  }
+  MPI_Alltoall(send_counts.data(), 1, MPI_INT, receive_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+  int total = 0;
+  for (int i_rank = 0; i_rank < size; ++i_rank) {
+    receive_displacements[i_rank] = total;
+    total += receive_counts[i_rank];
+  }
+  std::vector<double> received(total);
+  MPI_Alltoallv(sent.data(), send_counts.data(), send_displacements.data(), MPI_DOUBLE,
+                received.data(), receive_counts.data(), receive_displacements.data(), MPI_DOUBLE, MPI_COMM_WORLD);
+  return received;
+#else
+  return buffers[rank];
+#endif
+}
+
+void DomainDecomposition::packParticle(const Particles& particles, int index, std::vector<double>& buffer) {
+  buffer.push_back(particles.particle_types(index));
+  buffer.push_back(particles.boundary_types(index));
+  for (int i_dim = 0; i_dim < 3; ++i_dim) buffer.push_back(particles.position(i_dim, index));
+  for (int i_dim = 0; i_dim < 3; ++i_dim) buffer.push_back(particles.velocity(i_dim, index));
+  for (int i_dim = 0; i_dim < 3; ++i_dim) buffer.push_back(particles.temporary_position(i_dim, index));
+  for (int i_dim = 0; i_dim < 3; ++i_dim) buffer.push_back(particles.temporary_velocity(i_dim, index));
+  buffer.push_back(particles.pressure(index));
+  buffer.push_back(particles.particle_number_density(index));
+  buffer.push_back(particles.neighbor_particles(index));
+  buffer.push_back(particles.source_term(index));
+  buffer.push_back(particles.voxel_ratio(index));
+  buffer.push_back(particles.particle_spacing(index));
+}
+
+void DomainDecomposition::unpackParticle(Particles& particles, int index, const double* record, bool with_type) {
+  if (with_type) particles.particle_types(index) = static_cast<int>(record[0]);
+  particles.boundary_types(index) = static_cast<int>(record[1]);
+  for (int i_dim = 0; i_dim < 3; ++i_dim) particles.position(i_dim, index) = record[2 + i_dim];
+  for (int i_dim = 0; i_dim < 3; ++i_dim) particles.velocity(i_dim, index) = record[5 + i_dim];
+  for (int i_dim = 0; i_dim < 3; ++i_dim) particles.temporary_position(i_dim, index) = record[8 + i_dim];
+  for (int i_dim = 0; i_dim < 3; ++i_dim) particles.temporary_velocity(i_dim, index) = record[11 + i_dim];
+  particles.pressure(index) = record[14];
+  particles.particle_number_density(index) = record[15];
+  particles.neighbor_particles(index) = static_cast<int>(record[16]);
+  particles.source_term(index) = record[17];
+  particles.voxel_ratio(index) = record[18];
+  particles.particle_spacing(index) = record[19];
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,123 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "ensemble.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <boost/format.hpp>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace tiny_mps {
+
+Ensemble::Ensemble(const Condition& base, const std::string& output_root)
+    : base_(base), output_root(output_root) {}
+
+void Ensemble::addCase(const std::string& name, const Condition::Overrides& overrides) {
+  if (std::find(names.begin(), names.end(), name) != names.end()) {
+    Log(LOG_ERROR) << "Error: Case " << name << " has already been added to the ensemble.";
+    throw std::invalid_argument("Error: in addCase() in ensemble.cpp.");
+  }
+  names.push_back(name);
+  this->overrides.push_back(overrides);
+}
+
+std::vector<EnsembleResult> Ensemble::run(const CaseFunction& function, int threads, int threads_per_case) {
+  const int case_number = getSize();
+  threads_per_case = std::max(threads_per_case, 1);
+  if (threads <= 0) threads = std::max(static_cast<int>(std::thread::hardware_concurrency()) / threads_per_case, 1);
+  threads = std::max(std::min(threads, case_number), 1);
+  Log(LOG_INFO) << "Running " << case_number << " cases on " << threads << " threads x " << threads_per_case << " OpenMP threads";
+  makeDirectory(output_root);
+  std::vector<EnsembleResult> results(case_number);
+  Logger::getInstance().configure(std::min(Logger::parseLevel(base_.log_level), LOG_WARNING), base_.log_step_interval, base_.log_async);
+  std::atomic<int> next_case(0);
+  auto work = [&]() {
+#ifdef _OPENMP
+    omp_set_num_threads(threads_per_case);
+#endif
+    for (int i_case = next_case++; i_case < case_number; i_case = next_case++) {
+      runCase(function, i_case, results[i_case]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i_thread = 1; i_thread < threads; ++i_thread) workers.emplace_back(work);
+  // The calling thread works as well, and gets its own team size back afterwards.
+#ifdef _OPENMP
+  const int caller_threads = omp_get_max_threads();
+#endif
+  work();
+#ifdef _OPENMP
+  omp_set_num_threads(caller_threads);
+#endif
+  for (std::thread& worker : workers) worker.join();
+  Logger::getInstance().configure(Logger::parseLevel(base_.log_level), base_.log_step_interval, base_.log_async);
+
+  writeSummary(output_root + "summary.txt", results);
+  int failed = 0;
+  for (const EnsembleResult& result : results) {
+    if (!result.succeeded) ++failed;
+    Log(LOG_INFO) << boost::format("%-16s %-6s steps: %d, time: %f, max velocity: %f, wall time: %.1f s")
+        % result.name % (result.succeeded ? "done" : "failed") % result.steps % result.simulated_time
+        % result.max_speed % result.wall_time;
+  }
+  if (failed > 0) Log(LOG_WARNING) << "Warning: " << failed << " of " << case_number << " cases failed.";
+  return results;
+}
+
+void Ensemble::runCase(const CaseFunction& function, int index, EnsembleResult& result) const {
+  result.name = names[index];
+  result.output_directory = output_root + names[index] + "/";
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    makeDirectory(result.output_directory);
+    Condition condition(base_, overrides[index]);
+    function(condition, result.output_directory, result);
+    result.succeeded = true;
+  } catch (const std::exception& e) {
+    result.succeeded = false;
+    result.message = e.what();
+    Log(LOG_WARNING) << "Warning: Case " << result.name << " failed: " << e.what();
+  }
+  result.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Ensemble::writeSummary(const std::string& path, const std::vector<EnsembleResult>& results) {
+  std::ofstream ofs(path);
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeSummary() in ensemble.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << path;
+    throw std::ios_base::failure("Error: in writeSummary() in ensemble.cpp.");
+  }
+  ofs << "# name status steps simulated_time max_speed particles wall_time(s) message" << std::endl;
+  for (const EnsembleResult& result : results) {
+    ofs << boost::format("%s %s %d %e %e %d %f %s") % result.name % (result.succeeded ? "done" : "failed")
+        % result.steps % result.simulated_time % result.max_speed % result.particles % result.wall_time
+        % result.message << std::endl;
+  }
+}
+
+void Ensemble::makeDirectory(const std::string& path) {
+#ifdef _WIN32
+  const int status = _mkdir(path.c_str());
+#else
+  const int status = mkdir(path.c_str(), 0755);
+#endif
+  if (status != 0 && errno != EEXIST) {
+    Log(LOG_ERROR) << "Error: in makeDirectory() in ensemble.cpp";
+    Log(LOG_ERROR) << "Failed to make directory: " << path;
+    throw std::ios_base::failure("Error: in makeDirectory() in ensemble.cpp.");
+  }
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,64 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "gradient_correction.h"
+
+namespace tiny_mps {
+
+namespace {
+// Tensors below this determinant are treated as singular.
+const double kMinDeterminant = 1.0e-10;
+}
+
+GradientCorrection::GradientCorrection(int size, int dimension)
+    : dimension(dimension) {
+  reset(size);
+}
+
+void GradientCorrection::reset(int size) {
+  inverse.setZero(6, size);
+  corrected.setZero(size);
+}
+
+bool GradientCorrection::setTensor(int index, const Eigen::Matrix3d& tensor) {
+  const double a = tensor(0, 0), b = tensor(0, 1), d = tensor(1, 1);
+  double* c = inverse.col(index).data();
+  if (dimension == 2) {
+    const double det = a * d - b * b;
+    if (det <= kMinDeterminant) {
+      corrected(index) = 0;
+      return false;
+    }
+    c[0] = d / det;  c[1] = -b / det; c[2] = 0.0;
+    c[3] = a / det;  c[4] = 0.0;
+    c[5] = 1.0;
+  } else {
+    const double e = tensor(0, 2), f = tensor(1, 2), g = tensor(2, 2);
+    const double cof_xx = d * g - f * f;
+    const double cof_xy = e * f - b * g;
+    const double cof_xz = b * f - d * e;
+    const double det = a * cof_xx + b * cof_xy + e * cof_xz;
+    if (det <= kMinDeterminant) {
+      corrected(index) = 0;
+      return false;
+    }
+    c[0] = cof_xx / det;
+    c[1] = cof_xy / det;
+    c[2] = cof_xz / det;
+    c[3] = (a * g - e * e) / det;
+    c[4] = (b * e - a * f) / det;
+    c[5] = (a * d - b * b) / det;
+  }
+  corrected(index) = 1;
+  return true;
+}
+
+Eigen::Matrix3d GradientCorrection::getMatrix(int index) const {
+  const double* c = inverse.col(index).data();
+  Eigen::Matrix3d mat;
+  mat << c[0], c[1], c[2],
+         c[1], c[3], c[4],
+         c[2], c[4], c[5];
+  return mat;
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,335 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "grid_file.h"
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "logger.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MPS_USE_MMAP
+#endif
+
+namespace tiny_mps {
+
+namespace {
+const char kMagic[8] = {'T', 'M', 'P', 'S', 'G', 'R', 'I', 'D'};
+const std::uint32_t kVersion = 1;
+const std::uint32_t kByteOrder = 0x01020304;
+// Magic, version, byte order, the number of particles and start time.
+const std::size_t kHeaderSize = 8 + 4 + 4 + 8 + 8;
+// Type, position, velocity and pressure.
+const std::size_t kParticleSize = 4 + 3 * 8 + 3 * 8 + 8;
+
+template <typename T>
+T readValue(const char* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void writeValue(std::ofstream& ofs, const T& value) {
+  ofs.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Returns 0, 1, ..., size - 1.
+std::vector<int> getAllIndices(int size) {
+  std::vector<int> indices(size);
+  for (int i = 0; i < size; ++i) indices[i] = i;
+  return indices;
+}
+
+bool isBlank(const char* begin, const char* end) {
+  for (const char* p = begin; p < end; ++p) {
+    if (!std::isspace(static_cast<unsigned char>(*p))) return false;
+  }
+  return true;
+}
+
+// Parses "type x y z u v w pressure" between begin and end, which must be followed by a character
+// other than a number, e.g. '\n' or '\0'.
+bool parseLine(const char* begin, const char* end, int& type, double (&values)[7]) {
+  char* next;
+  const long parsed_type = std::strtol(begin, &next, 10);
+  if (next == begin || next > end) return false;
+  for (int i = 0; i < 7; ++i) {
+    const char* p = next;
+    values[i] = std::strtod(p, &next);
+    if (next == p || next > end) return false;
+  }
+  type = static_cast<int>(parsed_type);
+  return true;
+}
+}
+
+GridFile::GridFile(const std::string& path)
+    : path(path), data(nullptr), length(0), mapped(false), binary(false),
+      particles_number(0), start_time(0.0), body(0) {
+#ifdef MPS_USE_MMAP
+  const int fd = open(path.c_str(), O_RDONLY);
+  struct stat status;
+  if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0) {
+    void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED) {
+      data = static_cast<const char*>(address);
+      length = status.st_size;
+      mapped = true;
+    }
+  }
+  if (fd >= 0) close(fd);
+#endif
+  if (!mapped) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (ifs.fail()) {
+      Log(LOG_ERROR) << "Error: in GridFile() in grid_file.cpp";
+      Log(LOG_ERROR) << "Failed to read files: " << path;
+      throw std::ios_base::failure("Error: in GridFile() in grid_file.cpp.");
+    }
+    const std::streamoff end = ifs.tellg();
+    if (end == -1) fail("Failed to get the size of the file");
+    length = static_cast<std::size_t>(end);
+    char* buffer = new char[length];
+    data = buffer;
+    ifs.seekg(0);
+    if (!ifs.read(buffer, length) || ifs.gcount() != static_cast<std::streamsize>(length)) {
+      release();
+      fail("Failed to read the file");
+    }
+  }
+  try {
+    readHeader();
+  } catch (...) {
+    release();
+    throw;
+  }
+}
+
+GridFile::~GridFile() {
+  release();
+}
+
+void GridFile::release() {
+  if (data == nullptr) return;
+#ifdef MPS_USE_MMAP
+  if (mapped) munmap(const_cast<char*>(data), length);
+#endif
+  if (!mapped) delete[] data;
+  data = nullptr;
+}
+
+void GridFile::readHeader() {
+  if (length >= sizeof(kMagic) && std::memcmp(data, kMagic, sizeof(kMagic)) == 0) {
+    binary = true;
+    if (length < kHeaderSize) fail("Truncated header");
+    if (readValue<std::uint32_t>(data + 8) != kVersion) {
+      fail("Unsupported version " + std::to_string(readValue<std::uint32_t>(data + 8)));
+    }
+    if (readValue<std::uint32_t>(data + 12) != kByteOrder) fail("Written on an incompatible platform");
+    const std::uint64_t size = readValue<std::uint64_t>(data + 16);
+    if (size > static_cast<std::uint64_t>(std::numeric_limits<int>::max())) fail("Too many particles");
+    if (length != kHeaderSize + size * kParticleSize) fail("The size of the file does not match the number of particles");
+    particles_number = static_cast<int>(size);
+    start_time = readValue<double>(data + 24);
+    body = kHeaderSize;
+    return;
+  }
+  // Line 0: start time, Line 1: the number of particles
+  std::string lines[2];
+  std::size_t position = 0;
+  for (std::string& line : lines) {
+    const char* end = static_cast<const char*>(std::memchr(data + position, '\n', length - position));
+    if (end == nullptr) fail("Truncated header");
+    line.assign(data + position, end);
+    position = end - data + 1;
+  }
+  char* next;
+  start_time = std::strtod(lines[0].c_str(), &next);
+  if (next == lines[0].c_str()) fail("Invalid start time: " + lines[0]);
+  const long size = std::strtol(lines[1].c_str(), &next, 10);
+  if (next == lines[1].c_str() || size < 0 || size > std::numeric_limits<int>::max()) {
+    fail("Invalid number of particles: " + lines[1]);
+  }
+  particles_number = static_cast<int>(size);
+  body = position;
+}
+
+template <typename Function>
+void GridFile::parseParticles(const std::vector<int>& indices, const Function& function) const {
+  const int count = indices.size();
+  if (binary) {
+    const char* types = data + body;
+    const char* positions = types + 4 * static_cast<std::size_t>(particles_number);
+    const char* velocities = positions + 24 * static_cast<std::size_t>(particles_number);
+    const char* pressures = velocities + 24 * static_cast<std::size_t>(particles_number);
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; ++k) {
+      const std::size_t i = indices[k];
+      double values[7];
+      for (int i_dim = 0; i_dim < 3; ++i_dim) {
+        values[i_dim] = readValue<double>(positions + 8 * (3 * i + i_dim));
+        values[3 + i_dim] = readValue<double>(velocities + 8 * (3 * i + i_dim));
+      }
+      values[6] = readValue<double>(pressures + 8 * i);
+      function(k, readValue<std::int32_t>(types + 4 * i), values);
+    }
+    return;
+  }
+  // Finds the lines first, so that they can be parsed in parallel.
+  std::vector<std::size_t> line_begins, line_ends;
+  line_begins.reserve(particles_number);
+  line_ends.reserve(particles_number);
+  std::size_t begin = body;
+  while (begin < length) {
+    const char* end = static_cast<const char*>(std::memchr(data + begin, '\n', length - begin));
+    const std::size_t end_index = (end == nullptr) ? length : end - data;
+    if (!isBlank(data + begin, data + end_index)) {
+      line_begins.push_back(begin);
+      line_ends.push_back(end_index);
+    }
+    begin = end_index + 1;
+  }
+  if (line_begins.size() != static_cast<std::size_t>(particles_number)) {
+    fail("Expected " + std::to_string(particles_number) + " particles, but found " + std::to_string(line_begins.size()));
+  }
+  int invalid_particle = -1;
+#pragma omp parallel for schedule(static)
+  for (int k = 0; k < count; ++k) {
+    const int i_particle = indices[k];
+    int type = 0;
+    double values[7];
+    bool parsed;
+    if (i_particle + 1 < particles_number) {
+      parsed = parseLine(data + line_begins[i_particle], data + line_ends[i_particle], type, values);
+    } else {
+      // strtod() could read beyond the end of the file, so the last line is parsed from a copy.
+      const std::string line(data + line_begins[i_particle], data + line_ends[i_particle]);
+      parsed = parseLine(line.c_str(), line.c_str() + line.size(), type, values);
+    }
+    if (parsed) {
+      function(k, type, values);
+      continue;
+    }
+#pragma omp critical
+    if (invalid_particle < 0 || i_particle < invalid_particle) invalid_particle = i_particle;
+  }
+  if (invalid_particle >= 0) {
+    fail("Invalid particle: " + std::string(data + line_begins[invalid_particle], data + line_ends[invalid_particle]));
+  }
+}
+
+void GridFile::read(int dimension, Eigen::VectorXi& particle_types, Eigen::Matrix3Xd& position,
+                    Eigen::Matrix3Xd& velocity, Eigen::VectorXd& pressure) const {
+  read(dimension, getAllIndices(particles_number), particle_types, position, velocity, pressure);
+}
+
+void GridFile::read(int dimension, const std::vector<int>& indices, Eigen::VectorXi& particle_types,
+                    Eigen::Matrix3Xd& position, Eigen::Matrix3Xd& velocity, Eigen::VectorXd& pressure) const {
+  const int count = indices.size();
+  if (particle_types.size() < count || position.cols() < count || velocity.cols() < count || pressure.size() < count) {
+    fail("Storage is smaller than the particles");
+  }
+  parseParticles(indices, [&](int k, int type, const double (&values)[7]) {
+    particle_types(k) = type;
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      position(i_dim, k) = values[i_dim];
+      velocity(i_dim, k) = values[3 + i_dim];
+    }
+    pressure(k) = values[6];
+  });
+  Log(LOG_DEBUG) << "Read " << count << " of " << particles_number << " particles from " << (binary ? "binary " : "")
+                 << "grid file: " << path;
+}
+
+std::vector<int> GridFile::selectParticles(int dimension, const std::function<bool(const Eigen::Vector3d&)>& predicate) const {
+  std::vector<char> selected(particles_number, 0);
+  parseParticles(getAllIndices(particles_number), [&](int k, int, const double (&values)[7]) {
+    Eigen::Vector3d point = Eigen::Vector3d::Zero();
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) point(i_dim) = values[i_dim];
+    selected[k] = predicate(point);
+  });
+  std::vector<int> indices;
+  for (int i_particle = 0; i_particle < particles_number; ++i_particle) {
+    if (selected[i_particle]) indices.push_back(i_particle);
+  }
+  return indices;
+}
+
+Eigen::Matrix3Xd GridFile::readPositions(int dimension) const {
+  Eigen::Matrix3Xd position = Eigen::Matrix3Xd::Zero(3, particles_number);
+  parseParticles(getAllIndices(particles_number), [&](int k, int, const double (&values)[7]) {
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) position(i_dim, k) = values[i_dim];
+  });
+  return position;
+}
+
+void GridFile::writeBinary(const std::string& path, double start_time, int size, const Eigen::VectorXi& particle_types,
+                           const Eigen::Matrix3Xd& position, const Eigen::Matrix3Xd& velocity,
+                           const Eigen::VectorXd& pressure) {
+  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeBinary() in grid_file.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << path;
+    throw std::ios_base::failure("Error: in writeBinary() in grid_file.cpp.");
+  }
+  ofs.write(kMagic, sizeof(kMagic));
+  writeValue(ofs, kVersion);
+  writeValue(ofs, kByteOrder);
+  writeValue<std::uint64_t>(ofs, size);
+  writeValue(ofs, start_time);
+  for (int i_particle = 0; i_particle < size; ++i_particle) writeValue<std::int32_t>(ofs, particle_types(i_particle));
+  ofs.write(reinterpret_cast<const char*>(position.data()), 3 * sizeof(double) * size);
+  ofs.write(reinterpret_cast<const char*>(velocity.data()), 3 * sizeof(double) * size);
+  ofs.write(reinterpret_cast<const char*>(pressure.data()), sizeof(double) * size);
+  ofs.close();
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeBinary() in grid_file.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << path;
+    throw std::ios_base::failure("Error: in writeBinary() in grid_file.cpp.");
+  }
+  Log(LOG_INFO) << "Succeed in writing grid file: " << path;
+}
+
+void GridFile::writeText(const std::string& path, double start_time, int size, const Eigen::VectorXi& particle_types,
+                         const Eigen::Matrix3Xd& position, const Eigen::Matrix3Xd& velocity,
+                         const Eigen::VectorXd& pressure) {
+  std::ofstream ofs(path, std::ios::trunc);
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeText() in grid_file.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << path;
+    throw std::ios_base::failure("Error: in writeText() in grid_file.cpp.");
+  }
+  // Full precision, so that converting back gives the same values.
+  ofs << std::setprecision(17);
+  ofs << start_time << "\n" << size << "\n";
+  for (int i_particle = 0; i_particle < size; ++i_particle) {
+    ofs << particle_types(i_particle) << " "
+        << position(0, i_particle) << " " << position(1, i_particle) << " " << position(2, i_particle) << " "
+        << velocity(0, i_particle) << " " << velocity(1, i_particle) << " " << velocity(2, i_particle) << " "
+        << pressure(i_particle) << "\n";
+  }
+  ofs.close();
+  if (ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeText() in grid_file.cpp";
+    Log(LOG_ERROR) << "Failed to write files: " << path;
+    throw std::ios_base::failure("Error: in writeText() in grid_file.cpp.");
+  }
+  Log(LOG_INFO) << "Succeed in writing grid file: " << path;
+}
+
+void GridFile::fail(const std::string& message) const {
+  Log(LOG_ERROR) << "Error: in grid_file.cpp";
+  Log(LOG_ERROR) << message << ": " << path;
+  throw std::runtime_error("Error: in grid_file.cpp.");
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,301 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "hdf5_writer.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <boost/format.hpp>
+#include "logger.h"
+#ifdef MPS_USE_HDF5
+#include <hdf5.h>
+#endif
+
+namespace tiny_mps {
+
+#ifdef MPS_USE_HDF5
+namespace {
+// Rows of a chunk. Chunks of 3 columns take 384 KiB.
+const hsize_t kChunkRows = 16384;
+// Closes the collection of an XDMF file. Each output is written over it and writes it again.
+const char kXdmfFooter[] = "    </Grid>\n  </Domain>\n</Xdmf>\n";
+static_assert(sizeof(hid_t) == sizeof(std::int64_t), "hid_t is kept as std::int64_t.");
+
+void fail(const std::string& what) {
+  Log(LOG_ERROR) << "Error: in hdf5_writer.cpp";
+  Log(LOG_ERROR) << "Failed to " << what;
+  throw std::runtime_error("Error: in hdf5_writer.cpp.");
+}
+
+// Closes an HDF5 identifier when it goes out of scope.
+class Handle {
+ public:
+  Handle(hid_t id, herr_t (*close)(hid_t), const std::string& what) : id(id), close(close) {
+    if (id < 0) fail(what);
+  }
+  Handle(const Handle&) = delete;
+  Handle& operator=(const Handle&) = delete;
+  ~Handle() { close(id); }
+  operator hid_t() const { return id; }
+ private:
+  hid_t id;
+  herr_t (*close)(hid_t);
+};
+
+void check(herr_t status, const std::string& what) {
+  if (status < 0) fail(what);
+}
+
+herr_t collectLink(hid_t, const char* name, const H5L_info_t*, void* names) {
+  static_cast<std::vector<std::string>*>(names)->push_back(name);
+  return 0;
+}
+
+// Returns the index of name if it is prefix followed by digits, or -1.
+int parseIndex(const std::string& name, const std::string& prefix) {
+  if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) return -1;
+  for (std::size_t i = prefix.size(); i < name.size(); ++i) {
+    if (!std::isdigit(static_cast<unsigned char>(name[i]))) return -1;
+  }
+  return std::stoi(name.substr(prefix.size()));
+}
+
+// Returns the outputs of prefix in the file as (index, name), sorted by index.
+std::vector<std::pair<int, std::string> > listOutputs(hid_t file, const std::string& prefix) {
+  std::vector<std::string> names;
+  check(H5Literate(file, H5_INDEX_NAME, H5_ITER_INC, nullptr, collectLink, &names), "list groups");
+  std::vector<std::pair<int, std::string> > outputs;
+  for (const std::string& name : names) {
+    int index = parseIndex(name, prefix);
+    if (index >= 0) outputs.push_back(std::make_pair(index, name));
+  }
+  std::sort(outputs.begin(), outputs.end());
+  return outputs;
+}
+
+// Writes a dataset of rows x columns (or rows if columns is 0) in row-major order.
+void writeDataset(hid_t group, const std::string& name, hid_t type, const void* data,
+                  hsize_t rows, hsize_t columns, int compression) {
+  const int rank = (columns == 0) ? 1 : 2;
+  const hsize_t dims[2] = {rows, columns};
+  Handle space(H5Screate_simple(rank, dims, nullptr), H5Sclose, "create a dataspace");
+  Handle properties(H5Pcreate(H5P_DATASET_CREATE), H5Pclose, "create dataset properties");
+  if (rows > 0) {
+    const hsize_t chunk[2] = {std::min(rows, kChunkRows), columns};
+    check(H5Pset_chunk(properties, rank, chunk), "set chunks");
+    if (compression > 0) {
+      check(H5Pset_shuffle(properties), "set the shuffle filter");
+      check(H5Pset_deflate(properties, compression), "set compression");
+    }
+  }
+  Handle dataset(H5Dcreate2(group, name.c_str(), type, space, H5P_DEFAULT, properties, H5P_DEFAULT),
+                 H5Dclose, "create dataset " + name);
+  if (rows > 0) check(H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data), "write dataset " + name);
+}
+
+void writeAttribute(hid_t object, const std::string& name, const double* values, hsize_t size) {
+  Handle space(H5Screate_simple(1, &size, nullptr), H5Sclose, "create a dataspace");
+  Handle attribute(H5Acreate2(object, name.c_str(), H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT),
+                   H5Aclose, "create attribute " + name);
+  check(H5Awrite(attribute, H5T_NATIVE_DOUBLE, values), "write attribute " + name);
+}
+
+void writeAttribute(hid_t object, const std::string& name, const std::string& value) {
+  Handle type(H5Tcopy(H5T_C_S1), H5Tclose, "copy a string type");
+  check(H5Tset_size(type, std::max<std::size_t>(value.size(), 1)), "set a string size");
+  Handle space(H5Screate(H5S_SCALAR), H5Sclose, "create a dataspace");
+  Handle attribute(H5Acreate2(object, name.c_str(), type, space, H5P_DEFAULT, H5P_DEFAULT),
+                   H5Aclose, "create attribute " + name);
+  check(H5Awrite(attribute, type, value.c_str()), "write attribute " + name);
+}
+
+std::string readStringAttribute(hid_t object, const std::string& name) {
+  Handle attribute(H5Aopen(object, name.c_str(), H5P_DEFAULT), H5Aclose, "open attribute " + name);
+  Handle type(H5Aget_type(attribute), H5Tclose, "get the type of attribute " + name);
+  std::string value(H5Tget_size(type), '\0');
+  check(H5Aread(attribute, type, &value[0]), "read attribute " + name);
+  return value.substr(0, value.find('\0'));
+}
+
+std::string getDataItem(const std::string& dimensions, const std::string& number_type, int precision,
+                        const std::string& h5_name, const std::string& dataset) {
+  return (boost::format("<DataItem Dimensions=\"%s\" NumberType=\"%s\" Precision=\"%d\" Format=\"HDF\">%s:%s</DataItem>")
+          % dimensions % number_type % precision % h5_name % dataset).str();
+}
+
+std::string getFileName(const std::string& path) {
+  return path.substr(path.find_last_of("/\\") + 1);
+}
+}
+#endif
+
+Hdf5Writer::Hdf5Writer(const std::string& series_path, int compression)
+    : series_path(series_path), compression(std::min(std::max(compression, 0), 9)), file(-1) {
+  particles.prefix = "Step_";
+  particles.name = "Particles";
+  particles.xmf_path = series_path + ".xmf";
+  grid.prefix = "Grid_";
+  grid.name = "Grid";
+  grid.xmf_path = series_path + "_grid.xmf";
+}
+
+Hdf5Writer::~Hdf5Writer() {
+#ifdef MPS_USE_HDF5
+  if (file >= 0) H5Fclose(file);
+#endif
+}
+
+bool Hdf5Writer::isAvailable() {
+#ifdef MPS_USE_HDF5
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef MPS_USE_HDF5
+void Hdf5Writer::openFile(bool truncate) {
+  if (file >= 0) return;
+  const std::string h5_path = series_path + ".h5";
+  // Errors are reported by fail() instead of the stack printed by HDF5.
+  H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+  if (!truncate && std::ifstream(h5_path).good()) {
+    file = H5Fopen(h5_path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+  } else {
+    // The free space is kept in the file, so outputs written after a restart take that of those it removed.
+    Handle properties(H5Pcreate(H5P_FILE_CREATE), H5Pclose, "create file properties");
+    check(H5Pset_file_space_strategy(properties, H5F_FSPACE_STRATEGY_FSM_AGGR, 1, 1), "set the file space strategy");
+    file = H5Fcreate(h5_path.c_str(), H5F_ACC_TRUNC, properties, H5P_DEFAULT);
+    std::remove(particles.xmf_path.c_str());
+    std::remove(grid.xmf_path.c_str());
+  }
+  if (file < 0) fail("open files: " + h5_path);
+}
+
+void Hdf5Writer::beginSeries(Series& series, int index) {
+  if (series.xmf.is_open()) return;
+  std::ostringstream xmf;
+  xmf << "<?xml version=\"1.0\" ?>\n";
+  xmf << "<!DOCTYPE Xdmf SYSTEM \"Xdmf.dtd\" []>\n";
+  xmf << "<Xdmf Version=\"2.0\">\n";
+  xmf << "  <Domain>\n";
+  xmf << "    <Grid Name=\"" << series.name << "\" GridType=\"Collection\" CollectionType=\"Temporal\">\n";
+  for (const auto& output : listOutputs(file, series.prefix)) {
+    if (output.first >= index) {
+      check(H5Ldelete(file, output.second.c_str(), H5P_DEFAULT), "remove " + output.second);
+      continue;
+    }
+    Handle group(H5Gopen2(file, output.second.c_str(), H5P_DEFAULT), H5Gclose, "open " + output.second);
+    xmf << readStringAttribute(group, "Xdmf");
+  }
+  xmf << kXdmfFooter;
+  series.xmf.open(series.xmf_path, std::ios::in | std::ios::out | std::ios::trunc);
+  if (series.xmf.fail()) fail("write files: " + series.xmf_path);
+  series.xmf << xmf.str();
+}
+
+void Hdf5Writer::endOutput(Series& series, const std::string& entry) {
+  series.xmf.seekp(-static_cast<std::streamoff>(sizeof(kXdmfFooter) - 1), std::ios::end);
+  series.xmf << entry << kXdmfFooter;
+  series.xmf.flush();
+  if (series.xmf.fail()) fail("write files: " + series.xmf_path);
+  check(H5Fflush(file, H5F_SCOPE_LOCAL), "flush files: " + series_path + ".h5");
+}
+
+void Hdf5Writer::writeParticles(int index, double time, const ParticleSnapshot& snapshot) {
+  const std::string h5_path = series_path + ".h5";
+  const std::string h5_name = getFileName(h5_path);
+  const std::string name = (boost::format("%s%04d") % particles.prefix % index).str();
+  const hsize_t size = snapshot.getSize();
+  openFile(index == 0);
+  beginSeries(particles, index);
+  Handle group(H5Gcreate2(file, name.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Gclose, "create " + name);
+  writeAttribute(group, "Time", &time, 1);
+
+  std::ostringstream xdmf;
+  const std::string vector_dimensions = (boost::format("%d 3") % size).str();
+  const std::string scalar_dimensions = (boost::format("%d") % size).str();
+  xdmf << "      <Grid Name=\"" << name << "\" GridType=\"Uniform\">\n";
+  xdmf << "        <Time Value=\"" << boost::format("%.17g") % time << "\"/>\n";
+  xdmf << "        <Topology TopologyType=\"Polyvertex\" NumberOfElements=\"" << size << "\" NodesPerElement=\"1\"/>\n";
+  xdmf << "        <Geometry GeometryType=\"XYZ\">\n";
+  xdmf << "          " << getDataItem(vector_dimensions, "Float", 8, h5_name, "/" + name + "/Points") << "\n";
+  xdmf << "        </Geometry>\n";
+  writeDataset(group, "Points", H5T_NATIVE_DOUBLE, snapshot.getPosition().data(), size, 3, compression);
+  for (const ParticleSnapshot::Field& field : snapshot.getFields()) {
+    const std::string dataset = "/" + name + "/" + field.name;
+    switch (field.kind) {
+      case ParticleSnapshot::DOUBLE_SCALAR:
+        writeDataset(group, field.name, H5T_NATIVE_DOUBLE, field.doubles.data(), size, 0, compression);
+        xdmf << "        <Attribute Name=\"" << field.name << "\" AttributeType=\"Scalar\" Center=\"Node\">\n";
+        xdmf << "          " << getDataItem(scalar_dimensions, "Float", 8, h5_name, dataset) << "\n";
+        break;
+      case ParticleSnapshot::INT_SCALAR:
+        writeDataset(group, field.name, H5T_NATIVE_INT, field.ints.data(), size, 0, compression);
+        xdmf << "        <Attribute Name=\"" << field.name << "\" AttributeType=\"Scalar\" Center=\"Node\">\n";
+        xdmf << "          " << getDataItem(scalar_dimensions, "Int", sizeof(int), h5_name, dataset) << "\n";
+        break;
+      case ParticleSnapshot::DOUBLE_VECTOR:
+        writeDataset(group, field.name, H5T_NATIVE_DOUBLE, field.vectors.data(), size, 3, compression);
+        xdmf << "        <Attribute Name=\"" << field.name << "\" AttributeType=\"Vector\" Center=\"Node\">\n";
+        xdmf << "          " << getDataItem(vector_dimensions, "Float", 8, h5_name, dataset) << "\n";
+        break;
+    }
+    xdmf << "        </Attribute>\n";
+  }
+  xdmf << "      </Grid>\n";
+  writeAttribute(group, "Xdmf", xdmf.str());
+  endOutput(particles, xdmf.str());
+  Log(LOG_INFO) << "Succeed in writing hdf5 file: " << h5_path << ":/" << name;
+}
+
+void Hdf5Writer::writeGrid(int index, double time, const std::vector<double>& values, int width, int height,
+                           const Eigen::Vector3d& origin, double spacing) {
+  if (values.size() != static_cast<std::size_t>(width) * height) {
+    fail("write a grid of " + std::to_string(values.size()) + " values for " + std::to_string(width) + " x " + std::to_string(height));
+  }
+  const std::string h5_path = series_path + ".h5";
+  const std::string h5_name = getFileName(h5_path);
+  const std::string name = (boost::format("%s%04d") % grid.prefix % index).str();
+  openFile(false);
+  beginSeries(grid, index);
+  Handle group(H5Gcreate2(file, name.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT), H5Gclose, "create " + name);
+  writeAttribute(group, "Time", &time, 1);
+  writeAttribute(group, "Origin", origin.data(), 3);
+  writeAttribute(group, "Spacing", &spacing, 1);
+  writeDataset(group, "Pressure", H5T_NATIVE_DOUBLE, values.data(), height, width, compression);
+
+  // XDMF lists the slowest axis (y) first.
+  std::ostringstream xdmf;
+  xdmf << "      <Grid Name=\"" << name << "\" GridType=\"Uniform\">\n";
+  xdmf << "        <Time Value=\"" << boost::format("%.17g") % time << "\"/>\n";
+  xdmf << "        <Topology TopologyType=\"2DCoRectMesh\" Dimensions=\"" << height << " " << width << "\"/>\n";
+  xdmf << "        <Geometry GeometryType=\"ORIGIN_DXDY\">\n";
+  xdmf << "          <DataItem Dimensions=\"2\" NumberType=\"Float\" Precision=\"8\" Format=\"XML\">"
+       << boost::format("%.17g %.17g") % origin(1) % origin(0) << "</DataItem>\n";
+  xdmf << "          <DataItem Dimensions=\"2\" NumberType=\"Float\" Precision=\"8\" Format=\"XML\">"
+       << boost::format("%.17g %.17g") % spacing % spacing << "</DataItem>\n";
+  xdmf << "        </Geometry>\n";
+  xdmf << "        <Attribute Name=\"Pressure\" AttributeType=\"Scalar\" Center=\"Node\">\n";
+  xdmf << "          " << getDataItem((boost::format("%d %d") % height % width).str(), "Float", 8, h5_name, "/" + name + "/Pressure") << "\n";
+  xdmf << "        </Attribute>\n";
+  xdmf << "      </Grid>\n";
+  writeAttribute(group, "Xdmf", xdmf.str());
+  endOutput(grid, xdmf.str());
+  Log(LOG_INFO) << "Succeed in writing hdf5 file: " << h5_path << ":/" << name;
+}
+#else
+void Hdf5Writer::writeParticles(int, double, const ParticleSnapshot&) {
+  Log(LOG_ERROR) << "Error: TinyMPS was built without HDF5. Build it with \"make hdf5=yes\".";
+  throw std::runtime_error("Error: in writeParticles() in hdf5_writer.cpp.");
+}
+
+void Hdf5Writer::writeGrid(int, double, const std::vector<double>&, int, int, const Eigen::Vector3d&, double) {
+  Log(LOG_ERROR) << "Error: TinyMPS was built without HDF5. Build it with \"make hdf5=yes\".";
+  throw std::runtime_error("Error: in writeGrid() in hdf5_writer.cpp.");
+}
+#endif
+
+} // namespace tiny_mps
@@ -0,0 +1,116 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "logger.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace tiny_mps {
+
+namespace {
+// Pending lines are sent to the sink when the buffer grows beyond this size.
+const std::size_t kBufferSize = 1 << 16;
+}
+
+Logger& Logger::getInstance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger()
+    : level(LOG_INFO), step_interval(1), step(0), async(false), writing(false), stopping(false) {}
+
+Logger::~Logger() {
+  flush();
+  configure(level, step_interval, false);
+}
+
+void Logger::configure(LogLevel level, int step_interval, bool async) {
+  flush();
+  this->level = level;
+  this->step_interval = step_interval;
+  if (async == this->async) return;
+  if (async) {
+    stopping = false;
+    sink_thread = std::thread(&Logger::runSink, this);
+  } else {
+    {
+      std::lock_guard<std::mutex> lock(sink_mutex);
+      stopping = true;
+    }
+    sink_condition.notify_all();
+    sink_thread.join();
+  }
+  this->async = async;
+}
+
+LogLevel Logger::parseLevel(const std::string& name) {
+  std::string tmp = name;
+  std::transform(tmp.begin(), tmp.end(), tmp.begin(), ::tolower);
+  if (tmp == "quiet" || tmp == "error") return LOG_ERROR;
+  if (tmp == "warning") return LOG_WARNING;
+  if (tmp == "info") return LOG_INFO;
+  if (tmp == "debug") return LOG_DEBUG;
+  std::cerr << "Error: Unknown log level: " << name << std::endl;
+  throw std::invalid_argument("Error: Unknown log level.");
+}
+
+void Logger::write(LogLevel level, const std::string& line) {
+  if (level == LOG_ERROR) {
+    flush();
+    std::cerr << line << std::endl;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(buffer_mutex);
+  buffer += line;
+  buffer += '\n';
+  if (buffer.size() >= kBufferSize) sendBuffer();
+}
+
+void Logger::flush() {
+  {
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    sendBuffer();
+  }
+  if (async) {
+    std::unique_lock<std::mutex> lock(sink_mutex);
+    drained_condition.wait(lock, [this] { return blocks.empty() && !writing; });
+  }
+  std::cout.flush();
+}
+
+// Called with buffer_mutex held.
+void Logger::sendBuffer() {
+  if (buffer.empty()) return;
+  if (!async) {
+    std::cout.write(buffer.data(), buffer.size());
+    buffer.clear();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    blocks.push_back(std::string());
+    blocks.back().swap(buffer);
+  }
+  sink_condition.notify_one();
+}
+
+void Logger::runSink() {
+  std::unique_lock<std::mutex> lock(sink_mutex);
+  while (true) {
+    sink_condition.wait(lock, [this] { return stopping || !blocks.empty(); });
+    if (blocks.empty() && stopping) break;
+    std::string block;
+    block.swap(blocks.front());
+    blocks.pop_front();
+    writing = true;
+    lock.unlock();
+    std::cout.write(block.data(), block.size());
+    std::cout.flush();
+    lock.lock();
+    writing = false;
+    drained_condition.notify_all();
+  }
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,106 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "output_filter.h"
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include "logger.h"
+#include "particles.h"
+
+namespace tiny_mps {
+
+namespace {
+// The fields Particles and its subclasses add to snapshots.
+const char* const kFieldNames[] = {
+  "Pressure", "Velocity", "Type", "ParticleNumberDensity", "NeighborParticles", "BoundaryCondition",
+  "CorrectionVelocity", "SourceTerm", "VoxelsRatio",
+  // BubbleParticles
+  "AveragePressure", "NormalVector", "BubbleRadius", "VoidFraction", "FreeSurfaceType", "ModifiedParticleNumberDensity"
+};
+
+std::vector<std::string> splitList(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) items.push_back(item);
+  }
+  return items;
+}
+
+void fail(const std::string& message) {
+  Log(LOG_ERROR) << "Error: in parse() in output_filter.cpp";
+  Log(LOG_ERROR) << message;
+  throw std::invalid_argument("Error: in parse() in output_filter.cpp.");
+}
+
+int parseParticleType(const std::string& name) {
+  if (name == "normal") return ParticleType::NORMAL;
+  if (name == "wall") return ParticleType::WALL;
+  if (name == "dummy_wall") return ParticleType::DUMMY_WALL;
+  if (name == "inflow") return ParticleType::INFLOW;
+  if (name == "dummy_inflow") return ParticleType::DUMMY_INFLOW;
+  if (name == "ghost") return ParticleType::GHOST;
+  fail("Unknown particle type: " + name);
+  return ParticleType::GHOST;
+}
+}
+
+void OutputFilter::parse(const std::string& fields, const std::string& types, const std::string& box, int stride) {
+  this->fields.clear();
+  if (fields != "all") this->fields = splitList(fields);
+  for (const std::string& field : this->fields) {
+    if (!isFieldName(field)) fail("Unknown field: " + field);
+  }
+  particle_types.clear();
+  if (types != "all") {
+    for (const std::string& type : splitList(types)) particle_types.push_back(parseParticleType(type));
+  }
+  has_box = (box != "off");
+  if (has_box) {
+    const std::vector<std::string> bounds = splitList(box);
+    if (bounds.size() != 6) fail("A box needs 6 values: " + box);
+    for (int i = 0; i < 3; ++i) {
+      box_min(i) = std::stod(bounds[i]);
+      box_max(i) = std::stod(bounds[i + 3]);
+    }
+  }
+  if (stride < 1) fail("A stride must be positive: " + std::to_string(stride));
+  this->stride = stride;
+}
+
+bool OutputFilter::selectsAllParticles() const {
+  return particle_types.empty() && !has_box && stride == 1;
+}
+
+bool OutputFilter::selectsField(const std::string& name) const {
+  if (!isFieldName(name)) {
+    Log(LOG_ERROR) << "Error: in selectsField() in output_filter.cpp";
+    Log(LOG_ERROR) << "Field not listed in kFieldNames: " << name;
+    throw std::logic_error("Error: in selectsField() in output_filter.cpp.");
+  }
+  return fields.empty() || std::find(fields.begin(), fields.end(), name) != fields.end();
+}
+
+bool OutputFilter::isFieldName(const std::string& name) {
+  return std::find(std::begin(kFieldNames), std::end(kFieldNames), name) != std::end(kFieldNames);
+}
+
+std::vector<int> OutputFilter::selectParticles(const Eigen::Matrix3Xd& position,
+                                               const Eigen::VectorXi& particle_types) const {
+  std::vector<int> indices;
+  int count = 0;
+  for (int i_particle = 0; i_particle < position.cols(); ++i_particle) {
+    if (!this->particle_types.empty() &&
+        std::find(this->particle_types.begin(), this->particle_types.end(), particle_types(i_particle))
+        == this->particle_types.end()) continue;
+    if (has_box && ((position.col(i_particle).array() < box_min.array()).any() ||
+                    (position.col(i_particle).array() > box_max.array()).any())) continue;
+    if (count++ % stride != 0) continue;
+    indices.push_back(i_particle);
+  }
+  return indices;
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,252 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "pair_kernels.h"
+#include <cmath>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace tiny_mps {
+
+void AlignedCoordinates::assign(const Eigen::Matrix3Xd& coordinates) {
+  size = coordinates.cols();
+  padded_size = (size + 7) / 8 * 8;
+  if (data.size() != 3 * padded_size) data.setZero(3 * padded_size);
+  for (int i_dim = 0; i_dim < 3; ++i_dim) {
+    data.segment(i_dim * padded_size, size) = coordinates.row(i_dim).transpose();
+  }
+}
+
+namespace pair_kernels {
+
+namespace {
+
+inline double squaredDistance(const AlignedCoordinates& coordinates, int i, int j,
+                              double& dx, double& dy, double& dz) {
+  dx = coordinates.x()[j] - coordinates.x()[i];
+  dy = coordinates.y()[j] - coordinates.y()[i];
+  dz = coordinates.z()[j] - coordinates.z()[i];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+inline double horizontalSum(__m256d vec) {
+  __m128d low = _mm_add_pd(_mm256_castpd256_pd128(vec), _mm256_extractf128_pd(vec, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+#endif
+
+// Masked forms of gathers, square roots and extractions avoid the undefined
+// source operands of the plain intrinsics.
+#if defined(__AVX512F__)
+inline __m512d gather(const double* base, __m256i idx) {
+  return _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, idx, base, 8);
+}
+
+inline __m512d squareRoot(__m512d vec) {
+  return _mm512_maskz_sqrt_pd(0xFF, vec);
+}
+
+inline double horizontalSum(__m512d vec) {
+  return horizontalSum(_mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, vec, 0), _mm512_maskz_extractf64x4_pd(0xF, vec, 1)));
+}
+#elif defined(__AVX2__)
+inline __m256d gather(const double* base, __m128i idx) {
+  const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+  return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, idx, all, 8);
+}
+#endif
+
+} // namespace
+
+const char* getInstructionSet() {
+#if defined(__AVX512F__)
+  return "AVX-512";
+#elif defined(__AVX2__)
+  return "AVX2";
+#else
+  return "scalar";
+#endif
+}
+
+int filterNeighbors(const AlignedCoordinates& coordinates, int index,
+                    const int* candidates, int candidate_size, double radius, int* neighbors) {
+  const double r2_max = radius * radius;
+  int count = 0;
+  int k = 0;
+#if defined(__AVX512F__)
+  const __m512d xi = _mm512_set1_pd(coordinates.x()[index]);
+  const __m512d yi = _mm512_set1_pd(coordinates.y()[index]);
+  const __m512d zi = _mm512_set1_pd(coordinates.z()[index]);
+  const __m512d r2_max_v = _mm512_set1_pd(r2_max);
+  for (; k + 8 <= candidate_size; k += 8) {
+    __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(candidates + k));
+    __m512d dx = _mm512_sub_pd(gather(coordinates.x(), idx), xi);
+    __m512d dy = _mm512_sub_pd(gather(coordinates.y(), idx), yi);
+    __m512d dz = _mm512_sub_pd(gather(coordinates.z(), idx), zi);
+    __m512d r2 = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_add_pd(_mm512_mul_pd(dy, dy), _mm512_mul_pd(dz, dz)));
+    __mmask8 mask = _mm512_cmp_pd_mask(r2, r2_max_v, _CMP_LT_OQ);
+    int block[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(block), idx);
+    for (int lane = 0; lane < 8; ++lane) {
+      if ((mask >> lane) & 1) neighbors[count++] = block[lane];
+    }
+  }
+#elif defined(__AVX2__)
+  const __m256d xi = _mm256_set1_pd(coordinates.x()[index]);
+  const __m256d yi = _mm256_set1_pd(coordinates.y()[index]);
+  const __m256d zi = _mm256_set1_pd(coordinates.z()[index]);
+  const __m256d r2_max_v = _mm256_set1_pd(r2_max);
+  for (; k + 4 <= candidate_size; k += 4) {
+    __m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(candidates + k));
+    __m256d dx = _mm256_sub_pd(gather(coordinates.x(), idx), xi);
+    __m256d dy = _mm256_sub_pd(gather(coordinates.y(), idx), yi);
+    __m256d dz = _mm256_sub_pd(gather(coordinates.z(), idx), zi);
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_add_pd(_mm256_mul_pd(dy, dy), _mm256_mul_pd(dz, dz)));
+    int mask = _mm256_movemask_pd(_mm256_cmp_pd(r2, r2_max_v, _CMP_LT_OQ));
+    int block[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(block), idx);
+    for (int lane = 0; lane < 4; ++lane) {
+      if ((mask >> lane) & 1) neighbors[count++] = block[lane];
+    }
+  }
+#endif
+  for (; k < candidate_size; ++k) {
+    int j_particle = candidates[k];
+    double dx, dy, dz;
+    if (squaredDistance(coordinates, index, j_particle, dx, dy, dz) < r2_max) neighbors[count++] = j_particle;
+  }
+  return count;
+}
+
+double sumParticleNumberDensity(const AlignedCoordinates& coordinates, int index,
+                                const int* candidates, int candidate_size, double radius, int& count) {
+  const double r2_max = radius * radius;
+  double pnd = 0.0;
+  count = 0;
+  int k = 0;
+#if defined(__AVX512F__)
+  const __m512d xi = _mm512_set1_pd(coordinates.x()[index]);
+  const __m512d yi = _mm512_set1_pd(coordinates.y()[index]);
+  const __m512d zi = _mm512_set1_pd(coordinates.z()[index]);
+  const __m512d r2_max_v = _mm512_set1_pd(r2_max);
+  const __m512d radius_v = _mm512_set1_pd(radius);
+  const __m512d one = _mm512_set1_pd(1.0);
+  __m512d sum = _mm512_setzero_pd();
+  for (; k + 8 <= candidate_size; k += 8) {
+    __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(candidates + k));
+    __m512d dx = _mm512_sub_pd(gather(coordinates.x(), idx), xi);
+    __m512d dy = _mm512_sub_pd(gather(coordinates.y(), idx), yi);
+    __m512d dz = _mm512_sub_pd(gather(coordinates.z(), idx), zi);
+    __m512d r2 = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_add_pd(_mm512_mul_pd(dy, dy), _mm512_mul_pd(dz, dz)));
+    __mmask8 mask = _mm512_cmp_pd_mask(r2, r2_max_v, _CMP_LT_OQ);
+    __m512d weight = _mm512_sub_pd(_mm512_div_pd(radius_v, squareRoot(r2)), one);
+    sum = _mm512_mask_add_pd(sum, mask, sum, weight);
+    count += __builtin_popcount(mask);
+  }
+  pnd = horizontalSum(sum);
+#elif defined(__AVX2__)
+  const __m256d xi = _mm256_set1_pd(coordinates.x()[index]);
+  const __m256d yi = _mm256_set1_pd(coordinates.y()[index]);
+  const __m256d zi = _mm256_set1_pd(coordinates.z()[index]);
+  const __m256d r2_max_v = _mm256_set1_pd(r2_max);
+  const __m256d radius_v = _mm256_set1_pd(radius);
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d sum = _mm256_setzero_pd();
+  for (; k + 4 <= candidate_size; k += 4) {
+    __m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(candidates + k));
+    __m256d dx = _mm256_sub_pd(gather(coordinates.x(), idx), xi);
+    __m256d dy = _mm256_sub_pd(gather(coordinates.y(), idx), yi);
+    __m256d dz = _mm256_sub_pd(gather(coordinates.z(), idx), zi);
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_add_pd(_mm256_mul_pd(dy, dy), _mm256_mul_pd(dz, dz)));
+    __m256d mask = _mm256_cmp_pd(r2, r2_max_v, _CMP_LT_OQ);
+    __m256d weight = _mm256_sub_pd(_mm256_div_pd(radius_v, _mm256_sqrt_pd(r2)), one);
+    sum = _mm256_add_pd(sum, _mm256_and_pd(mask, weight));
+    count += __builtin_popcount(_mm256_movemask_pd(mask));
+  }
+  pnd = horizontalSum(sum);
+#endif
+  for (; k < candidate_size; ++k) {
+    double dx, dy, dz;
+    double r2 = squaredDistance(coordinates, index, candidates[k], dx, dy, dz);
+    if (r2 >= r2_max) continue;
+    pnd += radius / std::sqrt(r2) - 1.0;
+    ++count;
+  }
+  return pnd;
+}
+
+Eigen::Vector3d sumGradient(const AlignedCoordinates& coordinates, int index,
+                            const int* neighbors, int neighbor_size,
+                            const double* values, double reference, double radius) {
+  const double r2_max = radius * radius;
+  Eigen::Vector3d grad(0.0, 0.0, 0.0);
+  int k = 0;
+#if defined(__AVX512F__)
+  const __m512d xi = _mm512_set1_pd(coordinates.x()[index]);
+  const __m512d yi = _mm512_set1_pd(coordinates.y()[index]);
+  const __m512d zi = _mm512_set1_pd(coordinates.z()[index]);
+  const __m512d r2_max_v = _mm512_set1_pd(r2_max);
+  const __m512d radius_v = _mm512_set1_pd(radius);
+  const __m512d reference_v = _mm512_set1_pd(reference);
+  const __m512d one = _mm512_set1_pd(1.0);
+  __m512d gx = _mm512_setzero_pd();
+  __m512d gy = _mm512_setzero_pd();
+  __m512d gz = _mm512_setzero_pd();
+  for (; k + 8 <= neighbor_size; k += 8) {
+    __m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbors + k));
+    __m512d dx = _mm512_sub_pd(gather(coordinates.x(), idx), xi);
+    __m512d dy = _mm512_sub_pd(gather(coordinates.y(), idx), yi);
+    __m512d dz = _mm512_sub_pd(gather(coordinates.z(), idx), zi);
+    __m512d dv = _mm512_sub_pd(gather(values, idx), reference_v);
+    __m512d r2 = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_add_pd(_mm512_mul_pd(dy, dy), _mm512_mul_pd(dz, dz)));
+    __mmask8 mask = _mm512_cmp_pd_mask(r2, r2_max_v, _CMP_LT_OQ);
+    __m512d weight = _mm512_sub_pd(_mm512_div_pd(radius_v, squareRoot(r2)), one);
+    __m512d coef = _mm512_div_pd(_mm512_mul_pd(dv, weight), r2);
+    gx = _mm512_mask_add_pd(gx, mask, gx, _mm512_mul_pd(dx, coef));
+    gy = _mm512_mask_add_pd(gy, mask, gy, _mm512_mul_pd(dy, coef));
+    gz = _mm512_mask_add_pd(gz, mask, gz, _mm512_mul_pd(dz, coef));
+  }
+  grad << horizontalSum(gx), horizontalSum(gy), horizontalSum(gz);
+#elif defined(__AVX2__)
+  const __m256d xi = _mm256_set1_pd(coordinates.x()[index]);
+  const __m256d yi = _mm256_set1_pd(coordinates.y()[index]);
+  const __m256d zi = _mm256_set1_pd(coordinates.z()[index]);
+  const __m256d r2_max_v = _mm256_set1_pd(r2_max);
+  const __m256d radius_v = _mm256_set1_pd(radius);
+  const __m256d reference_v = _mm256_set1_pd(reference);
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d gx = _mm256_setzero_pd();
+  __m256d gy = _mm256_setzero_pd();
+  __m256d gz = _mm256_setzero_pd();
+  for (; k + 4 <= neighbor_size; k += 4) {
+    __m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(neighbors + k));
+    __m256d dx = _mm256_sub_pd(gather(coordinates.x(), idx), xi);
+    __m256d dy = _mm256_sub_pd(gather(coordinates.y(), idx), yi);
+    __m256d dz = _mm256_sub_pd(gather(coordinates.z(), idx), zi);
+    __m256d dv = _mm256_sub_pd(gather(values, idx), reference_v);
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_add_pd(_mm256_mul_pd(dy, dy), _mm256_mul_pd(dz, dz)));
+    __m256d mask = _mm256_cmp_pd(r2, r2_max_v, _CMP_LT_OQ);
+    __m256d weight = _mm256_sub_pd(_mm256_div_pd(radius_v, _mm256_sqrt_pd(r2)), one);
+    __m256d coef = _mm256_and_pd(mask, _mm256_div_pd(_mm256_mul_pd(dv, weight), r2));
+    gx = _mm256_add_pd(gx, _mm256_mul_pd(dx, coef));
+    gy = _mm256_add_pd(gy, _mm256_mul_pd(dy, coef));
+    gz = _mm256_add_pd(gz, _mm256_mul_pd(dz, coef));
+  }
+  grad << horizontalSum(gx), horizontalSum(gy), horizontalSum(gz);
+#endif
+  for (; k < neighbor_size; ++k) {
+    int j_particle = neighbors[k];
+    double dx, dy, dz;
+    double r2 = squaredDistance(coordinates, index, j_particle, dx, dy, dz);
+    if (r2 >= r2_max) continue;
+    double coef = (values[j_particle] - reference) * (radius / std::sqrt(r2) - 1.0) / r2;
+    grad(0) += dx * coef;
+    grad(1) += dy * coef;
+    grad(2) += dz * coef;
+  }
+  return grad;
+}
+
+} // namespace pair_kernels
+} // namespace tiny_mps
@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "particle_index.h"
+#include <iostream>
+#include <stdexcept>
+#include "particles.h"
+
+namespace tiny_mps {
+
+int ParticleIndex::getOrder(int type) {
+  switch (type) {
+    case ParticleType::WALL:         return 0;
+    case ParticleType::NORMAL:       return 1;
+    case ParticleType::INFLOW:       return 2;
+    case ParticleType::DUMMY_INFLOW: return 3;
+    case ParticleType::DUMMY_WALL:   return 4;
+    case ParticleType::GHOST:        return kGhostOrder;
+  }
+  Log(LOG_ERROR) << "Error: Unknown particle type: " << type;
+  throw std::invalid_argument("Error: Unknown particle type.");
+}
+
+void ParticleIndex::build(const Eigen::VectorXi& particle_types) {
+  const int size = particle_types.size();
+  int counts[kGroups + 1] = {};
+  for (int i_particle = 0; i_particle < size; ++i_particle) ++counts[getOrder(particle_types(i_particle)) + 1];
+  begins[0] = 0;
+  for (int order = 0; order < kGroups; ++order) begins[order + 1] = begins[order] + counts[order + 1];
+  int next[kGroups];
+  for (int order = 0; order < kGroups; ++order) next[order] = begins[order];
+  indices.resize(size);
+  locations.resize(size);
+  for (int i_particle = 0; i_particle < size; ++i_particle) {
+    int location = next[getOrder(particle_types(i_particle))]++;
+    indices[location] = i_particle;
+    locations[i_particle] = location;
+  }
+}
+
+void ParticleIndex::extend(int new_size) {
+  for (int i_particle = indices.size(); i_particle < new_size; ++i_particle) {
+    locations.push_back(indices.size());
+    indices.push_back(i_particle);
+  }
+  begins[kGroups] = indices.size();
+}
+
+void ParticleIndex::change(int index, int old_type, int new_type) {
+  int from = getOrder(old_type);
+  int to = getOrder(new_type);
+  int location = locations[index];
+  // Hands the index over across each boundary between the two groups.
+  for (int order = from; order < to; ++order) {
+    int last = begins[order + 1] - 1;
+    swap(location, last);
+    location = last;
+    --begins[order + 1];
+  }
+  for (int order = from; order > to; --order) {
+    int first = begins[order];
+    swap(location, first);
+    location = first;
+    ++begins[order];
+  }
+}
+
+void ParticleIndex::writeCheckpoint(CheckpointWriter& writer) const {
+  writer.beginSection("ParticleIndex");
+  writer.write(indices);
+  writer.write(locations);
+  for (int order = 0; order <= kGroups; ++order) writer.write(begins[order]);
+}
+
+void ParticleIndex::readCheckpoint(CheckpointReader& reader) {
+  reader.beginSection("ParticleIndex");
+  reader.read(indices);
+  reader.read(locations);
+  for (int order = 0; order <= kGroups; ++order) reader.read(begins[order]);
+}
+
+} // namespace tiny_mps
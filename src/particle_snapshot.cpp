@@ -0,0 +1,136 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "particle_snapshot.h"
+#include <fstream>
+#include <stdexcept>
+#include "logger.h"
+#include "vtu_writer.h"
+
+namespace tiny_mps {
+
+namespace {
+
+// Returns the columns of values at indices.
+template <typename Matrix>
+Matrix selectColumns(const Matrix& values, const std::vector<int>& indices) {
+  Matrix selected(values.rows(), indices.size());
+  for (int i = 0; i < static_cast<int>(indices.size()); ++i) selected.col(i) = values.col(indices[i]);
+  return selected;
+}
+
+// Returns the entries of values at indices.
+template <typename Vector>
+Vector selectEntries(const Vector& values, const std::vector<int>& indices) {
+  Vector selected(indices.size());
+  for (int i = 0; i < static_cast<int>(indices.size()); ++i) selected(i) = values(indices[i]);
+  return selected;
+}
+
+} // namespace
+
+ParticleSnapshot::ParticleSnapshot(const Eigen::Matrix3Xd& position, const Eigen::VectorXi& particle_types,
+                                   const OutputFilter& filter)
+    : filter(filter), all_particles(filter.selectsAllParticles()) {
+  if (all_particles) {
+    this->position = position;
+    return;
+  }
+  indices = filter.selectParticles(position, particle_types);
+  this->position = selectColumns(position, indices);
+}
+
+void ParticleSnapshot::addField(const std::string& name, const Eigen::VectorXd& values) {
+  if (!filter.selectsField(name)) return;
+  Field field{name, DOUBLE_SCALAR, all_particles ? values : selectEntries(values, indices),
+              Eigen::VectorXi(), Eigen::Matrix3Xd()};
+  fields.push_back(std::move(field));
+}
+
+void ParticleSnapshot::addField(const std::string& name, const Eigen::VectorXi& values) {
+  if (!filter.selectsField(name)) return;
+  Field field{name, INT_SCALAR, Eigen::VectorXd(), all_particles ? values : selectEntries(values, indices),
+              Eigen::Matrix3Xd()};
+  fields.push_back(std::move(field));
+}
+
+void ParticleSnapshot::addField(const std::string& name, const Eigen::Matrix3Xd& values) {
+  if (!filter.selectsField(name)) return;
+  Field field{name, DOUBLE_VECTOR, Eigen::VectorXd(), Eigen::VectorXi(),
+              all_particles ? values : selectColumns(values, indices)};
+  fields.push_back(std::move(field));
+}
+
+void ParticleSnapshot::writeVtkFile(const std::string& path, const std::string& title) const {
+  const int size = getSize();
+  std::ofstream ofs(path);
+  if(ofs.fail()) {
+    Log(LOG_ERROR) << "Error: in writeVtkFile() in particle_snapshot.cpp.";
+    throw std::ios_base::failure("Error: in writeVtkFile() in particle_snapshot.cpp.");
+  }
+  ofs << "# vtk DataFile Version 2.0" << std::endl;
+  ofs << title << std::endl;
+  ofs << "ASCII" << std::endl;
+  ofs << "DATASET UNSTRUCTURED_GRID" << std::endl;
+  ofs << std::endl;
+  ofs << "POINTS " << size << " double" << std::endl;
+  for(int i = 0; i < size; ++i) {
+    ofs << position(0, i) << " " << position(1, i) << " " << position(2, i) << std::endl;
+  }
+  ofs << std::endl;
+  ofs << "CELLS " << size << " " << size * 2 << std::endl;
+  for(int i = 0; i < size; ++i) {
+    ofs << 1 << " " << i << std::endl;
+  }
+  ofs << std::endl;
+  ofs << "CELL_TYPES " << size << std::endl;
+  for(int i = 0; i < size; ++i) {
+    ofs << 1 << std::endl;
+  }
+  ofs << std::endl;
+  ofs << "POINT_DATA " << size << std::endl;
+  for (std::size_t i_field = 0; i_field < fields.size(); ++i_field) {
+    const Field& field = fields[i_field];
+    if (i_field > 0) ofs << std::endl;
+    switch (field.kind) {
+      case DOUBLE_SCALAR:
+        ofs << "SCALARS " << field.name << " double" << std::endl;
+        ofs << "LOOKUP_TABLE " << field.name << std::endl;
+        for(int i = 0; i < size; ++i) {
+          ofs << field.doubles(i) << std::endl;
+        }
+        break;
+      case INT_SCALAR:
+        ofs << "SCALARS " << field.name << " int" << std::endl;
+        ofs << "LOOKUP_TABLE " << field.name << std::endl;
+        for(int i = 0; i < size; ++i) {
+          ofs << field.ints(i) << std::endl;
+        }
+        break;
+      case DOUBLE_VECTOR:
+        ofs << "VECTORS " << field.name << " double" << std::endl;
+        for(int i = 0; i < size; ++i) {
+          ofs << field.vectors(0, i) << " " << field.vectors(1, i) << " " << field.vectors(2, i) << std::endl;
+        }
+        break;
+    }
+  }
+  Log(LOG_INFO) << "Succeed in writing vtk file: " << path;
+}
+
+void ParticleSnapshot::writeVtuFile(const std::string& path, double time, bool float32, int compression) const {
+  VtuWriter writer(position);
+  for (const Field& field : fields) {
+    switch (field.kind) {
+      case DOUBLE_SCALAR: writer.addPointData(field.name, field.doubles); break;
+      case INT_SCALAR:    writer.addPointData(field.name, field.ints); break;
+      case DOUBLE_VECTOR: writer.addPointData(field.name, field.vectors); break;
+    }
+  }
+  writer.setTime(time);
+  writer.setFloat32(float32);
+  writer.setCompression(compression);
+  writer.write(path);
+  Log(LOG_INFO) << "Succeed in writing vtu file: " << path;
+}
+
+} // namespace tiny_mps
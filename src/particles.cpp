@@ -1,41 +1,83 @@
 // Copyright (c) 2017 Shota SUGIHARA
 // Distributed under the MIT License.
 #include "particles.h"
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <boost/format.hpp>
-#include <Eigen/LU>
+#include "grid_file.h"
+#include "hdf5_writer.h"
+#include "vtu_writer.h"
 
 namespace tiny_mps {
 
+namespace {
+// Returns path with its extension replaced by extension.
+std::string replaceExtension(const std::string& path, const std::string& extension) {
+  const std::size_t dot = path.find_last_of('.');
+  const std::size_t separator = path.find_last_of("/\\");
+  if (dot == std::string::npos || (separator != std::string::npos && dot < separator)) return path + extension;
+  return path.substr(0, dot) + extension;
+}
+
+std::string getFileName(const std::string& path) {
+  return path.substr(path.find_last_of("/\\") + 1);
+}
+}
+
 Particles::Particles(int size, const Condition& condition)
-    : condition_(condition), dimension(condition.dimension), inflow_stride(0.0) {
+    : condition_(condition), dimension(condition.dimension) {
   initialize(size);
+  if (!condition.polygon_wall_file.empty()) loadPolygonWall(condition.polygon_wall_file);
   setInitialParticleNumberDensity();
   setLaplacianLambda();
 }
 
 Particles::Particles(const std::string& path, const Condition& condition)
-    : condition_(condition), dimension(condition.dimension), inflow_stride(0.0) {
+    : condition_(condition), dimension(condition.dimension) {
   readGridFile(path, condition);
+  if (!condition.polygon_wall_file.empty()) loadPolygonWall(condition.polygon_wall_file);
+  updateParticleNumberDensity();
+  setInitialParticleNumberDensity();
+  setLaplacianLambda();
+  checkSurfaceParticles();
+  readResolutionZones();
+}
+
+Particles::Particles(const std::string& path, const Condition& condition, const DomainDecomposition& domain)
+    : condition_(condition), dimension(condition.dimension) {
+  readGridFile(path, condition, &domain);
+  if (!condition.polygon_wall_file.empty()) loadPolygonWall(condition.polygon_wall_file);
   updateParticleNumberDensity();
   setInitialParticleNumberDensity();
   setLaplacianLambda();
   checkSurfaceParticles();
+  readResolutionZones();
 }
 
 Particles::Particles(const Particles& other)
     : condition_(other.condition_),
       dimension(other.dimension) {
   size = other.size;
-  ghost_stack = other.ghost_stack;
+  ghost_slots = other.ghost_slots;
+  particle_index = other.particle_index;
   initial_particle_number_density = other.initial_particle_number_density;
   laplacian_lambda_pressure = other.laplacian_lambda_pressure;
   laplacian_lambda_viscosity = other.laplacian_lambda_viscosity;
   initial_neighbor_particles = other.initial_neighbor_particles;
-  inflow_stride = other.inflow_stride;
+  inlets = other.inlets;
+  resolution_zones = other.resolution_zones;
+  min_spacing_scale = other.min_spacing_scale;
+  max_spacing_scale = other.max_spacing_scale;
+  polygon_wall = other.polygon_wall;
+  wall_pnd_weight = other.wall_pnd_weight;
+  wall_gradient_weight = other.wall_gradient_weight;
+  wall_viscosity_weight = other.wall_viscosity_weight;
+  domain_decomposition = other.domain_decomposition;
+  solver_failed = other.solver_failed;
+  compacted_ghosts = other.compacted_ghosts;
   position = other.position;
   velocity = other.velocity;
   pressure = other.pressure;
@@ -48,17 +90,55 @@ Particles::Particles(const Particles& other)
   neighbor_particles = other.neighbor_particles;
   source_term = other.source_term;
   voxel_ratio = other.voxel_ratio;
+  particle_spacing = other.particle_spacing;
+}
+
+Particles::Particles(const Particles& other, const Condition& condition)
+    : condition_(condition), dimension(condition.dimension) {
+  if (other.dimension != dimension) {
+    Log(LOG_ERROR) << "Error: Particles of " << other.dimension << "-dimension cannot run under a " << dimension << "-dimension condition.";
+    throw std::invalid_argument("Error: dimension of the condition differs from the particles.");
+  }
+  Particles::operator=(other);
+  domain_decomposition = nullptr;
+  ghost_slots.setDeterministic(condition.deterministic_slots);
+  if (!inlets.empty()) inlets[0].velocity = condition.inflow_velocity;
+  if (!condition.polygon_wall_file.empty()) loadPolygonWall(condition.polygon_wall_file);
+  updateParticleNumberDensity();
+  setInitialParticleNumberDensity();
+  setLaplacianLambda();
+  checkSurfaceParticles();
+  readResolutionZones();
+}
+
+Particles::Particles(CheckpointReader& reader, const Condition& condition)
+    : condition_(condition), dimension(condition.dimension) {
+  initialize(0);
+  readCheckpoint(reader);
+  if (!condition.polygon_wall_file.empty()) loadPolygonWall(condition.polygon_wall_file);
+  Log(LOG_INFO) << "Succeed in reading checkpoint file: " << reader.getPath() << " (particles: " << size << ")";
 }
 
 Particles& Particles::operator=(const Particles& other) {
   if (this != &other) {
     size = other.size;
-    ghost_stack = other.ghost_stack;
+    ghost_slots = other.ghost_slots;
+    particle_index = other.particle_index;
     initial_particle_number_density = other.initial_particle_number_density;
     laplacian_lambda_pressure = other.laplacian_lambda_pressure;
     laplacian_lambda_viscosity = other.laplacian_lambda_viscosity;
     initial_neighbor_particles = other.initial_neighbor_particles;
-    inflow_stride = other.inflow_stride;
+    inlets = other.inlets;
+    resolution_zones = other.resolution_zones;
+    min_spacing_scale = other.min_spacing_scale;
+    max_spacing_scale = other.max_spacing_scale;
+    polygon_wall = other.polygon_wall;
+    wall_pnd_weight = other.wall_pnd_weight;
+    wall_gradient_weight = other.wall_gradient_weight;
+    wall_viscosity_weight = other.wall_viscosity_weight;
+    domain_decomposition = other.domain_decomposition;
+    solver_failed = other.solver_failed;
+    compacted_ghosts = other.compacted_ghosts;
     position = other.position;
     velocity = other.velocity;
     pressure = other.pressure;
@@ -71,6 +151,8 @@ Particles& Particles::operator=(const Particles& other) {
     neighbor_particles = other.neighbor_particles;
     source_term = other.source_term;
     voxel_ratio = other.voxel_ratio;
+    particle_spacing = other.particle_spacing;
+    static_boundary.clear();
   }
   return *this;
 }
@@ -91,135 +173,249 @@ void Particles::initialize(int size) {
   neighbor_particles = Eigen::VectorXi::Zero(size);
   source_term = Eigen::VectorXd::Zero(size);
   voxel_ratio = Eigen::VectorXd::Zero(size);
+  particle_spacing = Eigen::VectorXd::Constant(size, condition_.average_distance);
+  min_spacing_scale = 1.0;
+  max_spacing_scale = 1.0;
+  domain_decomposition = nullptr;
+  solver_failed = false;
+  compacted_ghosts = 0;
+  ghost_slots.clear();
+  ghost_slots.setDeterministic(condition_.deterministic_slots);
+  particle_index.build(particle_types);
+  static_boundary.clear();
+  resetInlets();
 }
 
-void Particles::readGridFile(const std::string& path, const Condition& condition) {
-  std::ifstream ifs(path);
-  if (ifs.fail()) {
-    std::cerr << "Error: in readGridFile() in particles.cpp" << std::endl;
-    std::cerr << "Failed to read files: " << path << std::endl;
-    throw std::ios_base::failure("Error: in readGridFile() in particles.cpp.");
-  }
-  std::string tmp_str;
-  getline(ifs, tmp_str);      //Line 0: Start time
-  getline(ifs, tmp_str);      //Line 1: particles_number
-  int ptcl_num = 0;
-  {
-    std::stringstream ss;
-    ss.str(tmp_str);
-    ss >> ptcl_num;
-    initialize(ptcl_num + condition.extra_ghost_particles);
-  }
-  int i_counter = 0;
-  while(getline(ifs, tmp_str)) {
-    std::stringstream ss;
-    ss.str(tmp_str);
-    ss >> particle_types(i_counter);
-    for(int i_dim = 0; i_dim < 3; ++i_dim) {
-      double tmp;
-      ss >> tmp;
-      if (i_dim < dimension) position(i_dim, i_counter) = tmp;
-    }
-    for(int i_dim = 0; i_dim < 3; ++i_dim) {
-      double tmp;
-      ss >> tmp;
-      if (i_dim < dimension) velocity(i_dim, i_counter) = tmp;
-    }
-    ss >> pressure(i_counter);
-    ++i_counter;
+void Particles::readGridFile(const std::string& path, const Condition& condition, const DomainDecomposition* domain) {
+  GridFile grid(path);
+  std::vector<int> indices;
+  if (domain) {
+    indices = grid.selectParticles(dimension, [domain](const Eigen::Vector3d& point) { return domain->isWithinHalo(point); });
   }
+  const int ptcl_num = domain ? static_cast<int>(indices.size()) : grid.getSize();
+  initialize(std::max(ptcl_num + condition.extra_ghost_particles, getReserveParticles(domain ? domain->getSize() : 1)));
+  if (domain) grid.read(dimension, indices, particle_types, position, velocity, pressure);
+  else grid.read(dimension, particle_types, position, velocity, pressure);
   for (int i_particle = ptcl_num; i_particle < size; ++i_particle) {
     particle_types(i_particle) = ParticleType::GHOST;
-    ghost_stack.push(i_particle);
+    ghost_slots.release(i_particle);
   }
-  std::cout << "Succeed in reading grid file: " << path << std::endl;
+  particle_index.build(particle_types);
+  compacted_ghosts = particle_index.getCount(ParticleType::GHOST);
+  resetInlets();
+  Log(LOG_INFO) << "Succeed in reading grid file: " << path;
 }
 
 void Particles::writeVtkFile(const std::string& path, const std::string& title) const {
-  std::ofstream ofs(path);
-  if(ofs.fail()) {
-    std::cerr << "Error: in writeVtkFile() in particles.cpp." << std::endl;
-    throw std::ios_base::failure("Error: in writeVtkFile() in particles.cpp.");
-  }
-  ofs << "# vtk DataFile Version 2.0" << std::endl;
-  ofs << title << std::endl;
-  ofs << "ASCII" << std::endl;
-  ofs << "DATASET UNSTRUCTURED_GRID" << std::endl;
-  ofs << std::endl;
-  ofs << "POINTS " << size << " double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << position(0, i) << " " << position(1, i) << " " << position(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "CELLS " << size << " " << size * 2 << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << 1 << " " << i << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "CELL_TYPES " << size << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << 1 << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "POINT_DATA " << size << std::endl;
-  ofs << "SCALARS Pressure double" << std::endl;
-  ofs << "LOOKUP_TABLE Pressure" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << pressure(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "VECTORS Velocity double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << velocity(0, i) << " " << velocity(1, i) << " " << velocity(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS Type int" << std::endl;
-  ofs << "LOOKUP_TABLE Type" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << particle_types(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS ParticleNumberDensity double" << std::endl;
-  ofs << "LOOKUP_TABLE ParticleNumberDensity" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << particle_number_density(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS NeighborParticles int" << std::endl;
-  ofs << "LOOKUP_TABLE NeighborParticles" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << neighbor_particles(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS BoundaryCondition int" << std::endl;
-  ofs << "LOOKUP_TABLE BoundaryCondition" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << boundary_types(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "VECTORS CorrectionVelocity double" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << correction_velocity(0, i) << " " << correction_velocity(1, i) << " " << correction_velocity(2, i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS SourceTerm double" << std::endl;
-  ofs << "LOOKUP_TABLE SourceTerm" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << source_term(i) << std::endl;
-  }
-  ofs << std::endl;
-  ofs << "SCALARS VoxelsRatio double" << std::endl;
-  ofs << "LOOKUP_TABLE VoxelsRatio" << std::endl;
-  for(int i = 0; i < size; ++i) {
-    ofs << voxel_ratio(i) << std::endl;
-  }
-  std::cout << "Succeed in writing vtk file: " << path << std::endl;
+  makeSnapshot().writeVtkFile(path, title);
+}
+
+void Particles::writeVtuFile(const std::string& path, double time) const {
+  makeSnapshot().writeVtuFile(path, time, condition_.vtu_precision == 32, condition_.vtu_compression);
+}
+
+ParticleSnapshot Particles::makeSnapshot() const {
+  ParticleSnapshot snapshot(position);
+  addOutputFields(snapshot);
+  return snapshot;
+}
+
+ParticleSnapshot Particles::makeSnapshot(const OutputFilter& filter) const {
+  ParticleSnapshot snapshot(position, particle_types, filter);
+  addOutputFields(snapshot);
+  return snapshot;
+}
+
+void Particles::addOutputFields(ParticleSnapshot& snapshot) const {
+  snapshot.addField("Pressure", pressure);
+  snapshot.addField("Velocity", velocity);
+  snapshot.addField("Type", particle_types);
+  snapshot.addField("ParticleNumberDensity", particle_number_density);
+  snapshot.addField("NeighborParticles", neighbor_particles);
+  snapshot.addField("BoundaryCondition", boundary_types);
+  snapshot.addField("CorrectionVelocity", correction_velocity);
+  snapshot.addField("SourceTerm", source_term);
+  snapshot.addField("VoxelsRatio", voxel_ratio);
 }
 
 bool Particles::saveInterval(const std::string& path, const Timer& timer) const {
+  for (std::size_t i_stream = 0; i_stream < condition_.output_streams.size(); ++i_stream) {
+    if (!timer.isOutputTime(i_stream)) continue;
+    const OutputStream& stream = condition_.output_streams[i_stream];
+    // "output/output_%1%.vtk" makes "output/fluid_%1%.vtk".
+    const std::string stream_path = path.substr(0, path.find_last_of("/\\") + 1) + stream.name + "_%1%"
+                                    + path.substr(replaceExtension(path, "").size());
+    writeOutput(stream_path, timer.getOutputCount(i_stream), timer.getCurrentTime(), stream.filter);
+  }
   if (!timer.isOutputTime()) return false;
-  std::string output_index = (boost::format("%04d") % timer.getOutputCount()).str();
-  writeVtkFile((boost::format(path) % output_index).str(), (boost::format("Time: %s") % timer.getCurrentTime()).str());
+  writeOutput(path, timer.getOutputCount(), timer.getCurrentTime(), condition_.output_filter);
+  return true;
+}
+
+void Particles::writeOutput(const std::string& path, int index, double time, const OutputFilter& filter) const {
+  std::string output_index = (boost::format("%04d") % index).str();
+  std::shared_ptr<const ParticleSnapshot> snapshot = std::make_shared<ParticleSnapshot>(makeSnapshot(filter));
+  if (condition_.output_format == "vtu") {
+    const std::string vtu_path = replaceExtension((boost::format(path) % output_index).str(), ".vtu");
+    std::shared_ptr<VtuCollection> collection = getVtuCollection(getSeriesPath(path) + ".pvd");
+    const bool float32 = condition_.vtu_precision == 32;
+    const int compression = condition_.vtu_compression;
+    submitOutput([snapshot, collection, vtu_path, time, float32, compression]() {
+      snapshot->writeVtuFile(vtu_path, time, float32, compression);
+      collection->add(time, getFileName(vtu_path));
+    });
+  } else if (condition_.output_format == "hdf5") {
+    std::shared_ptr<Hdf5Writer> writer = getHdf5Writer(getSeriesPath(path));
+    submitOutput([snapshot, writer, index, time]() { writer->writeParticles(index, time, *snapshot); });
+  } else {
+    const std::string vtk_path = (boost::format(path) % output_index).str();
+    const std::string title = (boost::format("Time: %s") % time).str();
+    submitOutput([snapshot, vtk_path, title]() { snapshot->writeVtkFile(vtk_path, title); });
+  }
+}
+
+std::string Particles::getSeriesPath(const std::string& path) {
+  // "output_%1%.vtk" makes "output".
+  std::string series = replaceExtension((boost::format(path) % "").str(), "");
+  while (!series.empty() && (series.back() == '_' || series.back() == '-')) series.pop_back();
+  return series;
+}
+
+void Particles::submitOutput(const SnapshotWriter::Job& job) const {
+  if (!condition_.async_output) {
+    job();
+    return;
+  }
+  if (!snapshot_writer) snapshot_writer.reset(new SnapshotWriter());
+  snapshot_writer->submit(job);
+}
+
+std::shared_ptr<Hdf5Writer> Particles::getHdf5Writer(const std::string& series_path) const {
+  std::shared_ptr<Hdf5Writer>& writer = hdf5_writers[series_path];
+  if (!writer) writer = std::make_shared<Hdf5Writer>(series_path, condition_.hdf5_compression);
+  return writer;
+}
+
+std::shared_ptr<VtuCollection> Particles::getVtuCollection(const std::string& pvd_path) const {
+  std::shared_ptr<VtuCollection>& collection = vtu_collections[pvd_path];
+  if (!collection) collection = std::make_shared<VtuCollection>(pvd_path);
+  return collection;
+}
+
+void Particles::flushOutput() const {
+  if (snapshot_writer) snapshot_writer->flush();
+}
+
+void Particles::writeCheckpoint(CheckpointWriter& writer) const {
+  writer.beginSection("Particles");
+  writer.write(dimension);
+  writer.write(size);
+  writer.write(position);
+  writer.write(velocity);
+  writer.write(pressure);
+  writer.write(particle_number_density);
+  writer.write(temporary_position);
+  writer.write(temporary_velocity);
+  writer.write(correction_velocity);
+  writer.write(particle_types);
+  writer.write(boundary_types);
+  writer.write(neighbor_particles);
+  writer.write(source_term);
+  writer.write(voxel_ratio);
+  writer.write(particle_spacing);
+  writer.write(initial_particle_number_density);
+  writer.write(laplacian_lambda_pressure);
+  writer.write(laplacian_lambda_viscosity);
+  writer.write(initial_neighbor_particles);
+  writer.write(min_spacing_scale);
+  writer.write(max_spacing_scale);
+  writer.write(solver_failed);
+  writer.write<std::uint64_t>(inlets.size());
+  for (const Inlet& inlet : inlets) {
+    writer.write(inlet.velocity);
+    writer.write(inlet.stride);
+    writer.write(inlet.inflow_particles);
+    writer.write(inlet.dummy_particles);
+  }
+  writer.write<std::uint64_t>(resolution_zones.size());
+  for (const ResolutionZone& zone : resolution_zones) {
+    writer.write(zone.minpos);
+    writer.write(zone.maxpos);
+    writer.write(zone.spacing_ratio);
+  }
+  particle_index.writeCheckpoint(writer);
+  ghost_slots.writeCheckpoint(writer);
+}
+
+void Particles::readCheckpoint(CheckpointReader& reader) {
+  reader.beginSection("Particles");
+  int checkpoint_dimension;
+  reader.read(checkpoint_dimension);
+  if (checkpoint_dimension != dimension) {
+    Log(LOG_ERROR) << "Error: The checkpoint is " << checkpoint_dimension << "-dimensional, but the condition is " << dimension << "-dimensional.";
+    throw std::invalid_argument("Error: dimension of the condition differs from the checkpoint.");
+  }
+  reader.read(size);
+  reader.read(position);
+  reader.read(velocity);
+  reader.read(pressure);
+  reader.read(particle_number_density);
+  reader.read(temporary_position);
+  reader.read(temporary_velocity);
+  reader.read(correction_velocity);
+  reader.read(particle_types);
+  reader.read(boundary_types);
+  reader.read(neighbor_particles);
+  reader.read(source_term);
+  reader.read(voxel_ratio);
+  reader.read(particle_spacing);
+  reader.read(initial_particle_number_density);
+  reader.read(laplacian_lambda_pressure);
+  reader.read(laplacian_lambda_viscosity);
+  reader.read(initial_neighbor_particles);
+  reader.read(min_spacing_scale);
+  reader.read(max_spacing_scale);
+  reader.read(solver_failed);
+  std::uint64_t inlet_number;
+  reader.read(inlet_number);
+  inlets.assign(inlet_number, Inlet(Eigen::Vector3d::Zero()));
+  for (Inlet& inlet : inlets) {
+    reader.read(inlet.velocity);
+    reader.read(inlet.stride);
+    reader.read(inlet.inflow_particles);
+    reader.read(inlet.dummy_particles);
+  }
+  std::uint64_t zone_number;
+  reader.read(zone_number);
+  resolution_zones.clear();
+  for (std::uint64_t i_zone = 0; i_zone < zone_number; ++i_zone) {
+    ResolutionZone zone(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero(), 1.0);
+    reader.read(zone.minpos);
+    reader.read(zone.maxpos);
+    reader.read(zone.spacing_ratio);
+    resolution_zones.push_back(zone);
+  }
+  particle_index.readCheckpoint(reader);
+  ghost_slots.readCheckpoint(reader);
+  compacted_ghosts = particle_index.getCount(ParticleType::GHOST);
+  static_boundary.clear();
+}
+
+void Particles::saveCheckpoint(const std::string& path, const Timer& timer) const {
+  CheckpointWriter writer(path);
+  writeCheckpoint(writer);
+  timer.writeCheckpoint(writer);
+  if (domain_decomposition) domain_decomposition->writeCheckpoint(writer);
+  writer.close();
+  Log(LOG_INFO) << "Wrote checkpoint file: " << path;
+}
+
+bool Particles::saveCheckpointInterval(const std::string& path, const Timer& timer) const {
+  if (condition_.checkpoint_interval <= 0 || timer.getLoopCount() == 0) return false;
+  if (timer.getLoopCount() % condition_.checkpoint_interval != 0) return false;
+  std::string checkpoint_path = path.substr(0, path.find_last_of("/\\") + 1) + condition_.checkpoint_file;
+  if (domain_decomposition) checkpoint_path = domain_decomposition->getRankPath(checkpoint_path);
+  saveCheckpoint(checkpoint_path, timer);
   return true;
 }
 
@@ -241,8 +437,8 @@ void Particles::setInitialParticleNumberDensity() {
   }
   initial_particle_number_density = pnd;
   initial_neighbor_particles = count;
-  std::cout << "Initial particle number density: " << initial_particle_number_density << std::endl;
-  std::cout << "Initial neighbor particles: " << initial_neighbor_particles << std::endl;
+  Log(LOG_INFO) << "Initial particle number density: " << initial_particle_number_density;
+  Log(LOG_INFO) << "Initial neighbor particles: " << initial_neighbor_particles;
 }
 
 void Particles::setLaplacianLambda() {
@@ -284,54 +480,137 @@ void Particles::setLaplacianLambda() {
     }
     laplacian_lambda_viscosity = numerator / denominator;
   }
-  std::cout << "Laplacian lambda for Pressure: " << laplacian_lambda_pressure << std::endl;
-  std::cout << "Laplacian lambda for Viscosity: " << laplacian_lambda_viscosity << std::endl;
-  std::cout << "Relaxation coefficient of PND: " << condition_.relaxation_coefficient_pnd << std::endl;
-  std::cout << "Relaxation coefficient of velocity divergence: " << condition_.relaxation_coefficient_vel_div << std::endl;
+  Log(LOG_INFO) << "Laplacian lambda for Pressure: " << laplacian_lambda_pressure;
+  Log(LOG_INFO) << "Laplacian lambda for Viscosity: " << laplacian_lambda_viscosity;
+  Log(LOG_INFO) << "Relaxation coefficient of PND: " << condition_.relaxation_coefficient_pnd;
+  Log(LOG_INFO) << "Relaxation coefficient of velocity divergence: " << condition_.relaxation_coefficient_vel_div;
 }
 
 bool Particles::nextLoop(const std::string& path, Timer& timer) {
-  std::cout << std::endl;
-  timer.limitCurrentDeltaTime(getMaxSpeed(), condition_);
+  StepLog(LOG_INFO) << "";
+  StepStats stats = calculateStepStats();
+  if (condition_.step_rejection && checkStepRejection(stats, timer)) {
+    restoreStepState();
+    timer.rejectStep();
+    stats = calculateStepStats();
+  }
+  // Particles which moved into another zone are split or merged before the delta time follows their spacing.
+  if (!resolution_zones.empty()) adaptResolution();
+  saveCheckpointInterval(path, timer);
+  timer.limitCurrentDeltaTime(stats.max_speed, condition_, getMinSpacing());
   timer.printCompuationTime();
   timer.printTimeInfo();
-  showParticlesInfo();
-  std::cout << boost::format("Max velocity: %f") % getMaxSpeed() << std::endl;
+  showParticlesInfo(stats);
+  StepLog(LOG_INFO) << boost::format("Max velocity: %f, Kinetic energy: %e") % stats.max_speed % stats.kinetic_energy;
   saveInterval(path, timer);
-  if (checkNeedlessCalculation()) {
-    std::cerr << "Error: All particles have become ghost." << std::endl;
+  if (checkNeedlessCalculation(stats)) {
+    flushOutput();
+    Log(LOG_ERROR) << "Error: All particles have become ghost.";
     writeVtkFile((boost::format(path) % "err").str(), (boost::format("Time: %s") % timer.getCurrentTime()).str());
     throw std::range_error("Error: All particles have become ghost.");
   }
   if (timer.isUnderMinDeltaTime()) {
-    std::cerr << "Error: Delta time has become so small." << std::endl;
+    flushOutput();
+    Log(LOG_ERROR) << "Error: Delta time has become so small.";
     writeVtkFile((boost::format(path) % "err").str(), (boost::format("Time: %s") % timer.getCurrentTime()).str());
     throw std::range_error("Error: Delta time has become so small.");
   }
   if (!timer.hasNextLoop()) {
-    std::cout << std::endl << "Total ";
-    timer.printCompuationTime();
-    std::cout << "Succeed in simulation." << std::endl;
+    Log(LOG_INFO) << "";
+    Log(LOG_INFO) << "Total " << timer.getComputationTime();
+    timer.printDeltaTimeSummary();
+    flushOutput();
+    Log(LOG_INFO) << "Succeed in simulation.";
+    Logger::getInstance().flush();
     return false;
   }
   timer.update();
+  if (condition_.step_rejection) saveStepState();
+  solver_failed = false;
   temporary_velocity = velocity;
   temporary_position = position;
   return true;
 }
 
+StepStats Particles::calculateStepStats() const {
+  StepStats stats;
+#pragma omp parallel
+  {
+    StepStats local;
+#pragma omp for nowait
+    for (int i_particle = 0; i_particle < size; ++i_particle) {
+      if (isHaloParticle(i_particle)) continue;
+      if (std::isnan(pressure(i_particle)) || velocity.col(i_particle).hasNaN() || position.col(i_particle).hasNaN()) {
+        local.has_nan = true;
+      }
+      switch (particle_types(i_particle)) {
+        case ParticleType::NORMAL:       ++local.normal; break;
+        case ParticleType::WALL:         ++local.wall; break;
+        case ParticleType::DUMMY_WALL:   ++local.dummy_wall; break;
+        case ParticleType::INFLOW:       ++local.inflow; break;
+        case ParticleType::DUMMY_INFLOW: ++local.dummy_inflow; break;
+        case ParticleType::GHOST:        ++local.ghost; break;
+      }
+      if (boundary_types(i_particle) == BoundaryType::INNER) ++local.inner;
+      else if (boundary_types(i_particle) == BoundaryType::SURFACE) ++local.surface;
+      else ++local.others;
+      if (particle_types(i_particle) == ParticleType::GHOST) continue;
+      double speed2 = velocity.col(i_particle).squaredNorm();
+      local.max_speed = std::max(local.max_speed, speed2);
+      if (particle_types(i_particle) == ParticleType::NORMAL) {
+        const double particle_mass = condition_.mass_density * std::pow(particle_spacing(i_particle), dimension);
+        local.kinetic_energy += 0.5 * particle_mass * speed2;
+      }
+    }
+#pragma omp critical
+    stats.merge(local);
+  }
+  stats.max_speed = std::sqrt(stats.max_speed);
+  if (domain_decomposition) domain_decomposition->reduce(stats);
+  return stats;
+}
+
 bool Particles::checkNeedlessCalculation() const {
-  if (pressure.hasNaN() || velocity.hasNaN() || position.hasNaN()) {
-    std::cerr << "Error: Data contains NaN." << std::endl;
+  return checkNeedlessCalculation(calculateStepStats());
+}
+
+bool Particles::checkNeedlessCalculation(const StepStats& stats) const {
+  if (stats.has_nan) {
+    Log(LOG_ERROR) << "Error: Data contains NaN.";
     return true;
   }
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::NORMAL) return false;
-  }
-  std::cerr << "Error: No normal particles." << std::endl;
+  if (stats.normal > 0) return false;
+  Log(LOG_ERROR) << "Error: No normal particles.";
   return true;
 }
 
+bool Particles::checkStepRejection(const StepStats& stats, const Timer& timer) const {
+  if (!step_snapshot || timer.getLoopCount() == 0) return false;
+  if (solver_failed) {
+    Log(LOG_WARNING) << "Warning: The pressure solver failed.";
+    return true;
+  }
+  if (stats.has_nan) {
+    Log(LOG_WARNING) << "Warning: NaN values were found.";
+    return true;
+  }
+  double courant = stats.max_speed * timer.getCurrentDeltaTime() / getMinSpacing();
+  if (courant > condition_.rejection_courant_number) {
+    Log(LOG_WARNING) << "Warning: Courant number has become " << courant << ".";
+    return true;
+  }
+  return false;
+}
+
+void Particles::saveStepState() {
+  if (step_snapshot) *step_snapshot = *this;
+  else step_snapshot.reset(new Particles(*this));
+}
+
+void Particles::restoreStepState() {
+  if (step_snapshot) Particles::operator=(*step_snapshot);
+}
+
 void Particles::extendStorage(int extra_size) {
   position.conservativeResize(3, size + extra_size);
   velocity.conservativeResize(3, size + extra_size);
@@ -345,6 +624,7 @@ void Particles::extendStorage(int extra_size) {
   particle_types.conservativeResize(size + extra_size);
   source_term.conservativeResize(size + extra_size);
   voxel_ratio.conservativeResize(size + extra_size);
+  particle_spacing.conservativeResize(size + extra_size);
 
   position.block(0, size, 3, extra_size)            = Eigen::MatrixXd::Zero(3, extra_size);
   velocity.block(0, size, 3, extra_size)            = Eigen::MatrixXd::Zero(3, extra_size);
@@ -356,44 +636,144 @@ void Particles::extendStorage(int extra_size) {
   neighbor_particles.segment(size, extra_size)      = Eigen::VectorXi::Zero(extra_size);
   source_term.segment(size, extra_size)             = Eigen::VectorXd::Zero(extra_size);
   voxel_ratio.segment(size, extra_size)             = Eigen::VectorXd::Zero(extra_size);
+  particle_spacing.segment(size, extra_size)        = Eigen::VectorXd::Constant(extra_size, condition_.average_distance);
   for (int i_particle = size; i_particle < size + extra_size; ++i_particle) {
     particle_types(i_particle) = ParticleType::GHOST;
     boundary_types(i_particle) = BoundaryType::OTHERS;
-    ghost_stack.push(i_particle);
+    ghost_slots.release(i_particle);
   }
+  Log(LOG_INFO) << "Extended storage: " << size << " -> " << size + extra_size;
   size += extra_size;
-  std::cout << "Added ghost particles: " << extra_size << std::endl;
+  particle_index.extend(size);
+}
+
+std::vector<int> Particles::compactStorage() {
+  std::vector<int> new_indices(size, -1);
+  int live_size = 0;
+  for (int i_particle = 0; i_particle < size; ++i_particle) {
+    if (particle_types(i_particle) != ParticleType::GHOST) new_indices[i_particle] = live_size++;
+  }
+  const int reserve = getReserveParticles(domain_decomposition ? domain_decomposition->getSize() : 1);
+  int new_size = std::min(size, std::max(live_size + condition_.extra_ghost_particles, reserve));
+  compactArray(position, new_indices, new_size);
+  compactArray(velocity, new_indices, new_size);
+  compactArray(temporary_position, new_indices, new_size);
+  compactArray(temporary_velocity, new_indices, new_size);
+  compactArray(correction_velocity, new_indices, new_size);
+  compactArray(pressure, new_indices, new_size);
+  compactArray(particle_number_density, new_indices, new_size);
+  compactArray(neighbor_particles, new_indices, new_size);
+  compactArray(boundary_types, new_indices, new_size, BoundaryType::OTHERS);
+  compactArray(particle_types, new_indices, new_size, ParticleType::GHOST);
+  compactArray(source_term, new_indices, new_size);
+  compactArray(voxel_ratio, new_indices, new_size);
+  compactArray(particle_spacing, new_indices, new_size, condition_.average_distance);
+  ghost_slots.clear();
+  for (int i_particle = live_size; i_particle < new_size; ++i_particle) ghost_slots.release(i_particle);
+  Log(LOG_INFO) << "Compacted storage: " << size << " -> " << new_size << " (ghosts: " << new_size - live_size << ")";
+  size = new_size;
+  compacted_ghosts = new_size - live_size;
+  particle_index.build(particle_types);
+  static_boundary.clear();
+  for (Inlet& inlet : inlets) {
+    for (int& index : inlet.inflow_particles) index = new_indices[index];
+    for (int& index : inlet.dummy_particles) index = new_indices[index];
+  }
+  return new_indices;
+}
+
+int Particles::getReserveParticles(int ranks) const {
+  return (condition_.reserve_particles + ranks - 1) / ranks;
+}
+
+bool Particles::needsCompaction() const {
+  return condition_.compaction_ghost_ratio > 0.0
+      && particle_index.getCount(ParticleType::GHOST) - compacted_ghosts > condition_.compaction_ghost_ratio * size;
+}
+
+void Particles::compactArray(Eigen::Matrix3Xd& array, const std::vector<int>& new_indices, int new_size) {
+  int packed = 0;
+  // new_indices[i] <= i, so moving forward never overwrites an entry still to be moved.
+  for (int i_old = 0; i_old < static_cast<int>(new_indices.size()); ++i_old) {
+    if (new_indices[i_old] < 0) continue;
+    array.col(new_indices[i_old]) = array.col(i_old);
+    ++packed;
+  }
+  array.conservativeResize(3, new_size);
+  array.rightCols(new_size - packed).setZero();
+}
+
+void Particles::compactArray(Eigen::VectorXd& array, const std::vector<int>& new_indices, int new_size, double fill) {
+  int packed = 0;
+  for (int i_old = 0; i_old < static_cast<int>(new_indices.size()); ++i_old) {
+    if (new_indices[i_old] < 0) continue;
+    array(new_indices[i_old]) = array(i_old);
+    ++packed;
+  }
+  array.conservativeResize(new_size);
+  array.tail(new_size - packed).setConstant(fill);
+}
+
+void Particles::compactArray(Eigen::VectorXi& array, const std::vector<int>& new_indices, int new_size, int fill) {
+  int packed = 0;
+  for (int i_old = 0; i_old < static_cast<int>(new_indices.size()); ++i_old) {
+    if (new_indices[i_old] < 0) continue;
+    array(new_indices[i_old]) = array(i_old);
+    ++packed;
+  }
+  array.conservativeResize(new_size);
+  array.tail(new_size - packed).setConstant(fill);
+}
+
+void Particles::reserveGhostParticles(int count) {
+  int shortage = count - ghost_slots.size();
+  if (shortage <= 0) return;
+  if (condition_.additional_ghost_particles <= 0) {
+    Log(LOG_ERROR) << "Error: Can't make new particles.";
+    Log(LOG_ERROR) << "Extra ghost particles has run out.";
+    Log(LOG_ERROR) << "Additional ghost particles: " << condition_.additional_ghost_particles;
+    throw std::bad_array_new_length();
+  }
+  // Grows geometrically so that steady inflow reallocates the storage only O(log N) times.
+  extendStorage(std::max({shortage, condition_.additional_ghost_particles,
+                          static_cast<int>(size * (condition_.storage_growth_factor - 1.0))}));
 }
 
 int Particles::addParticle() {
-  if (ghost_stack.empty()) {
-    if (condition_.additional_ghost_particles > 0) {
-      extendStorage(condition_.additional_ghost_particles);
-      int new_index = ghost_stack.top();
-      ghost_stack.pop();
-      particle_types(new_index) = ParticleType::NORMAL;
-      return new_index;
-    } else {
-      std::cerr << "Error: Can't make new particles." << std::endl
-                << "Extra ghost particles has run out." << std::endl
-                << "Additional ghost particles: " << condition_.additional_ghost_particles << std::endl;
-      throw std::bad_array_new_length();
-      exit(EXIT_FAILURE);
-    }
-  } else {
-    int new_index = ghost_stack.top();
-    ghost_stack.pop();
+  // The storage can't grow during a concurrent update.
+  if (!ghost_slots.isCaching()) reserveGhostParticles(1);
+  int new_index = ghost_slots.acquire();
+  if (new_index < 0) {
+    Log(LOG_ERROR) << "Error: Can't make new particles.";
+    Log(LOG_ERROR) << "Ghost slots reserved for this thread has run out.";
+    throw std::bad_array_new_length();
+  }
+  particle_types(new_index) = ParticleType::NORMAL;
+  if (!ghost_slots.isCaching()) particle_index.change(new_index, ParticleType::GHOST, ParticleType::NORMAL);
+  return new_index;
+}
+
+std::vector<int> Particles::addParticles(int count) {
+  reserveGhostParticles(count);
+  std::vector<int> new_indices(count);
+  for (int& new_index : new_indices) {
+    new_index = ghost_slots.acquire();
     particle_types(new_index) = ParticleType::NORMAL;
-    return new_index;
+    particle_index.change(new_index, ParticleType::GHOST, ParticleType::NORMAL);
   }
+  return new_indices;
 }
 
 void Particles::setGhostParticle(int index) {
   if (index < 0 || index >= size) {
-    std::cerr << "Error: Index is out of range." << std::endl;
-    std::cerr << "Size: " << size << ", Index: " << std::endl;
+    Log(LOG_ERROR) << "Error: Index is out of range.";
+    Log(LOG_ERROR) << "Size: " << size << ", Index: " << index;
     throw std::out_of_range("Error: Index is out of range.");
   }
+  const bool concurrent = ghost_slots.isCaching();
+  const bool is_inflow = particle_types(index) == ParticleType::INFLOW || particle_types(index) == ParticleType::DUMMY_INFLOW;
+  const bool is_wall = particle_types(index) == ParticleType::WALL || particle_types(index) == ParticleType::DUMMY_WALL;
+  if (!concurrent) particle_index.change(index, particle_types(index), ParticleType::GHOST);
   particle_types(index) = ParticleType::GHOST;
   boundary_types(index) = BoundaryType::OTHERS;
   position.col(index).setZero();
@@ -406,76 +786,250 @@ void Particles::setGhostParticle(int index) {
   correction_velocity.col(index).setZero();
   source_term(index) = 0.0;
   voxel_ratio(index) = 0.0;
-  ghost_stack.push(index);
-  std::cout << "Changed ghost particle: " << index << std::endl;
+  particle_spacing(index) = condition_.average_distance;
+  ghost_slots.release(index);
+  if (concurrent) return;
+  if (is_inflow) removeStaleInletParticles();
+  if (is_wall) static_boundary.clear();
+  Log(LOG_DEBUG) << "Changed ghost particle: " << index;
 }
 
-void Particles::removeOutsideParticles(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos) {
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::GHOST) continue;
-    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
-      if (position.col(i_particle)(i_dim) < minpos(i_dim) || position.col(i_particle)(i_dim) > maxpos(i_dim)) {
-        setGhostParticle(i_particle);
-      }
+void Particles::setGhostParticles(const std::vector<int>& indices) {
+  bool has_inflow = false;
+  bool has_wall = false;
+  for (int index : indices) {
+    if (index < 0 || index >= size) {
+      Log(LOG_ERROR) << "Error: Index is out of range.";
+      Log(LOG_ERROR) << "Size: " << size << ", Index: " << index;
+      throw std::out_of_range("Error: Index is out of range.");
     }
+    if (particle_types(index) == ParticleType::INFLOW || particle_types(index) == ParticleType::DUMMY_INFLOW) has_inflow = true;
+    if (particle_types(index) == ParticleType::WALL || particle_types(index) == ParticleType::DUMMY_WALL) has_wall = true;
+    particle_index.change(index, particle_types(index), ParticleType::GHOST);
+    particle_types(index) = ParticleType::GHOST;
+    boundary_types(index) = BoundaryType::OTHERS;
   }
+  if (has_inflow) removeStaleInletParticles();
+  if (has_wall) static_boundary.clear();
+  // Clears one array at a time rather than one particle at a time.
+  for (int index : indices) position.col(index).setZero();
+  for (int index : indices) velocity.col(index).setZero();
+  for (int index : indices) temporary_position.col(index).setZero();
+  for (int index : indices) temporary_velocity.col(index).setZero();
+  for (int index : indices) correction_velocity.col(index).setZero();
+  for (int index : indices) pressure(index) = 0.0;
+  for (int index : indices) particle_number_density(index) = 0.0;
+  for (int index : indices) neighbor_particles(index) = 0;
+  for (int index : indices) source_term(index) = 0.0;
+  for (int index : indices) voxel_ratio(index) = 0.0;
+  for (int index : indices) particle_spacing(index) = condition_.average_distance;
+  for (int index : indices) ghost_slots.release(index);
 }
 
-void Particles::removeFastParticles(double max_speed) {
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::GHOST) continue;
-    if (velocity.col(i_particle).norm() > max_speed) setGhostParticle(i_particle);
+void Particles::beginConcurrentUpdate(int slots_per_thread, int max_slots) {
+  if (max_slots < 0) max_slots = slots_per_thread * SlotAllocator::getThreadCount();
+  reserveGhostParticles(max_slots);
+  ghost_slots.fillCaches(slots_per_thread);
+}
+
+void Particles::endConcurrentUpdate() {
+  ghost_slots.drainCaches();
+  particle_index.build(particle_types);
+  static_boundary.clear();
+  removeStaleInletParticles();
+}
+
+void Particles::removeStaleInletParticles() {
+  // A freed inflow slot may already hold another particle, so entries are checked by type, not by GHOST.
+  auto is_not_inflow = [this](int index) {
+    return particle_types(index) != ParticleType::INFLOW && particle_types(index) != ParticleType::DUMMY_INFLOW;
+  };
+  for (Inlet& inlet : inlets) {
+    inlet.inflow_particles.erase(std::remove_if(inlet.inflow_particles.begin(), inlet.inflow_particles.end(), is_not_inflow),
+                                 inlet.inflow_particles.end());
+    inlet.dummy_particles.erase(std::remove_if(inlet.dummy_particles.begin(), inlet.dummy_particles.end(), is_not_inflow),
+                                inlet.dummy_particles.end());
   }
 }
 
-void Particles::calculateTemporaryParticleNumberDensity() {
-  Grid grid(condition_.pnd_weight_radius, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::GHOST) {
-      particle_number_density(i_particle) = 0.0;
-      neighbor_particles(i_particle) = 0;
-      continue;
+int Particles::removeParticles(const std::function<bool(int)>& predicate) {
+  ParticleIndex::Range live_range = particle_index.getLiveRange();
+  const int live_size = live_range.size();
+  std::vector<char> removed_flags(live_size, 0);
+#pragma omp parallel for
+  for (int i_live = 0; i_live < live_size; ++i_live) {
+    if (predicate(live_range.begin()[i_live])) removed_flags[i_live] = 1;
+  }
+  std::vector<int> removed;
+  for (int i_live = 0; i_live < live_size; ++i_live) {
+    if (removed_flags[i_live]) removed.push_back(live_range.begin()[i_live]);
+  }
+  if (removed.empty()) return 0;
+  // Sorts so that slots are reused in the same order regardless of the index layout.
+  std::sort(removed.begin(), removed.end());
+  setGhostParticles(removed);
+  StepLog(LOG_INFO) << "Removed particles: " << removed.size();
+  return removed.size();
+}
+
+int Particles::removeOutsideParticles(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos) {
+  return removeParticles([&](int index) {
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      if (position(i_dim, index) < minpos(i_dim) || position(i_dim, index) > maxpos(i_dim)) return true;
     }
+    return false;
+  });
+}
+
+int Particles::removeFastParticles(double max_speed) {
+  return removeParticles([&](int index) { return velocity.col(index).norm() > max_speed; });
+}
+
+void Particles::calculateTemporaryParticleNumberDensity() {
+  if (condition_.static_walls && isUniformResolution()) {
+    calculateParticleNumberDensityWithStaticBoundary(temporary_position);
+  } else {
+    Grid grid(condition_.pnd_weight_radius * max_spacing_scale, temporary_position, particle_types.array() != ParticleType::GHOST, dimension);
+    calculateParticleNumberDensity(temporary_position, grid);
+  }
+  addPolygonWallParticleNumberDensity(temporary_position);
+}
+
+void Particles::updateParticleNumberDensity() {
+  if (condition_.static_walls && isUniformResolution()) {
+    calculateParticleNumberDensityWithStaticBoundary(position);
+    addPolygonWallParticleNumberDensity(position);
+    return;
+  }
+  Grid grid(condition_.pnd_weight_radius * max_spacing_scale, position, particle_types.array() != ParticleType::GHOST, dimension);
+  updateParticleNumberDensity(grid);
+}
+
+void Particles::updateParticleNumberDensity(const Grid& grid) {
+  calculateParticleNumberDensity(position, grid);
+  addPolygonWallParticleNumberDensity(position);
+}
+
+void Particles::calculateParticleNumberDensity(const Eigen::Matrix3Xd& coordinates, const Grid& grid) {
+  if (condition_.simd_kernels && isUniformResolution()) {
+    calculateParticleNumberDensityWithKernels(coordinates, grid);
+    return;
+  }
+  // Ghosts keep zero, which setGhostParticle() assigns.
+  forEachParticle(particle_index.getLiveRange(), [&](int i_particle) {
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
     double pnd = 0.0;
-    int count = 0;
+    double count = 0.0;
+    const double scale = getSpacingScale(i_particle);
     for (int j_particle : neighbors) {
       if (particle_types(i_particle) == ParticleType::GHOST) continue;
-      Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      pnd += weightForParticleNumberDensity(r_ij);
-      ++count;
+      Eigen::Vector3d r_ij = coordinates.col(j_particle) - coordinates.col(i_particle);
+      if (r_ij.norm() >= condition_.pnd_weight_radius * scale) continue;
+      const double volume_ratio = getVolumeRatio(i_particle, j_particle);
+      pnd += weightForParticleNumberDensity(r_ij / scale) * volume_ratio;
+      count += volume_ratio;
     }
     particle_number_density(i_particle) = pnd;
-    neighbor_particles(i_particle) = count;
-  }
+    neighbor_particles(i_particle) = std::lround(count);
+  });
 }
 
-void Particles::updateParticleNumberDensity() {
-  Grid grid(condition_.pnd_weight_radius, position, particle_types.array() != ParticleType::GHOST, dimension);
-  updateParticleNumberDensity(grid);
+void Particles::calculateParticleNumberDensityWithKernels(const Eigen::Matrix3Xd& coordinates, const Grid& grid) {
+  aligned_coordinates.assign(coordinates);
+  forEachParticle(particle_index.getLiveRange(), [&](int i_particle) {
+    Grid::Neighbors candidates;
+    grid.getNeighborsInBox(i_particle, candidates);
+    int count = 0;
+    particle_number_density(i_particle) = pair_kernels::sumParticleNumberDensity(aligned_coordinates, i_particle,
+        candidates.data(), candidates.size(), condition_.pnd_weight_radius, count);
+    neighbor_particles(i_particle) = count;
+  });
 }
 
-void Particles::updateParticleNumberDensity(const Grid& grid) {
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::GHOST) {
-      particle_number_density(i_particle) = 0.0;
-      neighbor_particles(i_particle) = 0;
-      continue;
-    }
-    Grid::Neighbors neighbors;
-    grid.getNeighbors(i_particle, neighbors);
+void Particles::calculateParticleNumberDensityWithStaticBoundary(const Eigen::Matrix3Xd& coordinates) {
+  prepareStaticBoundary();
+  const double radius = condition_.pnd_weight_radius;
+  const ParticleIndex::Range moving = particle_index.getRange(ParticleType::NORMAL, ParticleType::DUMMY_INFLOW);
+  Grid grid(radius, gatherColumns(coordinates, moving), VectorXb::Constant(moving.size(), true), dimension);
+  forEachParticle(particle_index.getLiveRange(), [&](int i_particle) {
+    Grid::Neighbors neighbors, buffer;
     double pnd = 0.0;
     int count = 0;
+    if (static_boundary.contains(i_particle)) {
+      // Contributions among boundary particles are cached.
+      pnd = static_boundary.getParticleNumberDensity(i_particle);
+      count = static_boundary.getNeighborCount(i_particle);
+      grid.getNeighborsAround(coordinates.col(i_particle), neighbors);
+      for (int& j_particle : neighbors) j_particle = moving.begin()[j_particle];
+    } else {
+      getNeighborsWithStaticBoundary(i_particle, coordinates, grid, moving, neighbors, buffer);
+    }
     for (int j_particle : neighbors) {
-      if (particle_types(i_particle) == ParticleType::GHOST) continue;
-      Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
+      Eigen::Vector3d r_ij = coordinates.col(j_particle) - coordinates.col(i_particle);
+      if (r_ij.squaredNorm() >= radius * radius) continue;
       pnd += weightForParticleNumberDensity(r_ij);
       ++count;
     }
     particle_number_density(i_particle) = pnd;
     neighbor_particles(i_particle) = count;
+  });
+}
+
+void Particles::addPolygonWallParticleNumberDensity(const Eigen::Matrix3Xd& coordinates) {
+  if (polygon_wall.isEmpty()) return;
+  for (int i_particle : particle_index.getLiveRange()) {
+    addPolygonWallParticleNumberDensity(coordinates.col(i_particle), particle_number_density(i_particle), neighbor_particles(i_particle));
+  }
+}
+
+void Particles::loadPolygonWall(const std::string& path) {
+  if (!resolution_zones.empty() || !isUniformResolution()) {
+    Log(LOG_ERROR) << "Error: Polygon walls cannot be used with resolution zones, whose particles have their own spacing.";
+    throw std::logic_error("Error: Polygon walls cannot be used with resolution zones.");
   }
+  polygon_wall.readFile(path, dimension);
+  const double l0 = condition_.average_distance;
+  wall_pnd_weight.build([this](const Eigen::Vector3d& vec) { return weightForParticleNumberDensity(vec); },
+                        condition_.pnd_weight_radius, l0, dimension);
+  wall_gradient_weight.build([this](const Eigen::Vector3d& vec) { return weightForGradientPressure(vec); },
+                             condition_.gradient_radius, l0, dimension);
+  wall_viscosity_weight.build([this](const Eigen::Vector3d& vec) { return weightForLaplacianViscosity(vec); },
+                              condition_.laplacian_viscosity_weight_radius, l0, dimension);
+  Log(LOG_INFO) << "Wall weight for PND at the particle spacing: " << wall_pnd_weight.getWeight(l0);
+}
+
+void Particles::prepareStaticBoundary() {
+  if (static_boundary.isBuilt()) return;
+  const ParticleIndex::Range walls = particle_index.getRange(ParticleType::WALL);
+  const ParticleIndex::Range dummy_walls = particle_index.getRange(ParticleType::DUMMY_WALL);
+  std::vector<int> indices(walls.begin(), walls.end());
+  indices.insert(indices.end(), dummy_walls.begin(), dummy_walls.end());
+  static_boundary.build(position, indices,
+      std::max(condition_.pnd_weight_radius, condition_.laplacian_pressure_weight_radius), dimension);
+  static_boundary.cacheParticleNumberDensity(position, condition_.pnd_weight_radius,
+      [this](const Eigen::Vector3d& vec) { return weightForParticleNumberDensity(vec); });
+  Log(LOG_DEBUG) << "Built static boundary: " << indices.size() << " particles";
+}
+
+void Particles::getNeighborsWithStaticBoundary(int index, const Eigen::Matrix3Xd& coordinates, const Grid& moving_grid,
+                                               const ParticleIndex::Range& moving, Grid::Neighbors& neighbors, Grid::Neighbors& buffer) const {
+  moving_grid.getNeighborsAround(coordinates.col(index), neighbors);
+  for (int& j_particle : neighbors) j_particle = moving.begin()[j_particle];
+  neighbors.erase(std::remove(neighbors.begin(), neighbors.end(), index), neighbors.end());
+  if (static_boundary.contains(index)) {
+    const ParticleIndex::Range cached = static_boundary.getNeighbors(index);
+    neighbors.insert(neighbors.end(), cached.begin(), cached.end());
+  } else {
+    static_boundary.getNeighborsAround(coordinates.col(index), buffer);
+    neighbors.insert(neighbors.end(), buffer.begin(), buffer.end());
+  }
+}
+
+Eigen::Matrix3Xd Particles::gatherColumns(const Eigen::Matrix3Xd& array, const ParticleIndex::Range& range) {
+  Eigen::Matrix3Xd gathered(3, range.size());
+  for (int k = 0; k < range.size(); ++k) gathered.col(k) = array.col(range.begin()[k]);
+  return gathered;
 }
 
 void Particles::updateVoxelRatio(int width, const Grid& grid) {
@@ -525,48 +1079,244 @@ void Particles::updateVoxelRatio(int width, const Grid& grid) {
   }
 }
 
+void Particles::resetInlets() {
+  inlets.assign(1, Inlet(condition_.inflow_velocity));
+  for (int i_particle = 0; i_particle < size; ++i_particle) {
+    if (particle_types(i_particle) == ParticleType::INFLOW) inlets[0].inflow_particles.push_back(i_particle);
+    if (particle_types(i_particle) == ParticleType::DUMMY_INFLOW) inlets[0].dummy_particles.push_back(i_particle);
+  }
+}
+
+int Particles::addInlet(const Eigen::Vector3d& velocity, const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos) {
+  Inlet new_inlet(velocity);
+  auto is_inside = [&](int index) {
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      if (position(i_dim, index) < minpos(i_dim) || position(i_dim, index) > maxpos(i_dim)) return false;
+    }
+    return true;
+  };
+  for (Inlet& inlet : inlets) {
+    for (int index : inlet.inflow_particles) if (is_inside(index)) new_inlet.inflow_particles.push_back(index);
+    for (int index : inlet.dummy_particles) if (is_inside(index)) new_inlet.dummy_particles.push_back(index);
+    inlet.inflow_particles.erase(std::remove_if(inlet.inflow_particles.begin(), inlet.inflow_particles.end(), is_inside),
+                                 inlet.inflow_particles.end());
+    inlet.dummy_particles.erase(std::remove_if(inlet.dummy_particles.begin(), inlet.dummy_particles.end(), is_inside),
+                                inlet.dummy_particles.end());
+  }
+  std::sort(new_inlet.inflow_particles.begin(), new_inlet.inflow_particles.end());
+  std::sort(new_inlet.dummy_particles.begin(), new_inlet.dummy_particles.end());
+  inlets.push_back(new_inlet);
+  return inlets.size() - 1;
+}
+
 void Particles::moveInflowParticles(const Timer& timer) {
-  inflow_stride += condition_.inflow_velocity.norm() * timer.getCurrentDeltaTime();
-  Eigen::Vector3d inflow_normalized = condition_.inflow_velocity.normalized();
-  if (inflow_stride >= condition_.average_distance) {
-    for (int i_particle = 0; i_particle < size; ++i_particle) {
-      if (particle_types(i_particle) == ParticleType::INFLOW) {
-        int new_index = addParticle();
-        particle_types(new_index) = ParticleType::NORMAL;
-        boundary_types(new_index) = boundary_types(i_particle);
-        position.col(new_index) = position.col(i_particle);
-        velocity.col(new_index) = velocity.col(i_particle);
-        pressure(new_index) = pressure(i_particle);
-        particle_number_density(new_index) = particle_number_density(i_particle);
-        neighbor_particles(new_index) = neighbor_particles(i_particle);
-        temporary_position.col(new_index) = temporary_position.col(i_particle);
-        temporary_velocity.col(new_index) = temporary_velocity.col(i_particle);
-        correction_velocity.col(new_index) = correction_velocity.col(i_particle);
-        temporary_velocity.col(i_particle) = condition_.inflow_velocity;
-        velocity.col(i_particle) = condition_.inflow_velocity;
-        temporary_position.col(i_particle) -= inflow_normalized  * condition_.average_distance;
-        position.col(i_particle) -= inflow_normalized  * condition_.average_distance;
-      }
-      if (particle_types(i_particle) == ParticleType::DUMMY_INFLOW) {
-        temporary_velocity.col(i_particle) = condition_.inflow_velocity;
-        velocity.col(i_particle) = condition_.inflow_velocity;
-        temporary_position.col(i_particle) -= inflow_normalized * condition_.average_distance;
-        position.col(i_particle) -= inflow_normalized * condition_.average_distance;
-      }
+  for (Inlet& inlet : inlets) {
+    inlet.stride += inlet.velocity.norm() * timer.getCurrentDeltaTime();
+    if (inlet.stride >= condition_.average_distance) {
+      emitInflowLayer(inlet);
+      inlet.stride -= condition_.average_distance;
     }
-    inflow_stride -= condition_.average_distance;
-  } else {
-    for (int i_particle = 0; i_particle < size; ++i_particle) {
-      if (particle_types(i_particle) == ParticleType::INFLOW || particle_types(i_particle) == ParticleType::DUMMY_INFLOW ) {
-        temporary_velocity.col(i_particle) = condition_.inflow_velocity;
-        velocity.col(i_particle) = condition_.inflow_velocity;
+    for (int i_particle : inlet.inflow_particles) {
+      temporary_velocity.col(i_particle) = inlet.velocity;
+      velocity.col(i_particle) = inlet.velocity;
+    }
+    for (int i_particle : inlet.dummy_particles) {
+      temporary_velocity.col(i_particle) = inlet.velocity;
+      velocity.col(i_particle) = inlet.velocity;
+    }
+  }
+}
+
+void Particles::emitInflowLayer(Inlet& inlet) {
+  const int layer_size = inlet.inflow_particles.size();
+  std::vector<int> new_indices = addParticles(layer_size);
+  for (int i_layer = 0; i_layer < layer_size; ++i_layer) {
+    int i_particle = inlet.inflow_particles[i_layer];
+    int new_index = new_indices[i_layer];
+    boundary_types(new_index) = boundary_types(i_particle);
+    position.col(new_index) = position.col(i_particle);
+    velocity.col(new_index) = velocity.col(i_particle);
+    pressure(new_index) = pressure(i_particle);
+    particle_number_density(new_index) = particle_number_density(i_particle);
+    neighbor_particles(new_index) = neighbor_particles(i_particle);
+    temporary_position.col(new_index) = temporary_position.col(i_particle);
+    temporary_velocity.col(new_index) = temporary_velocity.col(i_particle);
+    correction_velocity.col(new_index) = correction_velocity.col(i_particle);
+  }
+  Eigen::Vector3d step = inlet.velocity.normalized() * condition_.average_distance;
+  for (int i_particle : inlet.inflow_particles) {
+    temporary_position.col(i_particle) -= step;
+    position.col(i_particle) -= step;
+  }
+  for (int i_particle : inlet.dummy_particles) {
+    temporary_position.col(i_particle) -= step;
+    position.col(i_particle) -= step;
+  }
+}
+
+int Particles::addResolutionZone(const Eigen::Vector3d& minpos, const Eigen::Vector3d& maxpos, double spacing_ratio) {
+  if (spacing_ratio <= 0.0) {
+    Log(LOG_ERROR) << "Error: Spacing ratio of a resolution zone must be positive.";
+    throw std::invalid_argument("Error: Spacing ratio of a resolution zone must be positive.");
+  }
+  if (!polygon_wall.isEmpty()) {
+    Log(LOG_ERROR) << "Error: Resolution zones cannot be used with polygon walls, whose wall weight functions are tabulated at average_distance.";
+    throw std::logic_error("Error: Resolution zones cannot be used with polygon walls.");
+  }
+  resolution_zones.push_back(ResolutionZone(minpos, maxpos, spacing_ratio));
+  return resolution_zones.size() - 1;
+}
+
+void Particles::readResolutionZones() {
+  if (condition_.resolution_zones.empty()) return;
+  resolution_zones.clear();
+  for (const ResolutionZone& zone : condition_.resolution_zones) addResolutionZone(zone.minpos, zone.maxpos, zone.spacing_ratio);
+}
+
+int Particles::adaptResolution() {
+  // Each pass halves or doubles spacings, so zones of ratios such as 0.25 or 4 take a few of them.
+  // Particles moved across a zone boundary by a merge could be split back, so passes are bounded.
+  const int max_passes = 8;
+  int changed = 0;
+  for (int i_pass = 0; i_pass < max_passes; ++i_pass) {
+    const int pass_changed = splitParticles() + mergeParticles();
+    if (pass_changed == 0) break;
+    changed += pass_changed;
+  }
+  min_spacing_scale = 1.0;
+  max_spacing_scale = 1.0;
+  for (int i_particle : particle_index.getLiveRange()) {
+    double scale = particle_spacing(i_particle) / condition_.average_distance;
+    min_spacing_scale = std::min(min_spacing_scale, scale);
+    max_spacing_scale = std::max(max_spacing_scale, scale);
+  }
+  if (changed > 0) Log(LOG_INFO) << "Adapted resolution: " << changed << " particles";
+  return changed;
+}
+
+double Particles::getTargetSpacing(const Eigen::Vector3d& point) const {
+  double ratio = 1.0;
+  bool found = false;
+  for (const ResolutionZone& zone : resolution_zones) {
+    if (!zone.contains(point)) continue;
+    ratio = found ? std::min(ratio, zone.spacing_ratio) : zone.spacing_ratio;
+    found = true;
+  }
+  return ratio * condition_.average_distance;
+}
+
+int Particles::splitParticles() {
+  // Children of a split particle are at least 0.75 times the target, so they are not merged right after.
+  const double split_ratio = 1.5;
+  std::vector<int> targets;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
+    if (particle_spacing(i_particle) > split_ratio * getTargetSpacing(position.col(i_particle))) targets.push_back(i_particle);
+  }
+  if (targets.empty()) return 0;
+  const int children = (dimension == 2) ? 4 : 8;
+  const int target_size = targets.size();
+  // Each thread splits one contiguous chunk of targets and takes the slots for it in order,
+  // so with deterministic_slots the children get the same slots as on a single thread.
+  const int chunk = (target_size + SlotAllocator::getThreadCount() - 1) / SlotAllocator::getThreadCount();
+  beginConcurrentUpdate(chunk * (children - 1), target_size * (children - 1));
+#pragma omp parallel for schedule(static, chunk)
+  for (int i_target = 0; i_target < target_size; ++i_target) {
+    const int i_particle = targets[i_target];
+    const double spacing = particle_spacing(i_particle) * 0.5;
+    const Eigen::Vector3d center = position.col(i_particle);
+    // The parent becomes the first child.
+    for (int i_child = 0; i_child < children; ++i_child) {
+      int index = (i_child == 0) ? i_particle : addParticle();
+      Eigen::Vector3d offset((i_child & 1) ? 0.5 : -0.5, (i_child & 2) ? 0.5 : -0.5, (i_child & 4) ? 0.5 : -0.5);
+      if (dimension == 2) offset(2) = 0.0;
+      position.col(index) = center + offset * spacing;
+      temporary_position.col(index) = position.col(index);
+      velocity.col(index) = velocity.col(i_particle);
+      temporary_velocity.col(index) = velocity.col(i_particle);
+      pressure(index) = pressure(i_particle);
+      particle_number_density(index) = particle_number_density(i_particle);
+      boundary_types(index) = boundary_types(i_particle);
+      particle_spacing(index) = spacing;
+      if (i_child != 0) copyParticleFields(i_particle, index);
+    }
+  }
+  endConcurrentUpdate();
+  return target_size;
+}
+
+int Particles::mergeParticles() {
+  // Particles finer than merge_ratio times the target are merged with the candidates nearest to the merged
+  // center while its spacing stays within the target, so 2^dimension particles of half the target become
+  // one of the target. Merged particles are not split right after, as they are within the target.
+  const double merge_ratio = 0.7;
+  const double tolerance = 1.0e-6;
+  VectorXb candidates = VectorXb::Constant(size, false);
+  double max_spacing = 0.0;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
+    if (particle_spacing(i_particle) >= merge_ratio * getTargetSpacing(position.col(i_particle))) continue;
+    candidates(i_particle) = true;
+    max_spacing = std::max(max_spacing, particle_spacing(i_particle));
+  }
+  if (max_spacing == 0.0) return 0;
+  // Partners are searched within 1.5 times the spacing from the merged center, which stays within
+  // the spacing from the first particle.
+  Grid grid(2.5 * max_spacing, position, candidates, dimension);
+  std::vector<bool> taken(size, false);
+  std::vector<int> removed;
+  std::vector<int> group;
+  Grid::Neighbors neighbors;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
+    if (!candidates(i_particle) || taken[i_particle]) continue;
+    grid.getNeighbors(i_particle, neighbors);
+    const double max_volume = std::pow(getTargetSpacing(position.col(i_particle)), dimension) * (1.0 + tolerance);
+    double volume = std::pow(particle_spacing(i_particle), dimension);
+    Eigen::Vector3d center = position.col(i_particle);
+    group.assign(1, i_particle);
+    taken[i_particle] = true;
+    while (true) {
+      int partner = -1;
+      double min_distance = 1.5 * particle_spacing(i_particle);
+      for (int j_particle : neighbors) {
+        if (taken[j_particle] || volume + std::pow(particle_spacing(j_particle), dimension) > max_volume) continue;
+        double distance = (position.col(j_particle) - center).norm();
+        if (distance < min_distance) {
+          min_distance = distance;
+          partner = j_particle;
+        }
       }
+      if (partner < 0) break;
+      const double volume_j = std::pow(particle_spacing(partner), dimension);
+      center = (center * volume + position.col(partner) * volume_j) / (volume + volume_j);
+      volume += volume_j;
+      group.push_back(partner);
+      taken[partner] = true;
     }
+    if (group.size() == 1) {
+      // Left to be a partner of a later particle.
+      taken[i_particle] = false;
+      continue;
+    }
+    Eigen::Vector3d momentum = Eigen::Vector3d::Zero();
+    double pressure_sum = 0.0;
+    for (int j_particle : group) {
+      const double volume_j = std::pow(particle_spacing(j_particle), dimension);
+      momentum += velocity.col(j_particle) * volume_j;
+      pressure_sum += pressure(j_particle) * volume_j;
+    }
+    position.col(i_particle) = center;
+    velocity.col(i_particle) = momentum / volume;
+    pressure(i_particle) = pressure_sum / volume;
+    temporary_position.col(i_particle) = position.col(i_particle);
+    temporary_velocity.col(i_particle) = velocity.col(i_particle);
+    particle_spacing(i_particle) = std::pow(volume, 1.0 / dimension);
+    removed.insert(removed.end(), group.begin() + 1, group.end());
   }
+  setGhostParticles(removed);
+  return removed.size();
 }
 
 void Particles::calculateTemporaryVelocity(const Eigen::Vector3d& force, const Timer& timer) {
-  Grid grid(condition_.laplacian_viscosity_weight_radius, position,
+  Grid grid(condition_.laplacian_viscosity_weight_radius * max_spacing_scale, position,
             particle_types.array() == ParticleType::NORMAL || particle_types.array() == ParticleType::INFLOW,
             condition_.dimension);
   calculateTemporaryVelocity(force, timer, grid);
@@ -574,22 +1324,116 @@ void Particles::calculateTemporaryVelocity(const Eigen::Vector3d& force, const T
 
 void Particles::calculateTemporaryVelocity(const Eigen::Vector3d& force, const Timer& timer, Grid& grid) {
   double delta_time = timer.getCurrentDeltaTime();
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) == ParticleType::NORMAL) {
+  auto viscosity_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianViscosity(vec); };
+  if (condition_.viscosity_calculation && condition_.implicit_viscosity) {
+    for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
       temporary_velocity.col(i_particle) += delta_time * force;
-      if (condition_.viscosity_calculation) {
-        Grid::Neighbors neighbors;
-        grid.getNeighbors(i_particle, neighbors);
-        Eigen::Vector3d lap_vec(0.0, 0.0, 0.0);
-        for (int j_particle : neighbors) {
-          Eigen::Vector3d u_ij = velocity.col(j_particle) - velocity.col(i_particle);
-          Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
-          lap_vec += u_ij * weightForLaplacianViscosity(r_ij) * 2 * dimension / (laplacian_lambda_viscosity * initial_particle_number_density);
-        }
-        temporary_velocity.col(i_particle) += lap_vec * condition_.kinematic_viscosity * delta_time;
+    }
+    solveViscosityImplicitly(timer, grid);
+    return;
+  }
+  forEachParticle(particle_index.getRange(ParticleType::NORMAL), [&](int i_particle) {
+    temporary_velocity.col(i_particle) += delta_time * force;
+    if (condition_.viscosity_calculation) {
+      Grid::Neighbors neighbors;
+      grid.getNeighbors(i_particle, neighbors);
+      Eigen::Vector3d lap_vec(0.0, 0.0, 0.0);
+      for (int j_particle : neighbors) {
+        Eigen::Vector3d u_ij = velocity.col(j_particle) - velocity.col(i_particle);
+        Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
+        lap_vec += u_ij * getLaplacianPairWeight(viscosity_weight, i_particle, j_particle, r_ij) * 2 * dimension
+                 / (laplacian_lambda_viscosity * initial_particle_number_density);
       }
+      lap_vec /= getVolumeScale(i_particle);
+      if (!polygon_wall.isEmpty()) {
+        Eigen::Vector3d direction;
+        double distance = polygon_wall.getDistance(position.col(i_particle), direction);
+        lap_vec -= velocity.col(i_particle) * wall_viscosity_weight.getWeight(distance) * 2 * dimension
+                 / (laplacian_lambda_viscosity * initial_particle_number_density);
+      }
+      temporary_velocity.col(i_particle) += lap_vec * condition_.kinematic_viscosity * delta_time;
+    }
+  });
+}
+
+void Particles::solveViscosityImplicitly(const Timer& timer, const Grid& grid) {
+  using T = Eigen::Triplet<double>;
+  const bool distributed = domain_decomposition && domain_decomposition->isDistributed();
+  const ParticleIndex::Range normals = particle_index.getRange(ParticleType::NORMAL);
+  // Rows are numbered by the order in the normal range. Across ranks they are particle indices,
+  // as in the pressure solve, and the other rows are left to the identity.
+  const int n_size = distributed ? size : normals.size();
+  std::vector<int> rows(size, -1);
+  for (int k = 0; k < normals.size(); ++k) rows[normals.begin()[k]] = distributed ? normals.begin()[k] : k;
+  const double coefficient = timer.getCurrentDeltaTime() * condition_.kinematic_viscosity * 2 * dimension
+                           / (laplacian_lambda_viscosity * initial_particle_number_density);
+  Eigen::SparseMatrix<double> v_mat(n_size, n_size);
+  Eigen::MatrixX3d rhs = Eigen::MatrixX3d::Zero(n_size, 3);
+  std::vector<T> coeffs;
+  coeffs.reserve(n_size * (int)(std::pow(condition_.laplacian_viscosity_influence * 2, dimension)));
+  if (distributed) {
+    for (int i_particle = 0; i_particle < size; ++i_particle) {
+      // Rows of halo particles are solved by their owners.
+      if (rows[i_particle] < 0 || isHaloParticle(i_particle)) coeffs.push_back(T(i_particle, i_particle, 1.0));
     }
   }
+  auto viscosity_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianViscosity(vec); };
+  Grid::Neighbors neighbors;
+  for (int i_particle : normals) {
+    if (isHaloParticle(i_particle)) continue;
+    const int k = rows[i_particle];
+    grid.getNeighbors(i_particle, neighbors);
+    // Rows are multiplied by the volume scale, which keeps the matrix symmetric across spacings.
+    const double volume = getVolumeScale(i_particle);
+    double diagonal = volume;
+    Eigen::Vector3d b = temporary_velocity.col(i_particle) * volume;
+    for (int j_particle : neighbors) {
+      Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
+      double a_ij = coefficient * getLaplacianPairWeight(viscosity_weight, i_particle, j_particle, r_ij);
+      diagonal += a_ij;
+      if (rows[j_particle] >= 0) coeffs.push_back(T(k, rows[j_particle], -a_ij));
+      else b += a_ij * velocity.col(j_particle);
+    }
+    if (!polygon_wall.isEmpty()) {
+      Eigen::Vector3d direction;
+      diagonal += coefficient * wall_viscosity_weight.getWeight(polygon_wall.getDistance(position.col(i_particle), direction));
+    }
+    coeffs.push_back(T(k, k, diagonal));
+    rhs.row(k) = b.transpose();
+  }
+  v_mat.setFromTriplets(coeffs.begin(), coeffs.end());
+  int iterations = 0;
+  if (distributed) {
+    for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+      Eigen::VectorXd solution;
+      int dim_iterations = 0;
+      double error = 0.0;
+      if (!domain_decomposition->solveConjugateGradient(v_mat, rhs.col(i_dim), solution, dim_iterations, error)) {
+        Log(LOG_ERROR) << "Error: Failed solving.";
+        solver_failed = true;
+      }
+      iterations += dim_iterations;
+      for (int i_particle : normals) temporary_velocity(i_dim, i_particle) = solution(i_particle);
+    }
+    StepLog(LOG_INFO) << "Viscosity solver - iterations: " << iterations;
+    return;
+  }
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>> cg;
+  cg.compute(v_mat);
+  if (cg.info() != Eigen::ComputationInfo::Success) {
+    Log(LOG_ERROR) << "Error: Failed decompostion.";
+    solver_failed = true;
+  }
+  for (int i_dim = 0; i_dim < dimension; ++i_dim) {
+    Eigen::VectorXd solution = cg.solveWithGuess(rhs.col(i_dim), rhs.col(i_dim));
+    if (cg.info() != Eigen::ComputationInfo::Success) {
+      Log(LOG_ERROR) << "Error: Failed solving.";
+      solver_failed = true;
+    }
+    iterations += cg.iterations();
+    for (int k = 0; k < n_size; ++k) temporary_velocity(i_dim, normals.begin()[k]) = solution(k);
+  }
+  StepLog(LOG_INFO) << "Viscosity solver - iterations: " << iterations;
 }
 
 void Particles::updateTemporaryPosition(const Timer& timer) {
@@ -597,7 +1441,7 @@ void Particles::updateTemporaryPosition(const Timer& timer) {
 }
 
 void Particles::solvePressurePoisson(const Timer& timer) {
-  Grid grid(condition_.laplacian_pressure_weight_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.laplacian_pressure_weight_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   using T = Eigen::Triplet<double>;
   double lap_r = grid.getGridWidth()/condition_.average_distance;
   int n_size = (int)(std::pow(lap_r * 2, dimension));
@@ -606,6 +1450,7 @@ void Particles::solvePressurePoisson(const Timer& timer) {
   source_term.setZero();
   std::vector<T> coeffs(size * n_size);
   std::vector<int> neighbors(n_size * 2);
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
   for (int i_particle = 0; i_particle < size; ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       coeffs.push_back(T(i_particle, i_particle, 1.0));
@@ -615,32 +1460,152 @@ void Particles::solvePressurePoisson(const Timer& timer) {
       continue;
     }
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     double sum = 0.0;
     double div_vel = 0.0;
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      double mat_ij = weightForLaplacianPressure(r_ij) * 2 * dimension
+      double mat_ij = getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij) * 2 * dimension
               / (laplacian_lambda_pressure * initial_particle_number_density);
       sum -= mat_ij;
       div_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) * condition_.dimension
+              / (r_ij.squaredNorm() * initial_particle_number_density);
       if (boundary_types(j_particle) == BoundaryType::INNER) {
         coeffs.push_back(T(i_particle, j_particle, mat_ij));
       }
     }
-    sum -= condition_.weak_compressibility * condition_.mass_density / (delta_time * delta_time);
+    // The row is multiplied by the volume scale, as getLaplacianPairWeight() is.
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
     coeffs.push_back(T(i_particle, i_particle, sum));
-    source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+    source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
                 - (particle_number_density(i_particle) - initial_particle_number_density)
-                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
+  }
+  p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
+  solveConjugateGradient(p_mat);
+}
+
+void Particles::solvePressurePoissonFused(const Timer& timer) {
+  const double pnd_radius = condition_.pnd_weight_radius;
+  const double lap_radius = condition_.laplacian_pressure_weight_radius;
+  // With static_walls, only the particles other than walls are binned here.
+  const ParticleIndex::Range moving = particle_index.getRange(ParticleType::NORMAL, ParticleType::DUMMY_INFLOW);
+  std::unique_ptr<Grid> grid;
+  const bool static_walls = condition_.static_walls && isUniformResolution();
+  // The static boundary path gathers its own neighbor lists, so the pair kernels serve the other one.
+  const bool simd_kernels = condition_.simd_kernels && isUniformResolution() && !static_walls;
+  if (simd_kernels) aligned_coordinates.assign(temporary_position);
+  const bool uniform = isUniformResolution();
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
+  if (static_walls) {
+    prepareStaticBoundary();
+    grid.reset(new Grid(std::max(pnd_radius, lap_radius), gatherColumns(temporary_position, moving),
+                        VectorXb::Constant(moving.size(), true), dimension));
+  } else {
+    grid.reset(new Grid(std::max(pnd_radius, lap_radius) * max_spacing_scale, temporary_position,
+                        particle_types.array() != ParticleType::GHOST, dimension));
+  }
+  using T = Eigen::Triplet<double>;
+  double lap_r = lap_radius / condition_.average_distance;
+  int n_size = (int)(std::pow(lap_r * 2, dimension));
+  double delta_time = timer.getCurrentDeltaTime();
+  Eigen::SparseMatrix<double> p_mat(size, size);
+  source_term.setZero();
+  std::vector<T> coeffs;
+  coeffs.reserve(size * n_size);
+  Grid::Neighbors neighbors, boundary_neighbors;
+  neighbors.reserve(n_size * 2);
+  // First sweep: everything that depends only on the particle itself and its neighbors' types.
+  // Off-diagonal entries are kept for all candidates and filtered once every boundary type is known.
+  for (int i_particle : particle_index.getRange(ParticleType::GHOST)) {
+    coeffs.push_back(T(i_particle, i_particle, 1.0));
+  }
+  for (int i_particle : particle_index.getLiveRange()) {
+    // Rows of halo particles are solved by their owners.
+    if (isHaloParticle(i_particle)) {
+      coeffs.push_back(T(i_particle, i_particle, 1.0));
+      continue;
+    }
+    double pnd = 0.0;
+    int count = 0;
+    if (static_walls) {
+      getNeighborsWithStaticBoundary(i_particle, temporary_position, *grid, moving, neighbors, boundary_neighbors);
+    } else if (simd_kernels) {
+      // PND is summed over the whole box; only the candidates within the Laplacian radius are kept.
+      grid->getNeighborsInBox(i_particle, neighbors);
+      pnd = pair_kernels::sumParticleNumberDensity(aligned_coordinates, i_particle, neighbors.data(), neighbors.size(),
+                                                   pnd_radius, count);
+      neighbors.resize(pair_kernels::filterNeighbors(aligned_coordinates, i_particle, neighbors.data(), neighbors.size(),
+                                                     lap_radius, neighbors.data()));
+    } else {
+      grid->getNeighbors(i_particle, neighbors);
+    }
+    const bool is_fluid = particle_types(i_particle) == ParticleType::NORMAL || particle_types(i_particle) == ParticleType::WALL
+        || particle_types(i_particle) == ParticleType::INFLOW;
+    const int row_begin = coeffs.size();
+    const double scale = getSpacingScale(i_particle);
+    double volume_count = 0.0;
+    double sum = 0.0;
+    double div_vel = 0.0;
+    for (int j_particle : neighbors) {
+      // Neighbors within the radius of either particle are coupled, by getLaplacianPairWeight().
+      const double pair_scale = uniform ? 1.0 : std::max(scale, getSpacingScale(j_particle));
+      Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
+      double r2 = r_ij.squaredNorm();
+      if (!simd_kernels && r2 < pnd_radius * pnd_radius * scale * scale) {
+        pnd += weightForParticleNumberDensity(r_ij / scale) * getVolumeRatio(i_particle, j_particle);
+        volume_count += getVolumeRatio(i_particle, j_particle);
+      }
+      if (!is_fluid || r2 >= lap_radius * lap_radius * pair_scale * pair_scale) continue;
+      ParticleType type_j = static_cast<ParticleType>(particle_types(j_particle));
+      if (type_j != ParticleType::NORMAL && type_j != ParticleType::WALL && type_j != ParticleType::INFLOW) continue;
+      double w_ij = weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle);
+      double mat_ij = (uniform ? w_ij : getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij))
+                    * 2 * dimension / (laplacian_lambda_pressure * initial_particle_number_density);
+      sum -= mat_ij;
+      div_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
+              * w_ij * condition_.dimension / (r2 * initial_particle_number_density);
+      coeffs.push_back(T(i_particle, j_particle, mat_ij));
+    }
+    count += std::lround(volume_count);
+    if (!polygon_wall.isEmpty()) addPolygonWallParticleNumberDensity(temporary_position.col(i_particle), pnd, count);
+    particle_number_density(i_particle) = pnd;
+    neighbor_particles(i_particle) = count;
+    if (!is_fluid) {
+      boundary_types(i_particle) = BoundaryType::OTHERS;
+    } else if (pnd < condition_.surface_threshold_pnd * initial_particle_number_density
+            && count < condition_.surface_threshold_number * initial_neighbor_particles) {
+      boundary_types(i_particle) = BoundaryType::SURFACE;
+    } else {
+      boundary_types(i_particle) = BoundaryType::INNER;
+    }
+    if (boundary_types(i_particle) != BoundaryType::INNER) {
+      coeffs.resize(row_begin);
+      coeffs.push_back(T(i_particle, i_particle, 1.0));
+      continue;
+    }
+    // The row is multiplied by the volume scale, as getLaplacianPairWeight() is.
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
+    coeffs.push_back(T(i_particle, i_particle, sum));
+    source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+                - (pnd - initial_particle_number_density)
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
   }
+  if (domain_decomposition) domain_decomposition->updateHalo(*this);
+  // Second sweep: drops couplings to surface neighbors, which are Dirichlet boundaries.
+  coeffs.erase(std::remove_if(coeffs.begin(), coeffs.end(), [this](const T& t) {
+    return t.row() != t.col() && boundary_types(t.col()) != BoundaryType::INNER;
+  }), coeffs.end());
   p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
   solveConjugateGradient(p_mat);
 }
 
 void Particles::solvePressurePoissonTanakaMasunaga(const Timer& timer) {
-  Grid grid(condition_.laplacian_pressure_weight_radius, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.laplacian_pressure_weight_radius * max_spacing_scale, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   using T = Eigen::Triplet<double>;
   double lap_r = grid.getGridWidth()/condition_.average_distance;
   int n_size = (int)(std::pow(lap_r * 2, dimension));
@@ -649,6 +1614,7 @@ void Particles::solvePressurePoissonTanakaMasunaga(const Timer& timer) {
   std::vector<T> coeffs(size * n_size);
   std::vector<int> neighbors(n_size * 2);
   source_term.setZero();
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
   for (int i_particle = 0; i_particle < size; ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       coeffs.push_back(T(i_particle, i_particle, 1.0));
@@ -658,32 +1624,35 @@ void Particles::solvePressurePoissonTanakaMasunaga(const Timer& timer) {
       continue;
     }
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     double sum = 0.0;
     double div_vel = 0.0;
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
-      double mat_ij = weightForLaplacianPressure(r_ij) * 2 * dimension
+      double mat_ij = getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij) * 2 * dimension
               / (laplacian_lambda_pressure * initial_particle_number_density);
       sum -= mat_ij;
       div_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) * condition_.dimension
+              / (r_ij.squaredNorm() * initial_particle_number_density);
       if (boundary_types(j_particle) == BoundaryType::INNER) {
         coeffs.push_back(T(i_particle, j_particle, mat_ij));
       }
     }
-    sum -= condition_.weak_compressibility * condition_.mass_density / (delta_time * delta_time);
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
     coeffs.push_back(T(i_particle, i_particle, sum));
-    source_term(i_particle) = div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
+    source_term(i_particle) = volume * (div_vel * condition_.mass_density * condition_.relaxation_coefficient_vel_div / delta_time
                 - (particle_number_density(i_particle) - initial_particle_number_density)
-                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density);
+                * condition_.relaxation_coefficient_pnd * condition_.mass_density / (delta_time * delta_time * initial_particle_number_density));
   }
   p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
   solveConjugateGradient(p_mat);
 }
 
 void Particles::solvePressurePoissonTamai(const Timer& timer) {
-  Grid grid(condition_.laplacian_pressure_weight_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.laplacian_pressure_weight_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   using T = Eigen::Triplet<double>;
   double lap_r = grid.getGridWidth()/condition_.average_distance;
   int n_size = (int)(std::pow(lap_r * 2, dimension));
@@ -692,6 +1661,7 @@ void Particles::solvePressurePoissonTamai(const Timer& timer) {
   std::vector<T> coeffs(size * n_size);
   std::vector<int> neighbors(n_size * 2);
   source_term.setZero();
+  auto laplacian_weight = [this](const Eigen::Vector3d& vec) { return weightForLaplacianPressure(vec); };
   for (int i_particle = 0; i_particle < size; ++i_particle) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) {
       coeffs.push_back(T(i_particle, i_particle, 1.0));
@@ -701,43 +1671,58 @@ void Particles::solvePressurePoissonTamai(const Timer& timer) {
       continue;
     }
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     double sum = 0.0;
     double div_vel = 0.0;
     double div_tmp_vel = 0.0;
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      double mat_ij = weightForLaplacianPressure(r_ij) * 2 * dimension
+      double mat_ij = getLaplacianPairWeight(laplacian_weight, i_particle, j_particle, r_ij) * 2 * dimension
               / (laplacian_lambda_pressure * initial_particle_number_density);
       sum -= mat_ij;
+      double w_ij = weightForLaplacianPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle);
       div_vel += (velocity.col(j_particle) - velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * w_ij * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
       div_tmp_vel += (temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle)).dot(r_ij)
-              * weightForLaplacianPressure(r_ij) * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
+              * w_ij * condition_.dimension / (r_ij.squaredNorm() * initial_particle_number_density);
               if (boundary_types(j_particle) == BoundaryType::INNER) {
         coeffs.push_back(T(i_particle, j_particle, mat_ij));
       }
     }
-    sum -= condition_.weak_compressibility * condition_.mass_density / (delta_time * delta_time);
+    const double volume = getVolumeScale(i_particle);
+    sum -= condition_.weak_compressibility * condition_.mass_density * volume / (delta_time * delta_time);
     coeffs.push_back(T(i_particle, i_particle, sum));
     double pnd_diff = (particle_number_density(i_particle) - initial_particle_number_density * voxel_ratio(i_particle)) / (initial_particle_number_density * voxel_ratio(i_particle));
-    source_term(i_particle) = (div_tmp_vel + std::abs(pnd_diff) * div_vel + std::abs(div_vel) * pnd_diff) * condition_.mass_density / delta_time;
+    source_term(i_particle) = volume * (div_tmp_vel + std::abs(pnd_diff) * div_vel + std::abs(div_vel) * pnd_diff) * condition_.mass_density / delta_time;
   }
   p_mat.setFromTriplets(coeffs.begin(), coeffs.end()); // Finished setup matrix
   solveConjugateGradient(p_mat);
 }
 
 void Particles::solveConjugateGradient(Eigen::SparseMatrix<double> p_mat) {
+  if (domain_decomposition && domain_decomposition->isDistributed()) {
+    int iterations = 0;
+    double error = 0.0;
+    if (!domain_decomposition->solveConjugateGradient(p_mat, source_term, pressure, iterations, error)) {
+      Log(LOG_ERROR) << "Error: Failed solving.";
+      solver_failed = true;
+    }
+    StepLog(LOG_INFO) << "Solver - iterations: " << iterations << ", estimated error: " << error;
+    return;
+  }
   Eigen::ConjugateGradient<Eigen::SparseMatrix<double>> cg;
   cg.compute(p_mat);
   if (cg.info() != Eigen::ComputationInfo::Success) {
-    std::cerr << "Error: Failed decompostion." << std::endl;
+    Log(LOG_ERROR) << "Error: Failed decompostion.";
+    solver_failed = true;
   }
   pressure = cg.solve(source_term);
   if (cg.info() != Eigen::ComputationInfo::Success) {
-    std::cerr << "Error: Failed solving." << std::endl;
+    Log(LOG_ERROR) << "Error: Failed solving.";
+    solver_failed = true;
   }
-  std::cout << "Solver - iterations: " << cg.iterations() << ", estimated error: " << cg.error() << std::endl;
+  StepLog(LOG_INFO) << "Solver - iterations: " << cg.iterations() << ", estimated error: " << cg.error();
 }
 
 void Particles::setZeroOnNegativePressure(){
@@ -747,17 +1732,40 @@ void Particles::setZeroOnNegativePressure(){
 }
 
 void Particles::correctVelocity(const Timer& timer) {
-  Grid grid(condition_.gradient_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.gradient_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   correctVelocity(timer, grid);
 }
 
 void Particles::correctVelocity(const Timer& timer, const Grid& grid) {
   correction_velocity.setZero();
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
-    if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
+  if (condition_.simd_kernels && isUniformResolution()) {
+    aligned_coordinates.assign(temporary_position);
+    forEachParticle(particle_index.getRange(ParticleType::NORMAL), [&](int i_particle) {
+      if (boundary_types(i_particle) == BoundaryType::OTHERS) return;
+      Grid::Neighbors neighbors;
+      grid.getNeighborsInBox(i_particle, neighbors);
+      neighbors.erase(std::remove_if(neighbors.begin(), neighbors.end(), [this](int j_particle) {
+        return boundary_types(j_particle) == BoundaryType::OTHERS;
+      }), neighbors.end());
+      neighbors.resize(pair_kernels::filterNeighbors(aligned_coordinates, i_particle, neighbors.data(), neighbors.size(),
+                                                     grid.getGridWidth(), neighbors.data()));
+      double p_min = pressure(i_particle);
+      for (int j_particle : neighbors) p_min = std::min(pressure(j_particle), p_min);
+      Eigen::Vector3d tmp = pair_kernels::sumGradient(aligned_coordinates, i_particle, neighbors.data(), neighbors.size(),
+                                                      pressure.data(), p_min, condition_.gradient_radius);
+      if (!polygon_wall.isEmpty()) tmp += getPolygonWallGradient(temporary_position.col(i_particle), pressure(i_particle) - p_min);
+      if (dimension == 2) tmp(2) = 0;
+      correction_velocity.col(i_particle) -= tmp * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
+    });
+    temporary_velocity += correction_velocity;
+    return;
+  }
+  forEachParticle(particle_index.getRange(ParticleType::NORMAL), [&](int i_particle) {
+    if (boundary_types(i_particle) == BoundaryType::OTHERS) return;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
+    eraseNeighborsBeyond(temporary_position, i_particle, condition_.gradient_radius * scale, neighbors);
     double p_min = pressure(i_particle);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
@@ -767,22 +1775,24 @@ void Particles::correctVelocity(const Timer& timer, const Grid& grid) {
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      tmp += r_ij * (pressure(j_particle) - p_min) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
+      tmp += r_ij * (pressure(j_particle) - p_min) * weightForGradientPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
     }
+    if (!polygon_wall.isEmpty()) tmp += getPolygonWallGradient(temporary_position.col(i_particle), pressure(i_particle) - p_min);
     if (dimension == 2) tmp(2) = 0;
     correction_velocity.col(i_particle) -= tmp * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
-  }
+  });
   temporary_velocity += correction_velocity;
 }
 
 void Particles::correctVelocityExplicitly(const Timer& timer) {
-  Grid grid(condition_.gradient_radius, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.gradient_radius * max_spacing_scale, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   correction_velocity.setZero();
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
+    eraseNeighborsBeyond(position, i_particle, condition_.gradient_radius * scale, neighbors);
     double p_min = pressure(i_particle);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
@@ -792,8 +1802,9 @@ void Particles::correctVelocityExplicitly(const Timer& timer) {
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
-      tmp += r_ij * (pressure(j_particle) - p_min) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
+      tmp += r_ij * (pressure(j_particle) - p_min) * weightForGradientPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
     }
+    if (!polygon_wall.isEmpty()) tmp += getPolygonWallGradient(position.col(i_particle), pressure(i_particle) - p_min);
     if (dimension == 2) tmp(2) = 0;
     correction_velocity.col(i_particle) -= tmp * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
   }
@@ -801,103 +1812,90 @@ void Particles::correctVelocityExplicitly(const Timer& timer) {
 }
 
 void Particles::correctTanakaMasunagaVelocity(const Timer& timer) {
-  Grid grid(condition_.gradient_radius, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.gradient_radius * max_spacing_scale, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   correction_velocity.setZero();
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     Eigen::Vector3d tmp(0.0, 0.0, 0.0);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
       Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
-      tmp += r_ij * (pressure(j_particle) + pressure(i_particle)) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
+      tmp += r_ij * (pressure(j_particle) + pressure(i_particle)) * weightForGradientPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
     }
+    if (!polygon_wall.isEmpty()) tmp += getPolygonWallGradient(position.col(i_particle), 2 * pressure(i_particle));
     if (dimension == 2) tmp(2) = 0;
     correction_velocity.col(i_particle) -= tmp * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
   }
   temporary_velocity += correction_velocity;
 }
 
-void Particles::correctVelocityWithTensor(const Timer& timer) {
-  Grid grid(condition_.gradient_radius, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
-  correction_velocity.setZero();
-  int tensor_count = 0;
-  int not_tensor_count = 0;
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
+void Particles::calculateGradientCorrection(const Eigen::Matrix3Xd& coordinates, const Grid& grid, GradientCorrection& correction) const {
+  correction.reset(size);
+  Grid::Neighbors neighbors;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
-    Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
+    const double scale = getSpacingScale(i_particle);
     Eigen::Matrix3d tensor = Eigen::Matrix3d::Zero();
-    Eigen::Vector3d tmp_vel(0.0, 0.0, 0.0);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
-      Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      Eigen::Vector3d n_ij = r_ij.normalized();
-      Eigen::Matrix3d tmp_tensor = Eigen::Matrix3d::Zero();
-      tmp_tensor << n_ij(0) * n_ij(0), n_ij(0) * n_ij(1), n_ij(0) * n_ij(2),
-                    n_ij(1) * n_ij(0), n_ij(1) * n_ij(1), n_ij(1) * n_ij(2),
-                    n_ij(2) * n_ij(0), n_ij(2) * n_ij(1), n_ij(2) * n_ij(2);
-      tensor += tmp_tensor * weightForGradientPressure(r_ij) / initial_particle_number_density;
-      tmp_vel += r_ij * (pressure(j_particle) - pressure(i_particle)) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
-    }
-    if (dimension == 2) {
-      tmp_vel(2) = 0;
-      tensor(2, 2) = 1.0;
-    }
-    if (tensor.determinant() > 1.0e-10) {
-      correction_velocity.col(i_particle) -= tensor.inverse() * tmp_vel * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
-      ++tensor_count;
-    } else {
-      correction_velocity.col(i_particle) -= tmp_vel * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
-      ++not_tensor_count;
-      // std::cout << abs(tensor.determinant()) << std::endl <<  tensor << std::endl;
+      Eigen::Vector3d r_ij = coordinates.col(j_particle) - coordinates.col(i_particle);
+      tensor.selfadjointView<Eigen::Upper>().rankUpdate(r_ij, weightForGradientPressure(r_ij / scale) * getVolumeRatio(i_particle, j_particle)
+                                                              / (r_ij.squaredNorm() * initial_particle_number_density));
     }
+    if (!polygon_wall.isEmpty()) tensor += getPolygonWallGradientTensor(coordinates.col(i_particle));
+    correction.setTensor(i_particle, tensor);
   }
-  std::cout << "Tensor: " << tensor_count << ", Not Tensor: " << not_tensor_count << std::endl;
+}
 
-  temporary_velocity += correction_velocity;
+void Particles::correctVelocityWithTensor(const Timer& timer) {
+  Grid grid(condition_.gradient_radius * max_spacing_scale, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  GradientCorrection correction(size, dimension);
+  calculateGradientCorrection(temporary_position, grid, correction);
+  correctVelocityWithTensor(timer, grid, correction);
+}
+
+void Particles::correctVelocityWithTensor(const Timer& timer, const Grid& grid, const GradientCorrection& correction) {
+  correctVelocityWithTensor(timer, temporary_position, grid, correction);
 }
 
 void Particles::correctVelocityTanakaMasunagaWithTensor(const Timer& timer) {
-  Grid grid(condition_.gradient_radius, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(condition_.gradient_radius * max_spacing_scale, position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  GradientCorrection correction(size, dimension);
+  calculateGradientCorrection(position, grid, correction);
+  correctVelocityWithTensor(timer, position, grid, correction);
+}
+
+void Particles::correctVelocityWithTensor(const Timer& timer, const Eigen::Matrix3Xd& coordinates, const Grid& grid, const GradientCorrection& correction) {
   correction_velocity.setZero();
   int tensor_count = 0;
   int not_tensor_count = 0;
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
+  Grid::Neighbors neighbors;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
-    Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
-    Eigen::Matrix3d tensor = Eigen::Matrix3d::Zero();
+    const double scale = getSpacingScale(i_particle);
     Eigen::Vector3d tmp_vel(0.0, 0.0, 0.0);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
-      Eigen::Vector3d r_ij = position.col(j_particle) - position.col(i_particle);
-      Eigen::Vector3d n_ij = r_ij.normalized();
-      Eigen::Matrix3d tmp_tensor = Eigen::Matrix3d::Zero();
-      tmp_tensor << n_ij(0) * n_ij(0), n_ij(0) * n_ij(1), n_ij(0) * n_ij(2),
-                    n_ij(1) * n_ij(0), n_ij(1) * n_ij(1), n_ij(1) * n_ij(2),
-                    n_ij(2) * n_ij(0), n_ij(2) * n_ij(1), n_ij(2) * n_ij(2);
-      tensor += tmp_tensor * weightForGradientPressure(r_ij) / initial_particle_number_density;
-      tmp_vel += r_ij * (pressure(j_particle) - pressure(i_particle)) * weightForGradientPressure(r_ij) / r_ij.squaredNorm();
-    }
-    if (dimension == 2) {
-      tmp_vel(2) = 0;
-      tensor(2, 2) = 1.0;
-    }
-    if (tensor.determinant() > 1.0e-10) {
-      correction_velocity.col(i_particle) -= tensor.inverse() * tmp_vel * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
+      Eigen::Vector3d r_ij = coordinates.col(j_particle) - coordinates.col(i_particle);
+      tmp_vel += r_ij * (pressure(j_particle) - pressure(i_particle)) * weightForGradientPressure(r_ij / scale)
+               * getVolumeRatio(i_particle, j_particle) / r_ij.squaredNorm();
+    }
+    if (dimension == 2) tmp_vel(2) = 0;
+    if (correction.isCorrected(i_particle)) {
+      correction_velocity.col(i_particle) -= correction.apply(i_particle, tmp_vel) * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
       ++tensor_count;
     } else {
       correction_velocity.col(i_particle) -= tmp_vel * dimension * timer.getCurrentDeltaTime() / (initial_particle_number_density * condition_.mass_density);
       ++not_tensor_count;
-      // std::cout << abs(tensor.determinant()) << std::endl <<  tensor << std::endl;
     }
   }
-  std::cout << "Tensor: " << tensor_count << ", Not Tensor: " << not_tensor_count << std::endl;
+  // Polygon walls take the pressure of the particle, so they enter only the correction tensor.
+  StepLog(LOG_INFO) << "Tensor: " << tensor_count << ", Not Tensor: " << not_tensor_count;
 
   temporary_velocity += correction_velocity;
 }
@@ -945,39 +1943,59 @@ void Particles::giveCollisionRepulsionForce() {
 }
 
 void Particles::giveCollisionRepulsionForce(double influence_ratio, double restitution_coefficient) {
-  Grid grid(influence_ratio * condition_.average_distance, temporary_position, boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
+  Grid grid(influence_ratio * condition_.average_distance * max_spacing_scale, temporary_position,
+            boundary_types.array() != BoundaryType::OTHERS, condition_.dimension);
   Eigen::Matrix3Xd impulse_vel = Eigen::MatrixXd::Zero(3, size);
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
-    if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
+  forEachParticle(particle_index.getRange(ParticleType::NORMAL), [&](int i_particle) {
+    if (boundary_types(i_particle) == BoundaryType::OTHERS) return;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
     for (int j_particle : neighbors) {
       if (boundary_types(j_particle) == BoundaryType::OTHERS) continue;
-      Eigen::Vector3d n_ij = (temporary_position.col(j_particle) - temporary_position.col(i_particle)).normalized();
+      Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
+      if (r_ij.norm() >= influence_ratio * condition_.average_distance * getPairScale(i_particle, j_particle)) continue;
+      Eigen::Vector3d n_ij = r_ij.normalized();
       Eigen::Vector3d u_ij = temporary_velocity.col(j_particle) - temporary_velocity.col(i_particle);
-      impulse_vel.col(i_particle) += n_ij * u_ij.dot(n_ij) * (restitution_coefficient + 1) / 2;
+      // Shares the impulse by mass, which is half of it between particles of the same spacing.
+      double mass_ratio = 0.5;
+      if (!isUniformResolution()) {
+        double mass_j = std::pow(particle_spacing(j_particle), dimension);
+        mass_ratio = mass_j / (std::pow(particle_spacing(i_particle), dimension) + mass_j);
+      }
+      impulse_vel.col(i_particle) += n_ij * u_ij.dot(n_ij) * (restitution_coefficient + 1) * mass_ratio;
     }
-  }
+    if (!polygon_wall.isEmpty()) {
+      // Polygon walls take the whole impulse, and particles behind them are turned back as well.
+      Eigen::Vector3d direction;
+      double distance = polygon_wall.getDistance(temporary_position.col(i_particle), direction);
+      double approaching_speed = temporary_velocity.col(i_particle).dot(direction);
+      if (distance < influence_ratio * particle_spacing(i_particle) && approaching_speed > 0.0) {
+        impulse_vel.col(i_particle) -= direction * approaching_speed * (restitution_coefficient + 1);
+      }
+    }
+  });
   temporary_velocity += impulse_vel;
 }
 
 void Particles::shiftParticles(double influence_ratio, double alpha) {
-  double influence_radius = influence_ratio * condition_.average_distance;
-  Grid grid(influence_radius, temporary_position, particle_types.array() != ParticleType::GHOST, condition_.dimension);
+  Grid grid(influence_ratio * condition_.average_distance * max_spacing_scale, temporary_position,
+            particle_types.array() != ParticleType::GHOST, condition_.dimension);
   Eigen::Matrix3Xd shift_vec = Eigen::MatrixXd::Zero(3, size);
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (particle_types(i_particle) != ParticleType::NORMAL) continue;
+  for (int i_particle : particle_index.getRange(ParticleType::NORMAL)) {
     if (boundary_types(i_particle) == BoundaryType::OTHERS) continue;
     Grid::Neighbors neighbors;
     grid.getNeighbors(i_particle, neighbors);
+    // Each particle is shifted within its own spacing.
+    const double influence_radius = influence_ratio * particle_spacing(i_particle);
     for (int j_particle : neighbors) {
       if (particle_types(j_particle) == ParticleType::GHOST) continue;
       Eigen::Vector3d r_ij = temporary_position.col(j_particle) - temporary_position.col(i_particle);
-      shift_vec.col(i_particle) += r_ij * weightStandard(r_ij, influence_radius) * influence_radius / r_ij.squaredNorm();
+      shift_vec.col(i_particle) += r_ij * weightStandard(r_ij, influence_radius) * getVolumeRatio(i_particle, j_particle)
+                                 * influence_radius / r_ij.squaredNorm();
     }
+    shift_vec.col(i_particle) *= alpha * particle_spacing(i_particle);
   }
-  temporary_position += shift_vec * alpha * condition_.average_distance;
+  temporary_position += shift_vec;
 }
 
 double Particles::weightForParticleNumberDensity(const Eigen::Vector3d& vec) const {
@@ -996,18 +2014,24 @@ double Particles::weightForLaplacianViscosity(const Eigen::Vector3d& vec) const
   return weightStandard(vec, condition_.laplacian_viscosity_weight_radius);
 }
 
+void Particles::updateParticleIndex() {
+  particle_index.build(particle_types);
+  static_boundary.clear();
+}
+
+void Particles::updateStaticBoundary() {
+  static_boundary.clear();
+  prepareStaticBoundary();
+}
+
 void Particles::showParticlesInfo() {
-  int inner = 0;
-  int surface = 0;
-  int ghost = 0;
-  for (int i_particle = 0; i_particle < size; ++i_particle) {
-    if (boundary_types(i_particle) == BoundaryType::INNER) ++inner;
-    if (boundary_types(i_particle) == BoundaryType::SURFACE) ++surface;
-    if (particle_types(i_particle) == ParticleType::GHOST) ++ghost;
-  }
-  std::cout << "Particles - "
-            << "inners: " << inner << ", surfaces: " << surface
-            << ", others: " << size - (inner + surface) << " (ghosts: " << ghost << ")" << std::endl;
+  showParticlesInfo(calculateStepStats());
+}
+
+void Particles::showParticlesInfo(const StepStats& stats) const {
+  StepLog(LOG_INFO) << "Particles - "
+                    << "inners: " << stats.inner << ", surfaces: " << stats.surface
+                    << ", others: " << stats.others << " (ghosts: " << stats.ghost << ")";
 }
 
 } // namespace tiny_mps
\ No newline at end of file
@@ -0,0 +1,186 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "polygon_wall.h"
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <Eigen/Geometry>
+#include "logger.h"
+
+namespace tiny_mps {
+
+namespace {
+// Distances are clamped to this ratio of the spacing.
+const double kMinDistanceRatio = 0.25;
+// Relative difference below which elements are equally near.
+const double kTieTolerance = 1.0e-9;
+}
+
+void WallWeightTable::build(const Weight& weight, double radius, double spacing, int dimension) {
+  this->dimension = dimension;
+  this->radius = radius;
+  min_distance = kMinDistanceRatio * spacing;
+  step = (radius - min_distance) / kSamples;
+  weights.assign(kSamples + 1, 0.0);
+  counts.assign(kSamples + 1, 0.0);
+  gradients.assign(kSamples + 1, 0.0);
+  normal_moments.assign(kSamples + 1, 0.0);
+  tangent_moments.assign(kSamples + 1, 0.0);
+  // The wall is the plane y = 0 and the particle is at (0, distance, 0).
+  const int xz_max = (int)std::ceil(radius / spacing);
+  const int z_max = (dimension == 3) ? xz_max : 0;
+  for (int i = 0; i <= kSamples; ++i) {
+    const double distance = min_distance + step * i;
+    for (int i_z = -z_max; i_z <= z_max; ++i_z) {
+      for (int i_y = 0; i_y <= xz_max; ++i_y) {
+        for (int i_x = -xz_max; i_x <= xz_max; ++i_x) {
+          Eigen::Vector3d r_ij(i_x * spacing, -i_y * spacing - distance, i_z * spacing);
+          if (r_ij.norm() >= radius) continue;
+          double w_ij = weight(r_ij);
+          weights[i] += w_ij;
+          counts[i] += 1.0;
+          gradients[i] += w_ij * (-r_ij(1)) / r_ij.squaredNorm();
+          normal_moments[i] += w_ij * r_ij(1) * r_ij(1) / r_ij.squaredNorm();
+          tangent_moments[i] += w_ij * r_ij(0) * r_ij(0) / r_ij.squaredNorm();
+        }
+      }
+    }
+  }
+}
+
+void PolygonWall::readFile(const std::string& path, int dimension) {
+  std::ifstream ifs(path);
+  if (ifs.fail()) {
+    Log(LOG_ERROR) << "Error: in readFile() in polygon_wall.cpp";
+    Log(LOG_ERROR) << "Failed to read files: " << path;
+    throw std::ios_base::failure("Error: in readFile() in polygon_wall.cpp.");
+  }
+  clear();
+  this->dimension = dimension;
+  std::string tmp_str;
+  getline(ifs, tmp_str);      //Line 0: elements_number
+  int element_num = 0;
+  {
+    std::stringstream ss;
+    ss.str(tmp_str);
+    ss >> element_num;
+  }
+  for (int i_element = 0; i_element < element_num; ++i_element) {
+    if (!getline(ifs, tmp_str)) {
+      Log(LOG_ERROR) << "Error: in readFile() in polygon_wall.cpp";
+      Log(LOG_ERROR) << "Expected " << element_num << " elements, but found " << i_element << ": " << path;
+      throw std::ios_base::failure("Error: in readFile() in polygon_wall.cpp.");
+    }
+    std::stringstream ss;
+    ss.str(tmp_str);
+    for (int i_vertex = 0; i_vertex < getVerticesPerElement(); ++i_vertex) {
+      Eigen::Vector3d vertex;
+      ss >> vertex(0) >> vertex(1) >> vertex(2);
+      if (dimension == 2) vertex(2) = 0.0;
+      vertices.push_back(vertex);
+    }
+  }
+  Log(LOG_INFO) << "Succeed in reading polygon wall file: " << path << " (elements: " << getSize() << ")";
+}
+
+void PolygonWall::addSegment(const Eigen::Vector3d& a, const Eigen::Vector3d& b) {
+  if (dimension != 2 && !isEmpty()) {
+    Log(LOG_ERROR) << "Error: Segments cannot be mixed with triangles.";
+    throw std::invalid_argument("Error: Segments cannot be mixed with triangles.");
+  }
+  dimension = 2;
+  vertices.push_back(a);
+  vertices.push_back(b);
+}
+
+void PolygonWall::addTriangle(const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Vector3d& c) {
+  if (dimension != 3 && !isEmpty()) {
+    Log(LOG_ERROR) << "Error: Triangles cannot be mixed with segments.";
+    throw std::invalid_argument("Error: Triangles cannot be mixed with segments.");
+  }
+  dimension = 3;
+  vertices.push_back(a);
+  vertices.push_back(b);
+  vertices.push_back(c);
+}
+
+void PolygonWall::clear() {
+  vertices.clear();
+}
+
+double PolygonWall::getDistance(const Eigen::Vector3d& point, Eigen::Vector3d& direction) const {
+  double min_distance = std::numeric_limits<double>::infinity();
+  // Cosine between the normal and the vector from the nearest point to point, which is negative behind the element.
+  // Among elements sharing the nearest vertex or edge, the one point faces most squarely decides the side.
+  double alignment = 0.0;
+  Eigen::Vector3d nearest_r = Eigen::Vector3d::Zero();
+  Eigen::Vector3d nearest_normal = Eigen::Vector3d::Zero();
+  const int n = getVerticesPerElement();
+  for (std::size_t i = 0; i + n <= vertices.size(); i += n) {
+    Eigen::Vector3d closest = (n == 2) ? closestPointOnSegment(point, vertices[i], vertices[i + 1])
+                                       : closestPointOnTriangle(point, vertices[i], vertices[i + 1], vertices[i + 2]);
+    Eigen::Vector3d r = closest - point;
+    double distance = r.norm();
+    Eigen::Vector3d normal = getNormal(i);
+    double cosine = (distance > 0.0) ? -r.dot(normal) / distance : 0.0;
+    bool is_nearer = distance < min_distance * (1.0 - kTieTolerance);
+    bool is_tie = !is_nearer && distance <= min_distance * (1.0 + kTieTolerance);
+    if (!is_nearer && !(is_tie && std::abs(cosine) > std::abs(alignment))) continue;
+    min_distance = std::min(distance, min_distance);
+    alignment = cosine;
+    nearest_r = r;
+    nearest_normal = normal;
+  }
+  if (alignment < 0.0) {
+    direction = -nearest_normal;
+    return -min_distance;
+  }
+  if (min_distance > 0.0 && !std::isinf(min_distance)) direction = nearest_r / min_distance;
+  else direction = -nearest_normal;
+  return min_distance;
+}
+
+Eigen::Vector3d PolygonWall::getNormal(std::size_t index) const {
+  Eigen::Vector3d normal;
+  if (dimension == 2) {
+    Eigen::Vector3d ab = vertices[index + 1] - vertices[index];
+    normal = Eigen::Vector3d(-ab(1), ab(0), 0.0);
+  } else {
+    normal = (vertices[index + 1] - vertices[index]).cross(vertices[index + 2] - vertices[index]);
+  }
+  double norm = normal.norm();
+  return (norm > 0.0) ? Eigen::Vector3d(normal / norm) : Eigen::Vector3d::Zero();
+}
+
+Eigen::Vector3d PolygonWall::closestPointOnSegment(const Eigen::Vector3d& p, const Eigen::Vector3d& a, const Eigen::Vector3d& b) {
+  Eigen::Vector3d ab = b - a;
+  double length2 = ab.squaredNorm();
+  if (length2 == 0.0) return a;
+  double t = std::min(std::max((p - a).dot(ab) / length2, 0.0), 1.0);
+  return a + t * ab;
+}
+
+// Finds the Voronoi region of the triangle containing p, one of three vertices, three edges or the face.
+Eigen::Vector3d PolygonWall::closestPointOnTriangle(const Eigen::Vector3d& p, const Eigen::Vector3d& a,
+                                                    const Eigen::Vector3d& b, const Eigen::Vector3d& c) {
+  Eigen::Vector3d ab = b - a, ac = c - a, ap = p - a;
+  double d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0.0 && d2 <= 0.0) return a;
+  Eigen::Vector3d bp = p - b;
+  double d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0.0 && d4 <= d3) return b;
+  double vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) return a + ab * (d1 / (d1 - d3));
+  Eigen::Vector3d cp = p - c;
+  double d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0.0 && d5 <= d6) return c;
+  double vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) return a + ac * (d2 / (d2 - d6));
+  double va = d3 * d6 - d5 * d4;
+  if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  double denominator = 1.0 / (va + vb + vc);
+  return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,98 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "slot_allocator.h"
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace tiny_mps {
+
+SlotAllocator::SlotAllocator(const SlotAllocator& other)
+    : free_slots(other.free_slots), caches(other.caches), deterministic(other.deterministic) {}
+
+SlotAllocator& SlotAllocator::operator=(const SlotAllocator& other) {
+  if (this != &other) {
+    free_slots = other.free_slots;
+    caches = other.caches;
+    deterministic = other.deterministic;
+  }
+  return *this;
+}
+
+int SlotAllocator::getThreadCount() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int SlotAllocator::getThreadNumber() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+int SlotAllocator::acquire() {
+  if (isCaching()) {
+    std::vector<int>& cache = caches[getThreadNumber()];
+    if (!cache.empty()) {
+      int index = cache.back();
+      cache.pop_back();
+      return index;
+    }
+    if (deterministic) return -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (free_slots.empty()) return -1;
+  int index = free_slots.back();
+  free_slots.pop_back();
+  return index;
+}
+
+void SlotAllocator::release(int index) {
+  if (isCaching()) {
+    caches[getThreadNumber()].push_back(index);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  free_slots.push_back(index);
+}
+
+void SlotAllocator::fillCaches(int per_thread) {
+  caches.assign(getThreadCount(), std::vector<int>());
+  // Thread 0 gets the slots that would be acquired first without caches.
+  for (std::vector<int>& cache : caches) {
+    int count = std::min(per_thread, size());
+    cache.assign(free_slots.end() - count, free_slots.end());
+    free_slots.resize(free_slots.size() - count);
+  }
+}
+
+void SlotAllocator::drainCaches() {
+  for (auto cache = caches.rbegin(); cache != caches.rend(); ++cache) {
+    free_slots.insert(free_slots.end(), cache->begin(), cache->end());
+  }
+  caches.clear();
+}
+
+void SlotAllocator::clear() {
+  free_slots.clear();
+  caches.clear();
+}
+
+void SlotAllocator::writeCheckpoint(CheckpointWriter& writer) const {
+  writer.beginSection("SlotAllocator");
+  writer.write(free_slots);
+}
+
+void SlotAllocator::readCheckpoint(CheckpointReader& reader) {
+  reader.beginSection("SlotAllocator");
+  reader.read(free_slots);
+  caches.clear();
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "snapshot_writer.h"
+#include <algorithm>
+#include "logger.h"
+
+namespace tiny_mps {
+
+SnapshotWriter::SnapshotWriter(int max_pending)
+    : max_pending(std::max(max_pending, 1)), running(false), stopping(false) {
+  thread = std::thread(&SnapshotWriter::run, this);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  try {
+    flush();
+  } catch (const std::exception& e) {
+    Log(LOG_ERROR) << "Error: Failed to write a snapshot: " << e.what();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  job_condition.notify_all();
+  thread.join();
+}
+
+void SnapshotWriter::submit(const Job& job) {
+  std::unique_lock<std::mutex> lock(mutex);
+  done_condition.wait(lock, [this] { return jobs.size() < max_pending || error; });
+  rethrowError();
+  jobs.push_back(job);
+  job_condition.notify_one();
+}
+
+void SnapshotWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  done_condition.wait(lock, [this] { return (jobs.empty() && !running) || error; });
+  rethrowError();
+}
+
+void SnapshotWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    job_condition.wait(lock, [this] { return !jobs.empty() || stopping; });
+    if (jobs.empty()) return;
+    Job job = jobs.front();
+    jobs.pop_front();
+    running = true;
+    done_condition.notify_all();
+    lock.unlock();
+    std::exception_ptr job_error;
+    try {
+      job();
+    } catch (...) {
+      job_error = std::current_exception();
+    }
+    lock.lock();
+    running = false;
+    if (job_error && !error) error = job_error;
+    done_condition.notify_all();
+  }
+}
+
+void SnapshotWriter::rethrowError() {
+  if (!error) return;
+  std::exception_ptr pending = error;
+  error = nullptr;
+  jobs.clear();
+  std::rethrow_exception(pending);
+}
+
+} // namespace tiny_mps
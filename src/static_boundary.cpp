@@ -0,0 +1,64 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "static_boundary.h"
+
+namespace tiny_mps {
+
+void StaticBoundary::build(const Eigen::Matrix3Xd& coordinates, const std::vector<int>& indices, double radius, int dimension) {
+  this->radius = radius;
+  this->indices = indices;
+  locals.assign(coordinates.cols(), -1);
+  Eigen::Matrix3Xd layer(3, indices.size());
+  for (int k = 0; k < static_cast<int>(indices.size()); ++k) {
+    locals[indices[k]] = k;
+    layer.col(k) = coordinates.col(indices[k]);
+  }
+  grid.reset(new Grid(radius, layer, Eigen::Matrix<bool, Eigen::Dynamic, 1>::Constant(indices.size(), true), dimension));
+  neighbor_begins.assign(1, 0);
+  neighbor_indices.clear();
+  Grid::Neighbors neighbors;
+  for (int k = 0; k < static_cast<int>(indices.size()); ++k) {
+    grid->getNeighbors(k, neighbors);
+    for (int l : neighbors) neighbor_indices.push_back(indices[l]);
+    neighbor_begins.push_back(neighbor_indices.size());
+  }
+  particle_number_density.setZero(indices.size());
+  neighbor_count.setZero(indices.size());
+  built = true;
+}
+
+void StaticBoundary::cacheParticleNumberDensity(const Eigen::Matrix3Xd& coordinates, double pnd_radius,
+                                                const std::function<double(const Eigen::Vector3d&)>& weight) {
+  for (int k = 0; k < static_cast<int>(indices.size()); ++k) {
+    double pnd = 0.0;
+    int count = 0;
+    for (int j_particle : getNeighbors(indices[k])) {
+      Eigen::Vector3d r_ij = coordinates.col(j_particle) - coordinates.col(indices[k]);
+      if (r_ij.squaredNorm() >= pnd_radius * pnd_radius) continue;
+      pnd += weight(r_ij);
+      ++count;
+    }
+    particle_number_density(k) = pnd;
+    neighbor_count(k) = count;
+  }
+}
+
+void StaticBoundary::clear() {
+  built = false;
+  indices.clear();
+  locals.clear();
+  grid.reset();
+  neighbor_begins.clear();
+  neighbor_indices.clear();
+  particle_number_density.resize(0);
+  neighbor_count.resize(0);
+}
+
+void StaticBoundary::getNeighborsAround(const Eigen::Vector3d& point, Grid::Neighbors& neighbors) const {
+  neighbors.clear();
+  if (!grid) return;
+  grid->getNeighborsAround(point, neighbors);
+  for (int& index : neighbors) index = indices[index];
+}
+
+} // namespace tiny_mps
@@ -0,0 +1,235 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "vtu_writer.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include "logger.h"
+#ifdef MPS_USE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace tiny_mps {
+
+namespace {
+const char kCollectionHeader[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<VTKFile type=\"Collection\" version=\"0.1\">\n"
+    "  <Collection>\n";
+const char kCollectionFooter[] =
+    "  </Collection>\n"
+    "</VTKFile>\n";
+
+// Bytes of the uncompressed blocks of an array, which ParaView also takes by default.
+const std::uint64_t kCompressionBlock = 32768;
+
+inline bool isLittleEndian() {
+  const std::uint16_t one = 1;
+  return *reinterpret_cast<const unsigned char*>(&one) == 1;
+}
+
+void fail(const std::string& function, const std::string& path) {
+  Log(LOG_ERROR) << "Error: in " << function << "() in vtu_writer.cpp.";
+  Log(LOG_ERROR) << "Failed to write files: " << path;
+  throw std::ios_base::failure("Error: in " + function + "() in vtu_writer.cpp.");
+}
+}
+
+VtuWriter::VtuWriter(const Eigen::Matrix3Xd& points)
+    : points(points), time(0.0), has_time(false), float32(false), compression(0) {}
+
+void VtuWriter::setCompression(int level) {
+  level = std::min(std::max(level, 0), 9);
+  if (level > 0 && !isCompressionAvailable()) {
+    Log(LOG_ERROR) << "Error: Compressed vtu files require TinyMPS built with \"make zlib=yes\".";
+    throw std::invalid_argument("Error: TinyMPS was built without zlib.");
+  }
+  compression = level;
+}
+
+bool VtuWriter::isCompressionAvailable() {
+#ifdef MPS_USE_ZLIB
+  return true;
+#else
+  return false;
+#endif
+}
+
+void VtuWriter::addPointData(const std::string& name, const Eigen::VectorXd& values) {
+  point_data.push_back(Array{name, "Float64", 1, values.data(), sizeof(double) * static_cast<std::uint64_t>(values.size())});
+}
+
+void VtuWriter::addPointData(const std::string& name, const Eigen::VectorXi& values) {
+  static_assert(sizeof(int) == 4, "VectorXi is written as Int32.");
+  point_data.push_back(Array{name, "Int32", 1, values.data(), sizeof(int) * static_cast<std::uint64_t>(values.size())});
+}
+
+void VtuWriter::addPointData(const std::string& name, const Eigen::Matrix3Xd& values) {
+  point_data.push_back(Array{name, "Float64", 3, values.data(), sizeof(double) * static_cast<std::uint64_t>(values.size())});
+}
+
+void VtuWriter::write(const std::string& path) const {
+  std::ofstream ofs(path, std::ios::binary);
+  if (ofs.fail()) fail("write", path);
+  const std::int64_t size = points.cols();
+  std::vector<Array> arrays = point_data;
+  // Double fields converted to Float32. Reserved, so the data of each stays where its array points.
+  std::vector<std::vector<float> > converted;
+  converted.reserve(arrays.size());
+  for (Array& array : arrays) {
+    if (!float32 || array.type != "Float64") continue;
+    const double* values = static_cast<const double*>(array.data);
+    converted.push_back(std::vector<float>(values, values + array.bytes / sizeof(double)));
+    array.type = "Float32";
+    array.data = converted.back().data();
+    array.bytes = sizeof(float) * converted.back().size();
+  }
+  arrays.push_back(Array{"Points", "Float64", 3, points.data(), sizeof(double) * static_cast<std::uint64_t>(points.size())});
+  // Vertex cells of one point each, indexed by Int32 unless there are too many points.
+  std::vector<std::int32_t> connectivity32, offsets32;
+  std::vector<std::int64_t> connectivity64, offsets64;
+  if (size <= std::numeric_limits<std::int32_t>::max()) {
+    connectivity32.resize(size);
+    std::iota(connectivity32.begin(), connectivity32.end(), 0);
+    offsets32.resize(size);
+    std::iota(offsets32.begin(), offsets32.end(), 1);
+    arrays.push_back(Array{"connectivity", "Int32", 1, connectivity32.data(), sizeof(std::int32_t) * connectivity32.size()});
+    arrays.push_back(Array{"offsets", "Int32", 1, offsets32.data(), sizeof(std::int32_t) * offsets32.size()});
+  } else {
+    connectivity64.resize(size);
+    std::iota(connectivity64.begin(), connectivity64.end(), 0);
+    offsets64.resize(size);
+    std::iota(offsets64.begin(), offsets64.end(), 1);
+    arrays.push_back(Array{"connectivity", "Int64", 1, connectivity64.data(), sizeof(std::int64_t) * connectivity64.size()});
+    arrays.push_back(Array{"offsets", "Int64", 1, offsets64.data(), sizeof(std::int64_t) * offsets64.size()});
+  }
+  const std::vector<std::uint8_t> types(size, 1);    // VTK_VERTEX
+  arrays.push_back(Array{"types", "UInt8", 1, types.data(), types.size()});
+  // Compressed arrays are encoded first, as their offsets go into the header.
+  std::vector<std::string> blocks;
+  if (compression > 0) {
+    for (const Array& array : arrays) blocks.push_back(encode(array));
+  }
+  std::vector<std::uint64_t> array_offsets(arrays.size() + 1, 0);
+  for (std::size_t i = 0; i < arrays.size(); ++i) {
+    const std::uint64_t block_size = blocks.empty() ? sizeof(std::uint64_t) + arrays[i].bytes : blocks[i].size();
+    array_offsets[i + 1] = array_offsets[i] + block_size;
+  }
+  const std::size_t points_array = point_data.size();
+
+  std::ostringstream header;
+  header << "<?xml version=\"1.0\"?>\n";
+  header << "<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\""
+         << (isLittleEndian() ? "LittleEndian" : "BigEndian") << "\" header_type=\"UInt64\"";
+  if (compression > 0) header << " compressor=\"vtkZLibDataCompressor\"";
+  header << ">\n";
+  header << "  <UnstructuredGrid>\n";
+  if (has_time) {
+    header << "    <FieldData>\n";
+    header << "      <DataArray type=\"Float64\" Name=\"TimeValue\" NumberOfTuples=\"1\" format=\"ascii\">"
+           << boost::format("%.17g") % time << "</DataArray>\n";
+    header << "    </FieldData>\n";
+  }
+  header << "    <Piece NumberOfPoints=\"" << size << "\" NumberOfCells=\"" << size << "\">\n";
+  header << "      <PointData>\n";
+  for (std::size_t i = 0; i < points_array; ++i) writeArrayHeader(header, arrays[i], array_offsets[i]);
+  header << "      </PointData>\n";
+  header << "      <Points>\n";
+  writeArrayHeader(header, arrays[points_array], array_offsets[points_array]);
+  header << "      </Points>\n";
+  header << "      <Cells>\n";
+  for (std::size_t i = points_array + 1; i < arrays.size(); ++i) writeArrayHeader(header, arrays[i], array_offsets[i]);
+  header << "      </Cells>\n";
+  header << "    </Piece>\n";
+  header << "  </UnstructuredGrid>\n";
+  header << "  <AppendedData encoding=\"raw\">\n";
+  header << "   _";
+  const std::string header_string = header.str();
+  ofs.write(header_string.data(), header_string.size());
+  for (std::size_t i = 0; i < arrays.size(); ++i) {
+    if (!blocks.empty()) {
+      ofs.write(blocks[i].data(), blocks[i].size());
+      continue;
+    }
+    ofs.write(reinterpret_cast<const char*>(&arrays[i].bytes), sizeof(arrays[i].bytes));
+    ofs.write(static_cast<const char*>(arrays[i].data), arrays[i].bytes);
+  }
+  const std::string footer = "\n  </AppendedData>\n</VTKFile>\n";
+  ofs.write(footer.data(), footer.size());
+  ofs.close();
+  if (ofs.fail()) fail("write", path);
+}
+
+#ifdef MPS_USE_ZLIB
+std::string VtuWriter::encode(const Array& array) const {
+  // The header holds the number of blocks, the size of a block, that of the last one (0 if it is full)
+  // and the compressed size of each block, followed by the blocks.
+  const std::uint64_t block_count = (array.bytes + kCompressionBlock - 1) / kCompressionBlock;
+  std::vector<std::uint64_t> header(3 + block_count);
+  header[0] = block_count;
+  header[1] = kCompressionBlock;
+  header[2] = array.bytes % kCompressionBlock;
+  std::string data;
+  std::vector<Bytef> buffer(compressBound(kCompressionBlock));
+  for (std::uint64_t i_block = 0; i_block < block_count; ++i_block) {
+    const std::uint64_t begin = i_block * kCompressionBlock;
+    const std::uint64_t bytes = std::min(kCompressionBlock, array.bytes - begin);
+    uLongf compressed = buffer.size();
+    if (compress2(buffer.data(), &compressed, static_cast<const Bytef*>(array.data) + begin, bytes, compression) != Z_OK) {
+      Log(LOG_ERROR) << "Error: in encode() in vtu_writer.cpp.";
+      Log(LOG_ERROR) << "Failed to compress " << array.name;
+      throw std::runtime_error("Error: in encode() in vtu_writer.cpp.");
+    }
+    header[3 + i_block] = compressed;
+    data.append(reinterpret_cast<const char*>(buffer.data()), compressed);
+  }
+  std::string block(reinterpret_cast<const char*>(header.data()), sizeof(std::uint64_t) * header.size());
+  return block + data;
+}
+#else
+std::string VtuWriter::encode(const Array&) const {
+  Log(LOG_ERROR) << "Error: Compressed vtu files require TinyMPS built with \"make zlib=yes\".";
+  throw std::runtime_error("Error: in encode() in vtu_writer.cpp.");
+}
+#endif
+
+void VtuWriter::writeArrayHeader(std::ostream& os, const Array& array, std::uint64_t offset) {
+  os << "        <DataArray type=\"" << array.type << "\" Name=\"" << array.name << "\"";
+  if (array.components > 1) os << " NumberOfComponents=\"" << array.components << "\"";
+  os << " format=\"appended\" offset=\"" << offset << "\"/>\n";
+}
+
+VtuCollection::VtuCollection(const std::string& path) : path(path) {}
+
+void VtuCollection::add(double time, const std::string& file) {
+  const std::string entry = (boost::format("    <DataSet timestep=\"%.17g\" part=\"0\" file=\"%s\"/>\n") % time % file).str();
+  if (pvd.is_open()) {
+    pvd.seekp(-static_cast<std::streamoff>(sizeof(kCollectionFooter) - 1), std::ios::end);
+    pvd << entry << kCollectionFooter;
+  } else {
+    std::ostringstream contents;
+    contents << kCollectionHeader;
+    {
+      std::ifstream ifs(path);
+      std::string line;
+      while (getline(ifs, line)) {
+        const std::size_t begin = line.find("timestep=\"");
+        if (line.find("<DataSet") == std::string::npos || begin == std::string::npos) continue;
+        if (std::stod(line.substr(begin + 10)) >= time) continue;
+        contents << line << '\n';
+      }
+    }
+    contents << entry << kCollectionFooter;
+    pvd.open(path, std::ios::in | std::ios::out | std::ios::trunc);
+    if (pvd.fail()) fail("add", path);
+    pvd << contents.str();
+  }
+  pvd.flush();
+  if (pvd.fail()) fail("add", path);
+}
+
+} // namespace tiny_mps
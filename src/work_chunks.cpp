@@ -0,0 +1,25 @@
+// Copyright (c) 2017 Shota SUGIHARA
+// Distributed under the MIT License.
+#include "work_chunks.h"
+#include <algorithm>
+#include "slot_allocator.h"
+
+namespace tiny_mps {
+
+WorkChunks::WorkChunks(const ParticleIndex::Range& range, const Eigen::VectorXi& neighbor_counts, int chunks_per_thread)
+    : range(range), begins(1, 0) {
+  const int chunk_number = std::min(std::max(chunks_per_thread * SlotAllocator::getThreadCount(), 1), std::max(range.size(), 1));
+  if (chunk_number > 1) {
+    double total_cost = 0.0;
+    for (int index : range) total_cost += neighbor_counts(index) + 1;
+    const double chunk_cost = total_cost / chunk_number;
+    double cost = 0.0;
+    for (int k = 0; k < range.size(); ++k) {
+      cost += neighbor_counts(range.begin()[k]) + 1;
+      if (cost >= chunk_cost * begins.size() && static_cast<int>(begins.size()) < chunk_number) begins.push_back(k + 1);
+    }
+  }
+  if (begins.back() != range.size()) begins.push_back(range.size());
+}
+
+} // namespace tiny_mps